@@ -1,7 +1,12 @@
 #pragma once
 
+#include <climits>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 using namespace std;
 
@@ -15,481 +20,536 @@ enum class ValueType
     String,
 };
 
+/**
+ * The result of evaluating an expression. Values are trivially copyable:
+ * strings are referenced, never copied, so a string value is only valid
+ * while the node or table that owns the string is alive.
+ */
 class Value
 {
 public:
-    Value() : type(ValueType::Undefined) {}
-    Value(const Value &value) : type(value.type)
-    {
-        if (type == ValueType::Integer)
-        {
-            i = value.i;
-        }
-        else if (type == ValueType::String)
-        {
-            s = value.s;
-        }
-    }
-    Value(const Value &&value) : type(move(value.type))
-    {
-        if (type == ValueType::Integer)
-        {
-            i = value.i;
-        }
-        else if (type == ValueType::String)
-        {
-            s = move(value.s);
-        }
-    }
+    Value() : type(ValueType::Undefined), i(0) {}
     Value(int i) : type(ValueType::Integer), i(i) {}
-    Value(const string &s) : type(ValueType::String), s(s) {}
-    ~Value() {}
+    Value(const string &s) : type(ValueType::String), s(&s) {}
+
+    // A temporary string would be destroyed before the value is read
+    Value(const string &&s) = delete;
 
     bool is_undefined() const { return type == ValueType::Undefined; }
     bool is_int() const { return type == ValueType::Integer; }
     bool is_str() const { return type == ValueType::String; }
 
     int to_int() const { return i; }
-    const string &to_str() const { return s; }
+    const string &to_str() const { return *s; }
 
 private:
     ValueType type;
-    const union
+    union
     {
         int i;
-        string s;
+        const string *s;
     };
 };
 
+static_assert(is_trivially_copyable<Value>::value,
+              "Value must be cheap to return from eval");
+
+/** Set of node types that can appear in an expression tree */
+enum class AstType
+{
+    Undefined,
+    Identifier,
+    Integer,
+    String,
+    Negate,
+    BitwiseComplement,
+    Not,
+    Subscript,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Modulo,
+    BitwiseAnd,
+    BitwiseOr,
+    BitwiseXor,
+    BitwiseShiftLeft,
+    BitwiseShiftRight,
+    LessThan,
+    LessThanEqual,
+    GreaterThan,
+    GreaterThanEqual,
+    Equal,
+    NotEqual,
+    TernaryIf,
+};
+
+class Ast;
+using AstPtr = unique_ptr<Ast>;
+
+/**
+ * An inclusive interval of the integers a node can evaluate to, for every t.
+ * Block backends leave 0 in lanes where a node is undefined, so the range of
+ * a node that may be undefined always contains 0.
+ */
+struct Range
+{
+    int64_t min;
+    int64_t max;
+
+    bool contains(int64_t value) const { return min <= value && value <= max; }
+};
+
+const Range kFullRange{INT_MIN, INT_MAX};
+
+/**
+ * Range of a node given the ranges of its operands, which each node stores
+ * when it is built. Defined with the rest of the range analysis.
+ */
+Range get_unary_range(AstType type, Range a);
+Range get_binary_range(AstType type, Range a, Range b);
+Range get_subscript_range(const Ast &left, Range index);
+Range unite(Range a, Range b);
+
 class Ast
 {
 public:
     virtual ~Ast(){};
     virtual Value eval(int t) const = 0;
-    virtual operator string() const = 0;
+
+    /** The expression, fully parenthesized, printed without recursion */
+    operator string() const;
+
+    /**
+     * Evaluate an integer expression without runtime type tests. Division by
+     * zero, a subscript out of range, or an operand of the wrong type in a
+     * tree that was not type checked clears `defined`, and the result is
+     * then meaningless. `defined` is never set to true.
+     */
+    virtual int eval_int(int t, bool &defined) const = 0;
+
+    /** Evaluate a string expression, such as the base of a subscript */
+    virtual const string &eval_str(int t, bool &defined) const
+    {
+        static const string empty;
+        defined = false;
+        return empty;
+    }
+
+    /** The concrete node type, used by passes that walk the tree */
+    virtual AstType type() const = 0;
+
+    /** A copy of the tree, with the same node classes */
+    virtual AstPtr clone() const = 0;
+
+    /**
+     * Move the operands of an operator node into `out`, leaving it with
+     * none. Used to tear trees down without recursion.
+     */
+    virtual void take_operands(vector<AstPtr> &out) {}
+
+    /**
+     * Range of an integer expression, computed from its operands when the
+     * node is built, so that looking it up never walks the tree. Operations
+     * that may wrap around, and nodes that are not integers, give the full
+     * range of int.
+     */
+    Range get_range() const { return range; }
+
+protected:
+    Ast() : range(kFullRange) {}
+
+    Range range;
 };
 
-using AstPtr = unique_ptr<Ast>;
+/**
+ * Destroy operand subtrees one node at a time from an explicit stack, so
+ * that destroying a deeply nested tree does not recurse once per level.
+ * Operator nodes call this from their destructors.
+ */
+void destroy_operands(AstPtr *operands, size_t count);
 
-class Undefined : public Ast
+class Undefined final : public Ast
 {
 public:
+    Undefined() { range = Range{0, 0}; }
     Value eval(int t) const { return Value(); }
-    operator string() const { return "UNDEFINED"; }
+    int eval_int(int t, bool &defined) const
+    {
+        defined = false;
+        return 0;
+    }
+    AstType type() const { return AstType::Undefined; }
+    AstPtr clone() const { return AstPtr(new Undefined()); }
 };
 
-class Identifier : public Ast
+class Identifier final : public Ast
 {
 public:
     Value eval(int t) const { return t; }
-    operator string() const { return "t"; }
+    int eval_int(int t, bool &defined) const { return t; }
+    AstType type() const { return AstType::Identifier; }
+    AstPtr clone() const { return AstPtr(new Identifier()); }
 };
 
-class Integer : public Ast
+class Integer final : public Ast
 {
 public:
-    Integer(int value) : value(value) {}
+    Integer(int value) : value(value) { range = Range{value, value}; }
     Value eval(int t) const { return value; }
-    operator string() const { return to_string(value); }
+    int eval_int(int t, bool &defined) const { return value; }
+    AstType type() const { return AstType::Integer; }
+    AstPtr clone() const { return AstPtr(new Integer(value)); }
+
+    int get_value() const { return value; }
 
 private:
     const int value;
 };
 
-class String : public Ast
+class String final : public Ast
 {
 public:
     String(const string &value) : value(value) {}
     Value eval(int t) const { return value; }
-    operator string() const { return "\"" + value + "\""; }
+    const string &eval_str(int t, bool &defined) const { return value; }
+    int eval_int(int t, bool &defined) const
+    {
+        defined = false;
+        return 0;
+    }
+    AstType type() const { return AstType::String; }
+    AstPtr clone() const { return AstPtr(new String(value)); }
+
+    const string &get_value() const { return value; }
 
 private:
     const string value;
 };
 
-class UnaryOperator : public Ast
+/**
+ * Operator functors. Each one names its node type and symbol, and applies
+ * the operator to integer operands. Binary operators also report whether
+ * the result is defined for a pair of operands.
+ */
+struct NegateOp
 {
-public:
-    UnaryOperator(AstPtr &&inner) : inner(move(inner)) {}
-
-    operator string() const
-    {
-        return "(" + operand() + inner->operator string() + ")";
-    }
-
-protected:
-    virtual string operand() const = 0;
-
-    AstPtr inner;
+    static const AstType type = AstType::Negate;
+    static const char *symbol() { return "-"; }
+    static int apply(int a) { return -a; }
 };
 
-class Negate : public UnaryOperator
+struct BitwiseComplementOp
 {
-public:
-    using UnaryOperator::UnaryOperator;
+    static const AstType type = AstType::BitwiseComplement;
+    static const char *symbol() { return "~"; }
+    static int apply(int a) { return ~a; }
+};
 
-    Value eval(int t) const
-    {
-        Value val = inner->eval(t);
-        if (val.is_int())
-        {
-            return -val.to_int();
-        }
-        return Value();
-    }
+struct NotOp
+{
+    static const AstType type = AstType::Not;
+    static const char *symbol() { return "!"; }
+    static int apply(int a) { return !a; }
+};
 
-protected:
-    string operand() const { return "-"; }
+/** Base for binary operators that are defined for every pair of integers */
+struct TotalOp
+{
+    static bool is_defined(int a, int b) { return true; }
 };
 
-class BitwiseComplement : public UnaryOperator
+struct AddOp : TotalOp
 {
-public:
-    using UnaryOperator::UnaryOperator;
+    static const AstType type = AstType::Add;
+    static const char *symbol() { return "+"; }
+    static int apply(int a, int b) { return a + b; }
+};
 
-    Value eval(int t) const
-    {
-        Value val = inner->eval(t);
-        if (val.is_int())
-        {
-            return ~val.to_int();
-        }
-        return Value();
-    }
+struct SubtractOp : TotalOp
+{
+    static const AstType type = AstType::Subtract;
+    static const char *symbol() { return "-"; }
+    static int apply(int a, int b) { return a - b; }
+};
 
-protected:
-    string operand() const { return "-"; }
+struct MultiplyOp : TotalOp
+{
+    static const AstType type = AstType::Multiply;
+    static const char *symbol() { return "*"; }
+    static int apply(int a, int b) { return a * b; }
 };
 
-class Not : public UnaryOperator
+struct DivideOp
 {
-public:
-    using UnaryOperator::UnaryOperator;
+    static const AstType type = AstType::Divide;
+    static const char *symbol() { return "/"; }
+    static bool is_defined(int a, int b) { return b != 0; }
 
-    Value eval(int t) const
+    // INT_MIN / -1 traps, so x / -1 is -x, wrapping, as in every backend
+    static int apply(int a, int b)
     {
-        Value val = inner->eval(t);
-        if (!val.is_int())
-        {
-            return Value();
-        }
-        return !val.to_int();
+        return b == -1 ? static_cast<int>(-static_cast<unsigned>(a)) : a / b;
     }
-
-protected:
-    string operand() const { return "-"; }
 };
 
-class BinaryOperator : public Ast
+struct ModuloOp
 {
-public:
-    explicit BinaryOperator(AstPtr left, AstPtr right)
-        : left(move(left)), right(move(right))
-    {
-    }
+    static const AstType type = AstType::Modulo;
+    static const char *symbol() { return "%"; }
+    static bool is_defined(int a, int b) { return b != 0; }
 
-    operator string() const
-    {
-        return "(" + left->operator string() + operand() +
-               right->operator string() + ")";
-    }
-
-protected:
-    virtual string operand() const = 0;
+    // INT_MIN % -1 traps too, and x % -1 is always 0
+    static int apply(int a, int b) { return b == -1 ? 0 : a % b; }
+};
 
-    AstPtr left;
-    AstPtr right;
+/**
+ * Division and modulo for operands that range analysis has proven safe, which
+ * skip the zero divisor test. They print and report their type as the
+ * checked operators do.
+ */
+struct UncheckedDivideOp : TotalOp
+{
+    static const AstType type = AstType::Divide;
+    static const char *symbol() { return "/"; }
+    static int apply(int a, int b) { return a / b; }
 };
 
-class Subscript : public BinaryOperator
+struct UncheckedModuloOp : TotalOp
 {
-public:
-    using BinaryOperator::BinaryOperator;
+    static const AstType type = AstType::Modulo;
+    static const char *symbol() { return "%"; }
+    static int apply(int a, int b) { return a % b; }
+};
 
-    Value eval(int t) const
-    {
-        Value s_val = left->eval(t);
-        if (!s_val.is_str())
-        {
-            return Value();
-        }
+struct BitwiseAndOp : TotalOp
+{
+    static const AstType type = AstType::BitwiseAnd;
+    static const char *symbol() { return "&"; }
+    static int apply(int a, int b) { return a & b; }
+};
 
-        Value i_val = right->eval(t);
-        if (!i_val.is_int())
-        {
-            return Value();
-        }
+struct BitwiseOrOp : TotalOp
+{
+    static const AstType type = AstType::BitwiseOr;
+    static const char *symbol() { return "|"; }
+    static int apply(int a, int b) { return a | b; }
+};
 
-        string s = s_val.to_str();
-        int i = i_val.to_int();
-        if (i < 0 || i >= s.length())
-        {
-            return Value();
-        }
+struct BitwiseXorOp : TotalOp
+{
+    static const AstType type = AstType::BitwiseXor;
+    static const char *symbol() { return "^"; }
+    static int apply(int a, int b) { return a ^ b; }
+};
 
-        return s[i];
-    }
+struct BitwiseShiftLeftOp : TotalOp
+{
+    static const AstType type = AstType::BitwiseShiftLeft;
+    static const char *symbol() { return "<<"; }
+    static int apply(int a, int b) { return a << b; }
+};
 
-    operator string() const
-    {
-        return "(" + left->operator string() + "[" + right->operator string() +
-               "])";
-    }
+struct BitwiseShiftRightOp : TotalOp
+{
+    static const AstType type = AstType::BitwiseShiftRight;
+    static const char *symbol() { return ">>"; }
+    static int apply(int a, int b) { return a >> b; }
+};
 
-protected:
-    string operand() const { return "["; }
+struct LessThanOp : TotalOp
+{
+    static const AstType type = AstType::LessThan;
+    static const char *symbol() { return "<"; }
+    static int apply(int a, int b) { return a < b; }
 };
 
-class Add : public BinaryOperator
+struct LessThanEqualOp : TotalOp
 {
-public:
-    using BinaryOperator::BinaryOperator;
+    static const AstType type = AstType::LessThanEqual;
+    static const char *symbol() { return "<="; }
+    static int apply(int a, int b) { return a <= b; }
+};
 
-    Value eval(int t) const
-    {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
+struct GreaterThanOp : TotalOp
+{
+    static const AstType type = AstType::GreaterThan;
+    static const char *symbol() { return ">"; }
+    static int apply(int a, int b) { return a > b; }
+};
 
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
+struct GreaterThanEqualOp : TotalOp
+{
+    static const AstType type = AstType::GreaterThanEqual;
+    static const char *symbol() { return ">="; }
+    static int apply(int a, int b) { return a >= b; }
+};
 
-        return a.to_int() + b.to_int();
-    }
+struct EqualOp : TotalOp
+{
+    static const AstType type = AstType::Equal;
+    static const char *symbol() { return "=="; }
+    static int apply(int a, int b) { return a == b; }
+};
 
-protected:
-    string operand() const { return "+"; }
+struct NotEqualOp : TotalOp
+{
+    static const AstType type = AstType::NotEqual;
+    static const char *symbol() { return "!="; }
+    static int apply(int a, int b) { return a != b; }
 };
 
-class Subtract : public BinaryOperator
+class UnaryOperator : public Ast
 {
 public:
-    using BinaryOperator::BinaryOperator;
+    UnaryOperator(AstPtr &&inner) : inner(move(inner)) {}
+    ~UnaryOperator() { destroy_operands(&inner, 1); }
 
-    Value eval(int t) const
-    {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
+    const Ast &get_inner() const { return *inner; }
 
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
+    /** The operator as it is printed */
+    virtual const char *operand() const = 0;
 
-        return a.to_int() - b.to_int();
-    }
+    void take_operands(vector<AstPtr> &out) { out.push_back(move(inner)); }
 
 protected:
-    string operand() const { return "-"; }
+    AstPtr inner;
 };
 
-class Multiply : public BinaryOperator
+template <typename Op> class UnaryNode final : public UnaryOperator
 {
 public:
-    using BinaryOperator::BinaryOperator;
-
-    Value eval(int t) const
+    UnaryNode(AstPtr &&inner) : UnaryOperator(move(inner))
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
-
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
-
-        return a.to_int() * b.to_int();
+        range = get_unary_range(Op::type, get_inner().get_range());
     }
 
-protected:
-    string operand() const { return "*"; }
-};
-
-class Divide : public BinaryOperator
-{
-public:
-    using BinaryOperator::BinaryOperator;
+    AstType type() const { return Op::type; }
+    AstPtr clone() const { return AstPtr(new UnaryNode(inner->clone())); }
 
     Value eval(int t) const
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
-
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
-
-        int b_val = b.to_int();
-        if (b_val == 0)
+        Value val = inner->eval(t);
+        if (!val.is_int())
         {
             return Value();
         }
+        return Op::apply(val.to_int());
+    }
 
-        return a.to_int() / b.to_int();
+    int eval_int(int t, bool &defined) const
+    {
+        return Op::apply(inner->eval_int(t, defined));
     }
 
-protected:
-    string operand() const { return "/"; }
+    const char *operand() const { return Op::symbol(); }
 };
 
-class Modulo : public BinaryOperator
+using Negate = UnaryNode<NegateOp>;
+using BitwiseComplement = UnaryNode<BitwiseComplementOp>;
+using Not = UnaryNode<NotOp>;
+
+class BinaryOperator : public Ast
 {
 public:
-    using BinaryOperator::BinaryOperator;
-
-    Value eval(int t) const
+    explicit BinaryOperator(AstPtr left, AstPtr right)
+        : left(move(left)), right(move(right))
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
+    }
+    ~BinaryOperator()
+    {
+        AstPtr operands[] = {move(left), move(right)};
+        destroy_operands(operands, 2);
+    }
 
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
+    const Ast &get_left() const { return *left; }
+    const Ast &get_right() const { return *right; }
 
-        int b_val = b.to_int();
-        if (b_val == 0)
-        {
-            return Value();
-        }
+    /** The operator as it is printed between its operands */
+    virtual const char *operand() const = 0;
 
-        return a.to_int() % b.to_int();
+    void take_operands(vector<AstPtr> &out)
+    {
+        out.push_back(move(left));
+        out.push_back(move(right));
     }
 
 protected:
-    string operand() const { return "%"; }
+    AstPtr left;
+    AstPtr right;
 };
 
-class BitwiseAnd : public BinaryOperator
+class Subscript final : public BinaryOperator
 {
 public:
-    using BinaryOperator::BinaryOperator;
-
-    Value eval(int t) const
+    Subscript(AstPtr left, AstPtr right)
+        : BinaryOperator(move(left), move(right))
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
-
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
-
-        return a.to_int() & b.to_int();
+        range = get_subscript_range(get_left(), get_right().get_range());
     }
 
-protected:
-    string operand() const { return "&"; }
-};
+    AstType type() const { return AstType::Subscript; }
 
-class BitwiseOr : public BinaryOperator
-{
-public:
-    using BinaryOperator::BinaryOperator;
+    AstPtr clone() const
+    {
+        return AstPtr(new Subscript(left->clone(), right->clone()));
+    }
 
     Value eval(int t) const
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
+        Value s_val = left->eval(t);
+        if (!s_val.is_str())
         {
             return Value();
         }
 
-        Value b = right->eval(t);
-        if (!b.is_int())
+        Value i_val = right->eval(t);
+        if (!i_val.is_int())
         {
             return Value();
         }
 
-        return a.to_int() | b.to_int();
-    }
-
-protected:
-    string operand() const { return "|"; }
-};
-
-class BitwiseXor : public BinaryOperator
-{
-public:
-    using BinaryOperator::BinaryOperator;
-
-    Value eval(int t) const
-    {
-        Value a = left->eval(t);
-        if (!a.is_int())
+        const string &s = s_val.to_str();
+        int i = i_val.to_int();
+        if (i < 0 || i >= static_cast<int>(s.length()))
         {
             return Value();
         }
 
-        Value b = right->eval(t);
-        if (!b.is_int())
+        return s[i];
+    }
+
+    int eval_int(int t, bool &defined) const
+    {
+        const string &s = left->eval_str(t, defined);
+        int i = right->eval_int(t, defined);
+        if (i < 0 || i >= static_cast<int>(s.length()))
         {
-            return Value();
+            defined = false;
+            return 0;
         }
-
-        return a.to_int() ^ b.to_int();
+        return s[i];
     }
 
-protected:
-    string operand() const { return "^"; }
+    const char *operand() const { return "["; }
 };
 
-class BitwiseShiftLeft : public BinaryOperator
+template <typename Op> class BinaryNode final : public BinaryOperator
 {
 public:
-    using BinaryOperator::BinaryOperator;
-
-    Value eval(int t) const
+    BinaryNode(AstPtr left, AstPtr right)
+        : BinaryOperator(move(left), move(right))
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
-
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
-
-        return a.to_int() << b.to_int();
+        range = get_binary_range(Op::type, get_left().get_range(),
+                                 get_right().get_range());
     }
 
-protected:
-    string operand() const { return "<<"; }
-};
+    AstType type() const { return Op::type; }
 
-class BitwiseShiftRight : public BinaryOperator
-{
-public:
-    using BinaryOperator::BinaryOperator;
+    AstPtr clone() const
+    {
+        return AstPtr(new BinaryNode(left->clone(), right->clone()));
+    }
 
     Value eval(int t) const
     {
@@ -505,175 +565,171 @@ public:
             return Value();
         }
 
-        return a.to_int() >> b.to_int();
-    }
-
-protected:
-    string operand() const { return ">>"; }
-};
-
-class LessThan : public BinaryOperator
-{
-public:
-    using BinaryOperator::BinaryOperator;
-
-    Value eval(int t) const
-    {
-        Value a = left->eval(t);
-        if (!a.is_int())
+        if (!Op::is_defined(a.to_int(), b.to_int()))
         {
             return Value();
         }
+        return Op::apply(a.to_int(), b.to_int());
+    }
 
-        Value b = right->eval(t);
-        if (!b.is_int())
+    int eval_int(int t, bool &defined) const
+    {
+        int a = left->eval_int(t, defined);
+        int b = right->eval_int(t, defined);
+        if (!Op::is_defined(a, b))
         {
-            return Value();
+            defined = false;
+            return 0;
         }
-
-        return a.to_int() < b.to_int();
+        return Op::apply(a, b);
     }
 
-protected:
-    string operand() const { return "<"; }
+    const char *operand() const { return Op::symbol(); }
 };
 
-class LessThanEqual : public BinaryOperator
+/**
+ * Fused node for `expr op CONST`. The constant is read once at construction,
+ * so evaluation makes a single virtual call for the left operand. The right
+ * child is kept for printing and for passes that walk the tree.
+ */
+template <typename Op> class ConstantNode final : public BinaryOperator
 {
 public:
-    using BinaryOperator::BinaryOperator;
-
-    Value eval(int t) const
+    ConstantNode(AstPtr left, AstPtr right)
+        : BinaryOperator(move(left), move(right)),
+          value(static_cast<const Integer &>(get_right()).get_value())
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
-
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
-
-        return a.to_int() <= b.to_int();
+        range = get_binary_range(Op::type, get_left().get_range(),
+                                 get_right().get_range());
     }
 
-protected:
-    string operand() const { return "<="; }
-};
+    AstType type() const { return Op::type; }
 
-class GreaterThan : public BinaryOperator
-{
-public:
-    using BinaryOperator::BinaryOperator;
+    AstPtr clone() const
+    {
+        return AstPtr(new ConstantNode(left->clone(), right->clone()));
+    }
 
     Value eval(int t) const
     {
         Value a = left->eval(t);
-        if (!a.is_int())
+        if (!a.is_int() || !Op::is_defined(a.to_int(), value))
         {
             return Value();
         }
+        return Op::apply(a.to_int(), value);
+    }
 
-        Value b = right->eval(t);
-        if (!b.is_int())
+    int eval_int(int t, bool &defined) const
+    {
+        int a = left->eval_int(t, defined);
+        if (!Op::is_defined(a, value))
         {
-            return Value();
+            defined = false;
+            return 0;
         }
-
-        return a.to_int() > b.to_int();
+        return Op::apply(a, value);
     }
 
-protected:
-    string operand() const { return ">"; }
+    const char *operand() const { return Op::symbol(); }
+
+private:
+    const int value;
 };
 
-class GreaterThanEqual : public BinaryOperator
+/** Fused node for `t op CONST`, evaluated without visiting either child */
+template <typename Op>
+class IdentifierConstantNode final : public BinaryOperator
 {
 public:
-    using BinaryOperator::BinaryOperator;
-
-    Value eval(int t) const
+    IdentifierConstantNode(AstPtr left, AstPtr right)
+        : BinaryOperator(move(left), move(right)),
+          value(static_cast<const Integer &>(get_right()).get_value())
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
-
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
-
-        return a.to_int() >= b.to_int();
+        range = get_binary_range(Op::type, get_left().get_range(),
+                                 get_right().get_range());
     }
 
-protected:
-    string operand() const { return ">="; }
-};
+    AstType type() const { return Op::type; }
 
-class Equal : public BinaryOperator
-{
-public:
-    using BinaryOperator::BinaryOperator;
+    AstPtr clone() const
+    {
+        return AstPtr(
+            new IdentifierConstantNode(left->clone(), right->clone()));
+    }
 
     Value eval(int t) const
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
+        if (!Op::is_defined(t, value))
         {
             return Value();
         }
+        return Op::apply(t, value);
+    }
 
-        Value b = right->eval(t);
-        if (!b.is_int())
+    int eval_int(int t, bool &defined) const
+    {
+        if (!Op::is_defined(t, value))
         {
-            return Value();
+            defined = false;
+            return 0;
         }
-
-        return a.to_int() == b.to_int();
+        return Op::apply(t, value);
     }
 
-protected:
-    string operand() const { return "=="; }
+    const char *operand() const { return Op::symbol(); }
+
+private:
+    const int value;
 };
 
-class NotEqual : public BinaryOperator
+using Add = BinaryNode<AddOp>;
+using Subtract = BinaryNode<SubtractOp>;
+using Multiply = BinaryNode<MultiplyOp>;
+using Divide = BinaryNode<DivideOp>;
+using Modulo = BinaryNode<ModuloOp>;
+using BitwiseAnd = BinaryNode<BitwiseAndOp>;
+using BitwiseOr = BinaryNode<BitwiseOrOp>;
+using BitwiseXor = BinaryNode<BitwiseXorOp>;
+using BitwiseShiftLeft = BinaryNode<BitwiseShiftLeftOp>;
+using BitwiseShiftRight = BinaryNode<BitwiseShiftRightOp>;
+using LessThan = BinaryNode<LessThanOp>;
+using LessThanEqual = BinaryNode<LessThanEqualOp>;
+using GreaterThan = BinaryNode<GreaterThanOp>;
+using GreaterThanEqual = BinaryNode<GreaterThanEqualOp>;
+using Equal = BinaryNode<EqualOp>;
+using NotEqual = BinaryNode<NotEqualOp>;
+
+/**
+ * Build the node for `left op right`, choosing a fused node when the right
+ * operand is an integer constant.
+ */
+template <typename Op> AstPtr make_binary(AstPtr left, AstPtr right)
 {
-public:
-    using BinaryOperator::BinaryOperator;
-
-    Value eval(int t) const
+    if (right->type() != AstType::Integer)
     {
-        Value a = left->eval(t);
-        if (!a.is_int())
-        {
-            return Value();
-        }
-
-        Value b = right->eval(t);
-        if (!b.is_int())
-        {
-            return Value();
-        }
-
-        return a.to_int() != b.to_int();
+        return AstPtr(new BinaryNode<Op>(move(left), move(right)));
     }
+    if (left->type() == AstType::Identifier)
+    {
+        return AstPtr(
+            new IdentifierConstantNode<Op>(move(left), move(right)));
+    }
+    return AstPtr(new ConstantNode<Op>(move(left), move(right)));
+}
 
-protected:
-    string operand() const { return "!="; }
-};
-
-class TernaryIf : public Ast
+class TernaryIf final : public Ast
 {
 public:
     TernaryIf(AstPtr pred, AstPtr pass, AstPtr fail)
         : pred(move(pred)), pass(move(pass)), fail(move(fail))
     {
+        range = unite(get_pass().get_range(), get_fail().get_range());
+    }
+    ~TernaryIf()
+    {
+        AstPtr operands[] = {move(pred), move(pass), move(fail)};
+        destroy_operands(operands, 3);
     }
 
     Value eval(int t) const
@@ -687,10 +743,35 @@ public:
         return p.to_int() ? pass->eval(t) : fail->eval(t);
     }
 
-    operator string() const
+    int eval_int(int t, bool &defined) const
+    {
+        return pred->eval_int(t, defined) ? pass->eval_int(t, defined)
+                                          : fail->eval_int(t, defined);
+    }
+
+    const string &eval_str(int t, bool &defined) const
+    {
+        return pred->eval_int(t, defined) ? pass->eval_str(t, defined)
+                                          : fail->eval_str(t, defined);
+    }
+
+    AstType type() const { return AstType::TernaryIf; }
+
+    AstPtr clone() const
+    {
+        return AstPtr(
+            new TernaryIf(pred->clone(), pass->clone(), fail->clone()));
+    }
+
+    const Ast &get_pred() const { return *pred; }
+    const Ast &get_pass() const { return *pass; }
+    const Ast &get_fail() const { return *fail; }
+
+    void take_operands(vector<AstPtr> &out)
     {
-        return "(" + pred->operator string() + "?" + pass->operator string() +
-               ":" + fail->operator string() + ")";
+        out.push_back(move(pred));
+        out.push_back(move(pass));
+        out.push_back(move(fail));
     }
 
 private:
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "ast.hpp"
+#include "vm.hpp"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * Expressions with the same block instructions, evaluated in lock-step with
+ * one lane per expression. The arguments of each instruction are stored as
+ * kBlockSize lanes, and string arguments index the strings of every
+ * expression in the group.
+ */
+struct BatchGroup
+{
+    vector<OpCode> code;
+    vector<int> args;
+    vector<string> strings;
+    vector<int> expressions;
+    int max_depth;
+};
+
+/**
+ * Many expressions evaluated at the same values of t, as when scanning a
+ * library of expressions. Expressions whose bytecode only differs in its
+ * constants and strings share a group, so that each instruction is decoded
+ * once per t for up to kBlockSize expressions. An expression with too few
+ * others of the same shape is evaluated by its own Program instead.
+ */
+class BatchProgram
+{
+public:
+    explicit BatchProgram(const vector<AstPtr> &asts);
+
+    /**
+     * Evaluate every expression for n consecutive values of t starting at
+     * t0. The results of expression i are written from out + i * n, and
+     * defined may be null as in Program::eval_block.
+     */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Number of expressions in the batch */
+    size_t size() const { return count; }
+
+    const vector<BatchGroup> &get_groups() const { return groups; }
+
+    /** Number of expressions that are evaluated in a group */
+    int get_grouped_count() const;
+
+private:
+    size_t count;
+    vector<BatchGroup> groups;
+    vector<Program> programs;
+    vector<int> ungrouped;
+};
+
+} // namespace bb
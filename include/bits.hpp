@@ -0,0 +1,84 @@
+#pragma once
+
+#include "ast.hpp"
+
+#include <cstdint>
+
+using namespace std;
+
+namespace bb
+{
+
+/** Samples are truncated to 8 bits by the UGen and the command line tool */
+const uint32_t kOutputBits = 0xFF;
+
+/** Every bit of a sample */
+const uint32_t kAllBits = ~uint32_t(0);
+
+/** Every bit at or below the highest set bit */
+uint32_t fill_low_bits(uint32_t bits);
+
+/** Narrowest lane width, 8, 16 or 32 bits, that holds the given bits */
+int get_lane_bits(uint32_t bits);
+
+/**
+ * Bits of an operand that can change the demanded bits of a node's result.
+ * Operands are numbered as the tree orders them: left or inner first, and
+ * predicate, pass and fail for a ternary. Carries only move towards higher
+ * bits, so `+`, `-` and `*` demand every bit below the highest demanded
+ * one, while `&`, `|` and `^` demand the same bits, less any bits fixed by
+ * a constant operand.
+ */
+uint32_t get_operand_bits(const Ast &ast, int operand, uint32_t demanded);
+
+/**
+ * True if the low n bits of the node only depend on the low n bits of its
+ * operands, for any n, so that it can be computed in narrow lanes. Shifting
+ * right by a constant also qualifies, since it reads its operand at the
+ * operand's own width.
+ */
+bool is_narrow_op(const Ast &ast);
+
+/**
+ * Widest lane, 8, 16 or 32 bits, that any node needs to produce the
+ * demanded bits of the result. An expression whose lane width is 8 can be
+ * computed entirely in 8-bit lanes.
+ */
+int get_expression_lane_bits(const Ast &ast, uint32_t demanded = kOutputBits);
+
+/**
+ * Bits of t that can change the demanded bits of an expression, or whether
+ * it is defined. Divisors, subscripts and predicates depend on every bit of
+ * their operands, so they always pass the bits of t they use through.
+ */
+uint32_t get_t_bits(const Ast &ast, uint32_t demanded = kOutputBits);
+
+/** Lowest bit of t for a node that does not depend on t at all */
+const int kNoTBits = 32;
+
+/**
+ * For each bit of a node's value, the lowest bit of t that can change it,
+ * and the lowest bit of t that can change whether the node is defined. A
+ * node whose lowest bit is k only changes when t >> k does, which happens
+ * once every 2^k consecutive samples.
+ */
+struct TBitFloors
+{
+    int value[32];
+    int defined;
+};
+
+/**
+ * Floors of a node, given the floors of its operands in the order used by
+ * get_operand_bits. Only the type and any constant operand of the node are
+ * read, so a whole expression can be classified in one pass over its nodes.
+ */
+TBitFloors get_t_bit_floors(const Ast &ast, const TBitFloors *operands);
+
+/** Lowest bit of t that can change the node, or kNoTBits if none can */
+int get_lowest_t_bit(const TBitFloors &floors);
+
+/** Lowest bit of t that can change the value of an expression */
+int get_lowest_t_bit(const Ast &ast);
+
+} // namespace bb
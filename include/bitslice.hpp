@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ast.hpp"
+#include "bits.hpp"
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * True if the expression only uses t, integers, `~`, `&`, `|`, `^`, `<<` and
+ * `>>`, so that it can be evaluated by a BitSliceProgram.
+ */
+bool is_bit_sliceable(const Ast &ast);
+
+/**
+ * A node of a bit-sliced program. Operands refer to earlier nodes by index,
+ * and `slices` is the number of low bits of the node that are computed.
+ */
+struct BitSliceNode
+{
+    AstType type;
+    int value;
+    int operands[2];
+    int slices;
+};
+
+/**
+ * A bitwise expression evaluated 64 samples at a time in bit-sliced form,
+ * where word i of a node holds bit i of the node for each sample in the
+ * block. Bitwise operators become one word operation per bit for the whole
+ * block and shifts by a constant only move words, so the cost is dominated
+ * by converting t into slices and the result back into samples.
+ *
+ * As with NarrowProgram, only the demanded bits of each result are exact,
+ * and bits that are not demanded are not computed at all. The expression
+ * must satisfy is_bit_sliceable, and is never undefined.
+ */
+class BitSliceProgram
+{
+public:
+    explicit BitSliceProgram(const Ast &ast, uint32_t demanded = kOutputBits);
+
+    /** Evaluate the expression for n consecutive values of t from t0 */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Evaluate the expression for n arbitrary values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined) const;
+
+    const vector<BitSliceNode> &get_nodes() const { return nodes; }
+
+    /**
+     * Number of words computed per block, summed over every node. A shift
+     * right by a constant usually reuses the words of its operand, and
+     * computes none.
+     */
+    int get_slice_count() const;
+
+    /**
+     * True if the program is expected to be faster than the vm for blocks of
+     * consecutive t. Converting to and from slices costs about as much as a
+     * dozen bitwise operators, and a shift by a variable count costs several.
+     */
+    bool is_faster_than_vm() const;
+
+private:
+    void eval(const int *t, int t0, int n, int *out, bool *defined) const;
+
+    vector<BitSliceNode> nodes;
+};
+
+} // namespace bb
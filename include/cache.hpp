@@ -0,0 +1,106 @@
+#pragma once
+
+#include "ast.hpp"
+#include "tier.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * Programs kept by a ProgramCache unless another capacity is given. Each
+ * may hold a lookup table or a cached period besides its compiled code.
+ */
+const size_t kDefaultCacheEntries = 16;
+
+/** A tree in canonical form and its structural hash */
+struct CanonicalAst
+{
+    AstPtr ast;
+    uint64_t hash;
+};
+
+/**
+ * Hash the structure of a tree, so that trees which only differ in the
+ * order of commutative operands, or in writing a<b as b>a, hash the same.
+ * Parentheses and spacing never reach the tree, so they cannot matter.
+ */
+uint64_t hash_ast(const Ast &ast);
+
+/**
+ * Rebuild a tree with the operands of commutative operators and of
+ * comparisons in a fixed order, mirroring comparisons whose operands are
+ * swapped, and keeping integer constants on the right where they can be
+ * fused. Trees that hash the same have the same canonical form, which
+ * evaluates to the same value as the input for every t, and has the same
+ * hash.
+ */
+CanonicalAst canonicalize(const Ast &ast);
+
+/**
+ * The tiers compiled for the expressions loaded most recently, found by the
+ * structural hash of their canonical tree, so that an expression loaded
+ * again, however it is formatted, starts on the fastest tier compiled for
+ * it the first time rather than on the tree. The least recently used
+ * expression is dropped once there are more than the capacity.
+ *
+ * Entries also keep the printed canonical tree, so two expressions whose
+ * hashes collide never share tiers. The cache may be used from several
+ * threads, and a program it returns stays valid after its entry is
+ * dropped.
+ */
+class ProgramCache
+{
+public:
+    explicit ProgramCache(size_t capacity = kDefaultCacheEntries);
+
+    /**
+     * Parse and optimize an expression, and return a program for it that
+     * looks for a period of at most period_bytes, as TieredProgram does.
+     * Throws invalid_argument as parse does.
+     */
+    unique_ptr<TieredProgram> parse(const string &input,
+                                    size_t period_bytes = 0);
+
+    /** Return a program for a tree, compiling it if it is not cached */
+    unique_ptr<TieredProgram> get(const Ast &ast, size_t period_bytes = 0);
+
+    /** Calls that found the expression in the cache */
+    size_t get_hits() const;
+
+    /** Calls that had to compile the expression */
+    size_t get_misses() const;
+
+    /** Number of expressions in the cache */
+    size_t size() const;
+
+    /** Drop every expression and reset the counters */
+    void clear();
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        string text;
+        unique_ptr<TieredProgram> program;
+    };
+
+    /** Entries from the most to the least recently used */
+    list<Entry> entries;
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+    size_t capacity;
+    size_t hits;
+    size_t misses;
+    mutable mutex entries_mutex;
+};
+
+} // namespace bb
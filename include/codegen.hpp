@@ -0,0 +1,71 @@
+#pragma once
+
+#include "vm.hpp"
+
+#include <string>
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * Generate a self-contained C translation unit for the expression. The
+ * unit exports three functions:
+ *
+ * - int bb_eval(int t, bool *defined)
+ * - void bb_eval_block(int t0, int n, int *out, bool *defined)
+ * - void bb_eval_block_array(const int *t, int n, int *out, bool *defined)
+ *
+ * with the same semantics as the methods of Program.
+ */
+string generate_c(const Ast &ast);
+
+/**
+ * An expression compiled ahead of time by the system C compiler.
+ *
+ * The generated translation unit is compiled into a shared object in a
+ * temporary directory and loaded with dlopen. Compiling takes tens of
+ * milliseconds, so this backend suits long offline renders. If the
+ * compiler or the dynamic loader is unavailable, evaluation falls back to
+ * the bytecode interpreter.
+ */
+class NativeProgram
+{
+public:
+    /**
+     * Compile the expression with the given compiler command. Flags are
+     * appended to the command, so "clang -march=native" is also accepted.
+     */
+    explicit NativeProgram(const Ast &ast, const string &compiler = "cc");
+    ~NativeProgram();
+
+    NativeProgram(const NativeProgram &) = delete;
+    NativeProgram &operator=(const NativeProgram &) = delete;
+
+    /** Evaluate the expression for the given t */
+    Value eval(int t) const;
+
+    /** Evaluate the expression for n consecutive values of t from t0 */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Evaluate the expression for n arbitrary values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined) const;
+
+    /** True if evaluation runs compiled code rather than the interpreter */
+    bool is_native() const { return handle != nullptr; }
+
+private:
+    using ScalarFn = int (*)(int t, bool *defined);
+    using BlockFn = void (*)(int t0, int n, int *out, bool *defined);
+    using BlockArrayFn = void (*)(const int *t, int n, int *out,
+                                  bool *defined);
+
+    Program program;
+    void *handle;
+    ScalarFn scalar;
+    BlockFn block;
+    BlockArrayFn block_array;
+};
+
+} // namespace bb
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "ast.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * A node of an expression DAG. Operands refer to earlier nodes by index, so
+ * the node list is always in evaluation order. Integer nodes keep their
+ * value in `value` and string nodes keep an index into the string table.
+ */
+struct DagNode
+{
+    AstType type;
+    int value;
+    int operands[3];
+
+    bool operator==(const DagNode &other) const
+    {
+        return type == other.type && value == other.value &&
+               operands[0] == other.operands[0] &&
+               operands[1] == other.operands[1] &&
+               operands[2] == other.operands[2];
+    }
+};
+
+/**
+ * An expression stored as a hash-consed DAG, where structurally identical
+ * subtrees are stored once. Operands of commutative operators are put in a
+ * canonical order first, so t+1 and 1+t also share a node.
+ *
+ * Every node is evaluated exactly once per t. Ternary arms are evaluated
+ * eagerly and selected per sample, with an undefined flag per node, so an
+ * untaken arm never makes the result undefined. Divisions and subscripts
+ * that range analysis proves safe run without per-lane guards.
+ *
+ * Each node also records the lowest bit of t it depends on. A node that does
+ * not depend on the bits of t that vary within a block is computed for one
+ * lane, and keeps its lanes from the previous block while the bits it does
+ * depend on are unchanged.
+ */
+class Dag
+{
+public:
+    explicit Dag(const Ast &ast);
+
+    /** Evaluate the expression for the given t */
+    Value eval(int t) const;
+
+    /** Evaluate the expression for n consecutive values of t from t0 */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Evaluate the expression for n arbitrary values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined) const;
+
+    const vector<DagNode> &get_nodes() const { return nodes; }
+    const vector<string> &get_strings() const { return strings; }
+
+    /** Number of nodes in the tree the DAG was built from */
+    size_t get_tree_size() const { return tree_size; }
+
+    /** Number of tree nodes that were merged into an existing node */
+    size_t get_merged() const { return tree_size - nodes.size(); }
+
+    /** Lowest bit of t that can change the node, or kNoTBits if none can */
+    int get_lowest_t_bit(size_t id) const { return lowest_t_bits[id]; }
+
+    /** Number of nodes that are operators rather than t or a constant */
+    size_t get_operator_count() const;
+
+    /**
+     * Number of operators that are uniform over an aligned block of
+     * kBlockSize consecutive samples, and so are computed at most once per
+     * block.
+     */
+    size_t get_hoisted_count() const;
+
+private:
+    void eval(const int *t, int t0, int n, int *out, bool *defined) const;
+
+    vector<DagNode> nodes;
+    vector<string> strings;
+    vector<bool> always_int;
+    vector<bool> guarded;
+    vector<int> lowest_t_bits;
+    size_t tree_size;
+};
+
+} // namespace bb
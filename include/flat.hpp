@@ -0,0 +1,123 @@
+#pragma once
+
+#include "ast.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+class FlatAst;
+struct FlatNode;
+
+/** Evaluates a type checked integer node, clearing defined if it is not */
+using FlatEval = int (*)(const FlatAst &ast, const FlatNode &node, int t,
+                         bool &defined);
+
+/**
+ * A node of a FlatAst. Operands are indices of earlier nodes, and unused
+ * operands are 0. Integer nodes keep their value in `value`, string nodes
+ * keep an index into the string table, and binary operators with an integer
+ * right operand keep a copy of it.
+ *
+ * Each node holds the function that evaluates it, chosen when the node is
+ * added in the same way that make_binary chooses a fused node.
+ */
+struct FlatNode
+{
+    FlatEval eval;
+    AstType type;
+    int value;
+    uint32_t operands[3];
+
+    /** Nodes on the longest path from here to a leaf, counting both ends */
+    uint32_t depth;
+};
+
+/**
+ * Trees nested deeper than this are evaluated in a single pass over the
+ * array rather than by recursion, which would risk overflowing the stack
+ */
+const uint32_t kMaxRecursionDepth = 4096;
+
+/**
+ * An expression tree stored in a single array rather than as a heap object
+ * per node. Every node follows its operands, so the array is in evaluation
+ * order with the root last, and the whole tree is freed at once.
+ *
+ * Evaluation recurses from the root as it does for an Ast, with operands
+ * found by index in the same array. Trees deeper than kMaxRecursionDepth
+ * are evaluated node by node in array order instead, which needs no stack
+ * but evaluates both arms of every ternary.
+ */
+class FlatAst
+{
+public:
+    /** Reserve room for the given number of nodes */
+    void reserve(size_t count) { nodes.reserve(count); }
+
+    /** Append a node after its operands, and return its index */
+    uint32_t add_node(AstType type, int value, uint32_t a = 0, uint32_t b = 0,
+                      uint32_t c = 0);
+
+    /** Add a string to the string table, and return its index */
+    int add_string(const string &s);
+
+    /** Evaluate the expression for the given t */
+    Value eval(int t) const;
+
+    /**
+     * Evaluate a type checked integer expression as Ast::eval_int does,
+     * clearing defined if the result is undefined
+     */
+    int eval_int(int t, bool &defined) const;
+
+    /** Evaluate consecutive samples from t0, as Program::eval_block does */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Evaluate the samples at the given values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined) const;
+
+    /** Depth of the tree, or 0 if it is empty */
+    uint32_t get_depth() const;
+
+    /** Build the same tree as parse would, one node at a time */
+    AstPtr get_ast() const;
+
+    /** The expression printed as the equivalent Ast would print it */
+    operator string() const;
+
+    const vector<FlatNode> &get_nodes() const { return nodes; }
+    const vector<string> &get_strings() const { return strings; }
+
+    /** Number of nodes in the expression */
+    size_t size() const { return nodes.size(); }
+
+private:
+    vector<FlatNode> nodes;
+    vector<string> strings;
+};
+
+/**
+ * Check that a flat tree has the types that check_types requires of an
+ * Ast. Throws invalid_argument otherwise.
+ */
+void check_flat_types(const FlatAst &ast);
+
+/** Number of operands a node of the given type has */
+int get_operand_count(AstType type);
+
+/** Evaluate the node at the given index */
+inline int eval_flat_child(const FlatAst &ast, uint32_t index, int t,
+                           bool &defined)
+{
+    const FlatNode &node = ast.get_nodes()[index];
+    return node.eval(ast, node, t, defined);
+}
+
+} // namespace bb
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "ast.hpp"
+#include "tier.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+/** The first bytes of every program image */
+const char kImageMagic[8] = {'B', 'Y', 'T', 'E', 'B', 'E', 'A', 'T'};
+
+/** Version of the image layout written by write_image */
+const uint32_t kImageVersion = 1;
+
+/** Bytes in the fixed header, which every section follows */
+const size_t kImageHeaderBytes = 40;
+
+/** Bytes per node: its AstType and its value, each 32 bits */
+const size_t kImageNodeBytes = 8;
+
+/** Bytes per string: the offset and length of its characters */
+const size_t kImageStringBytes = 8;
+
+/**
+ * Serialize an optimized expression as a program image, which loads without
+ * lexing or parsing. With a non-zero period_bytes, the period that a
+ * PeriodicProgram finds within that bound is stored too, so the expression
+ * plays back from it as soon as it is loaded, without rendering it again.
+ *
+ * The image holds the nodes of the tree in postfix order, its strings and
+ * the period, at offsets computed from counts in a fixed header. Every
+ * field is little-endian with a fixed width, and no field is an address,
+ * so an image can be written on one machine and read at any address on
+ * another.
+ */
+vector<uint8_t> write_image(const Ast &ast, size_t period_bytes = 0);
+
+/**
+ * A program image read in place, such as from a mapped file or a received
+ * blob, which must outlive it. The constructor checks the whole image
+ * without allocating, so that a truncated or corrupt image is rejected
+ * before anything is built from it.
+ */
+class ProgramImage
+{
+public:
+    /** Throws invalid_argument if the data is not a valid image */
+    ProgramImage(const uint8_t *data, size_t size);
+
+    /** Rebuild and type check the expression */
+    AstPtr get_ast() const;
+
+    /** A program that plays back the stored period, or compiles the tree */
+    unique_ptr<TieredProgram> load() const;
+
+    /** Number of nodes in the expression */
+    uint32_t get_node_count() const { return node_count; }
+
+    /** Samples in the stored period, or 0 if there is none */
+    uint32_t get_period() const { return period; }
+
+private:
+    const uint8_t *data;
+    uint32_t node_count;
+    uint32_t string_count;
+    uint32_t period;
+    uint32_t defined_words;
+    size_t strings_offset;
+    size_t string_bytes_offset;
+    size_t samples_offset;
+    size_t defined_offset;
+};
+
+} // namespace bb
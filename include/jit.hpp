@@ -0,0 +1,59 @@
+#pragma once
+
+#include "vm.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * An expression compiled to native x86-64 machine code.
+ *
+ * The bytecode program is lowered instruction by instruction into an
+ * executable mapping, with the accumulator in eax and the interpreter stack
+ * on the machine stack. On other architectures, or if executable memory
+ * cannot be mapped, evaluation falls back to the bytecode interpreter.
+ */
+class JitProgram
+{
+public:
+    explicit JitProgram(const Ast &ast);
+    ~JitProgram();
+
+    JitProgram(const JitProgram &) = delete;
+    JitProgram &operator=(const JitProgram &) = delete;
+
+    /** Evaluate the expression for the given t */
+    Value eval(int t) const;
+
+    /** Evaluate the expression for n consecutive values of t from t0 */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Evaluate the expression for n arbitrary values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined) const;
+
+    /** True if evaluation runs native code rather than the interpreter */
+    bool is_native() const { return memory != nullptr; }
+
+    /** True if native code can be generated for the host architecture */
+    static bool is_supported();
+
+private:
+    using ScalarFn = uint64_t (*)(int t);
+    using BlockFn = void (*)(int t0, int n, int *out, bool *defined);
+    using BlockArrayFn = void (*)(const int *t, int n, int *out,
+                                  bool *defined);
+
+    Program program;
+    void *memory;
+    size_t size;
+    ScalarFn scalar;
+    BlockFn block;
+    BlockArrayFn block_array;
+};
+
+} // namespace bb
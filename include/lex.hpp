@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <cstring>
+#include <ostream>
 #include <string>
 #include <vector>
 
@@ -43,6 +46,9 @@ enum class TokenType
     TernaryElse,
 };
 
+/** Number of token types */
+const int kTokenTypeCount = static_cast<int>(TokenType::TernaryElse) + 1;
+
 inline ostream &operator<<(std::ostream &os, const TokenType &type)
 {
 
@@ -169,11 +175,41 @@ inline ostream &operator<<(std::ostream &os, const TokenType &type)
     return os;
 }
 
-/** A token and the category that it belongs to */
+/**
+ * The characters of a token, as a slice of the string it was lexed from
+ * rather than a copy. It is only valid while that string is.
+ */
+struct TokenText
+{
+    TokenText() : data(""), length(0) {}
+    TokenText(const char *s) : data(s), length(strlen(s)) {}
+    TokenText(const char *s, size_t n) : data(s), length(n) {}
+
+    string str() const { return string(data, length); }
+
+    const char *data;
+    size_t length;
+};
+
+inline bool operator==(const TokenText &a, const TokenText &b)
+{
+    return a.length == b.length && memcmp(a.data, b.data, a.length) == 0;
+}
+
+inline ostream &operator<<(std::ostream &os, const TokenText &text)
+{
+    return os.write(text.data, text.length);
+}
+
+/**
+ * A token and the category that it belongs to. Integer tokens also carry
+ * their decoded value.
+ */
 struct Token
 {
     TokenType type;
-    string value;
+    TokenText value;
+    int integer = 0;
 };
 
 inline bool operator==(const Token &t1, const Token &t2)
@@ -191,7 +227,34 @@ inline ostream &operator<<(std::ostream &os, const Token &token)
     return os;
 }
 
-/** Split a string into a list of component tokens */
+/**
+ * Split a string into a list of component tokens. The tokens refer to the
+ * input, which must outlive them.
+ */
 vector<Token> lex(const string &input);
+vector<Token> lex(const char *input, size_t length);
+
+/**
+ * How the tokens of an edited input line up with those of the input it was
+ * edited from. The first `prefix` tokens are the same in both, as are the
+ * tokens from `old_suffix` in the original and from `new_suffix` in the
+ * edit. Only the tokens between were lexed again.
+ */
+struct TokenEdit
+{
+    size_t prefix;
+    size_t old_suffix;
+    size_t new_suffix;
+};
+
+/**
+ * Lex an edited version of an input whose tokens are already known, giving
+ * the same tokens as lex. Tokens outside the edited characters are copied
+ * rather than lexed again, so a small edit costs little however long the
+ * input is. `previous` and `tokens` are the original input and its tokens.
+ */
+vector<Token> relex(const char *previous, size_t previous_length,
+                    const vector<Token> &tokens, const char *input,
+                    size_t length, TokenEdit &edit);
 
 } // namespace bb
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "ast.hpp"
+#include "bits.hpp"
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+/** Most bits of t that a LookupProgram indexes its table with */
+const int kMaxLookupBits = 16;
+
+/**
+ * Number of consecutive bits of t, from the lowest to the highest bit that
+ * get_t_bits reports, that a table of the expression would be indexed by
+ */
+int get_lookup_bits(const Ast &ast, uint32_t demanded = kOutputBits);
+
+/** True if a table of the expression has at most kMaxLookupBits bits */
+bool is_lookup_sized(const Ast &ast, uint32_t demanded = kOutputBits);
+
+/**
+ * An expression that depends on only a few bits of t, precomputed into a
+ * table indexed by those bits. Evaluation is a shift, a mask and a load per
+ * sample, whatever the expression costs.
+ *
+ * As with NarrowProgram, only the demanded bits of each result are exact,
+ * and with kAllBits every result is. The expression must satisfy
+ * is_lookup_sized for the same demanded bits.
+ */
+class LookupProgram
+{
+public:
+    explicit LookupProgram(const Ast &ast, uint32_t demanded = kOutputBits);
+
+    /** Evaluate the expression for n consecutive values of t from t0 */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Evaluate the expression for n arbitrary values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined) const;
+
+    /** Number of bits of t in a table index */
+    int get_table_bits() const { return bits; }
+
+    /** Lowest bit of t in a table index */
+    int get_table_shift() const { return shift; }
+
+private:
+    int bits;
+    int shift;
+    vector<int> values;
+    vector<unsigned char> defined_values;
+};
+
+} // namespace bb
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ast.hpp"
+#include "bits.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * A node of a narrow program. Operands refer to earlier nodes by index, and
+ * `bits` is the width of the lanes the node is computed in. Nodes that are
+ * not `narrow` always use signed 32-bit lanes. A binary node with a
+ * `constant` right operand holds it in `value` instead of an operand node.
+ */
+struct NarrowNode
+{
+    AstType type;
+    int value;
+    int operands[3];
+    int bits;
+    bool narrow;
+    bool guarded;
+    bool constant;
+};
+
+/**
+ * An expression evaluated a block at a time with each node in the narrowest
+ * lanes that hold its demanded bits, so that an 8-bit node processes four
+ * times as many values of t per vector instruction as a 32-bit one. Nodes
+ * that cannot be narrowed, such as comparisons and division, run in 32-bit
+ * lanes and are truncated for the nodes that read them.
+ *
+ * Only the demanded bits of each result are exact. With the default of
+ * kOutputBits, every result is correct once truncated to a sample, and
+ * whether it is defined is always exact.
+ */
+class NarrowProgram
+{
+public:
+    explicit NarrowProgram(const Ast &ast, uint32_t demanded = kOutputBits);
+
+    /** Evaluate the expression for n consecutive values of t from t0 */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Evaluate the expression for n arbitrary values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined) const;
+
+    const vector<NarrowNode> &get_nodes() const { return nodes; }
+
+    /** Number of nodes computed in lanes of the given width */
+    int get_node_count(int bits) const;
+
+private:
+    void eval(const int *t, int t0, int n, int *out, bool *defined) const;
+
+    vector<NarrowNode> nodes;
+    vector<string> strings;
+};
+
+} // namespace bb
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ast.hpp"
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * Rewrite an expression tree into an equivalent one with fewer nodes.
+ *
+ * The pass folds constant sub-expressions, removes identities such as x|0,
+ * turns power-of-two multiply, divide and modulo into shifts and masks
+ * where that cannot change the result, and prunes ternary arms behind a
+ * constant predicate. Division and modulo that range analysis proves safe
+ * are built without their zero divisor test. The result evaluates to the
+ * same value as the input for every t, including which values of t are
+ * undefined.
+ */
+AstPtr optimize(AstPtr ast);
+
+/**
+ * Build the optimized form of an operator from operands that are already
+ * optimized. optimize rebuilds each node of a tree from its operands in
+ * this way, so a tree built bottom-up with these is the tree it returns.
+ */
+AstPtr optimize_unary(AstType type, AstPtr inner);
+AstPtr optimize_binary(AstType type, AstPtr left, AstPtr right);
+AstPtr optimize_ternary(AstPtr pred, AstPtr pass, AstPtr fail);
+
+/**
+ * Build the node for an operator as written, without optimizing it, but
+ * choosing the fused or unchecked node that its operands allow
+ */
+AstPtr make_unary_node(AstType type, AstPtr inner);
+AstPtr make_binary_node(AstType type, AstPtr left, AstPtr right);
+
+} // namespace bb
@@ -1,14 +1,96 @@
 #pragma once
 
 #include "ast.hpp"
+#include "flat.hpp"
+#include "lex.hpp"
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 using namespace std;
 
 namespace bb
 {
 
+/**
+ * Parse and type check an expression. Throws invalid_argument if the input
+ * cannot be parsed or is ill-typed.
+ */
 AstPtr parse(const string &tokens);
 
+/** Parse an expression that is not held in a string, such as a mapped file */
+AstPtr parse(const char *input, size_t length);
+
+/**
+ * Parse and type check an expression into a FlatAst, with the same errors
+ * as parse.
+ */
+FlatAst parse_flat(const string &tokens);
+FlatAst parse_flat(const char *input, size_t length);
+
+/**
+ * Check that a tree has the expected type, that strings are only used as
+ * subscript bases and that both arms of a ternary have the same type.
+ * Throws invalid_argument otherwise.
+ */
+void check_types(const Ast &ast, ValueType expected = ValueType::Integer);
+
+/**
+ * The optimized tree of a parenthesized group, kept by a Reparser under the
+ * indices of the group's parentheses in its tokens
+ */
+struct ParsedGroup
+{
+    size_t open;
+    size_t close;
+    ValueType type;
+    uint32_t depth;
+    AstPtr ast;
+};
+
+/**
+ * Parses successive edits of an expression, as sent while live coding,
+ * reusing the work done for the version before. Only the edited characters
+ * are lexed again, and a parenthesized group outside the edit is copied
+ * from the previous parse already optimized. Each parse returns the same
+ * tree as optimize(parse(input)).
+ */
+class Reparser
+{
+public:
+    Reparser();
+
+    /**
+     * Parse, type check and optimize an edited expression. Throws
+     * invalid_argument as parse does, or if the expression is nested deeper
+     * than kMaxRecursionDepth, which the passes over the tree it returns
+     * could not handle. Either way the last expression that parsed stays
+     * the base for the next edit.
+     */
+    AstPtr parse(const string &input);
+
+    /**
+     * True if the last expression parsed has the same tokens as the one
+     * before it, as when an expression is sent again or only its spacing
+     * changed, so a program built for that one can be kept
+     */
+    bool is_unchanged() const { return unchanged; }
+
+    /** Tokens that the last parse lexed rather than copied */
+    size_t get_lexed_tokens() const { return lexed_tokens; }
+
+    /** Groups that the last parse copied rather than parsed */
+    size_t get_reused_groups() const { return reused_groups; }
+
+private:
+    vector<char> source;
+    vector<Token> tokens;
+    vector<ParsedGroup> groups;
+    bool unchanged;
+    size_t lexed_tokens;
+    size_t reused_groups;
+};
+
 } // namespace bb
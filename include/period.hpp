@@ -0,0 +1,81 @@
+#pragma once
+
+#include "ast.hpp"
+#include "vm.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+/** Default bound on the memory a PeriodicProgram caches a period in */
+const size_t kDefaultPeriodBytes = size_t(1) << 22;
+
+/** Samples compared with the cached period at each verification point */
+const int kPeriodCheckSamples = 4096;
+
+/**
+ * An expression played back from a cached copy of one period of its output.
+ * Many expressions repeat with a power-of-two period that analysis cannot
+ * prove, so the period is found empirically: the longest period that fits
+ * in max_bytes is rendered from t = 0, and the shortest power of two that
+ * it repeats with is then checked against kPeriodCheckSamples samples at
+ * points spread over the whole range of t. An expression that fails the
+ * check is evaluated live by a Program.
+ *
+ * Each cached sample takes a byte and a bit for whether it is defined, so
+ * only the low 8 bits of a result are exact, as with kOutputBits for a
+ * NarrowProgram.
+ */
+class PeriodicProgram
+{
+public:
+    explicit PeriodicProgram(const Ast &ast,
+                             size_t max_bytes = kDefaultPeriodBytes);
+
+    /**
+     * Play back a period that was found before, such as one read from a
+     * program image. The number of samples must be a power of two, and
+     * defined_words holds a bit per sample, or is empty if every sample is
+     * defined. Throws invalid_argument otherwise.
+     */
+    PeriodicProgram(const Ast &ast, vector<uint8_t> samples,
+                    vector<uint64_t> defined_words);
+
+    /** Evaluate the expression for n consecutive values of t from t0 */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Evaluate the expression for n arbitrary values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined) const;
+
+    /** True if samples are played back from the cache */
+    bool is_periodic() const { return period != 0; }
+
+    /** Samples in one period, or 0 if the expression is evaluated live */
+    uint32_t get_period() const { return period; }
+
+    /** Bytes used by the cached period */
+    size_t get_cache_bytes() const;
+
+    const vector<uint8_t> &get_samples() const { return samples; }
+    const vector<uint64_t> &get_defined_words() const
+    {
+        return defined_words;
+    }
+
+private:
+    bool is_defined(uint32_t index) const;
+    bool find_period(uint32_t max_period);
+    bool check_period(uint32_t t0) const;
+
+    Program program;
+    uint32_t period;
+    vector<uint8_t> samples;
+    vector<uint64_t> defined_words;
+};
+
+} // namespace bb
@@ -0,0 +1,841 @@
+#pragma once
+
+#include "ast.hpp"
+#include "lex.hpp"
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+/** Most nodes, and so most tokens, in an expression parsed at compile time */
+const size_t kMaxPresetNodes = 256;
+
+/**
+ * A node of a PresetTree. Operands are indices of earlier nodes. Integer
+ * nodes keep their value in `value`, and string nodes the offset and length
+ * of their characters in the expression.
+ */
+struct PresetNode
+{
+    AstType type;
+    ValueType value_type;
+    int value;
+    uint32_t length;
+    uint32_t operands[3];
+};
+
+/**
+ * An expression parsed at compile time. Every node follows its operands,
+ * and the last node is the root. The characters of strings are read from
+ * `text`, which must be a string literal.
+ */
+struct PresetTree
+{
+    const char *text;
+    PresetNode nodes[kMaxPresetNodes];
+    uint32_t size;
+
+    constexpr uint32_t get_root() const { return size - 1; }
+};
+
+/** The characters of a string node */
+struct PresetString
+{
+    const char *data;
+    uint32_t length;
+};
+
+/** A token of an expression parsed at compile time */
+struct PresetToken
+{
+    TokenType type;
+    uint32_t begin;
+    uint32_t length;
+    int integer;
+};
+
+constexpr PresetTree parse_preset(const char *text);
+
+/**
+ * A node of a preset as a type. Each node is a distinct instantiation whose
+ * operands and constants are template arguments, so evaluating the root
+ * compiles to straight-line code that the optimizer sees whole. Operators
+ * apply the functors of ast.hpp, so presets evaluate as Ast::eval_int does.
+ */
+template <const PresetTree &Tree, uint32_t Index> struct PresetExpr
+{
+    static constexpr const PresetNode &node = Tree.nodes[Index];
+
+    template <int N> using Operand = PresetExpr<Tree, node.operands[N]>;
+
+    static int eval_int(int t, bool &defined);
+    static PresetString eval_str(int t, bool &defined);
+};
+
+/**
+ * A built-in expression compiled at compile time. Source is a type with a
+ * string literal `static constexpr const char *text`, which is parsed and
+ * type checked as it is compiled, so a malformed preset does not build.
+ */
+template <typename Source> class Preset
+{
+public:
+    static constexpr PresetTree tree = parse_preset(Source::text);
+
+    /** Evaluate the expression, clearing `defined` if it is undefined */
+    static int eval_int(int t, bool &defined)
+    {
+        return PresetExpr<tree, tree.get_root()>::eval_int(t, defined);
+    }
+
+    /** Evaluate the expression for n consecutive values of t from t0 */
+    static void eval_block(int t0, int n, int *out, bool *defined)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            bool is_defined = true;
+            int value = eval_int(t0 + i, is_defined);
+            out[i] = is_defined ? value : 0;
+            if (defined)
+            {
+                defined[i] = is_defined;
+            }
+        }
+    }
+};
+
+/** A preset shipped with the command line tool */
+struct BuiltinPreset
+{
+    const char *name;
+    const char *text;
+    void (*eval_block)(int t0, int n, int *out, bool *defined);
+};
+
+/** The presets compiled into the command line tool */
+const vector<BuiltinPreset> &get_builtin_presets();
+
+/**
+ * The built-in preset that computes the same as an expression, written in
+ * any order that canonicalize treats as the same, or null if there is none
+ */
+const BuiltinPreset *find_builtin_preset(const Ast &ast);
+
+/** The functor of ast.hpp that applies an operator node type */
+template <AstType Type> struct PresetOp;
+template <> struct PresetOp<AstType::Negate>
+{
+    using type = NegateOp;
+};
+template <> struct PresetOp<AstType::BitwiseComplement>
+{
+    using type = BitwiseComplementOp;
+};
+template <> struct PresetOp<AstType::Not>
+{
+    using type = NotOp;
+};
+template <> struct PresetOp<AstType::Add>
+{
+    using type = AddOp;
+};
+template <> struct PresetOp<AstType::Subtract>
+{
+    using type = SubtractOp;
+};
+template <> struct PresetOp<AstType::Multiply>
+{
+    using type = MultiplyOp;
+};
+template <> struct PresetOp<AstType::Divide>
+{
+    using type = DivideOp;
+};
+template <> struct PresetOp<AstType::Modulo>
+{
+    using type = ModuloOp;
+};
+template <> struct PresetOp<AstType::BitwiseAnd>
+{
+    using type = BitwiseAndOp;
+};
+template <> struct PresetOp<AstType::BitwiseOr>
+{
+    using type = BitwiseOrOp;
+};
+template <> struct PresetOp<AstType::BitwiseXor>
+{
+    using type = BitwiseXorOp;
+};
+template <> struct PresetOp<AstType::BitwiseShiftLeft>
+{
+    using type = BitwiseShiftLeftOp;
+};
+template <> struct PresetOp<AstType::BitwiseShiftRight>
+{
+    using type = BitwiseShiftRightOp;
+};
+template <> struct PresetOp<AstType::LessThan>
+{
+    using type = LessThanOp;
+};
+template <> struct PresetOp<AstType::LessThanEqual>
+{
+    using type = LessThanEqualOp;
+};
+template <> struct PresetOp<AstType::GreaterThan>
+{
+    using type = GreaterThanOp;
+};
+template <> struct PresetOp<AstType::GreaterThanEqual>
+{
+    using type = GreaterThanEqualOp;
+};
+template <> struct PresetOp<AstType::Equal>
+{
+    using type = EqualOp;
+};
+template <> struct PresetOp<AstType::NotEqual>
+{
+    using type = NotEqualOp;
+};
+
+template <const PresetTree &Tree, uint32_t Index>
+int PresetExpr<Tree, Index>::eval_int(int t, bool &defined)
+{
+    constexpr AstType type = node.type;
+    if constexpr (type == AstType::Identifier)
+    {
+        return t;
+    }
+    else if constexpr (type == AstType::Integer)
+    {
+        return node.value;
+    }
+    else if constexpr (type == AstType::String)
+    {
+        defined = false;
+        return 0;
+    }
+    else if constexpr (type == AstType::TernaryIf)
+    {
+        return Operand<0>::eval_int(t, defined)
+                   ? Operand<1>::eval_int(t, defined)
+                   : Operand<2>::eval_int(t, defined);
+    }
+    else if constexpr (type == AstType::Subscript)
+    {
+        PresetString s = Operand<0>::eval_str(t, defined);
+        int i = Operand<1>::eval_int(t, defined);
+        if (i < 0 || static_cast<uint32_t>(i) >= s.length)
+        {
+            defined = false;
+            return 0;
+        }
+        return s.data[i];
+    }
+    else if constexpr (type == AstType::Negate ||
+                       type == AstType::BitwiseComplement ||
+                       type == AstType::Not)
+    {
+        return PresetOp<type>::type::apply(Operand<0>::eval_int(t, defined));
+    }
+    else
+    {
+        using Op = typename PresetOp<type>::type;
+        int a = Operand<0>::eval_int(t, defined);
+        int b = Operand<1>::eval_int(t, defined);
+        if (!Op::is_defined(a, b))
+        {
+            defined = false;
+            return 0;
+        }
+        return Op::apply(a, b);
+    }
+}
+
+template <const PresetTree &Tree, uint32_t Index>
+PresetString PresetExpr<Tree, Index>::eval_str(int t, bool &defined)
+{
+    if constexpr (node.type == AstType::String)
+    {
+        return PresetString{Tree.text + node.value, node.length};
+    }
+    else if constexpr (node.type == AstType::TernaryIf)
+    {
+        return Operand<0>::eval_int(t, defined)
+                   ? Operand<1>::eval_str(t, defined)
+                   : Operand<2>::eval_str(t, defined);
+    }
+    else
+    {
+        defined = false;
+        return PresetString{"", 0};
+    }
+}
+
+/**
+ * The lexer and parser below follow lex and parse_tokens, with fixed-size
+ * stacks in place of vectors so that they can run at compile time. Errors
+ * throw as they do at runtime, which makes them compile errors in a
+ * constant expression.
+ */
+
+/** Binding power of a binary operator token, 0 for ?, -1 for neither */
+constexpr int get_preset_precedence(TokenType type)
+{
+    switch (type)
+    {
+    case TokenType::LeftBracket:
+        return 11;
+    case TokenType::Multiply:
+    case TokenType::Divide:
+    case TokenType::Modulo:
+        return 10;
+    case TokenType::Plus:
+    case TokenType::Minus:
+        return 9;
+    case TokenType::BitwiseShiftLeft:
+    case TokenType::BitwiseShiftRight:
+        return 8;
+    case TokenType::LessThan:
+    case TokenType::GreaterThan:
+    case TokenType::LessThanEqual:
+    case TokenType::GreaterThanEqual:
+        return 7;
+    case TokenType::Equal:
+    case TokenType::NotEqual:
+        return 6;
+    case TokenType::BitwiseAnd:
+        return 5;
+    case TokenType::BitwiseXor:
+        return 4;
+    case TokenType::BitwiseOr:
+        return 3;
+    case TokenType::And:
+        return 2;
+    case TokenType::Or:
+        return 1;
+    case TokenType::TernaryIf:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/** The node a binary operator token builds */
+constexpr AstType get_preset_binary_type(TokenType type)
+{
+    switch (type)
+    {
+    case TokenType::LeftBracket:
+        return AstType::Subscript;
+    case TokenType::Plus:
+        return AstType::Add;
+    case TokenType::Minus:
+        return AstType::Subtract;
+    case TokenType::Multiply:
+        return AstType::Multiply;
+    case TokenType::Divide:
+        return AstType::Divide;
+    case TokenType::Modulo:
+        return AstType::Modulo;
+    case TokenType::BitwiseAnd:
+        return AstType::BitwiseAnd;
+    case TokenType::BitwiseOr:
+        return AstType::BitwiseOr;
+    case TokenType::BitwiseXor:
+        return AstType::BitwiseXor;
+    case TokenType::BitwiseShiftLeft:
+        return AstType::BitwiseShiftLeft;
+    case TokenType::BitwiseShiftRight:
+        return AstType::BitwiseShiftRight;
+    case TokenType::LessThan:
+        return AstType::LessThan;
+    case TokenType::GreaterThan:
+        return AstType::GreaterThan;
+    case TokenType::LessThanEqual:
+        return AstType::LessThanEqual;
+    case TokenType::GreaterThanEqual:
+        return AstType::GreaterThanEqual;
+    case TokenType::Equal:
+        return AstType::Equal;
+    case TokenType::NotEqual:
+        return AstType::NotEqual;
+    default:
+        throw invalid_argument("Unrecognized operator");
+    }
+}
+
+/** The node a prefix operator token builds, or Undefined if it is none */
+constexpr AstType get_preset_unary_type(TokenType type)
+{
+    switch (type)
+    {
+    case TokenType::Minus:
+        return AstType::Negate;
+    case TokenType::BitwiseComplement:
+        return AstType::BitwiseComplement;
+    case TokenType::Not:
+        return AstType::Not;
+    default:
+        return AstType::Undefined;
+    }
+}
+
+constexpr bool is_preset_digit(char c, int base)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0' < base;
+    }
+    return base == 16 && ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'));
+}
+
+/** As decode_integer, which stops at the first digit not in its base */
+constexpr int decode_preset_integer(const char *text, size_t length)
+{
+    int base = 10;
+    size_t i = 0;
+    if (length > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+    {
+        base = 16;
+        i = 2;
+    }
+    else if (length > 1 && text[0] == '0')
+    {
+        base = 8;
+        i = 1;
+    }
+
+    long long value = 0;
+    for (; i < length && is_preset_digit(text[i], base); ++i)
+    {
+        char c = text[i];
+        int digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+        value = value * base + digit;
+        if (value > INT_MAX)
+        {
+            throw out_of_range("Integer out of range");
+        }
+    }
+    return static_cast<int>(value);
+}
+
+/**
+ * Lex the token that starts at or after `i`, skipping whitespace, and move
+ * `i` past it. Returns an Unknown token at the end of the text.
+ */
+constexpr PresetToken lex_preset_token(const char *text, size_t &i)
+{
+    while (text[i] == ' ' || text[i] == '\t' || text[i] == '\n' ||
+           text[i] == '\r')
+    {
+        ++i;
+    }
+
+    size_t start = i;
+    char c = text[i];
+    TokenType type = TokenType::Unknown;
+    switch (c)
+    {
+    case '\0':
+        return PresetToken{TokenType::Unknown, uint32_t(i), 0, 0};
+    case 't':
+        type = TokenType::Identifier;
+        break;
+    case '+':
+        type = TokenType::Plus;
+        break;
+    case '-':
+        type = TokenType::Minus;
+        break;
+    case '*':
+        type = TokenType::Multiply;
+        break;
+    case '/':
+        type = TokenType::Divide;
+        break;
+    case '%':
+        type = TokenType::Modulo;
+        break;
+    case '^':
+        type = TokenType::BitwiseXor;
+        break;
+    case '~':
+        type = TokenType::BitwiseComplement;
+        break;
+    case '?':
+        type = TokenType::TernaryIf;
+        break;
+    case ':':
+        type = TokenType::TernaryElse;
+        break;
+    case '(':
+        type = TokenType::LeftParen;
+        break;
+    case ')':
+        type = TokenType::RightParen;
+        break;
+    case '[':
+        type = TokenType::LeftBracket;
+        break;
+    case ']':
+        type = TokenType::RightBracket;
+        break;
+    case '<':
+        type = text[i + 1] == '<'   ? TokenType::BitwiseShiftLeft
+               : text[i + 1] == '=' ? TokenType::LessThanEqual
+                                    : TokenType::LessThan;
+        break;
+    case '>':
+        type = text[i + 1] == '>'   ? TokenType::BitwiseShiftRight
+               : text[i + 1] == '=' ? TokenType::GreaterThanEqual
+                                    : TokenType::GreaterThan;
+        break;
+    case '!':
+        type = text[i + 1] == '=' ? TokenType::NotEqual : TokenType::Not;
+        break;
+    case '=':
+        if (text[i + 1] != '=')
+        {
+            throw invalid_argument("Invalid token: =");
+        }
+        type = TokenType::Equal;
+        break;
+    case '&':
+        type = text[i + 1] == '&' ? TokenType::And : TokenType::BitwiseAnd;
+        break;
+    case '|':
+        type = text[i + 1] == '|' ? TokenType::Or : TokenType::BitwiseOr;
+        break;
+    case '"':
+    {
+        ++i;
+        while (text[i] != '"')
+        {
+            if (text[i] == '\0')
+            {
+                throw invalid_argument("Invalid string");
+            }
+            ++i;
+        }
+        ++i;
+        return PresetToken{TokenType::String, uint32_t(start + 1),
+                           uint32_t(i - start - 2), 0};
+    }
+    default:
+        break;
+    }
+
+    if (type != TokenType::Unknown)
+    {
+        bool pair = type == TokenType::BitwiseShiftLeft ||
+                    type == TokenType::LessThanEqual ||
+                    type == TokenType::BitwiseShiftRight ||
+                    type == TokenType::GreaterThanEqual ||
+                    type == TokenType::NotEqual || type == TokenType::Equal ||
+                    type == TokenType::And || type == TokenType::Or;
+        i += pair ? 2 : 1;
+        return PresetToken{type, uint32_t(start), uint32_t(i - start), 0};
+    }
+
+    if (c < '0' || c > '9')
+    {
+        throw invalid_argument("Invalid token");
+    }
+    bool is_hex = c == '0' && (text[i + 1] == 'x' || text[i + 1] == 'X');
+    i += is_hex ? 2 : 1;
+    while (is_preset_digit(text[i], is_hex ? 16 : 10))
+    {
+        ++i;
+    }
+    if (is_hex && i == start + 2)
+    {
+        throw invalid_argument("Invalid hexadecimal integer: 0x");
+    }
+    return PresetToken{TokenType::Integer, uint32_t(start),
+                       uint32_t(i - start),
+                       decode_preset_integer(text + start, i - start)};
+}
+
+/** Append a node after its operands, checking their types */
+constexpr uint32_t add_preset_node(PresetTree &tree, AstType type, int value,
+                                   uint32_t a = 0, uint32_t b = 0,
+                                   uint32_t c = 0)
+{
+    if (tree.size == kMaxPresetNodes)
+    {
+        throw invalid_argument("Preset has too many nodes");
+    }
+
+    ValueType value_type = ValueType::Integer;
+    bool is_typed = true;
+    switch (type)
+    {
+    case AstType::Identifier:
+    case AstType::Integer:
+        break;
+    case AstType::String:
+        value_type = ValueType::String;
+        break;
+    case AstType::Negate:
+    case AstType::BitwiseComplement:
+    case AstType::Not:
+        is_typed = tree.nodes[a].value_type == ValueType::Integer;
+        break;
+    case AstType::Subscript:
+        is_typed = tree.nodes[a].value_type == ValueType::String &&
+                   tree.nodes[b].value_type == ValueType::Integer;
+        break;
+    case AstType::TernaryIf:
+        value_type = tree.nodes[b].value_type;
+        is_typed = tree.nodes[a].value_type == ValueType::Integer &&
+                   tree.nodes[c].value_type == value_type;
+        break;
+    default:
+        is_typed = tree.nodes[a].value_type == ValueType::Integer &&
+                   tree.nodes[b].value_type == ValueType::Integer;
+        break;
+    }
+    if (!is_typed)
+    {
+        throw invalid_argument("Type error");
+    }
+
+    tree.nodes[tree.size] = PresetNode{type, value_type, value, 0, {a, b, c}};
+    return tree.size++;
+}
+
+/**
+ * Build the pending binary operators of the innermost frame that bind at
+ * least as tightly as min_precedence
+ */
+constexpr void reduce_preset_binary(PresetTree &tree, uint32_t *operands,
+                                    size_t &operand_count,
+                                    const PresetToken *operators,
+                                    size_t &operator_count, size_t base,
+                                    int min_precedence)
+{
+    while (operator_count > base &&
+           get_preset_precedence(operators[operator_count - 1].type) >=
+               min_precedence)
+    {
+        TokenType type = operators[--operator_count].type;
+        uint32_t right = operands[--operand_count];
+        uint32_t left = operands[operand_count - 1];
+        operands[operand_count - 1] = add_preset_node(
+            tree, get_preset_binary_type(type), 0, left, right);
+    }
+}
+
+/** Apply the prefix operators that precede the primary just parsed */
+constexpr void reduce_preset_unary(PresetTree &tree, uint32_t *operands,
+                                   size_t operand_count,
+                                   const PresetToken *operators,
+                                   const bool *unary, size_t &operator_count,
+                                   size_t base)
+{
+    while (operator_count > base && unary[operator_count - 1])
+    {
+        TokenType type = operators[--operator_count].type;
+        operands[operand_count - 1] =
+            add_preset_node(tree, get_preset_unary_type(type), 0,
+                            operands[operand_count - 1]);
+    }
+}
+
+/**
+ * Parse and type check an expression as parse does, into a tree that can
+ * be evaluated at compile time. Throws invalid_argument, or out_of_range
+ * for an integer that does not fit in an int, if parse would.
+ */
+constexpr PresetTree parse_preset(const char *text)
+{
+    enum Frame
+    {
+        Input,
+        Paren,
+        Bracket,
+        TernaryPass,
+        TernaryFail,
+    };
+
+    PresetTree tree{};
+    tree.text = text;
+
+    uint32_t operands[kMaxPresetNodes] = {};
+    size_t operand_count = 0;
+    PresetToken operators[kMaxPresetNodes] = {};
+    bool unary[kMaxPresetNodes] = {};
+    size_t operator_count = 0;
+    Frame frames[kMaxPresetNodes] = {};
+    size_t frame_operators[kMaxPresetNodes] = {};
+    size_t frame_count = 1;
+
+    size_t i = 0;
+    PresetToken token = lex_preset_token(text, i);
+    if (token.type == TokenType::Unknown)
+    {
+        throw invalid_argument("No tokens to parse");
+    }
+
+    bool expect_operand = true;
+    for (;;)
+    {
+        if (frame_count == kMaxPresetNodes ||
+            operator_count == kMaxPresetNodes)
+        {
+            throw invalid_argument("Preset has too many nodes");
+        }
+        size_t base = frame_operators[frame_count - 1];
+
+        if (expect_operand)
+        {
+            TokenType type = token.type;
+            if (type == TokenType::Unknown)
+            {
+                throw invalid_argument("Expected primary token but got end "
+                                       "of input");
+            }
+            PresetToken primary = token;
+            token = lex_preset_token(text, i);
+
+            if (type == TokenType::LeftParen)
+            {
+                frames[frame_count] = Paren;
+                frame_operators[frame_count] = operator_count;
+                ++frame_count;
+                continue;
+            }
+            if (get_preset_unary_type(type) != AstType::Undefined)
+            {
+                operators[operator_count] = primary;
+                unary[operator_count++] = true;
+                continue;
+            }
+
+            if (type == TokenType::Identifier)
+            {
+                operands[operand_count++] =
+                    add_preset_node(tree, AstType::Identifier, 0);
+            }
+            else if (type == TokenType::Integer)
+            {
+                operands[operand_count++] =
+                    add_preset_node(tree, AstType::Integer, primary.integer);
+            }
+            else if (type == TokenType::String)
+            {
+                uint32_t node = add_preset_node(tree, AstType::String,
+                                                primary.begin);
+                tree.nodes[node].length = primary.length;
+                operands[operand_count++] = node;
+            }
+            else
+            {
+                throw invalid_argument("Unexpected primary token");
+            }
+            reduce_preset_unary(tree, operands, operand_count, operators,
+                                unary, operator_count, base);
+            expect_operand = false;
+            continue;
+        }
+
+        // A binary operator or a ternary continues the expression
+        TokenType type = token.type;
+        int precedence = get_preset_precedence(type);
+        if (precedence > 0)
+        {
+            reduce_preset_binary(tree, operands, operand_count, operators,
+                                 operator_count, base, precedence);
+            operators[operator_count] = token;
+            unary[operator_count++] = false;
+            token = lex_preset_token(text, i);
+            if (type == TokenType::LeftBracket)
+            {
+                frames[frame_count] = Bracket;
+                frame_operators[frame_count] = operator_count;
+                ++frame_count;
+            }
+            expect_operand = true;
+            continue;
+        }
+        if (precedence == 0)
+        {
+            reduce_preset_binary(tree, operands, operand_count, operators,
+                                 operator_count, base, 0);
+            token = lex_preset_token(text, i);
+            frames[frame_count] = TernaryPass;
+            frame_operators[frame_count] = operator_count;
+            ++frame_count;
+            expect_operand = true;
+            continue;
+        }
+
+        // Anything else ends the innermost frame
+        reduce_preset_binary(tree, operands, operand_count, operators,
+                             operator_count, base, 0);
+        switch (frames[frame_count - 1])
+        {
+        case Input:
+            if (type != TokenType::Unknown)
+            {
+                throw invalid_argument("Not all tokens consumed");
+            }
+            if (tree.nodes[tree.get_root()].value_type != ValueType::Integer)
+            {
+                throw invalid_argument("Type error");
+            }
+            return tree;
+        case Paren:
+            if (type != TokenType::RightParen)
+            {
+                throw invalid_argument("Unbalanced parentheses");
+            }
+            token = lex_preset_token(text, i);
+            --frame_count;
+            reduce_preset_unary(tree, operands, operand_count, operators,
+                                unary, operator_count,
+                                frame_operators[frame_count - 1]);
+            break;
+        case Bracket:
+            if (type != TokenType::RightBracket)
+            {
+                throw invalid_argument("Unbalanced brackets");
+            }
+            token = lex_preset_token(text, i);
+            --frame_count;
+            break;
+        case TernaryPass:
+            if (type != TokenType::TernaryElse)
+            {
+                throw invalid_argument("Missing ternary else");
+            }
+            token = lex_preset_token(text, i);
+            frames[frame_count - 1] = TernaryFail;
+            expect_operand = true;
+            break;
+        case TernaryFail:
+        {
+            // The same token ends the frame that the ternary is in
+            uint32_t fail = operands[--operand_count];
+            uint32_t pass = operands[--operand_count];
+            uint32_t pred = operands[operand_count - 1];
+            operands[operand_count - 1] = add_preset_node(
+                tree, AstType::TernaryIf, 0, pred, pass, fail);
+            --frame_count;
+            break;
+        }
+        }
+    }
+}
+
+} // namespace bb
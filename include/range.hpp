@@ -0,0 +1,26 @@
+#pragma once
+
+#include "ast.hpp"
+
+#include <cstdint>
+
+using namespace std;
+
+namespace bb
+{
+
+/** The range that the node stored when it was built, see Ast::get_range */
+Range get_range(const Ast &ast);
+
+/**
+ * True unless `left op right` is proven to always be defined: a divisor is
+ * never 0, INT_MIN is never divided by -1 and a subscript is always within
+ * its string. Always false for operators other than Divide, Modulo and
+ * Subscript, which never need a guard.
+ */
+bool needs_guard(AstType type, const Ast &left, const Ast &right);
+
+/** needs_guard for the operands of a binary node */
+bool needs_guard(const Ast &ast);
+
+} // namespace bb
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "ast.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+using namespace std;
+
+namespace bb
+{
+
+/** Evaluation tiers, from the cheapest to build to the fastest to run */
+enum class Tier
+{
+    Tree,
+    Bytecode,
+    Native,
+    Period,
+    Table,
+};
+
+const int kTierCount = 5;
+
+/** Timing collected for one tier of a TieredProgram */
+struct TierStats
+{
+    /** Nanoseconds from construction until the tier was ready, or -1 */
+    int64_t ready_ns;
+
+    /** Nanoseconds from construction until the tier's first block, or -1 */
+    int64_t first_block_ns;
+
+    /** Samples evaluated by the tier */
+    int64_t samples;
+
+    /** Nanoseconds spent evaluating those samples */
+    int64_t eval_ns;
+
+    /** Steady-state cost of the tier, or 0 if it has not run */
+    double ns_per_sample() const
+    {
+        return samples ? static_cast<double>(eval_ns) / samples : 0;
+    }
+};
+
+struct TierState;
+class PeriodicProgram;
+
+/**
+ * An expression that starts producing samples immediately by walking the
+ * tree, while a background thread compiles it to bytecode and then to
+ * native code. An expression that depends on few enough bits of t is
+ * finally tabulated into a LookupProgram. Otherwise, with a non-zero
+ * period_bytes, the thread looks for a period of at most that many bytes
+ * and plays it back with a PeriodicProgram, whose results are only exact
+ * in their low 8 bits.
+ *
+ * Each call to eval_block uses the fastest tier that is ready when the call
+ * begins, so tiers only change at block boundaries.
+ *
+ * Programs made by share evaluate with the same tiers, compiled once. The
+ * destructor does not wait for the compiler thread. The thread owns a share
+ * of the compiled state and exits on its own once it notices that every
+ * program sharing it was destroyed.
+ */
+class TieredProgram
+{
+public:
+    explicit TieredProgram(AstPtr ast, size_t period_bytes = 0);
+
+    /**
+     * Play back a period that was found before, such as one read from a
+     * program image, from the first block. Nothing is compiled, since the
+     * period is the fastest tier the expression would reach.
+     */
+    TieredProgram(AstPtr ast, unique_ptr<PeriodicProgram> periodic);
+    ~TieredProgram();
+
+    TieredProgram(const TieredProgram &) = delete;
+    TieredProgram &operator=(const TieredProgram &) = delete;
+
+    /** Evaluate the expression for n consecutive values of t from t0 */
+    void eval_block(int t0, int n, int *out, bool *defined);
+
+    /** Evaluate the expression for n arbitrary values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined);
+
+    /** The fastest tier that is ready to evaluate */
+    Tier get_tier() const;
+
+    /** Block until the background compiler has built every tier */
+    void wait() const;
+
+    /**
+     * Timing for a tier, as observed by the thread calling eval_block. Times
+     * are from the construction of this program, so a tier that was ready
+     * when it was shared is ready after 0ns.
+     */
+    TierStats get_stats(Tier tier) const;
+
+    /**
+     * A program for the same expression that shares the tiers compiled for
+     * this one, including those that are still being compiled, so it starts
+     * on the fastest tier that is ready. Each program keeps its own stats.
+     */
+    unique_ptr<TieredProgram> share() const;
+
+private:
+    using Clock = chrono::steady_clock;
+
+    explicit TieredProgram(shared_ptr<TierState> state);
+
+    Tier begin_block(Clock::time_point &start);
+    void end_block(Tier tier, Clock::time_point start, int n);
+
+    shared_ptr<TierState> state;
+    TierStats stats[kTierCount];
+
+    /** Nanoseconds from the construction of the state to this program */
+    int64_t created_ns;
+};
+
+/** Name of a tier for logging */
+const char *get_tier_name(Tier tier);
+
+} // namespace bb
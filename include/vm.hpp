@@ -0,0 +1,140 @@
+#pragma once
+
+#include "ast.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+/** Set of instructions understood by the bytecode interpreter */
+enum class OpCode : uint8_t
+{
+    Identifier,
+    Integer,
+    String,
+    Undefined,
+    Negate,
+    BitwiseComplement,
+    Not,
+    Subscript,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Modulo,
+    BitwiseAnd,
+    BitwiseOr,
+    BitwiseXor,
+    BitwiseShiftLeft,
+    BitwiseShiftRight,
+    LessThan,
+    LessThanEqual,
+    GreaterThan,
+    GreaterThanEqual,
+    Equal,
+    NotEqual,
+    AddConstant,
+    SubtractConstant,
+    MultiplyConstant,
+    DivideConstant,
+    ModuloConstant,
+    BitwiseAndConstant,
+    BitwiseOrConstant,
+    BitwiseXorConstant,
+    BitwiseShiftLeftConstant,
+    BitwiseShiftRightConstant,
+    LessThanConstant,
+    LessThanEqualConstant,
+    GreaterThanConstant,
+    GreaterThanEqualConstant,
+    EqualConstant,
+    NotEqualConstant,
+    SubscriptUnchecked,
+    DivideUnchecked,
+    ModuloUnchecked,
+    JumpIfZero,
+    Jump,
+    Return,
+    Select,
+};
+
+/** Number of t values evaluated together by Program::eval_block */
+const int kBlockSize = 64;
+
+/**
+ * A single bytecode instruction. The meaning of arg depends on the opcode:
+ * an integer constant, an index into the string table or a jump target.
+ */
+struct Instruction
+{
+    OpCode op;
+    int arg;
+};
+
+/**
+ * A bytecode program compiled from an expression tree.
+ *
+ * The program runs on a stack machine whose top element is kept in an
+ * accumulator. Binary operators with a constant right operand are encoded
+ * as a single instruction carrying the constant. An Undefined result stops
+ * evaluation immediately, since it would propagate to the root anyway.
+ *
+ * A second instruction stream evaluates kBlockSize values of t at once,
+ * with every stack slot holding one lane per t. Ternary expressions
+ * evaluate both arms and select between them per lane, and Undefined
+ * results are tracked as a bit mask per slot instead of stopping early.
+ */
+class Program
+{
+public:
+    /** The default program has no expression and evaluates to Undefined */
+    Program()
+        : code{Instruction{OpCode::Undefined, 0}},
+          block_code{Instruction{OpCode::Undefined, 0}}, max_depth(0),
+          block_max_depth(1)
+    {
+    }
+
+    /**
+     * Evaluate the program for the given t. String results cannot be
+     * sampled and are reported as Undefined.
+     */
+    Value eval(int t) const;
+
+    /**
+     * Evaluate the program for n consecutive values of t starting at t0.
+     * Undefined results are written to out as 0 and flagged as false in
+     * defined, which may be null if the caller does not need them.
+     */
+    void eval_block(int t0, int n, int *out, bool *defined) const;
+
+    /** Evaluate the program for n arbitrary values of t */
+    void eval_block(const int *t, int n, int *out, bool *defined) const;
+
+    const vector<Instruction> &get_code() const { return code; }
+    const vector<Instruction> &get_block_code() const { return block_code; }
+    const vector<string> &get_strings() const { return strings; }
+    int get_max_depth() const { return max_depth; }
+    int get_block_max_depth() const { return block_max_depth; }
+
+private:
+    friend Program compile(const Ast &ast);
+
+    int run(int t, int *stack, bool &defined) const;
+
+    vector<Instruction> code;
+    vector<Instruction> block_code;
+    vector<string> strings;
+    int max_depth;
+    int block_max_depth;
+};
+
+/** Compile an expression tree into a bytecode program */
+Program compile(const Ast &ast);
+
+} // namespace bb
@@ -1,40 +1,275 @@
 #include <SC_PlugIn.hpp>
 
+#include <cstring>
+#include <new>
 #include <stdexcept>
 #include <string>
 
 #include "ByteBeat.hpp"
+#include "cache.hpp"
+#include "image.hpp"
 #include "parse.hpp"
+#include "tier.hpp"
+#include "vm.hpp"
 
 static InterfaceTable *ft;
 
+/**
+ * Tiers compiled for the expressions played most recently by any unit, so
+ * that going back to an expression resumes on its compiled code
+ */
+static bb::ProgramCache programCache;
+
 namespace ByteBeat
 {
+/**
+ * What a command needs of its unit, which may be freed while the command is
+ * in the non-real-time thread. Only the real-time thread touches it, so it
+ * needs no lock. The unit clears `unit` when it is freed, and the last of
+ * the unit and its commands to finish frees the handle.
+ */
+struct UnitHandle
+{
+    ByteBeat *unit;
+    int refs;
+};
+
+/**
+ * A unit command on its way to the non-real-time thread, which builds its
+ * program, and back to the real-time thread, which swaps it in. Whatever
+ * the unit gives up in exchange is freed in the non-real-time thread too.
+ */
+struct ProgramCmd
+{
+    UnitHandle *handle;
+
+    /** The expression or image, copied out of the message after the command */
+    char *input;
+    size_t size;
+    bool isImage;
+    size_t periodBytes;
+
+    unique_ptr<bb::Reparser> parser;
+    unique_ptr<bb::TieredProgram> program;
+    bool unchanged;
+};
+
+void releaseHandle(World *world, UnitHandle *handle);
+
 ByteBeat::ByteBeat()
+    : mPeriodBytes(0), mProgramPeriodBytes(0), mLoaded(false)
 {
     mCalcFunc = make_calc_function<ByteBeat, &ByteBeat::next>();
 
-    // Initialize with no audio to avoid popping/unitialized buffer. The
-    // Undefined expression will be evaluated as 0.0 when sampled.
-    mAst = bb::AstPtr(new bb::Undefined());
+    mHandle = static_cast<UnitHandle *>(RTAlloc(mWorld, sizeof(UnitHandle)));
+    if (mHandle)
+    {
+        mHandle->unit = this;
+        mHandle->refs = 1;
+    }
+    else
+    {
+        Print("ByteBeat: out of real-time memory\n");
+    }
+
+    // There is no program until the first expression is parsed, so no audio
+    // is produced. Silence is output as 0.0.
+}
+
+ByteBeat::~ByteBeat()
+{
+    if (mHandle)
+    {
+        mHandle->unit = nullptr;
+        releaseHandle(mWorld, mHandle);
+    }
+
+    // Free the program and parser in the non-real-time thread too
+    if (!mProgram && !mParser)
+    {
+        return;
+    }
+    ProgramCmd *cmd = newCmd(0, false);
+    if (cmd)
+    {
+        cmd->program = move(mProgram);
+        cmd->parser = move(mParser);
+        DoAsynchronousCommand(mWorld, nullptr, nullptr, cmd, freeProgram,
+                              nullptr, nullptr, freeCmd, 0, nullptr);
+    }
 }
 
 void ByteBeat::parse(const char *input)
 {
-    string s = input;
+    size_t size = strlen(input);
+    ProgramCmd *cmd = newCmd(size, false);
+    if (!cmd)
+    {
+        return;
+    }
+    memcpy(cmd->input, input, size);
+
+    // The parser goes with the command, so a command sent before the last
+    // one returns starts a new one and that expression is parsed in full
+    cmd->parser = move(mParser);
+    sendCmd(cmd);
+}
+
+void ByteBeat::load(sc_msg_iter *args)
+{
+    size_t size = args->getbsize();
+    ProgramCmd *cmd = newCmd(size, true);
+    if (!cmd)
+    {
+        return;
+    }
+    args->getb(cmd->input, size);
+    sendCmd(cmd);
+}
+
+ProgramCmd *ByteBeat::newCmd(size_t size, bool isImage)
+{
+    void *memory = RTAlloc(mWorld, sizeof(ProgramCmd) + size);
+    if (!memory)
+    {
+        Print("ByteBeat: out of real-time memory\n");
+        return nullptr;
+    }
+    ProgramCmd *cmd = new (memory) ProgramCmd();
+    cmd->handle = nullptr;
+    cmd->input = reinterpret_cast<char *>(cmd + 1);
+    cmd->size = size;
+    cmd->isImage = isImage;
+    cmd->periodBytes = mPeriodBytes;
+    cmd->unchanged = false;
+    return cmd;
+}
+
+void ByteBeat::sendCmd(ProgramCmd *cmd)
+{
+    if (mHandle)
+    {
+        cmd->handle = mHandle;
+        ++mHandle->refs;
+    }
+    DoAsynchronousCommand(mWorld, nullptr, nullptr, cmd, buildProgram,
+                          swapProgram, freeProgram, freeCmd, 0, nullptr);
+}
+
+void ByteBeat::install(ProgramCmd &cmd)
+{
+    // A parser that failed on its first expression has nothing to edit
+    if (!cmd.isImage && (cmd.program || !mParser))
+    {
+        swap(mParser, cmd.parser);
+    }
+    if (!cmd.program)
+    {
+        return;
+    }
 
+    // Sending the same expression again keeps its compiled tiers and
+    // cached period rather than starting over from the tree
+    if (mProgram && !mLoaded && cmd.unchanged &&
+        mProgramPeriodBytes == cmd.periodBytes)
+    {
+        return;
+    }
+    swap(mProgram, cmd.program);
+    mProgramPeriodBytes = cmd.periodBytes;
+    mLoaded = cmd.isImage;
+}
+
+/**
+ * Parse the expression and find its program, or decode the image, in the
+ * non-real-time thread
+ */
+bool ByteBeat::buildProgram(World *world, void *data)
+{
+    ProgramCmd &cmd = *static_cast<ProgramCmd *>(data);
+    bool parsed = false;
     try
     {
-        mAst = bb::parse(s);
+        if (cmd.isImage)
+        {
+            bb::ProgramImage image(reinterpret_cast<uint8_t *>(cmd.input),
+                                   cmd.size);
+            cmd.program = image.load();
+            return true;
+        }
+        if (!cmd.parser)
+        {
+            cmd.parser.reset(new bb::Reparser());
+        }
+        bb::AstPtr ast = cmd.parser->parse(string(cmd.input, cmd.size));
+        parsed = true;
+        cmd.unchanged = cmd.parser->is_unchanged();
+        cmd.program = programCache.get(*ast, cmd.periodBytes);
     }
-    catch (invalid_argument &ex)
+    catch (exception &ex)
     {
+        // Anything thrown out of this thread would terminate the server.
+        // A parser whose last expression failed to build is dropped, as it
+        // no longer matches the program that keeps playing.
+        if (parsed)
+        {
+            cmd.parser.reset();
+        }
         Print("%s", ex.what());
         // TODO: Send back to client somehow. May not be possible without a
         //       more general sendResponse interface.
         // See:
         // https://scsynth.org/t/scsynth-plugincmd-and-sending-responses/2638
     }
+    return true;
+}
+
+/** Swap the program into the unit, in the real-time thread */
+bool ByteBeat::swapProgram(World *world, void *data)
+{
+    ProgramCmd &cmd = *static_cast<ProgramCmd *>(data);
+    if (cmd.handle && cmd.handle->unit)
+    {
+        cmd.handle->unit->install(cmd);
+    }
+    return true;
+}
+
+/**
+ * Free whatever program and parser the command is left with, in the
+ * non-real-time thread. No reply is sent, as the command has no name.
+ */
+bool ByteBeat::freeProgram(World *world, void *data)
+{
+    ProgramCmd &cmd = *static_cast<ProgramCmd *>(data);
+    cmd.program.reset();
+    cmd.parser.reset();
+    return true;
+}
+
+/** Free the command itself, in the real-time thread */
+void ByteBeat::freeCmd(World *world, void *data)
+{
+    ProgramCmd *cmd = static_cast<ProgramCmd *>(data);
+    if (cmd->handle)
+    {
+        releaseHandle(world, cmd->handle);
+    }
+    cmd->~ProgramCmd();
+    RTFree(world, cmd);
+}
+
+void releaseHandle(World *world, UnitHandle *handle)
+{
+    if (--handle->refs == 0)
+    {
+        RTFree(world, handle);
+    }
+}
+
+void ByteBeat::setPeriodBytes(int bytes)
+{
+    mPeriodBytes = bytes > 0 ? bytes : 0;
 }
 
 void ByteBeat::next(int nSamples)
@@ -42,35 +277,41 @@ void ByteBeat::next(int nSamples)
     const float *tBuf = in(0);
     float *outBuf = out(0);
 
-    for (int i = 0; i < nSamples; ++i)
+    if (!mProgram)
     {
-        int t = tBuf[i];
-        float sample;
+        for (int i = 0; i < nSamples; ++i)
+        {
+            outBuf[i] = 0;
+        }
+        return;
+    }
+
+    int t[bb::kBlockSize];
+    int values[bb::kBlockSize];
+    bool defined[bb::kBlockSize];
 
-        // In most cases, the t input will change slower than the sample
-        // rate. Save some cycles by only evaluating the expression when
-        // t changes.
-        if (t == mPrevT)
+    // Evaluate a whole block of t values at once, which is much cheaper per
+    // sample than evaluating them one at a time even when t repeats.
+    for (int offset = 0; offset < nSamples; offset += bb::kBlockSize)
+    {
+        int n = sc_min(bb::kBlockSize, nSamples - offset);
+        for (int i = 0; i < n; ++i)
         {
-            sample = mPrevSample;
+            t[i] = tBuf[offset + i];
         }
-        else
+
+        mProgram->eval_block(t, n, values, defined);
+
+        for (int i = 0; i < n; ++i)
         {
-            bb::Value val = mAst->eval(t);
-            if (val.is_int())
+            float sample = 0;
+            if (defined[i])
             {
-                uint8_t byte = val.to_int();
+                uint8_t byte = values[i];
                 sample = 2 * (float)byte / 255 - 1;
             }
-            else
-            {
-                sample = 0;
-            }
-            mPrevT = t;
-            mPrevSample = sample;
+            outBuf[offset + i] = sample;
         }
-
-        outBuf[i] = sample;
     }
 }
 
@@ -79,6 +320,23 @@ void ByteBeat::next(int nSamples)
  * a single string argument representing the new bytebeat expression.
  */
 void evalCmd(ByteBeat *unit, sc_msg_iter *args) { unit->parse(args->gets()); }
+
+/**
+ * Unit command callback for the /load command. Expects args to contain a
+ * single blob argument holding a program image, as written by the command
+ * line tool with -o.
+ */
+void loadCmd(ByteBeat *unit, sc_msg_iter *args) { unit->load(args); }
+
+/**
+ * Unit command callback for the /period command. Expects args to contain
+ * a single integer argument, the bytes that the period of later
+ * expressions may be cached in.
+ */
+void periodCmd(ByteBeat *unit, sc_msg_iter *args)
+{
+    unit->setPeriodBytes(args->geti());
+}
 } // namespace ByteBeat
 
 PluginLoad(ByteBeat)
@@ -88,4 +346,6 @@ PluginLoad(ByteBeat)
     registerUnit<ByteBeat::ByteBeat>(ft, "ByteBeat", false);
 
     DefineUnitCmd("ByteBeat", "/eval", (UnitCmdFunc)ByteBeat::evalCmd);
+    DefineUnitCmd("ByteBeat", "/load", (UnitCmdFunc)ByteBeat::loadCmd);
+    DefineUnitCmd("ByteBeat", "/period", (UnitCmdFunc)ByteBeat::periodCmd);
 }
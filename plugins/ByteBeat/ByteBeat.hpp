@@ -2,10 +2,18 @@
 
 #include <SC_PlugIn.hpp>
 
-#include "ast.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "parse.hpp"
+#include "tier.hpp"
 
 namespace ByteBeat
 {
+struct UnitHandle;
+struct ProgramCmd;
+
 /**
  * ByteBeat is able to parse simple mathematical expressions and evaluate
  * them to produce audio samples.
@@ -15,6 +23,24 @@ namespace ByteBeat
  * an expression has been parsed, it will become the active expression and
  * begin producing audio samples.
  *
+ * Expressions are parsed and their programs built in the non-real-time
+ * thread, and the audio thread only swaps in the finished program. Each
+ * expression is parsed as an edit of the one before, so only the edited
+ * part is parsed again, and an expression sent again with at most its
+ * spacing changed keeps playing on the program already built for it.
+ *
+ * New expressions start playing on the first block after they are parsed,
+ * using the expression tree, and switch to compiled code once a background
+ * thread has built it. Expressions played recently by any unit, however
+ * they were formatted, start on the code already compiled for them. Once
+ * the /period unit command has set a bound, the thread then looks for a
+ * period of the output of at most that many bytes, and plays it back from a
+ * cache once found.
+ *
+ * The /load unit command plays a program image instead, precompiled by the
+ * command line tool, so that a period found on another machine is played
+ * back without being rendered again.
+ *
  * ByteBeat expects a single audio-rate input, "t", that is passed to the
  * expression.
  */
@@ -22,14 +48,30 @@ class ByteBeat : public SCUnit
 {
 public:
     ByteBeat();
+    ~ByteBeat();
 
     /**
-     * Parse the incoming expression and replace the existing expression.
-     * Does not replace the existing expression if the incoming expression
-     * cannot be parsed.
+     * Parse the incoming expression in the non-real-time thread and replace
+     * the existing expression once it is built. Does not replace the
+     * existing expression if the incoming expression cannot be parsed.
      */
     void parse(const char *input);
 
+    /**
+     * Replace the existing expression with one loaded from the program
+     * image in the blob argument of a unit command, which starts on the
+     * period stored in it, if any. The blob is copied into real-time memory
+     * and decoded in the non-real-time thread. Does not replace the
+     * existing expression if the image is not valid.
+     */
+    void load(sc_msg_iter *args);
+
+    /**
+     * Bound the memory used to cache the period of expressions parsed from
+     * now on. 0, the default, disables period detection.
+     */
+    void setPeriodBytes(int bytes);
+
 private:
     /**
      * Evaluate the current bytebeat expression for the given number of
@@ -37,10 +79,51 @@ private:
      */
     void next(int nSamples);
 
-    float mPrevSample = 0;
-    int mPrevT = 0;
+    /**
+     * Allocate a command from real-time memory, with room for the given
+     * bytes of input, an expression or an image. Returns null if the memory
+     * is exhausted.
+     */
+    ProgramCmd *newCmd(size_t size, bool isImage);
+
+    /** Build the command's program in the non-real-time thread */
+    void sendCmd(ProgramCmd *cmd);
+
+    /** Swap in the program that a command built, in the real-time thread */
+    void install(ProgramCmd &cmd);
+
+    /** Command stages, see DoAsynchronousCommand */
+    static bool buildProgram(World *world, void *data);
+    static bool swapProgram(World *world, void *data);
+    static bool freeProgram(World *world, void *data);
+    static void freeCmd(World *world, void *data);
+
+    /**
+     * bytebeat expression used to generate audio samples, or null until the
+     * first expression is parsed
+     */
+    unique_ptr<bb::TieredProgram> mProgram;
+
+    /**
+     * Parses each expression as an edit of the previous one. A command
+     * takes it to the non-real-time thread and gives it back, so it is null
+     * until the first expression is parsed and while a command has it.
+     */
+    unique_ptr<bb::Reparser> mParser;
+
+    /** Lets commands in flight find out whether the unit was freed */
+    UnitHandle *mHandle;
+
+    /**
+     * Bound on the memory used to cache the period of an expression, or 0
+     * until the /period unit command sets one
+     */
+    size_t mPeriodBytes;
+
+    /** The bound that mProgram was built with */
+    size_t mProgramPeriodBytes;
 
-    /** bytebeat expression used to generate audio samples */
-    bb::AstPtr mAst;
+    /** True if mProgram was loaded from an image rather than parsed */
+    bool mLoaded;
 };
 } // namespace ByteBeat
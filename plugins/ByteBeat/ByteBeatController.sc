@@ -9,6 +9,18 @@ ByteBeatController {
         this.sendMsg('/eval', expression)
     }
 
+    load { arg path;
+        var file = File.open(path, "rb");
+        var image = Int8Array.newClear(file.length);
+        file.read(image);
+        file.close;
+        this.sendMsg('/load', image)
+    }
+
+    period { arg bytes;
+        this.sendMsg('/period', bytes)
+    }
+
     sendMsg { arg cmd ... args;
         synth.server.sendMsg('/u_cmd', synth.nodeID, synthIndex, cmd, *args)
     }
@@ -0,0 +1,118 @@
+#include "ast.hpp"
+
+namespace bb
+{
+
+bool has_operands(const Ast &ast);
+
+void destroy_operands(AstPtr *operands, size_t count)
+{
+    // Leaves are freed directly, so a node whose operands are all leaves,
+    // or were already taken, never allocates the stack
+    vector<AstPtr> stack;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (operands[i] && has_operands(*operands[i]))
+        {
+            stack.push_back(move(operands[i]));
+        }
+        operands[i].reset();
+    }
+
+    while (!stack.empty())
+    {
+        AstPtr node = move(stack.back());
+        stack.pop_back();
+        node->take_operands(stack);
+    }
+}
+
+/**
+ * Print with an explicit stack of pending nodes and text, into a single
+ * string. Concatenating the strings of the operands instead would copy
+ * each character once per level of nesting above it.
+ */
+Ast::operator string() const
+{
+    struct Item
+    {
+        const Ast *node;
+        const char *text;
+    };
+
+    string out;
+    vector<Item> stack{{this, nullptr}};
+    while (!stack.empty())
+    {
+        Item item = stack.back();
+        stack.pop_back();
+        if (!item.node)
+        {
+            out += item.text;
+            continue;
+        }
+
+        const Ast &ast = *item.node;
+        switch (ast.type())
+        {
+        case AstType::Undefined:
+            out += "UNDEFINED";
+            break;
+        case AstType::Identifier:
+            out += "t";
+            break;
+        case AstType::Integer:
+            out += to_string(static_cast<const Integer &>(ast).get_value());
+            break;
+        case AstType::String:
+            out += "\"";
+            out += static_cast<const String &>(ast).get_value();
+            out += "\"";
+            break;
+        case AstType::Negate:
+        case AstType::BitwiseComplement:
+        case AstType::Not:
+        {
+            auto &unary = static_cast<const UnaryOperator &>(ast);
+            out += "(";
+            out += unary.operand();
+            stack.push_back({nullptr, ")"});
+            stack.push_back({&unary.get_inner(), nullptr});
+            break;
+        }
+        case AstType::TernaryIf:
+        {
+            auto &ternary = static_cast<const TernaryIf &>(ast);
+            out += "(";
+            stack.push_back({nullptr, ")"});
+            stack.push_back({&ternary.get_fail(), nullptr});
+            stack.push_back({nullptr, ":"});
+            stack.push_back({&ternary.get_pass(), nullptr});
+            stack.push_back({nullptr, "?"});
+            stack.push_back({&ternary.get_pred(), nullptr});
+            break;
+        }
+        default:
+        {
+            auto &binary = static_cast<const BinaryOperator &>(ast);
+            bool subscript = ast.type() == AstType::Subscript;
+            out += "(";
+            stack.push_back({nullptr, subscript ? "])" : ")"});
+            stack.push_back({&binary.get_right(), nullptr});
+            stack.push_back({nullptr, binary.operand()});
+            stack.push_back({&binary.get_left(), nullptr});
+            break;
+        }
+        }
+    }
+    return out;
+}
+
+bool has_operands(const Ast &ast)
+{
+    AstType type = ast.type();
+    return type != AstType::Undefined && type != AstType::Identifier &&
+           type != AstType::Integer && type != AstType::String;
+}
+
+} // namespace bb
@@ -0,0 +1,495 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <map>
+
+namespace bb
+{
+
+/** Shapes with fewer expressions than this are evaluated one at a time */
+const size_t kMinBatchLanes = 4;
+
+/** A stack slot of a group, with one lane per expression */
+struct BatchLanes
+{
+    int v[kBlockSize];
+
+    /** One bit per lane, set when the lane is Undefined */
+    uint64_t undef;
+};
+
+void add_expression(BatchGroup &group, const Program &program,
+                    int expression);
+const BatchLanes &run_group(const BatchGroup &group, int t,
+                            BatchLanes *stack);
+void divide_lanes(BatchLanes &a, const BatchLanes &b, bool modulo);
+void subscript_lanes(BatchLanes &a, const BatchLanes &b,
+                     const vector<string> &strings, bool guarded);
+void select_lanes(BatchLanes &pred, const BatchLanes &pass,
+                  const BatchLanes &fail);
+
+BatchProgram::BatchProgram(const vector<AstPtr> &asts) : count(asts.size())
+{
+    vector<Program> compiled;
+    map<vector<OpCode>, vector<int>> shapes;
+    for (size_t i = 0; i < asts.size(); ++i)
+    {
+        compiled.push_back(compile(*asts[i]));
+        vector<OpCode> shape;
+        for (const Instruction &ins : compiled.back().get_block_code())
+        {
+            shape.push_back(ins.op);
+        }
+        shapes[shape].push_back(i);
+    }
+
+    for (auto &shape : shapes)
+    {
+        const vector<int> &expressions = shape.second;
+        if (expressions.size() < kMinBatchLanes)
+        {
+            for (int expression : expressions)
+            {
+                programs.push_back(move(compiled[expression]));
+                ungrouped.push_back(expression);
+            }
+            continue;
+        }
+
+        for (size_t first = 0; first < expressions.size();
+             first += kBlockSize)
+        {
+            BatchGroup group{shape.first, {}, {}, {}, 0};
+            group.args.resize(group.code.size() * kBlockSize);
+            size_t last = min(expressions.size(), first + kBlockSize);
+            for (size_t i = first; i < last; ++i)
+            {
+                add_expression(group, compiled[expressions[i]],
+                               expressions[i]);
+            }
+
+            // Unused lanes repeat the first expression, so that they are
+            // as safe to evaluate as it is
+            for (size_t pc = 0; pc < group.code.size(); ++pc)
+            {
+                int *args = group.args.data() + pc * kBlockSize;
+                fill(args + group.expressions.size(), args + kBlockSize,
+                     args[0]);
+            }
+            groups.push_back(move(group));
+        }
+    }
+}
+
+int BatchProgram::get_grouped_count() const
+{
+    int grouped = 0;
+    for (const BatchGroup &group : groups)
+    {
+        grouped += group.expressions.size();
+    }
+    return grouped;
+}
+
+/** Add an expression to the next lane of a group with the same shape */
+void add_expression(BatchGroup &group, const Program &program, int expression)
+{
+    int lane = group.expressions.size();
+    const vector<Instruction> &code = program.get_block_code();
+    for (size_t pc = 0; pc < code.size(); ++pc)
+    {
+        int arg = code[pc].arg;
+        if (code[pc].op == OpCode::String)
+        {
+            arg += group.strings.size();
+        }
+        group.args[pc * kBlockSize + lane] = arg;
+    }
+
+    const vector<string> &strings = program.get_strings();
+    group.strings.insert(group.strings.end(), strings.begin(), strings.end());
+    group.expressions.push_back(expression);
+    group.max_depth = max(group.max_depth, program.get_block_max_depth());
+}
+
+void BatchProgram::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    for (size_t i = 0; i < programs.size(); ++i)
+    {
+        size_t first = ungrouped[i] * static_cast<size_t>(n);
+        programs[i].eval_block(t0, n, out + first,
+                               defined ? defined + first : nullptr);
+    }
+
+    int depth = 0;
+    for (const BatchGroup &group : groups)
+    {
+        depth = max(depth, group.max_depth);
+    }
+    vector<BatchLanes> stack(depth + 1);
+
+    // Each block of results is gathered before it is written, so that the
+    // results of every expression are written in order
+    vector<int> values(kBlockSize * kBlockSize);
+    uint64_t undef[kBlockSize];
+    for (const BatchGroup &group : groups)
+    {
+        for (int offset = 0; offset < n; offset += kBlockSize)
+        {
+            int count = min(kBlockSize, n - offset);
+            int block_t0 = static_cast<int>(static_cast<unsigned>(t0) + offset);
+            for (int i = 0; i < count; ++i)
+            {
+                int t = static_cast<int>(static_cast<unsigned>(block_t0) + i);
+                const BatchLanes &result = run_group(group, t, stack.data());
+                copy(result.v, result.v + kBlockSize,
+                     values.begin() + i * kBlockSize);
+                undef[i] = result.undef;
+            }
+
+            for (size_t lane = 0; lane < group.expressions.size(); ++lane)
+            {
+                size_t first =
+                    group.expressions[lane] * static_cast<size_t>(n) + offset;
+                for (int i = 0; i < count; ++i)
+                {
+                    bool lane_defined = !((undef[i] >> lane) & 1);
+                    out[first + i] =
+                        lane_defined ? values[i * kBlockSize + lane] : 0;
+                    if (defined)
+                    {
+                        defined[first + i] = lane_defined;
+                    }
+                }
+            }
+        }
+    }
+}
+
+int lane_add(int a, int b)
+{
+    return static_cast<unsigned>(a) + static_cast<unsigned>(b);
+}
+int lane_subtract(int a, int b)
+{
+    return static_cast<unsigned>(a) - static_cast<unsigned>(b);
+}
+int lane_multiply(int a, int b)
+{
+    return static_cast<unsigned>(a) * static_cast<unsigned>(b);
+}
+int lane_divide(int a, int b) { return a / b; }
+int lane_modulo(int a, int b) { return a % b; }
+int lane_bitwise_and(int a, int b) { return a & b; }
+int lane_bitwise_or(int a, int b) { return a | b; }
+int lane_bitwise_xor(int a, int b) { return a ^ b; }
+int lane_shift_left(int a, int b)
+{
+    return static_cast<unsigned>(a) << (b & 31);
+}
+int lane_shift_right(int a, int b) { return a >> (b & 31); }
+int lane_less_than(int a, int b) { return a < b; }
+int lane_less_than_equal(int a, int b) { return a <= b; }
+int lane_greater_than(int a, int b) { return a > b; }
+int lane_greater_than_equal(int a, int b) { return a >= b; }
+int lane_equal(int a, int b) { return a == b; }
+int lane_not_equal(int a, int b) { return a != b; }
+int lane_negate(int a) { return lane_subtract(0, a); }
+int lane_complement(int a) { return ~a; }
+int lane_not(int a) { return !a; }
+
+template <int (*F)(int)> void apply(BatchLanes &a)
+{
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        a.v[i] = F(a.v[i]);
+    }
+}
+
+template <int (*F)(int, int)> void apply(BatchLanes &a, const BatchLanes &b)
+{
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        a.v[i] = F(a.v[i], b.v[i]);
+    }
+    a.undef |= b.undef;
+}
+
+/** Apply an operator whose right operand is a different constant per lane */
+template <int (*F)(int, int)>
+void apply_constant(BatchLanes &a, const int *args)
+{
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        a.v[i] = F(a.v[i], args[i]);
+    }
+}
+
+/**
+ * Run the block instructions of a group for a single value of t. As in the
+ * block interpreter, the first stack slot is never written.
+ */
+const BatchLanes &run_group(const BatchGroup &group, int t, BatchLanes *stack)
+{
+    int sp = 1;
+    for (size_t pc = 0; pc < group.code.size(); ++pc)
+    {
+        const int *args = group.args.data() + pc * kBlockSize;
+        BatchLanes &a = stack[sp - 1];
+        const BatchLanes &b = stack[sp - 1];
+
+        switch (group.code[pc])
+        {
+        case OpCode::Identifier:
+        {
+            BatchLanes &top = stack[sp++];
+            fill(top.v, top.v + kBlockSize, t);
+            top.undef = 0;
+            break;
+        }
+        case OpCode::Integer:
+        case OpCode::String:
+        {
+            BatchLanes &top = stack[sp++];
+            copy(args, args + kBlockSize, top.v);
+            top.undef = 0;
+            break;
+        }
+        case OpCode::Undefined:
+        {
+            BatchLanes &top = stack[sp++];
+            fill(top.v, top.v + kBlockSize, 0);
+            top.undef = ~uint64_t(0);
+            break;
+        }
+        case OpCode::Negate:
+            apply<lane_negate>(a);
+            break;
+        case OpCode::BitwiseComplement:
+            apply<lane_complement>(a);
+            break;
+        case OpCode::Not:
+            apply<lane_not>(a);
+            break;
+        case OpCode::Subscript:
+            subscript_lanes(stack[sp - 2], b, group.strings, true);
+            --sp;
+            break;
+        case OpCode::Add:
+            apply<lane_add>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::Subtract:
+            apply<lane_subtract>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::Multiply:
+            apply<lane_multiply>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::Divide:
+            divide_lanes(stack[sp - 2], b, false);
+            --sp;
+            break;
+        case OpCode::Modulo:
+            divide_lanes(stack[sp - 2], b, true);
+            --sp;
+            break;
+        case OpCode::BitwiseAnd:
+            apply<lane_bitwise_and>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::BitwiseOr:
+            apply<lane_bitwise_or>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::BitwiseXor:
+            apply<lane_bitwise_xor>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::BitwiseShiftLeft:
+            apply<lane_shift_left>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::BitwiseShiftRight:
+            apply<lane_shift_right>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::LessThan:
+            apply<lane_less_than>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::LessThanEqual:
+            apply<lane_less_than_equal>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::GreaterThan:
+            apply<lane_greater_than>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::GreaterThanEqual:
+            apply<lane_greater_than_equal>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::Equal:
+            apply<lane_equal>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::NotEqual:
+            apply<lane_not_equal>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::AddConstant:
+            apply_constant<lane_add>(a, args);
+            break;
+        case OpCode::SubtractConstant:
+            apply_constant<lane_subtract>(a, args);
+            break;
+        case OpCode::MultiplyConstant:
+            apply_constant<lane_multiply>(a, args);
+            break;
+        // Constant divisors are never 0 or -1, which compile replaces
+        case OpCode::DivideConstant:
+            apply_constant<lane_divide>(a, args);
+            break;
+        case OpCode::ModuloConstant:
+            apply_constant<lane_modulo>(a, args);
+            break;
+        case OpCode::BitwiseAndConstant:
+            apply_constant<lane_bitwise_and>(a, args);
+            break;
+        case OpCode::BitwiseOrConstant:
+            apply_constant<lane_bitwise_or>(a, args);
+            break;
+        case OpCode::BitwiseXorConstant:
+            apply_constant<lane_bitwise_xor>(a, args);
+            break;
+        case OpCode::BitwiseShiftLeftConstant:
+            apply_constant<lane_shift_left>(a, args);
+            break;
+        case OpCode::BitwiseShiftRightConstant:
+            apply_constant<lane_shift_right>(a, args);
+            break;
+        case OpCode::LessThanConstant:
+            apply_constant<lane_less_than>(a, args);
+            break;
+        case OpCode::LessThanEqualConstant:
+            apply_constant<lane_less_than_equal>(a, args);
+            break;
+        case OpCode::GreaterThanConstant:
+            apply_constant<lane_greater_than>(a, args);
+            break;
+        case OpCode::GreaterThanEqualConstant:
+            apply_constant<lane_greater_than_equal>(a, args);
+            break;
+        case OpCode::EqualConstant:
+            apply_constant<lane_equal>(a, args);
+            break;
+        case OpCode::NotEqualConstant:
+            apply_constant<lane_not_equal>(a, args);
+            break;
+        case OpCode::SubscriptUnchecked:
+            subscript_lanes(stack[sp - 2], b, group.strings, false);
+            --sp;
+            break;
+        case OpCode::DivideUnchecked:
+            apply<lane_divide>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::ModuloUnchecked:
+            apply<lane_modulo>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::Select:
+            select_lanes(stack[sp - 3], stack[sp - 2], b);
+            sp -= 2;
+            break;
+        case OpCode::JumpIfZero:
+        case OpCode::Jump:
+        case OpCode::Return:
+            break;
+        }
+    }
+
+    return stack[1];
+}
+
+/**
+ * Divide lane by lane, marking lanes that divide by zero as Undefined. As in
+ * the other backends, x / -1 is computed as a negation because INT_MIN / -1
+ * traps.
+ */
+void divide_lanes(BatchLanes &a, const BatchLanes &b, bool modulo)
+{
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        int d = b.v[i];
+        if (d == 0)
+        {
+            a.undef |= uint64_t(1) << i;
+            a.v[i] = 0;
+        }
+        else if (d == -1)
+        {
+            a.v[i] = modulo ? 0 : lane_subtract(0, a.v[i]);
+        }
+        else
+        {
+            a.v[i] = modulo ? a.v[i] % d : a.v[i] / d;
+        }
+    }
+    a.undef |= b.undef;
+}
+
+void subscript_lanes(BatchLanes &a, const BatchLanes &b,
+                     const vector<string> &strings, bool guarded)
+{
+    if (!guarded)
+    {
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            a.v[i] = strings[a.v[i]][b.v[i]];
+        }
+        a.undef |= b.undef;
+        return;
+    }
+
+    uint64_t undef = a.undef | b.undef;
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        uint64_t bit = uint64_t(1) << i;
+        if (undef & bit)
+        {
+            a.v[i] = 0;
+            continue;
+        }
+
+        const string &s = strings[a.v[i]];
+        int index = b.v[i];
+        if (index < 0 || index >= static_cast<int>(s.length()))
+        {
+            undef |= bit;
+            a.v[i] = 0;
+        }
+        else
+        {
+            a.v[i] = s[index];
+        }
+    }
+    a.undef = undef;
+}
+
+/** Select pass where pred is non-zero, otherwise fail */
+void select_lanes(BatchLanes &pred, const BatchLanes &pass,
+                  const BatchLanes &fail)
+{
+    uint64_t taken = 0;
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        taken |= static_cast<uint64_t>(pred.v[i] != 0) << i;
+        pred.v[i] = pred.v[i] ? pass.v[i] : fail.v[i];
+    }
+    pred.undef |= (taken & pass.undef) | (~taken & fail.undef);
+}
+
+} // namespace bb
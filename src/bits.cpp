@@ -0,0 +1,318 @@
+#include "bits.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace bb
+{
+
+const Ast *get_operand(const Ast &ast, int operand);
+const Ast *get_constant_operand(const Ast &ast);
+TBitFloors get_subtree_t_bit_floors(const Ast &ast);
+
+uint32_t fill_low_bits(uint32_t bits)
+{
+    bits |= bits >> 1;
+    bits |= bits >> 2;
+    bits |= bits >> 4;
+    bits |= bits >> 8;
+    bits |= bits >> 16;
+    return bits;
+}
+
+int get_lane_bits(uint32_t bits)
+{
+    return bits <= 0xFF ? 8 : bits <= 0xFFFF ? 16 : 32;
+}
+
+uint32_t get_operand_bits(const Ast &ast, int operand, uint32_t demanded)
+{
+    const Ast *constant = get_constant_operand(ast);
+    uint32_t c = constant ? static_cast<const Integer &>(*constant).get_value()
+                          : 0;
+
+    switch (ast.type())
+    {
+    case AstType::Negate:
+    case AstType::Add:
+    case AstType::Subtract:
+    case AstType::Multiply:
+        return fill_low_bits(demanded);
+    case AstType::BitwiseComplement:
+    case AstType::BitwiseXor:
+        return demanded;
+    case AstType::BitwiseAnd:
+        return constant ? demanded & c : demanded;
+    case AstType::BitwiseOr:
+        return constant ? demanded & ~c : demanded;
+    case AstType::BitwiseShiftLeft:
+        if (operand == 1)
+        {
+            return 31;
+        }
+        return constant ? demanded >> (c & 31) : fill_low_bits(demanded);
+    case AstType::BitwiseShiftRight:
+    {
+        if (operand == 1)
+        {
+            return 31;
+        }
+        if (!constant)
+        {
+            return kAllBits;
+        }
+        // Bits shifted in from above are copies of the sign bit
+        c &= 31;
+        uint32_t bits = demanded << c;
+        if (c && demanded >> (32 - c))
+        {
+            bits |= uint32_t(1) << 31;
+        }
+        return bits;
+    }
+    case AstType::TernaryIf:
+        return operand == 0 ? kAllBits : demanded;
+    default:
+        // Comparisons, division and subscripts depend on every bit, and so
+        // does whether a divisor or an index makes the result undefined
+        return kAllBits;
+    }
+}
+
+bool is_narrow_op(const Ast &ast)
+{
+    switch (ast.type())
+    {
+    case AstType::Identifier:
+    case AstType::Integer:
+    case AstType::Negate:
+    case AstType::BitwiseComplement:
+    case AstType::Add:
+    case AstType::Subtract:
+    case AstType::Multiply:
+    case AstType::BitwiseAnd:
+    case AstType::BitwiseOr:
+    case AstType::BitwiseXor:
+    case AstType::BitwiseShiftLeft:
+    case AstType::TernaryIf:
+        return true;
+    case AstType::BitwiseShiftRight:
+        return get_constant_operand(ast) != nullptr;
+    default:
+        return false;
+    }
+}
+
+int get_expression_lane_bits(const Ast &ast, uint32_t demanded)
+{
+    int bits = is_narrow_op(ast) ? get_lane_bits(demanded) : 32;
+    for (int i = 0; i < 3; ++i)
+    {
+        const Ast *operand = get_operand(ast, i);
+        if (operand && bits < 32)
+        {
+            bits = max(bits, get_expression_lane_bits(
+                                 *operand, get_operand_bits(ast, i, demanded)));
+        }
+    }
+    return bits;
+}
+
+uint32_t get_t_bits(const Ast &ast, uint32_t demanded)
+{
+    if (ast.type() == AstType::Identifier)
+    {
+        return demanded;
+    }
+
+    // Operands with no demanded bits are still visited, because whether they
+    // are defined carries to the result
+    uint32_t bits = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        const Ast *operand = get_operand(ast, i);
+        if (operand)
+        {
+            bits |= get_t_bits(*operand, get_operand_bits(ast, i, demanded));
+        }
+    }
+    return bits;
+}
+
+TBitFloors get_t_bit_floors(const Ast &ast, const TBitFloors *operands)
+{
+    TBitFloors floors;
+    fill(floors.value, floors.value + 32, kNoTBits);
+    floors.defined = kNoTBits;
+    if (ast.type() == AstType::Identifier)
+    {
+        for (int i = 0; i < 32; ++i)
+        {
+            floors.value[i] = i;
+        }
+        return floors;
+    }
+
+    // Whether an operand is defined always carries to the node, and `all`
+    // is the floor of a node that depends on every bit of its operands
+    int all = kNoTBits;
+    for (int i = 0; i < 3 && get_operand(ast, i); ++i)
+    {
+        floors.defined = min(floors.defined, operands[i].defined);
+        all = min(all, get_lowest_t_bit(operands[i]));
+    }
+
+    const Ast *constant = get_constant_operand(ast);
+    uint32_t c = constant ? static_cast<const Integer &>(*constant).get_value()
+                          : 0;
+    int *v = floors.value;
+    switch (ast.type())
+    {
+    case AstType::Undefined:
+    case AstType::Integer:
+    case AstType::String:
+        break;
+    case AstType::BitwiseComplement:
+        copy(operands[0].value, operands[0].value + 32, v);
+        break;
+    case AstType::Negate:
+    case AstType::Add:
+    case AstType::Subtract:
+    case AstType::Multiply:
+    {
+        // Carries only move towards higher bits
+        bool binary = ast.type() != AstType::Negate;
+        int low = kNoTBits;
+        for (int i = 0; i < 32; ++i)
+        {
+            low = min(low, operands[0].value[i]);
+            if (binary)
+            {
+                low = min(low, operands[1].value[i]);
+            }
+            v[i] = low;
+        }
+        break;
+    }
+    case AstType::BitwiseAnd:
+    case AstType::BitwiseOr:
+    case AstType::BitwiseXor:
+    {
+        // Bits that a constant operand fixes cannot change
+        uint32_t fixed = 0;
+        if (constant && ast.type() != AstType::BitwiseXor)
+        {
+            fixed = ast.type() == AstType::BitwiseAnd ? ~c : c;
+        }
+        for (int i = 0; i < 32; ++i)
+        {
+            v[i] = fixed >> i & 1
+                       ? kNoTBits
+                       : min(operands[0].value[i], operands[1].value[i]);
+        }
+        break;
+    }
+    case AstType::BitwiseShiftLeft:
+    case AstType::BitwiseShiftRight:
+    {
+        if (!constant)
+        {
+            fill(v, v + 32, all);
+            break;
+        }
+        int shift = c & 31;
+        bool left = ast.type() == AstType::BitwiseShiftLeft;
+        for (int i = 0; i < 32; ++i)
+        {
+            // Bits shifted in from above are copies of the sign bit
+            v[i] = left ? (i >= shift ? operands[0].value[i - shift] : kNoTBits)
+                        : operands[0].value[min(i + shift, 31)];
+        }
+        break;
+    }
+    case AstType::Divide:
+    case AstType::Modulo:
+    case AstType::Subscript:
+    case AstType::TernaryIf:
+        // A divisor, an index or a predicate also decides whether the node
+        // is defined
+        fill(v, v + 32, all);
+        floors.defined = min(floors.defined, all);
+        break;
+    default:
+        fill(v, v + 32, all);
+        break;
+    }
+    return floors;
+}
+
+int get_lowest_t_bit(const TBitFloors &floors)
+{
+    return min(*min_element(floors.value, floors.value + 32), floors.defined);
+}
+
+int get_lowest_t_bit(const Ast &ast)
+{
+    return get_lowest_t_bit(get_subtree_t_bit_floors(ast));
+}
+
+TBitFloors get_subtree_t_bit_floors(const Ast &ast)
+{
+    TBitFloors operands[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        const Ast *operand = get_operand(ast, i);
+        if (operand)
+        {
+            operands[i] = get_subtree_t_bit_floors(*operand);
+        }
+    }
+    return get_t_bit_floors(ast, operands);
+}
+
+/** The operand with the given index, or null if the node has no such operand */
+const Ast *get_operand(const Ast &ast, int operand)
+{
+    switch (ast.type())
+    {
+    case AstType::Undefined:
+    case AstType::Identifier:
+    case AstType::Integer:
+    case AstType::String:
+        return nullptr;
+    case AstType::Negate:
+    case AstType::BitwiseComplement:
+    case AstType::Not:
+        return operand == 0
+                   ? &static_cast<const UnaryOperator &>(ast).get_inner()
+                   : nullptr;
+    case AstType::TernaryIf:
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        return operand == 0   ? &ternary.get_pred()
+               : operand == 1 ? &ternary.get_pass()
+                              : &ternary.get_fail();
+    }
+    default:
+    {
+        auto &binary = static_cast<const BinaryOperator &>(ast);
+        return operand == 0   ? &binary.get_left()
+               : operand == 1 ? &binary.get_right()
+                              : nullptr;
+    }
+    }
+}
+
+/**
+ * The integer right operand of a binary node. The optimizer moves constants
+ * to the right of commutative operators, so this is the only side checked.
+ */
+const Ast *get_constant_operand(const Ast &ast)
+{
+    const Ast *right = ast.type() == AstType::TernaryIf ? nullptr
+                                                        : get_operand(ast, 1);
+    return right && right->type() == AstType::Integer ? right : nullptr;
+}
+
+} // namespace bb
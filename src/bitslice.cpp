@@ -0,0 +1,592 @@
+#include "bitslice.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+namespace bb
+{
+
+/** Bits of a sample that can be sliced */
+const int kSliceBits = 32;
+
+/**
+ * Operators at which a bit-sliced block overtakes the vm. A shift by a
+ * variable count is slower than in the vm, so it counts against the rest.
+ */
+const int kMinBitSliceOperators = 12;
+const int kVariableShiftWeight = 5;
+
+/** Programs with more nodes than this allocate their slices */
+const size_t kInlineSliceNodes = 64;
+
+/** Bit i of the offsets 0 to 63 of the samples within a block */
+const uint64_t kOffsetSlices[] = {
+    0xAAAAAAAAAAAAAAAAull, 0xCCCCCCCCCCCCCCCCull, 0xF0F0F0F0F0F0F0F0ull,
+    0xFF00FF00FF00FF00ull, 0xFFFF0000FFFF0000ull, 0xFFFFFFFF00000000ull,
+};
+
+/**
+ * The words of one node for a block, one per bit. A node whose words are
+ * those of another node shifted right by a constant points into them instead.
+ */
+struct SliceWords
+{
+    uint64_t w[kSliceBits];
+    const uint64_t *slices;
+};
+
+struct BitSliceBuilder
+{
+    vector<BitSliceNode> nodes;
+    int identifier = -1;
+};
+
+int flatten(const Ast &ast, uint32_t demanded, BitSliceBuilder &builder);
+int push_node(BitSliceBuilder &builder, BitSliceNode node);
+int get_slice_width(uint32_t bits);
+int get_operand_slices(const BitSliceNode &node, int operand);
+bool is_slice_view(const BitSliceNode &node);
+uint64_t broadcast_bit(int value, int bit);
+uint64_t transpose_bits(uint64_t x);
+void transpose_bytes(uint64_t *m);
+void slice_consecutive(int t0, int slices, uint64_t *v);
+void slice_samples(const int *t, int slices, uint64_t *v);
+void unslice(const uint64_t *v, int slices, int count, int *out);
+void run_node(const BitSliceNode &node, const SliceWords *words,
+              const int *t, int t0, uint64_t *v);
+
+bool is_bit_sliceable(const Ast &ast)
+{
+    switch (ast.type())
+    {
+    case AstType::Identifier:
+    case AstType::Integer:
+        return true;
+    case AstType::BitwiseComplement:
+        return is_bit_sliceable(
+            static_cast<const UnaryOperator &>(ast).get_inner());
+    case AstType::BitwiseAnd:
+    case AstType::BitwiseOr:
+    case AstType::BitwiseXor:
+    case AstType::BitwiseShiftLeft:
+    case AstType::BitwiseShiftRight:
+    {
+        auto &binary = static_cast<const BinaryOperator &>(ast);
+        return is_bit_sliceable(binary.get_left()) &&
+               is_bit_sliceable(binary.get_right());
+    }
+    default:
+        return false;
+    }
+}
+
+BitSliceProgram::BitSliceProgram(const Ast &ast, uint32_t demanded)
+{
+    BitSliceBuilder builder;
+    flatten(ast, demanded, builder);
+    nodes = move(builder.nodes);
+
+    // An operator may read slices of an operand that cannot change its
+    // result, such as those cleared by a constant mask. Operands come before
+    // the nodes that read them, so one pass from the root computes them.
+    for (size_t id = nodes.size(); id-- > 0;)
+    {
+        for (int operand = 0; operand < 2; ++operand)
+        {
+            int index = nodes[id].operands[operand];
+            if (index >= 0)
+            {
+                int &slices = nodes[index].slices;
+                slices = max(slices, get_operand_slices(nodes[id], operand));
+            }
+        }
+    }
+}
+
+int BitSliceProgram::get_slice_count() const
+{
+    int count = 0;
+    for (const BitSliceNode &node : nodes)
+    {
+        if (!is_slice_view(node))
+        {
+            count += node.slices;
+        }
+    }
+    return count;
+}
+
+bool BitSliceProgram::is_faster_than_vm() const
+{
+    int operators = 0;
+    for (const BitSliceNode &node : nodes)
+    {
+        bool shift = node.type == AstType::BitwiseShiftLeft ||
+                     node.type == AstType::BitwiseShiftRight;
+        if (shift && node.operands[1] >= 0)
+        {
+            operators -= kVariableShiftWeight;
+        }
+        else if (node.type != AstType::Identifier &&
+                 node.type != AstType::Integer && !is_slice_view(node))
+        {
+            ++operators;
+        }
+    }
+    return operators >= kMinBitSliceOperators;
+}
+
+/**
+ * Append the nodes of a tree in evaluation order, each computing the slices
+ * that its parent demands. A constant right operand is kept in the node.
+ */
+int flatten(const Ast &ast, uint32_t demanded, BitSliceBuilder &builder)
+{
+    AstType type = ast.type();
+    BitSliceNode node{type, 0, {-1, -1}, get_slice_width(demanded)};
+
+    switch (type)
+    {
+    case AstType::Identifier:
+        // Every use of t shares one node, sliced as widely as any use needs
+        if (builder.identifier < 0)
+        {
+            builder.identifier = push_node(builder, node);
+        }
+        else
+        {
+            int &slices = builder.nodes[builder.identifier].slices;
+            slices = max(slices, node.slices);
+        }
+        return builder.identifier;
+    case AstType::Integer:
+        node.value = static_cast<const Integer &>(ast).get_value();
+        break;
+    case AstType::BitwiseComplement:
+        node.operands[0] =
+            flatten(static_cast<const UnaryOperator &>(ast).get_inner(),
+                    get_operand_bits(ast, 0, demanded), builder);
+        break;
+    case AstType::BitwiseAnd:
+    case AstType::BitwiseOr:
+    case AstType::BitwiseXor:
+    case AstType::BitwiseShiftLeft:
+    case AstType::BitwiseShiftRight:
+    {
+        auto &binary = static_cast<const BinaryOperator &>(ast);
+        const Ast &right = binary.get_right();
+        node.operands[0] = flatten(binary.get_left(),
+                                   get_operand_bits(ast, 0, demanded), builder);
+        if (right.type() == AstType::Integer)
+        {
+            node.value = static_cast<const Integer &>(right).get_value();
+        }
+        else
+        {
+            node.operands[1] =
+                flatten(right, get_operand_bits(ast, 1, demanded), builder);
+        }
+        break;
+    }
+    default:
+        throw invalid_argument("Expression cannot be bit-sliced");
+    }
+
+    return push_node(builder, node);
+}
+
+int push_node(BitSliceBuilder &builder, BitSliceNode node)
+{
+    builder.nodes.push_back(node);
+    return builder.nodes.size() - 1;
+}
+
+/** Number of low bits up to and including the highest set bit */
+int get_slice_width(uint32_t bits)
+{
+    int width = 0;
+    while (width < kSliceBits && bits >> width)
+    {
+        ++width;
+    }
+    return width;
+}
+
+/** Number of slices of an operand that run_node reads */
+int get_operand_slices(const BitSliceNode &node, int operand)
+{
+    int n = node.slices;
+    if (n == 0)
+    {
+        return 0;
+    }
+    bool shift = node.type == AstType::BitwiseShiftLeft ||
+                 node.type == AstType::BitwiseShiftRight;
+    if (shift && operand == 1)
+    {
+        // Only the low five bits of a count are used
+        return 5;
+    }
+    if (node.type == AstType::BitwiseShiftLeft && node.operands[1] < 0)
+    {
+        return max(n - (node.value & 31), 0);
+    }
+    if (node.type == AstType::BitwiseShiftRight)
+    {
+        // Shifting right reads the sign bit for any bits shifted in
+        int shift_count = node.operands[1] < 0 ? node.value & 31 : kSliceBits;
+        return min(n + shift_count, kSliceBits);
+    }
+    return n;
+}
+
+/**
+ * True if a node shifts right by a constant without reading the sign bit, so
+ * that its slices are a suffix of those of its operand
+ */
+bool is_slice_view(const BitSliceNode &node)
+{
+    return node.type == AstType::BitwiseShiftRight && node.operands[1] < 0 &&
+           (node.value & 31) + node.slices <= kSliceBits;
+}
+
+/** A word with every bit set if the given bit of value is set */
+uint64_t broadcast_bit(int value, int bit)
+{
+    return 0 - static_cast<uint64_t>(static_cast<uint32_t>(value) >> bit & 1);
+}
+
+void BitSliceProgram::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    eval(nullptr, t0, n, out, defined);
+}
+
+void BitSliceProgram::eval_block(const int *t, int n, int *out,
+                                 bool *defined) const
+{
+    eval(t, 0, n, out, defined);
+}
+
+void BitSliceProgram::eval(const int *t, int t0, int n, int *out,
+                           bool *defined) const
+{
+    if (n <= 0)
+    {
+        return;
+    }
+
+    SliceWords inline_words[kInlineSliceNodes];
+    vector<SliceWords> heap_words;
+    SliceWords *words = inline_words;
+    if (nodes.size() > kInlineSliceNodes)
+    {
+        heap_words.resize(nodes.size());
+        words = heap_words.data();
+    }
+
+    const BitSliceNode &root = nodes.back();
+    int block_t[kBlockSize];
+    for (int offset = 0; offset < n; offset += kBlockSize)
+    {
+        // Pad the final partial block so that every lane is valid
+        int count = min(kBlockSize, n - offset);
+        if (t)
+        {
+            copy(t + offset, t + offset + count, block_t);
+            fill(block_t + count, block_t + kBlockSize, 0);
+        }
+
+        int block_t0 = static_cast<int>(static_cast<unsigned>(t0) + offset);
+        for (size_t id = 0; id < nodes.size(); ++id)
+        {
+            const BitSliceNode &node = nodes[id];
+            if (is_slice_view(node))
+            {
+                words[id].slices =
+                    words[node.operands[0]].slices + (node.value & 31);
+                continue;
+            }
+            run_node(node, words, t ? block_t : nullptr, block_t0,
+                     words[id].w);
+            words[id].slices = words[id].w;
+        }
+        unslice(words[nodes.size() - 1].slices, root.slices, count,
+                out + offset);
+    }
+
+    if (defined)
+    {
+        fill(defined, defined + n, true);
+    }
+}
+
+/**
+ * Apply a bitwise operator to the first n slices. A constant right operand
+ * is broadcast one bit per slice.
+ */
+template <typename F>
+void apply_slices(int n, const uint64_t *a, const uint64_t *b, int value,
+                  uint64_t *v, F f)
+{
+    if (b)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            v[i] = f(a[i], b[i]);
+        }
+        return;
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        v[i] = f(a[i], broadcast_bit(value, i));
+    }
+}
+
+/**
+ * Evaluate the demanded slices of a node for a block. Shifting by a constant
+ * moves whole words, and shifting by a variable count selects between the
+ * shifted and unshifted words for each bit of the count.
+ */
+void run_node(const BitSliceNode &node, const SliceWords *words,
+              const int *t, int t0, uint64_t *v)
+{
+    int n = node.slices;
+    const uint64_t *a = node.operands[0] >= 0 ? words[node.operands[0]].slices
+                                              : nullptr;
+    const uint64_t *b = node.operands[1] >= 0 ? words[node.operands[1]].slices
+                                              : nullptr;
+
+    switch (node.type)
+    {
+    case AstType::Identifier:
+        if (t)
+        {
+            slice_samples(t, n, v);
+        }
+        else
+        {
+            slice_consecutive(t0, n, v);
+        }
+        break;
+    case AstType::Integer:
+        for (int i = 0; i < n; ++i)
+        {
+            v[i] = broadcast_bit(node.value, i);
+        }
+        break;
+    case AstType::BitwiseComplement:
+        for (int i = 0; i < n; ++i)
+        {
+            v[i] = ~a[i];
+        }
+        break;
+    case AstType::BitwiseAnd:
+        apply_slices(n, a, b, node.value, v,
+                     [](uint64_t x, uint64_t y) { return x & y; });
+        break;
+    case AstType::BitwiseOr:
+        apply_slices(n, a, b, node.value, v,
+                     [](uint64_t x, uint64_t y) { return x | y; });
+        break;
+    case AstType::BitwiseXor:
+        apply_slices(n, a, b, node.value, v,
+                     [](uint64_t x, uint64_t y) { return x ^ y; });
+        break;
+    case AstType::BitwiseShiftLeft:
+    {
+        if (!b)
+        {
+            int shift = min(node.value & 31, n);
+            fill(v, v + shift, 0);
+            copy(a, a + n - shift, v + shift);
+            break;
+        }
+        // Each row reads the row below it, with zeros shifted in past the
+        // lowest row
+        uint64_t x[2][16 + kSliceBits] = {};
+        copy(a, a + n, x[0] + 16);
+        for (int bit = 0; bit < 5; ++bit)
+        {
+            int shift = 1 << bit;
+            uint64_t select = b[bit];
+            const uint64_t *from = x[bit & 1] + 16;
+            uint64_t *to = x[~bit & 1] + 16;
+            for (int i = 0; i < n; ++i)
+            {
+                to[i] = (select & from[i - shift]) | (~select & from[i]);
+            }
+        }
+        copy(x[1] + 16, x[1] + 16 + n, v);
+        break;
+    }
+    case AstType::BitwiseShiftRight:
+    {
+        // Bits shifted in from above are copies of the sign bit
+        if (!b)
+        {
+            int shift = node.value & 31;
+            int moved = min(n, kSliceBits - shift);
+            copy(a + shift, a + shift + moved, v);
+            if (moved < n)
+            {
+                fill(v + moved, v + n, a[kSliceBits - 1]);
+            }
+            break;
+        }
+        // Each row reads the row above it, with the sign bit repeated past
+        // the highest row
+        uint64_t x[2][kSliceBits + 16];
+        for (int i = 0; i < 2; ++i)
+        {
+            copy(a, a + kSliceBits, x[i]);
+            fill(x[i] + kSliceBits, x[i] + kSliceBits + 16, a[kSliceBits - 1]);
+        }
+        for (int bit = 0; bit < 5; ++bit)
+        {
+            int shift = 1 << bit;
+            uint64_t select = b[bit];
+            const uint64_t *from = x[bit & 1];
+            uint64_t *to = x[~bit & 1];
+            for (int i = 0; i < kSliceBits; ++i)
+            {
+                to[i] = (select & from[i + shift]) | (~select & from[i]);
+            }
+        }
+        copy(x[1], x[1] + n, v);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * Transpose the 8x8 bit matrix whose row r is byte r, so that bit c of byte
+ * r moves to bit r of byte c
+ */
+uint64_t transpose_bits(uint64_t x)
+{
+    uint64_t swap = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+    x ^= swap ^ (swap << 7);
+    swap = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+    x ^= swap ^ (swap << 14);
+    swap = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+    x ^= swap ^ (swap << 28);
+    return x;
+}
+
+/**
+ * Transpose the 8x8 byte matrix whose row r is word r, so that byte c of
+ * word r moves to byte r of word c
+ */
+void transpose_bytes(uint64_t *m)
+{
+    // Swap 4, then 2, then 1 byte blocks between pairs of rows
+    const uint64_t kLow[] = {0x00000000FFFFFFFFull, 0x0000FFFF0000FFFFull,
+                             0x00FF00FF00FF00FFull};
+    for (int stage = 0; stage < 3; ++stage)
+    {
+        int stride = 4 >> stage;
+        int width = 8 * stride;
+        uint64_t low = kLow[stage];
+        for (int r = 0; r < 8; ++r)
+        {
+            if (r & stride)
+            {
+                continue;
+            }
+            uint64_t a = m[r];
+            uint64_t b = m[r + stride];
+            m[r] = (a & low) | (b << width & ~low);
+            m[r + stride] = (a >> width & low) | (b & ~low);
+        }
+    }
+}
+
+/**
+ * Slice t0 + i for the 64 samples of a block by adding t0 to the slices of
+ * the offsets with a ripple carry, one word per bit.
+ */
+void slice_consecutive(int t0, int slices, uint64_t *v)
+{
+    uint64_t carry = 0;
+    for (int i = 0; i < slices; ++i)
+    {
+        uint64_t offset = i < 6 ? kOffsetSlices[i] : 0;
+        uint64_t base = broadcast_bit(t0, i);
+        v[i] = offset ^ base ^ carry;
+        carry = (offset & base) | (carry & (offset ^ base));
+    }
+}
+
+/**
+ * Slice the 64 values of t in a block a byte at a time. Bit k of byte j of
+ * word g is bit k of the byte of sample 8g + j, which two transposes move to
+ * bit 8g + j of byte g of slice k.
+ */
+void slice_samples(const int *t, int slices, uint64_t *v)
+{
+    for (int byte = 0; byte * 8 < slices; ++byte)
+    {
+        uint64_t m[8] = {};
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            uint64_t sample = static_cast<uint32_t>(t[i]) >> (byte * 8) & 0xFF;
+            m[i / 8] |= sample << (i % 8 * 8);
+        }
+        for (int group = 0; group < 8; ++group)
+        {
+            m[group] = transpose_bits(m[group]);
+        }
+        transpose_bytes(m);
+        for (int k = 0; k < 8 && byte * 8 + k < slices; ++k)
+        {
+            v[byte * 8 + k] = m[k];
+        }
+    }
+}
+
+/**
+ * Gather the computed slices of a block back into samples, reversing the
+ * transposes of slice_samples a byte at a time
+ */
+void unslice(const uint64_t *v, int slices, int count, int *out)
+{
+    // Full blocks are written in place, and only partial ones are copied
+    uint32_t values[kBlockSize];
+    uint32_t *samples = values;
+    if (count == kBlockSize)
+    {
+        samples = reinterpret_cast<uint32_t *>(out);
+    }
+    fill(samples, samples + kBlockSize, 0);
+
+    for (int byte = 0; byte * 8 < slices; ++byte)
+    {
+        uint64_t m[8] = {};
+        for (int k = 0; k < 8 && byte * 8 + k < slices; ++k)
+        {
+            m[k] = v[byte * 8 + k];
+        }
+        transpose_bytes(m);
+        for (int group = 0; group < 8; ++group)
+        {
+            uint64_t x = transpose_bits(m[group]);
+            for (int j = 0; j < 8; ++j)
+            {
+                samples[group * 8 + j] |= static_cast<uint32_t>(x >> j * 8 &
+                                                                0xFF)
+                                          << byte * 8;
+            }
+        }
+    }
+    if (samples == values)
+    {
+        copy(values, values + count, out);
+    }
+}
+
+} // namespace bb
@@ -0,0 +1,614 @@
+#include "vm.hpp"
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#endif
+
+namespace bb
+{
+
+/**
+ * Vector primitives for the block interpreter. Each target provides a vec
+ * type holding kVecLanes 32-bit integers. Comparisons return all ones for
+ * true lanes and vmovemask packs one bit per lane. Without SIMD support a
+ * vec is a single integer, so the kernels below stay the same.
+ */
+#if defined(__AVX2__)
+
+typedef __m256i vec;
+const int kVecLanes = 8;
+
+inline vec vload(const int *p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const vec *>(p));
+}
+inline void vstore(int *p, vec a)
+{
+    _mm256_storeu_si256(reinterpret_cast<vec *>(p), a);
+}
+inline vec vset(int a) { return _mm256_set1_epi32(a); }
+inline vec viota() { return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); }
+inline vec vadd(vec a, vec b) { return _mm256_add_epi32(a, b); }
+inline vec vsub(vec a, vec b) { return _mm256_sub_epi32(a, b); }
+inline vec vmul(vec a, vec b) { return _mm256_mullo_epi32(a, b); }
+inline vec vand(vec a, vec b) { return _mm256_and_si256(a, b); }
+inline vec vandnot(vec a, vec b) { return _mm256_andnot_si256(a, b); }
+inline vec vor(vec a, vec b) { return _mm256_or_si256(a, b); }
+inline vec vxor(vec a, vec b) { return _mm256_xor_si256(a, b); }
+inline vec vshl(vec a, vec b)
+{
+    return _mm256_sllv_epi32(a, _mm256_and_si256(b, vset(31)));
+}
+inline vec vshr(vec a, vec b)
+{
+    return _mm256_srav_epi32(a, _mm256_and_si256(b, vset(31)));
+}
+inline vec vshl_n(vec a, int n)
+{
+    return _mm256_sll_epi32(a, _mm_cvtsi32_si128(n));
+}
+inline vec vshr_n(vec a, int n)
+{
+    return _mm256_sra_epi32(a, _mm_cvtsi32_si128(n));
+}
+inline vec veq(vec a, vec b) { return _mm256_cmpeq_epi32(a, b); }
+inline vec vgt(vec a, vec b) { return _mm256_cmpgt_epi32(a, b); }
+inline unsigned vmovemask(vec m)
+{
+    return _mm256_movemask_ps(_mm256_castsi256_ps(m));
+}
+
+#elif defined(__SSE2__)
+
+typedef __m128i vec;
+const int kVecLanes = 4;
+
+inline vec vload(const int *p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const vec *>(p));
+}
+inline void vstore(int *p, vec a)
+{
+    _mm_storeu_si128(reinterpret_cast<vec *>(p), a);
+}
+inline vec vset(int a) { return _mm_set1_epi32(a); }
+inline vec viota() { return _mm_setr_epi32(0, 1, 2, 3); }
+inline vec vadd(vec a, vec b) { return _mm_add_epi32(a, b); }
+inline vec vsub(vec a, vec b) { return _mm_sub_epi32(a, b); }
+inline vec vmul(vec a, vec b)
+{
+#if defined(__SSE4_1__)
+    return _mm_mullo_epi32(a, b);
+#else
+    // Multiply the even and odd lanes separately and interleave the low
+    // halves of the 64-bit products
+    vec even = _mm_mul_epu32(a, b);
+    vec odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+#endif
+}
+inline vec vand(vec a, vec b) { return _mm_and_si128(a, b); }
+inline vec vandnot(vec a, vec b) { return _mm_andnot_si128(a, b); }
+inline vec vor(vec a, vec b) { return _mm_or_si128(a, b); }
+inline vec vxor(vec a, vec b) { return _mm_xor_si128(a, b); }
+// SSE2 has no per-lane shift amounts
+inline vec vshl(vec a, vec b)
+{
+    alignas(16) int x[4], y[4];
+    vstore(x, a);
+    vstore(y, b);
+    for (int i = 0; i < 4; ++i)
+    {
+        x[i] = static_cast<unsigned>(x[i]) << (y[i] & 31);
+    }
+    return vload(x);
+}
+inline vec vshr(vec a, vec b)
+{
+    alignas(16) int x[4], y[4];
+    vstore(x, a);
+    vstore(y, b);
+    for (int i = 0; i < 4; ++i)
+    {
+        x[i] >>= y[i] & 31;
+    }
+    return vload(x);
+}
+inline vec vshl_n(vec a, int n) { return _mm_sll_epi32(a, _mm_cvtsi32_si128(n)); }
+inline vec vshr_n(vec a, int n) { return _mm_sra_epi32(a, _mm_cvtsi32_si128(n)); }
+inline vec veq(vec a, vec b) { return _mm_cmpeq_epi32(a, b); }
+inline vec vgt(vec a, vec b) { return _mm_cmpgt_epi32(a, b); }
+inline unsigned vmovemask(vec m)
+{
+    return _mm_movemask_ps(_mm_castsi128_ps(m));
+}
+
+#else
+
+typedef int vec;
+const int kVecLanes = 1;
+
+inline vec vload(const int *p) { return *p; }
+inline void vstore(int *p, vec a) { *p = a; }
+inline vec vset(int a) { return a; }
+inline vec viota() { return 0; }
+inline vec vadd(vec a, vec b)
+{
+    return static_cast<unsigned>(a) + static_cast<unsigned>(b);
+}
+inline vec vsub(vec a, vec b)
+{
+    return static_cast<unsigned>(a) - static_cast<unsigned>(b);
+}
+inline vec vmul(vec a, vec b)
+{
+    return static_cast<unsigned>(a) * static_cast<unsigned>(b);
+}
+inline vec vand(vec a, vec b) { return a & b; }
+inline vec vandnot(vec a, vec b) { return ~a & b; }
+inline vec vor(vec a, vec b) { return a | b; }
+inline vec vxor(vec a, vec b) { return a ^ b; }
+inline vec vshl(vec a, vec b) { return static_cast<unsigned>(a) << (b & 31); }
+inline vec vshr(vec a, vec b) { return a >> (b & 31); }
+inline vec vshl_n(vec a, int n) { return static_cast<unsigned>(a) << n; }
+inline vec vshr_n(vec a, int n) { return a >> n; }
+inline vec veq(vec a, vec b) { return -(a == b); }
+inline vec vgt(vec a, vec b) { return -(a > b); }
+inline unsigned vmovemask(vec m) { return m & 1; }
+
+#endif
+
+inline vec vneg(vec a) { return vsub(vset(0), a); }
+inline vec vcompl(vec a) { return vxor(a, vset(-1)); }
+inline vec vnot(vec a) { return vneg(veq(a, vset(0))); }
+inline vec vlt(vec a, vec b) { return vneg(vgt(b, a)); }
+inline vec vle(vec a, vec b) { return vadd(vgt(a, b), vset(1)); }
+inline vec vgt01(vec a, vec b) { return vneg(vgt(a, b)); }
+inline vec vge(vec a, vec b) { return vadd(vgt(b, a), vset(1)); }
+inline vec veq01(vec a, vec b) { return vneg(veq(a, b)); }
+inline vec vne(vec a, vec b) { return vadd(veq(a, b), vset(1)); }
+
+/** A stack slot of the block interpreter */
+struct Lanes
+{
+    alignas(32) int v[kBlockSize];
+
+    /** One bit per lane, set when the lane is Undefined */
+    uint64_t undef;
+};
+
+/** Programs needing more block stack slots than this allocate their stack */
+const int kInlineBlockDepth = 32;
+
+template <vec (*F)(vec)> inline void apply(Lanes &a)
+{
+    for (int i = 0; i < kBlockSize; i += kVecLanes)
+    {
+        vstore(a.v + i, F(vload(a.v + i)));
+    }
+}
+
+template <vec (*F)(vec, vec)> inline void apply(Lanes &a, const Lanes &b)
+{
+    for (int i = 0; i < kBlockSize; i += kVecLanes)
+    {
+        vstore(a.v + i, F(vload(a.v + i), vload(b.v + i)));
+    }
+    a.undef |= b.undef;
+}
+
+template <vec (*F)(vec, vec)> inline void apply_constant(Lanes &a, int b)
+{
+    vec c = vset(b);
+    for (int i = 0; i < kBlockSize; i += kVecLanes)
+    {
+        vstore(a.v + i, F(vload(a.v + i), c));
+    }
+}
+
+template <vec (*F)(vec, int)> inline void apply_shift(Lanes &a, int n)
+{
+    for (int i = 0; i < kBlockSize; i += kVecLanes)
+    {
+        vstore(a.v + i, F(vload(a.v + i), n));
+    }
+}
+
+/** Bit mask of the lanes that are non-zero */
+inline uint64_t nonzero_mask(const Lanes &a)
+{
+    uint64_t zero = 0;
+    vec z = vset(0);
+    for (int i = 0; i < kBlockSize; i += kVecLanes)
+    {
+        zero |= static_cast<uint64_t>(vmovemask(veq(vload(a.v + i), z))) << i;
+    }
+    return ~zero;
+}
+
+/**
+ * Integer division has no vector instruction, so divide lane by lane.
+ * Dividing by zero marks the lane as Undefined, and dividing by -1 is
+ * computed as a negation because INT_MIN / -1 traps. Unselected ternary
+ * arms are evaluated for every lane, so neither may fault.
+ */
+void divide(Lanes &a, const Lanes &b, bool modulo)
+{
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        int d = b.v[i];
+        if (d == 0)
+        {
+            a.undef |= uint64_t(1) << i;
+            a.v[i] = 0;
+        }
+        else if (d == -1)
+        {
+            a.v[i] = modulo ? 0 : -static_cast<unsigned>(a.v[i]);
+        }
+        else
+        {
+            a.v[i] = modulo ? a.v[i] % d : a.v[i] / d;
+        }
+    }
+    a.undef |= b.undef;
+}
+
+void divide_constant(Lanes &a, int d, bool modulo)
+{
+    if (d == -1)
+    {
+        if (modulo)
+        {
+            fill(a.v, a.v + kBlockSize, 0);
+        }
+        else
+        {
+            apply<vneg>(a);
+        }
+        return;
+    }
+
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        a.v[i] = modulo ? a.v[i] % d : a.v[i] / d;
+    }
+}
+
+void subscript(Lanes &a, const Lanes &b, const vector<string> &strings)
+{
+    uint64_t undef = a.undef | b.undef;
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        uint64_t bit = uint64_t(1) << i;
+        if (undef & bit)
+        {
+            a.v[i] = 0;
+            continue;
+        }
+
+        const string &s = strings[a.v[i]];
+        int index = b.v[i];
+        if (index < 0 || index >= static_cast<int>(s.length()))
+        {
+            undef |= bit;
+            a.v[i] = 0;
+        }
+        else
+        {
+            a.v[i] = s[index];
+        }
+    }
+    a.undef = undef;
+}
+
+/**
+ * Division whose divisors range analysis has proven to be neither 0 nor -1
+ * with an INT_MIN dividend. Lanes that are undefined still hold a value in
+ * range, so no lane can trap and the loop has no branches.
+ */
+void divide_unchecked(Lanes &a, const Lanes &b, bool modulo)
+{
+    if (modulo)
+    {
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            a.v[i] %= b.v[i];
+        }
+    }
+    else
+    {
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            a.v[i] /= b.v[i];
+        }
+    }
+    a.undef |= b.undef;
+}
+
+/** Subscript whose indices are proven to be within every string */
+void subscript_unchecked(Lanes &a, const Lanes &b,
+                         const vector<string> &strings)
+{
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        a.v[i] = strings[a.v[i]][b.v[i]];
+    }
+    a.undef |= b.undef;
+}
+
+/** Select pass where pred is non-zero, otherwise fail */
+void select(Lanes &pred, const Lanes &pass, const Lanes &fail)
+{
+    uint64_t taken = nonzero_mask(pred);
+    vec z = vset(0);
+    for (int i = 0; i < kBlockSize; i += kVecLanes)
+    {
+        vec m = veq(vload(pred.v + i), z);
+        vstore(pred.v + i, vor(vand(m, vload(fail.v + i)),
+                               vandnot(m, vload(pass.v + i))));
+    }
+    pred.undef |= (taken & pass.undef) | (~taken & fail.undef);
+}
+
+/**
+ * Run the block instructions for a single block. Either t holds the lanes of
+ * the identifier or they are counted up from t0. The first stack slot is
+ * never written, so that the top of the stack can always be named.
+ */
+const Lanes &run_block(const Program &program, const int *t, int t0,
+                       Lanes *stack)
+{
+    const vector<string> &strings = program.get_strings();
+    int sp = 1;
+
+    for (const Instruction &ins : program.get_block_code())
+    {
+        Lanes &a = stack[sp - 1];
+        const Lanes &b = stack[sp - 1];
+
+        switch (ins.op)
+        {
+        case OpCode::Identifier:
+        {
+            Lanes &top = stack[sp++];
+            if (t)
+            {
+                copy(t, t + kBlockSize, top.v);
+            }
+            else
+            {
+                vec base = vadd(vset(t0), viota());
+                for (int i = 0; i < kBlockSize; i += kVecLanes)
+                {
+                    vstore(top.v + i, vadd(base, vset(i)));
+                }
+            }
+            top.undef = 0;
+            break;
+        }
+        case OpCode::Integer:
+        case OpCode::String:
+        {
+            Lanes &top = stack[sp++];
+            fill(top.v, top.v + kBlockSize, ins.arg);
+            top.undef = 0;
+            break;
+        }
+        case OpCode::Undefined:
+        {
+            Lanes &top = stack[sp++];
+            fill(top.v, top.v + kBlockSize, 0);
+            top.undef = ~uint64_t(0);
+            break;
+        }
+        case OpCode::Negate:
+            apply<vneg>(a);
+            break;
+        case OpCode::BitwiseComplement:
+            apply<vcompl>(a);
+            break;
+        case OpCode::Not:
+            apply<vnot>(a);
+            break;
+        case OpCode::Subscript:
+            subscript(stack[sp - 2], b, strings);
+            --sp;
+            break;
+        case OpCode::Add:
+            apply<vadd>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::Subtract:
+            apply<vsub>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::Multiply:
+            apply<vmul>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::Divide:
+            divide(stack[sp - 2], b, false);
+            --sp;
+            break;
+        case OpCode::Modulo:
+            divide(stack[sp - 2], b, true);
+            --sp;
+            break;
+        case OpCode::BitwiseAnd:
+            apply<vand>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::BitwiseOr:
+            apply<vor>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::BitwiseXor:
+            apply<vxor>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::BitwiseShiftLeft:
+            apply<vshl>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::BitwiseShiftRight:
+            apply<vshr>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::LessThan:
+            apply<vlt>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::LessThanEqual:
+            apply<vle>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::GreaterThan:
+            apply<vgt01>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::GreaterThanEqual:
+            apply<vge>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::Equal:
+            apply<veq01>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::NotEqual:
+            apply<vne>(stack[sp - 2], b);
+            --sp;
+            break;
+        case OpCode::AddConstant:
+            apply_constant<vadd>(a, ins.arg);
+            break;
+        case OpCode::SubtractConstant:
+            apply_constant<vsub>(a, ins.arg);
+            break;
+        case OpCode::MultiplyConstant:
+            apply_constant<vmul>(a, ins.arg);
+            break;
+        case OpCode::DivideConstant:
+            divide_constant(a, ins.arg, false);
+            break;
+        case OpCode::ModuloConstant:
+            divide_constant(a, ins.arg, true);
+            break;
+        case OpCode::BitwiseAndConstant:
+            apply_constant<vand>(a, ins.arg);
+            break;
+        case OpCode::BitwiseOrConstant:
+            apply_constant<vor>(a, ins.arg);
+            break;
+        case OpCode::BitwiseXorConstant:
+            apply_constant<vxor>(a, ins.arg);
+            break;
+        case OpCode::BitwiseShiftLeftConstant:
+            apply_shift<vshl_n>(a, ins.arg);
+            break;
+        case OpCode::BitwiseShiftRightConstant:
+            apply_shift<vshr_n>(a, ins.arg);
+            break;
+        case OpCode::LessThanConstant:
+            apply_constant<vlt>(a, ins.arg);
+            break;
+        case OpCode::LessThanEqualConstant:
+            apply_constant<vle>(a, ins.arg);
+            break;
+        case OpCode::GreaterThanConstant:
+            apply_constant<vgt01>(a, ins.arg);
+            break;
+        case OpCode::GreaterThanEqualConstant:
+            apply_constant<vge>(a, ins.arg);
+            break;
+        case OpCode::EqualConstant:
+            apply_constant<veq01>(a, ins.arg);
+            break;
+        case OpCode::NotEqualConstant:
+            apply_constant<vne>(a, ins.arg);
+            break;
+        case OpCode::SubscriptUnchecked:
+            subscript_unchecked(stack[sp - 2], b, strings);
+            --sp;
+            break;
+        case OpCode::DivideUnchecked:
+            divide_unchecked(stack[sp - 2], b, false);
+            --sp;
+            break;
+        case OpCode::ModuloUnchecked:
+            divide_unchecked(stack[sp - 2], b, true);
+            --sp;
+            break;
+        case OpCode::Select:
+            select(stack[sp - 3], stack[sp - 2], b);
+            sp -= 2;
+            break;
+        case OpCode::JumpIfZero:
+        case OpCode::Jump:
+        case OpCode::Return:
+            break;
+        }
+    }
+
+    return stack[1];
+}
+
+void eval_blocks(const Program &program, const int *t, int t0, int n,
+                 int *out, bool *defined)
+{
+    Lanes inline_stack[kInlineBlockDepth];
+    vector<Lanes> heap_stack;
+    Lanes *stack = inline_stack;
+    if (program.get_block_max_depth() >= kInlineBlockDepth)
+    {
+        heap_stack.resize(program.get_block_max_depth() + 1);
+        stack = heap_stack.data();
+    }
+
+    alignas(32) int t_block[kBlockSize];
+
+    for (int offset = 0; offset < n; offset += kBlockSize)
+    {
+        int count = min(kBlockSize, n - offset);
+        const int *t_lanes = nullptr;
+        if (t)
+        {
+            // Pad the final partial block so that every lane is valid
+            copy(t + offset, t + offset + count, t_block);
+            fill(t_block + count, t_block + kBlockSize, 0);
+            t_lanes = t_block;
+        }
+
+        const Lanes &result = run_block(program, t_lanes, t0 + offset, stack);
+
+        for (int i = 0; i < count; ++i)
+        {
+            bool lane_defined = !((result.undef >> i) & 1);
+            out[offset + i] = lane_defined ? result.v[i] : 0;
+            if (defined)
+            {
+                defined[offset + i] = lane_defined;
+            }
+        }
+    }
+}
+
+void Program::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    eval_blocks(*this, nullptr, t0, n, out, defined);
+}
+
+void Program::eval_block(const int *t, int n, int *out, bool *defined) const
+{
+    eval_blocks(*this, t, 0, n, out, defined);
+}
+
+} // namespace bb
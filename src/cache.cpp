@@ -0,0 +1,349 @@
+#include "cache.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+void walk_canonical(const Ast &ast, vector<uint64_t> &hashes,
+                    vector<AstPtr> *nodes);
+uint64_t hash_node(AstType type, uint64_t value, uint64_t a = 0,
+                   uint64_t b = 0, uint64_t c = 0);
+uint64_t hash_string(const string &s);
+uint64_t mix_hash(uint64_t seed, uint64_t value);
+bool is_before(const Ast &a, uint64_t a_hash, const Ast &b, uint64_t b_hash);
+bool commutes(AstType type);
+AstType get_mirror(AstType type);
+
+uint64_t hash_ast(const Ast &ast)
+{
+    vector<uint64_t> hashes;
+    walk_canonical(ast, hashes, nullptr);
+    return hashes.back();
+}
+
+CanonicalAst canonicalize(const Ast &ast)
+{
+    vector<uint64_t> hashes;
+    vector<AstPtr> nodes;
+    walk_canonical(ast, hashes, &nodes);
+    return CanonicalAst{move(nodes.back()), hashes.back()};
+}
+
+/**
+ * Hash a tree after its operands, from an explicit stack, leaving the hash
+ * of each finished subtree on `hashes`. With `nodes`, the canonical form of
+ * each subtree is built alongside its hash.
+ *
+ * A binary node is hashed as if comparisons were written with < or <=, and
+ * with commutative operands in the order of their hashes, so that the hash
+ * does not depend on the order the operands are written in. Canonical nodes
+ * put integer constants after other operands and otherwise order them by
+ * hash, mirroring comparisons whose operands are swapped.
+ */
+void walk_canonical(const Ast &ast, vector<uint64_t> &hashes,
+                    vector<AstPtr> *nodes)
+{
+    struct Item
+    {
+        const Ast *node;
+        bool visited;
+    };
+
+    vector<Item> stack{{&ast, false}};
+    while (!stack.empty())
+    {
+        Item item = stack.back();
+        stack.pop_back();
+        const Ast &node = *item.node;
+        AstType type = node.type();
+        switch (type)
+        {
+        case AstType::Undefined:
+        case AstType::Identifier:
+            hashes.push_back(hash_node(type, 0));
+            if (nodes)
+            {
+                nodes->push_back(node.clone());
+            }
+            continue;
+        case AstType::Integer:
+            hashes.push_back(hash_node(
+                type, static_cast<const Integer &>(node).get_value()));
+            if (nodes)
+            {
+                nodes->push_back(node.clone());
+            }
+            continue;
+        case AstType::String:
+        {
+            auto &value = static_cast<const String &>(node).get_value();
+            hashes.push_back(hash_node(type, hash_string(value)));
+            if (nodes)
+            {
+                nodes->push_back(node.clone());
+            }
+            continue;
+        }
+        default:
+            break;
+        }
+
+        if (!item.visited)
+        {
+            stack.push_back({item.node, true});
+            if (type == AstType::TernaryIf)
+            {
+                auto &ternary = static_cast<const TernaryIf &>(node);
+                stack.push_back({&ternary.get_fail(), false});
+                stack.push_back({&ternary.get_pass(), false});
+                stack.push_back({&ternary.get_pred(), false});
+            }
+            else if (type == AstType::Negate ||
+                     type == AstType::BitwiseComplement ||
+                     type == AstType::Not)
+            {
+                auto &unary = static_cast<const UnaryOperator &>(node);
+                stack.push_back({&unary.get_inner(), false});
+            }
+            else
+            {
+                auto &binary = static_cast<const BinaryOperator &>(node);
+                stack.push_back({&binary.get_right(), false});
+                stack.push_back({&binary.get_left(), false});
+            }
+            continue;
+        }
+
+        if (type == AstType::TernaryIf)
+        {
+            size_t first = hashes.size() - 3;
+            uint64_t hash = hash_node(type, 0, hashes[first],
+                                      hashes[first + 1], hashes[first + 2]);
+            hashes.resize(first);
+            hashes.push_back(hash);
+            if (nodes)
+            {
+                AstPtr fail = move(nodes->back());
+                nodes->pop_back();
+                AstPtr pass = move(nodes->back());
+                nodes->pop_back();
+                AstPtr pred = move(nodes->back());
+                nodes->pop_back();
+                nodes->push_back(AstPtr(
+                    new TernaryIf(move(pred), move(pass), move(fail))));
+            }
+        }
+        else if (type == AstType::Negate ||
+                 type == AstType::BitwiseComplement || type == AstType::Not)
+        {
+            hashes.back() = hash_node(type, 0, hashes.back());
+            if (nodes)
+            {
+                nodes->back() = make_unary_node(type, move(nodes->back()));
+            }
+        }
+        else
+        {
+            uint64_t right_hash = hashes.back();
+            hashes.pop_back();
+            uint64_t left_hash = hashes.back();
+
+            AstType mirror = get_mirror(type);
+            AstType hash_type = type;
+            uint64_t a = left_hash;
+            uint64_t b = right_hash;
+            if (type == AstType::GreaterThan ||
+                type == AstType::GreaterThanEqual)
+            {
+                hash_type = mirror;
+                swap(a, b);
+            }
+            else if (commutes(type) && a > b)
+            {
+                swap(a, b);
+            }
+            hashes.back() = hash_node(hash_type, 0, a, b);
+
+            if (nodes)
+            {
+                AstPtr right = move(nodes->back());
+                nodes->pop_back();
+                AstPtr left = move(nodes->back());
+                nodes->pop_back();
+
+                // Equal operands are written with < or <=, the form that
+                // b>a is hashed in
+                bool swapped = false;
+                if (commutes(type) || mirror != type)
+                {
+                    swapped =
+                        is_before(*right, right_hash, *left, left_hash) ||
+                        (!is_before(*left, left_hash, *right, right_hash) &&
+                         hash_type != type);
+                }
+                if (swapped)
+                {
+                    swap(left, right);
+                    type = mirror;
+                }
+                nodes->push_back(
+                    make_binary_node(type, move(left), move(right)));
+            }
+        }
+    }
+}
+
+uint64_t hash_node(AstType type, uint64_t value, uint64_t a, uint64_t b,
+                   uint64_t c)
+{
+    uint64_t hash = mix_hash(static_cast<uint64_t>(type), value);
+    hash = mix_hash(hash, a);
+    hash = mix_hash(hash, b);
+    return mix_hash(hash, c);
+}
+
+/** 64-bit FNV-1a */
+uint64_t hash_string(const string &s)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : s)
+    {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/** Combine a word into a hash, finishing with the splitmix64 mixer */
+uint64_t mix_hash(uint64_t seed, uint64_t value)
+{
+    uint64_t hash = seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) +
+                            (seed >> 2));
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+    return hash ^ (hash >> 31);
+}
+
+/** Whether a canonical operand goes before another, constants last */
+bool is_before(const Ast &a, uint64_t a_hash, const Ast &b, uint64_t b_hash)
+{
+    bool a_integer = a.type() == AstType::Integer;
+    bool b_integer = b.type() == AstType::Integer;
+    if (a_integer != b_integer)
+    {
+        return b_integer;
+    }
+    return a_hash < b_hash;
+}
+
+bool commutes(AstType type)
+{
+    return type == AstType::Add || type == AstType::Multiply ||
+           type == AstType::BitwiseAnd || type == AstType::BitwiseOr ||
+           type == AstType::BitwiseXor || type == AstType::Equal ||
+           type == AstType::NotEqual;
+}
+
+/** The comparison with its operands swapped, or type if there is none */
+AstType get_mirror(AstType type)
+{
+    switch (type)
+    {
+    case AstType::LessThan:
+        return AstType::GreaterThan;
+    case AstType::LessThanEqual:
+        return AstType::GreaterThanEqual;
+    case AstType::GreaterThan:
+        return AstType::LessThan;
+    case AstType::GreaterThanEqual:
+        return AstType::LessThanEqual;
+    default:
+        return type;
+    }
+}
+
+ProgramCache::ProgramCache(size_t capacity)
+    : capacity(capacity), hits(0), misses(0)
+{
+}
+
+unique_ptr<TieredProgram> ProgramCache::parse(const string &input,
+                                              size_t period_bytes)
+{
+    return get(*optimize(bb::parse(input)), period_bytes);
+}
+
+unique_ptr<TieredProgram> ProgramCache::get(const Ast &ast,
+                                            size_t period_bytes)
+{
+    CanonicalAst canonical = canonicalize(ast);
+    uint64_t key = mix_hash(canonical.hash, period_bytes);
+    string text = *canonical.ast;
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        auto found = index.find(key);
+        if (found != index.end() && found->second->text == text)
+        {
+            ++hits;
+            entries.splice(entries.begin(), entries, found->second);
+            return found->second->program->share();
+        }
+        ++misses;
+    }
+
+    // Start compiling without the lock, so other threads can still find
+    // the expressions that are cached meanwhile
+    unique_ptr<TieredProgram> program(
+        new TieredProgram(move(canonical.ast), period_bytes));
+    unique_ptr<TieredProgram> shared = program->share();
+
+    lock_guard<mutex> lock(entries_mutex);
+    auto found = index.find(key);
+    if (found != index.end())
+    {
+        entries.erase(found->second);
+        index.erase(found);
+    }
+    entries.push_front(Entry{key, move(text), move(program)});
+    index[key] = entries.begin();
+    if (entries.size() > capacity)
+    {
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+    return shared;
+}
+
+size_t ProgramCache::get_hits() const
+{
+    lock_guard<mutex> lock(entries_mutex);
+    return hits;
+}
+
+size_t ProgramCache::get_misses() const
+{
+    lock_guard<mutex> lock(entries_mutex);
+    return misses;
+}
+
+size_t ProgramCache::size() const
+{
+    lock_guard<mutex> lock(entries_mutex);
+    return entries.size();
+}
+
+void ProgramCache::clear()
+{
+    lock_guard<mutex> lock(entries_mutex);
+    entries.clear();
+    index.clear();
+    hits = 0;
+    misses = 0;
+}
+
+} // namespace bb
@@ -0,0 +1,423 @@
+#include "codegen.hpp"
+#include "range.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#include <unistd.h>
+#define BB_CODEGEN_DLOPEN
+#endif
+
+using namespace std;
+
+namespace bb
+{
+
+// Helpers shared by every generated unit. Arithmetic goes through unsigned
+// so that overflow wraps instead of being undefined behavior in C.
+const char *const kPrelude = R"(#include <stdbool.h>
+
+static inline int bb_undefined(int *u) { *u = 1; return 0; }
+static inline int bb_add(int a, int b) { return (int)((unsigned)a + (unsigned)b); }
+static inline int bb_sub(int a, int b) { return (int)((unsigned)a - (unsigned)b); }
+static inline int bb_mul(int a, int b) { return (int)((unsigned)a * (unsigned)b); }
+static inline int bb_neg(int a) { return (int)(0u - (unsigned)a); }
+static inline int bb_shl(int a, int b) { return (int)((unsigned)a << (b & 31)); }
+static inline int bb_shr(int a, int b) { return a >> (b & 31); }
+
+static inline int bb_div(int a, int b, int *u)
+{
+    if (b == 0) return bb_undefined(u);
+    if (b == -1) return bb_neg(a);
+    return a / b;
+}
+
+static inline int bb_mod(int a, int b, int *u)
+{
+    if (b == 0) return bb_undefined(u);
+    if (b == -1) return 0;
+    return a % b;
+}
+)";
+
+const char *const kEntryPoints = R"(
+static inline int bb_subscript(int s, int i, int *u)
+{
+    if (i < 0 || i >= bb_lengths[s]) return bb_undefined(u);
+    return bb_strings[s][i];
+}
+
+static inline int bb_kernel(int t, int *u)
+{
+    return BB_EXPR;
+}
+
+int bb_eval(int t, bool *defined)
+{
+    int u = 0;
+    int v = bb_kernel(t, &u);
+    *defined = !u;
+    return u ? 0 : v;
+}
+
+void bb_eval_block(int t0, int n, int *out, bool *defined)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        int u = 0;
+        int v = bb_kernel((int)((unsigned)t0 + (unsigned)i), &u);
+        out[i] = u ? 0 : v;
+        if (defined) defined[i] = !u;
+    }
+}
+
+void bb_eval_block_array(const int *t, int n, int *out, bool *defined)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        int u = 0;
+        int v = bb_kernel(t[i], &u);
+        out[i] = u ? 0 : v;
+        if (defined) defined[i] = !u;
+    }
+}
+)";
+
+void generate_node(const Ast &ast, ValueType expected, vector<string> &strings,
+                   string &out);
+int intern_c_string(vector<string> &strings, const string &s);
+string escape_c_string(const string &s);
+bool run_compiler(const string &compiler, const string &source,
+                  const string &library);
+
+string generate_c(const Ast &ast)
+{
+    vector<string> strings;
+    string expr;
+    generate_node(ast, ValueType::Integer, strings, expr);
+
+    // Keep the tables non-empty; index 0 is only read on undefined paths
+    if (strings.empty())
+    {
+        strings.push_back("");
+    }
+
+    string out = kPrelude;
+    out += "\nstatic const char *const bb_strings[] = {";
+    for (size_t i = 0; i < strings.size(); ++i)
+    {
+        out += i ? ", " : "";
+        out += escape_c_string(strings[i]);
+    }
+    out += "};\nstatic const int bb_lengths[] = {";
+    for (size_t i = 0; i < strings.size(); ++i)
+    {
+        out += i ? ", " : "";
+        out += to_string(strings[i].length());
+    }
+    out += "};\n\n#define BB_EXPR " + expr + "\n";
+    out += kEntryPoints;
+    return out;
+}
+
+void generate_node(const Ast &ast, ValueType expected, vector<string> &strings,
+                   string &out)
+{
+    AstType type = ast.type();
+
+    if (type == AstType::TernaryIf)
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        out += "(";
+        generate_node(ternary.get_pred(), ValueType::Integer, strings, out);
+        out += " ? ";
+        generate_node(ternary.get_pass(), expected, strings, out);
+        out += " : ";
+        generate_node(ternary.get_fail(), expected, strings, out);
+        out += ")";
+        return;
+    }
+
+    if (type == AstType::String)
+    {
+        if (expected != ValueType::String)
+        {
+            out += "bb_undefined(u)";
+            return;
+        }
+        auto &str = static_cast<const String &>(ast);
+        out += to_string(intern_c_string(strings, str.get_value()));
+        return;
+    }
+
+    // Every remaining node produces an integer
+    if (type == AstType::Undefined || expected != ValueType::Integer)
+    {
+        out += "bb_undefined(u)";
+        return;
+    }
+
+    if (type == AstType::Identifier)
+    {
+        out += "t";
+        return;
+    }
+
+    if (type == AstType::Integer)
+    {
+        int value = static_cast<const Integer &>(ast).get_value();
+        // INT_MIN cannot be written as a literal
+        out += value < 0 ? "(" + to_string(value + 1) + " - 1)"
+                         : to_string(value);
+        return;
+    }
+
+    if (type == AstType::Negate || type == AstType::BitwiseComplement ||
+        type == AstType::Not)
+    {
+        auto &unary = static_cast<const UnaryOperator &>(ast);
+        out += type == AstType::Negate              ? "bb_neg("
+               : type == AstType::BitwiseComplement ? "(~"
+                                                    : "(!";
+        generate_node(unary.get_inner(), ValueType::Integer, strings, out);
+        out += ")";
+        return;
+    }
+
+    auto &binary = static_cast<const BinaryOperator &>(ast);
+    ValueType left_type = ValueType::Integer;
+    const char *prefix = nullptr;
+    const char *infix = nullptr;
+    const char *suffix = ")";
+    switch (type)
+    {
+    case AstType::Subscript:
+        if (needs_guard(ast))
+        {
+            prefix = "bb_subscript(", infix = ", ", suffix = ", u)";
+        }
+        else
+        {
+            prefix = "bb_strings[", infix = "][", suffix = "]";
+        }
+        left_type = ValueType::String;
+        break;
+    case AstType::Add:
+        prefix = "bb_add(", infix = ", ";
+        break;
+    case AstType::Subtract:
+        prefix = "bb_sub(", infix = ", ";
+        break;
+    case AstType::Multiply:
+        prefix = "bb_mul(", infix = ", ";
+        break;
+    case AstType::Divide:
+        if (needs_guard(ast))
+        {
+            prefix = "bb_div(", infix = ", ", suffix = ", u)";
+        }
+        else
+        {
+            prefix = "(", infix = " / ";
+        }
+        break;
+    case AstType::Modulo:
+        if (needs_guard(ast))
+        {
+            prefix = "bb_mod(", infix = ", ", suffix = ", u)";
+        }
+        else
+        {
+            prefix = "(", infix = " % ";
+        }
+        break;
+    case AstType::BitwiseShiftLeft:
+        prefix = "bb_shl(", infix = ", ";
+        break;
+    case AstType::BitwiseShiftRight:
+        prefix = "bb_shr(", infix = ", ";
+        break;
+    case AstType::BitwiseAnd:
+        prefix = "(", infix = " & ";
+        break;
+    case AstType::BitwiseOr:
+        prefix = "(", infix = " | ";
+        break;
+    case AstType::BitwiseXor:
+        prefix = "(", infix = " ^ ";
+        break;
+    case AstType::LessThan:
+        prefix = "(", infix = " < ";
+        break;
+    case AstType::LessThanEqual:
+        prefix = "(", infix = " <= ";
+        break;
+    case AstType::GreaterThan:
+        prefix = "(", infix = " > ";
+        break;
+    case AstType::GreaterThanEqual:
+        prefix = "(", infix = " >= ";
+        break;
+    case AstType::Equal:
+        prefix = "(", infix = " == ";
+        break;
+    case AstType::NotEqual:
+        prefix = "(", infix = " != ";
+        break;
+    default:
+        throw invalid_argument("unsupported node type");
+    }
+
+    out += prefix;
+    generate_node(binary.get_left(), left_type, strings, out);
+    out += infix;
+    generate_node(binary.get_right(), ValueType::Integer, strings, out);
+    out += suffix;
+}
+
+int intern_c_string(vector<string> &strings, const string &s)
+{
+    for (size_t i = 0; i < strings.size(); ++i)
+    {
+        if (strings[i] == s)
+        {
+            return i;
+        }
+    }
+    strings.push_back(s);
+    return strings.size() - 1;
+}
+
+string escape_c_string(const string &s)
+{
+    string out = "\"";
+    for (char c : s)
+    {
+        unsigned char u = c;
+        if (u >= 0x20 && u < 0x7f && c != '"' && c != '\\' && c != '?')
+        {
+            out += c;
+            continue;
+        }
+        // Fixed-width octal escapes cannot swallow the next character
+        char escape[5];
+        snprintf(escape, sizeof(escape), "\\%03o", u);
+        out += escape;
+    }
+    return out + "\"";
+}
+
+bool run_compiler(const string &compiler, const string &source,
+                  const string &library)
+{
+    string command = compiler + " -O3 -shared -fPIC -o '" + library + "' '" +
+                     source + "' 2>/dev/null";
+    return system(command.c_str()) == 0;
+}
+
+NativeProgram::NativeProgram(const Ast &ast, const string &compiler)
+    : program(compile(ast)), handle(nullptr), scalar(nullptr), block(nullptr),
+      block_array(nullptr)
+{
+#if defined(BB_CODEGEN_DLOPEN)
+    const char *tmpdir = getenv("TMPDIR");
+    string dir = string(tmpdir && *tmpdir ? tmpdir : "/tmp") +
+                 "/bytebeat-XXXXXX";
+    if (!mkdtemp(&dir[0]))
+    {
+        return;
+    }
+
+    string source = dir + "/expr.c";
+    string library = dir + "/expr.so";
+    {
+        ofstream file(source);
+        file << generate_c(ast);
+    }
+
+    void *lib = nullptr;
+    if (run_compiler(compiler, source, library))
+    {
+        lib = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    }
+
+    // The mapping outlives the file, so nothing needs to stay on disk
+    unlink(library.c_str());
+    unlink(source.c_str());
+    rmdir(dir.c_str());
+
+    if (!lib)
+    {
+        return;
+    }
+
+    scalar = reinterpret_cast<ScalarFn>(dlsym(lib, "bb_eval"));
+    block = reinterpret_cast<BlockFn>(dlsym(lib, "bb_eval_block"));
+    block_array =
+        reinterpret_cast<BlockArrayFn>(dlsym(lib, "bb_eval_block_array"));
+    if (!scalar || !block || !block_array)
+    {
+        scalar = nullptr;
+        block = nullptr;
+        block_array = nullptr;
+        dlclose(lib);
+        return;
+    }
+    handle = lib;
+#else
+    (void)compiler;
+#endif
+}
+
+NativeProgram::~NativeProgram()
+{
+#if defined(BB_CODEGEN_DLOPEN)
+    if (handle)
+    {
+        dlclose(handle);
+    }
+#endif
+}
+
+Value NativeProgram::eval(int t) const
+{
+    if (!scalar)
+    {
+        return program.eval(t);
+    }
+
+    bool defined;
+    int result = scalar(t, &defined);
+    if (!defined)
+    {
+        return Value();
+    }
+    return result;
+}
+
+void NativeProgram::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    if (!block)
+    {
+        program.eval_block(t0, n, out, defined);
+        return;
+    }
+    block(t0, n, out, defined);
+}
+
+void NativeProgram::eval_block(const int *t, int n, int *out,
+                               bool *defined) const
+{
+    if (!block_array)
+    {
+        program.eval_block(t, n, out, defined);
+        return;
+    }
+    block_array(t, n, out, defined);
+}
+
+} // namespace bb
@@ -0,0 +1,604 @@
+#include "dag.hpp"
+#include "bits.hpp"
+#include "range.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std;
+
+namespace bb
+{
+
+/** What a DAG node evaluated to for one sample */
+enum class DagKind : unsigned char
+{
+    Undefined,
+    Integer,
+    String,
+};
+
+/** DAGs with more nodes than this allocate their evaluation scratch space */
+const size_t kInlineDagNodes = 64;
+
+/** log2 of kBlockSize, the lowest bit of t that is fixed in an aligned block */
+const int kBlockBits = 6;
+
+/**
+ * Whether a node's lanes were left uniform by the previous block, and the
+ * bits of t they were computed for
+ */
+struct DagHoist
+{
+    bool cached;
+    int key;
+};
+
+struct DagNodeHash
+{
+    size_t operator()(const DagNode &node) const
+    {
+        size_t h = static_cast<size_t>(node.type);
+        h = h * 31 + static_cast<unsigned>(node.value);
+        for (int operand : node.operands)
+        {
+            h = h * 31 + static_cast<unsigned>(operand);
+        }
+        return h;
+    }
+};
+
+struct DagBuilder
+{
+    vector<DagNode> nodes;
+    vector<string> strings;
+    vector<bool> guarded;
+    vector<TBitFloors> floors;
+    unordered_map<DagNode, int, DagNodeHash> index;
+    size_t tree_size;
+};
+
+int intern_node(const Ast &ast, DagBuilder &builder);
+int intern_dag_string(DagBuilder &builder, const string &s);
+bool is_commutative_node(AstType type);
+bool is_leaf_node(AstType type);
+void run_nodes(const vector<DagNode> &nodes, const vector<string> &strings,
+               const vector<bool> &always_int, const vector<bool> &guarded,
+               const vector<int> &lowest_t_bits, const int *t, int n,
+               int *values, DagKind *kinds, DagHoist *hoist);
+void run_node(const DagNode &node, const vector<string> &strings,
+              bool always_int, bool guarded, const int *t, int n, int stride,
+              const int *values, const DagKind *kinds, int *v, DagKind *k);
+
+Dag::Dag(const Ast &ast)
+{
+    DagBuilder builder;
+    builder.tree_size = 0;
+    intern_node(ast, builder);
+    nodes = move(builder.nodes);
+    strings = move(builder.strings);
+    guarded = move(builder.guarded);
+    tree_size = builder.tree_size;
+    for (const TBitFloors &floors : builder.floors)
+    {
+        lowest_t_bits.push_back(bb::get_lowest_t_bit(floors));
+    }
+
+    // A node always yields an integer if its operands do and it cannot
+    // divide by zero
+    always_int.resize(nodes.size());
+    for (size_t id = 0; id < nodes.size(); ++id)
+    {
+        const DagNode &node = nodes[id];
+        bool result = node.type != AstType::Undefined &&
+                      node.type != AstType::String &&
+                      node.type != AstType::Subscript;
+        for (int operand : node.operands)
+        {
+            result = result && (operand < 0 || always_int[operand]);
+        }
+        if (node.type == AstType::Divide || node.type == AstType::Modulo)
+        {
+            result = result && !guarded[id];
+        }
+        always_int[id] = result;
+    }
+}
+
+int intern_node(const Ast &ast, DagBuilder &builder)
+{
+    ++builder.tree_size;
+
+    DagNode node{ast.type(), 0, {-1, -1, -1}};
+    bool swapped = false;
+    switch (node.type)
+    {
+    case AstType::Undefined:
+    case AstType::Identifier:
+        break;
+    case AstType::Integer:
+        node.value = static_cast<const Integer &>(ast).get_value();
+        break;
+    case AstType::String:
+        node.value = intern_dag_string(
+            builder, static_cast<const String &>(ast).get_value());
+        break;
+    case AstType::Negate:
+    case AstType::BitwiseComplement:
+    case AstType::Not:
+        node.operands[0] = intern_node(
+            static_cast<const UnaryOperator &>(ast).get_inner(), builder);
+        break;
+    case AstType::TernaryIf:
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        node.operands[0] = intern_node(ternary.get_pred(), builder);
+        node.operands[1] = intern_node(ternary.get_pass(), builder);
+        node.operands[2] = intern_node(ternary.get_fail(), builder);
+        break;
+    }
+    default:
+    {
+        auto &binary = static_cast<const BinaryOperator &>(ast);
+        node.operands[0] = intern_node(binary.get_left(), builder);
+        node.operands[1] = intern_node(binary.get_right(), builder);
+        if (is_commutative_node(node.type) &&
+            node.operands[0] > node.operands[1])
+        {
+            swap(node.operands[0], node.operands[1]);
+            swapped = true;
+        }
+        break;
+    }
+    }
+
+    auto it = builder.index.find(node);
+    if (it != builder.index.end())
+    {
+        return it->second;
+    }
+    // Floors take their operands in the order of the tree, before any swap
+    TBitFloors operands[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        if (node.operands[i] >= 0)
+        {
+            operands[i] = builder.floors[node.operands[i]];
+        }
+    }
+    if (swapped)
+    {
+        swap(operands[0], operands[1]);
+    }
+
+    int id = builder.nodes.size();
+    builder.nodes.push_back(node);
+    builder.guarded.push_back(needs_guard(ast));
+    builder.floors.push_back(get_t_bit_floors(ast, operands));
+    builder.index.emplace(node, id);
+    return id;
+}
+
+int intern_dag_string(DagBuilder &builder, const string &s)
+{
+    for (size_t i = 0; i < builder.strings.size(); ++i)
+    {
+        if (builder.strings[i] == s)
+        {
+            return i;
+        }
+    }
+    builder.strings.push_back(s);
+    return builder.strings.size() - 1;
+}
+
+bool is_commutative_node(AstType type)
+{
+    return type == AstType::Add || type == AstType::Multiply ||
+           type == AstType::BitwiseAnd || type == AstType::BitwiseOr ||
+           type == AstType::BitwiseXor || type == AstType::Equal ||
+           type == AstType::NotEqual;
+}
+
+size_t Dag::get_operator_count() const
+{
+    return count_if(nodes.begin(), nodes.end(), [](const DagNode &node) {
+        return !is_leaf_node(node.type);
+    });
+}
+
+size_t Dag::get_hoisted_count() const
+{
+    size_t count = 0;
+    for (size_t id = 0; id < nodes.size(); ++id)
+    {
+        if (!is_leaf_node(nodes[id].type) && lowest_t_bits[id] >= kBlockBits)
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+bool is_leaf_node(AstType type)
+{
+    return type == AstType::Undefined || type == AstType::Identifier ||
+           type == AstType::Integer || type == AstType::String;
+}
+
+Value Dag::eval(int t) const
+{
+    int inline_values[kInlineDagNodes];
+    DagKind inline_kinds[kInlineDagNodes];
+    vector<int> heap_values;
+    vector<DagKind> heap_kinds;
+    int *values = inline_values;
+    DagKind *kinds = inline_kinds;
+    if (nodes.size() > kInlineDagNodes)
+    {
+        heap_values.resize(nodes.size());
+        heap_kinds.resize(nodes.size());
+        values = heap_values.data();
+        kinds = heap_kinds.data();
+    }
+
+    run_nodes(nodes, strings, always_int, guarded, lowest_t_bits, &t, 1,
+              values, kinds, nullptr);
+
+    size_t root = nodes.size() - 1;
+    if (kinds[root] == DagKind::Integer)
+    {
+        return values[root];
+    }
+    if (kinds[root] == DagKind::String)
+    {
+        return strings[values[root]];
+    }
+    return Value();
+}
+
+void Dag::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    eval(nullptr, t0, n, out, defined);
+}
+
+void Dag::eval_block(const int *t, int n, int *out, bool *defined) const
+{
+    eval(t, 0, n, out, defined);
+}
+
+void Dag::eval(const int *t, int t0, int n, int *out, bool *defined) const
+{
+    int inline_values[kInlineDagNodes * kBlockSize];
+    DagKind inline_kinds[kInlineDagNodes * kBlockSize];
+    DagHoist inline_hoist[kInlineDagNodes];
+    vector<int> heap_values;
+    vector<DagKind> heap_kinds;
+    vector<DagHoist> heap_hoist;
+    int *values = inline_values;
+    DagKind *kinds = inline_kinds;
+    DagHoist *hoist = inline_hoist;
+    if (nodes.size() > kInlineDagNodes)
+    {
+        heap_values.resize(nodes.size() * kBlockSize);
+        heap_kinds.resize(nodes.size() * kBlockSize);
+        heap_hoist.resize(nodes.size());
+        values = heap_values.data();
+        kinds = heap_kinds.data();
+        hoist = heap_hoist.data();
+    }
+
+    int block_t[kBlockSize];
+    int previous = 0;
+    for (int offset = 0; offset < n; offset += kBlockSize)
+    {
+        int count = min(kBlockSize, n - offset);
+        if (!t)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                block_t[i] =
+                    static_cast<int>(static_cast<unsigned>(t0) + offset + i);
+            }
+        }
+
+        // Lanes are laid out by count, so a block of another size starts
+        // without any cached nodes
+        if (count != previous)
+        {
+            fill(hoist, hoist + nodes.size(), DagHoist{false, 0});
+            previous = count;
+        }
+        run_nodes(nodes, strings, always_int, guarded, lowest_t_bits,
+                  t ? t + offset : block_t, count, values, kinds, hoist);
+
+        size_t root = (nodes.size() - 1) * count;
+        for (int i = 0; i < count; ++i)
+        {
+            bool is_int = kinds[root + i] == DagKind::Integer;
+            out[offset + i] = is_int ? values[root + i] : 0;
+            if (defined)
+            {
+                defined[offset + i] = is_int;
+            }
+        }
+    }
+}
+
+template <typename F>
+void apply_unary(int n, int *v, const int *a, F f)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        v[i] = f(a[i]);
+    }
+}
+
+template <typename F>
+void apply_binary(int n, int *v, const int *a, const int *b, F f)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        v[i] = f(a[i], b[i]);
+    }
+}
+
+/**
+ * Evaluate every node for n <= kBlockSize samples. Node i keeps its lanes at
+ * values[i * n] and kinds[i * n], so each operator is a flat loop over lanes
+ * that the compiler can vectorize.
+ *
+ * A node that does not depend on the bits of t that vary within the block is
+ * computed for the first lane and copied to the others. With hoist, it is
+ * skipped entirely if its lanes already hold the value for the same bits of t.
+ */
+void run_nodes(const vector<DagNode> &nodes, const vector<string> &strings,
+               const vector<bool> &always_int, const vector<bool> &guarded,
+               const vector<int> &lowest_t_bits, const int *t, int n,
+               int *values, DagKind *kinds, DagHoist *hoist)
+{
+    uint32_t varying = 0;
+    for (int i = 1; i < n; ++i)
+    {
+        varying |= t[i] ^ t[0];
+    }
+    int block_low = 0;
+    while (block_low < 32 && varying >> block_low)
+    {
+        ++block_low;
+    }
+
+    for (size_t id = 0; id < nodes.size(); ++id)
+    {
+        int *v = values + id * n;
+        DagKind *k = kinds + id * n;
+        int lanes = n;
+        int low = lowest_t_bits[id];
+        if (low >= block_low)
+        {
+            int key = low < 32 ? t[0] >> low : 0;
+            if (hoist && hoist[id].cached && hoist[id].key == key)
+            {
+                continue;
+            }
+            lanes = 1;
+            if (hoist)
+            {
+                hoist[id] = DagHoist{true, key};
+            }
+        }
+        else if (hoist)
+        {
+            hoist[id].cached = false;
+        }
+
+        run_node(nodes[id], strings, always_int[id], guarded[id], t, lanes, n,
+                 values, kinds, v, k);
+        if (lanes < n)
+        {
+            fill(v + 1, v + n, v[0]);
+            fill(k + 1, k + n, k[0]);
+        }
+    }
+}
+
+/**
+ * Evaluate the first n lanes of one node into v and k, where every node has
+ * stride lanes in values and kinds
+ */
+void run_node(const DagNode &node, const vector<string> &strings,
+              bool always_int, bool guarded, const int *t, int n, int stride,
+              const int *values, const DagKind *kinds, int *v, DagKind *k)
+{
+    // Nodes without operands never read these
+    size_t first = node.operands[0] < 0 ? 0 : node.operands[0] * stride;
+    size_t second = node.operands[1] < 0 ? 0 : node.operands[1] * stride;
+    const int *a = values + first;
+    const int *b = values + second;
+    const DagKind *ka = kinds + first;
+    const DagKind *kb = kinds + second;
+
+    switch (node.type)
+    {
+    case AstType::Identifier:
+        copy(t, t + n, v);
+        fill(k, k + n, DagKind::Integer);
+        return;
+    case AstType::Undefined:
+    case AstType::Integer:
+    case AstType::String:
+        fill(v, v + n, node.value);
+        fill(k, k + n,
+             node.type == AstType::Integer  ? DagKind::Integer
+             : node.type == AstType::String ? DagKind::String
+                                            : DagKind::Undefined);
+        return;
+    case AstType::TernaryIf:
+    {
+        size_t third = node.operands[2] * stride;
+        const int *c = values + third;
+        const DagKind *kc = kinds + third;
+        for (int i = 0; i < n; ++i)
+        {
+            bool pass = a[i] != 0;
+            v[i] = pass ? b[i] : c[i];
+            k[i] = ka[i] != DagKind::Integer ? DagKind::Undefined
+                   : pass                    ? kb[i]
+                                             : kc[i];
+        }
+        return;
+    }
+    case AstType::Subscript:
+        if (!guarded)
+        {
+            for (int i = 0; i < n; ++i)
+            {
+                v[i] = strings[a[i]][b[i]];
+                k[i] = ka[i] == DagKind::String ? kb[i]
+                                                : DagKind::Undefined;
+            }
+            return;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            v[i] = 0;
+            k[i] = DagKind::Undefined;
+            if (ka[i] != DagKind::String || kb[i] != DagKind::Integer)
+            {
+                continue;
+            }
+            const string &s = strings[a[i]];
+            if (b[i] >= 0 && b[i] < static_cast<int>(s.length()))
+            {
+                v[i] = s[b[i]];
+                k[i] = DagKind::Integer;
+            }
+        }
+        return;
+    case AstType::Negate:
+    case AstType::BitwiseComplement:
+    case AstType::Not:
+        for (int i = 0; i < n; ++i)
+        {
+            k[i] = ka[i] == DagKind::Integer ? DagKind::Integer
+                                             : DagKind::Undefined;
+        }
+        break;
+    default:
+        // Most operators only see integers, which skips the lane checks
+        if (always_int)
+        {
+            fill(k, k + n, DagKind::Integer);
+            break;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            k[i] = ka[i] == DagKind::Integer && kb[i] == DagKind::Integer
+                       ? DagKind::Integer
+                       : DagKind::Undefined;
+        }
+        break;
+    }
+
+    // Arithmetic wraps and shift counts use their low five bits, as in
+    // the other backends. Unless range analysis proved the divisor safe,
+    // every lane is guarded against division traps, because untaken
+    // ternary arms are evaluated too.
+    switch (node.type)
+    {
+    case AstType::Negate:
+        apply_unary(n, v, a, [](int x) { return 0u - x; });
+        break;
+    case AstType::BitwiseComplement:
+        apply_unary(n, v, a, [](int x) { return ~x; });
+        break;
+    case AstType::Not:
+        apply_unary(n, v, a, [](int x) { return !x; });
+        break;
+    case AstType::Add:
+        apply_binary(n, v, a, b,
+                     [](int x, int y) { return unsigned(x) + y; });
+        break;
+    case AstType::Subtract:
+        apply_binary(n, v, a, b,
+                     [](int x, int y) { return unsigned(x) - y; });
+        break;
+    case AstType::Multiply:
+        apply_binary(n, v, a, b,
+                     [](int x, int y) { return unsigned(x) * y; });
+        break;
+    case AstType::Divide:
+        if (!guarded)
+        {
+            apply_binary(n, v, a, b, [](int x, int y) { return x / y; });
+            break;
+        }
+        apply_binary(n, v, a, b, [](int x, int y) {
+            return y == 0 ? 0 : y == -1 ? 0u - x : unsigned(x / y);
+        });
+        break;
+    case AstType::Modulo:
+        if (!guarded)
+        {
+            apply_binary(n, v, a, b, [](int x, int y) { return x % y; });
+            break;
+        }
+        apply_binary(n, v, a, b, [](int x, int y) {
+            return y == 0 || y == -1 ? 0 : x % y;
+        });
+        break;
+    case AstType::BitwiseAnd:
+        apply_binary(n, v, a, b, [](int x, int y) { return x & y; });
+        break;
+    case AstType::BitwiseOr:
+        apply_binary(n, v, a, b, [](int x, int y) { return x | y; });
+        break;
+    case AstType::BitwiseXor:
+        apply_binary(n, v, a, b, [](int x, int y) { return x ^ y; });
+        break;
+    case AstType::BitwiseShiftLeft:
+        apply_binary(n, v, a, b,
+                     [](int x, int y) { return unsigned(x) << (y & 31); });
+        break;
+    case AstType::BitwiseShiftRight:
+        apply_binary(n, v, a, b,
+                     [](int x, int y) { return x >> (y & 31); });
+        break;
+    case AstType::LessThan:
+        apply_binary(n, v, a, b, [](int x, int y) { return x < y; });
+        break;
+    case AstType::LessThanEqual:
+        apply_binary(n, v, a, b, [](int x, int y) { return x <= y; });
+        break;
+    case AstType::GreaterThan:
+        apply_binary(n, v, a, b, [](int x, int y) { return x > y; });
+        break;
+    case AstType::GreaterThanEqual:
+        apply_binary(n, v, a, b, [](int x, int y) { return x >= y; });
+        break;
+    case AstType::Equal:
+        apply_binary(n, v, a, b, [](int x, int y) { return x == y; });
+        break;
+    case AstType::NotEqual:
+        apply_binary(n, v, a, b, [](int x, int y) { return x != y; });
+        break;
+    default:
+        break;
+    }
+
+    // A zero divisor is the only way an operator itself is undefined
+    if (guarded &&
+        (node.type == AstType::Divide || node.type == AstType::Modulo))
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            if (b[i] == 0)
+            {
+                k[i] = DagKind::Undefined;
+            }
+        }
+    }
+}
+
+} // namespace bb
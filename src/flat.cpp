@@ -0,0 +1,688 @@
+#include "flat.hpp"
+#include "optimize.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+namespace bb
+{
+
+Value eval_flat_node(const FlatAst &ast, uint32_t index, int t);
+int eval_flat_nodes(const FlatAst &ast, int t, int *values, bool *defined);
+FlatEval get_flat_eval(AstType type, const FlatNode *left,
+                       const FlatNode *right);
+string get_flat_string(const FlatAst &ast, uint32_t index);
+const char *get_operator_symbol(AstType type);
+
+uint32_t FlatAst::add_node(AstType type, int value, uint32_t a, uint32_t b,
+                           uint32_t c)
+{
+    FlatNode node{nullptr, type, value, {a, b, c}, 1};
+    for (int i = 0; i < get_operand_count(type); ++i)
+    {
+        node.depth = max(node.depth, nodes[node.operands[i]].depth + 1);
+    }
+
+    bool binary = type > AstType::Subscript && type < AstType::TernaryIf;
+    const FlatNode *left = binary ? &nodes[a] : nullptr;
+    const FlatNode *right = binary ? &nodes[b] : nullptr;
+    if (right && right->type == AstType::Integer)
+    {
+        node.value = right->value;
+    }
+    node.eval = get_flat_eval(type, left, right);
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+int FlatAst::add_string(const string &s)
+{
+    strings.push_back(s);
+    return strings.size() - 1;
+}
+
+Value FlatAst::eval(int t) const
+{
+    if (get_depth() <= kMaxRecursionDepth)
+    {
+        return nodes.empty() ? Value() : eval_flat_node(*this, size() - 1, t);
+    }
+
+    // A type checked tree is an integer expression
+    bool defined = true;
+    int value = eval_int(t, defined);
+    return defined ? Value(value) : Value();
+}
+
+int FlatAst::eval_int(int t, bool &defined) const
+{
+    if (nodes.empty())
+    {
+        defined = false;
+        return 0;
+    }
+    if (get_depth() <= kMaxRecursionDepth)
+    {
+        return eval_flat_child(*this, size() - 1, t, defined);
+    }
+
+    vector<int> values(size());
+    unique_ptr<bool[]> defined_values(new bool[size()]);
+    defined = defined && eval_flat_nodes(*this, t, values.data(),
+                                         defined_values.get());
+    return values.back();
+}
+
+void FlatAst::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    vector<int> t(n);
+    for (int i = 0; i < n; ++i)
+    {
+        t[i] = static_cast<int>(static_cast<unsigned>(t0) + i);
+    }
+    eval_block(t.data(), n, out, defined);
+}
+
+void FlatAst::eval_block(const int *t, int n, int *out, bool *defined) const
+{
+    if (nodes.empty() || get_depth() <= kMaxRecursionDepth)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            bool d = true;
+            out[i] = eval_int(t[i], d);
+            if (defined)
+            {
+                defined[i] = d;
+            }
+        }
+        return;
+    }
+
+    // One scratch array for the whole block
+    vector<int> values(size());
+    unique_ptr<bool[]> defined_values(new bool[size()]);
+    for (int i = 0; i < n; ++i)
+    {
+        bool d = eval_flat_nodes(*this, t[i], values.data(),
+                                 defined_values.get());
+        out[i] = values.back();
+        if (defined)
+        {
+            defined[i] = d;
+        }
+    }
+}
+
+uint32_t FlatAst::get_depth() const
+{
+    return nodes.empty() ? 0 : nodes.back().depth;
+}
+
+AstPtr FlatAst::get_ast() const
+{
+    if (nodes.empty())
+    {
+        return AstPtr(new Undefined());
+    }
+
+    // Each node is the operand of exactly one later node, so its tree is
+    // moved out of the array when that node is built
+    vector<AstPtr> built(size());
+    for (size_t i = 0; i < size(); ++i)
+    {
+        const FlatNode &node = nodes[i];
+        const uint32_t *operands = node.operands;
+        switch (node.type)
+        {
+        case AstType::Undefined:
+            built[i] = AstPtr(new Undefined());
+            break;
+        case AstType::Identifier:
+            built[i] = AstPtr(new Identifier());
+            break;
+        case AstType::Integer:
+            built[i] = AstPtr(new Integer(node.value));
+            break;
+        case AstType::String:
+            built[i] = AstPtr(new String(strings[node.value]));
+            break;
+        case AstType::Negate:
+        case AstType::BitwiseComplement:
+        case AstType::Not:
+            built[i] = make_unary_node(node.type, move(built[operands[0]]));
+            break;
+        case AstType::TernaryIf:
+            built[i] = AstPtr(new TernaryIf(move(built[operands[0]]),
+                                            move(built[operands[1]]),
+                                            move(built[operands[2]])));
+            break;
+        default:
+            built[i] = make_binary_node(node.type, move(built[operands[0]]),
+                                        move(built[operands[1]]));
+            break;
+        }
+    }
+    return move(built.back());
+}
+
+FlatAst::operator string() const
+{
+    return nodes.empty() ? "UNDEFINED" : get_flat_string(*this, size() - 1);
+}
+
+template <typename Op> int apply_flat_binary(int a, int b, bool &defined)
+{
+    if (!Op::is_defined(a, b))
+    {
+        defined = false;
+        return 0;
+    }
+    return Op::apply(a, b);
+}
+
+/**
+ * Evaluate every node in array order, which visits operands before the
+ * nodes that use them, and return whether the root is defined. Both arms
+ * of a ternary are evaluated, but only the chosen arm's definedness is
+ * passed on, so the result matches the recursive evaluation.
+ */
+int eval_flat_nodes(const FlatAst &ast, int t, int *values, bool *defined)
+{
+    const vector<FlatNode> &nodes = ast.get_nodes();
+    const vector<string> &strings = ast.get_strings();
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        const FlatNode &node = nodes[i];
+        int a = values[node.operands[0]];
+        int b = values[node.operands[1]];
+        bool d = true;
+        for (int j = 0; j < get_operand_count(node.type) && j < 2; ++j)
+        {
+            d = d && defined[node.operands[j]];
+        }
+
+        int value = 0;
+        switch (node.type)
+        {
+        case AstType::Undefined:
+            d = false;
+            break;
+        case AstType::Identifier:
+            value = t;
+            break;
+        case AstType::Integer:
+        case AstType::String:
+            value = node.value;
+            break;
+        case AstType::Negate:
+            value = NegateOp::apply(a);
+            break;
+        case AstType::BitwiseComplement:
+            value = BitwiseComplementOp::apply(a);
+            break;
+        case AstType::Not:
+            value = NotOp::apply(a);
+            break;
+        case AstType::Subscript:
+        {
+            const string &s = strings[a];
+            d = d && b >= 0 && b < static_cast<int>(s.length());
+            value = d ? s[b] : 0;
+            break;
+        }
+        case AstType::TernaryIf:
+        {
+            uint32_t arm = node.operands[a ? 1 : 2];
+            d = defined[node.operands[0]] && defined[arm];
+            value = values[arm];
+            break;
+        }
+        case AstType::Add:
+            value = apply_flat_binary<AddOp>(a, b, d);
+            break;
+        case AstType::Subtract:
+            value = apply_flat_binary<SubtractOp>(a, b, d);
+            break;
+        case AstType::Multiply:
+            value = apply_flat_binary<MultiplyOp>(a, b, d);
+            break;
+        case AstType::Divide:
+            value = apply_flat_binary<DivideOp>(a, b, d);
+            break;
+        case AstType::Modulo:
+            value = apply_flat_binary<ModuloOp>(a, b, d);
+            break;
+        case AstType::BitwiseAnd:
+            value = apply_flat_binary<BitwiseAndOp>(a, b, d);
+            break;
+        case AstType::BitwiseOr:
+            value = apply_flat_binary<BitwiseOrOp>(a, b, d);
+            break;
+        case AstType::BitwiseXor:
+            value = apply_flat_binary<BitwiseXorOp>(a, b, d);
+            break;
+        case AstType::BitwiseShiftLeft:
+            value = apply_flat_binary<BitwiseShiftLeftOp>(a, b, d);
+            break;
+        case AstType::BitwiseShiftRight:
+            value = apply_flat_binary<BitwiseShiftRightOp>(a, b, d);
+            break;
+        case AstType::LessThan:
+            value = apply_flat_binary<LessThanOp>(a, b, d);
+            break;
+        case AstType::LessThanEqual:
+            value = apply_flat_binary<LessThanEqualOp>(a, b, d);
+            break;
+        case AstType::GreaterThan:
+            value = apply_flat_binary<GreaterThanOp>(a, b, d);
+            break;
+        case AstType::GreaterThanEqual:
+            value = apply_flat_binary<GreaterThanEqualOp>(a, b, d);
+            break;
+        case AstType::Equal:
+            value = apply_flat_binary<EqualOp>(a, b, d);
+            break;
+        case AstType::NotEqual:
+            value = apply_flat_binary<NotEqualOp>(a, b, d);
+            break;
+        }
+        values[i] = value;
+        defined[i] = d;
+    }
+    return defined[nodes.size() - 1];
+}
+
+/**
+ * Types are checked from the root down, as check_types does for an Ast, by
+ * visiting every node after the nodes that use it
+ */
+void check_flat_types(const FlatAst &ast)
+{
+    const vector<FlatNode> &nodes = ast.get_nodes();
+    vector<ValueType> expected(nodes.size(), ValueType::Integer);
+    for (size_t i = nodes.size(); i-- > 0;)
+    {
+        const FlatNode &node = nodes[i];
+        ValueType actual = ValueType::Integer;
+        switch (node.type)
+        {
+        case AstType::Undefined:
+            continue;
+        case AstType::String:
+            actual = ValueType::String;
+            break;
+        case AstType::TernaryIf:
+            expected[node.operands[1]] = expected[i];
+            expected[node.operands[2]] = expected[i];
+            continue;
+        case AstType::Subscript:
+            expected[node.operands[0]] = ValueType::String;
+            break;
+        default:
+            break;
+        }
+
+        if (actual != expected[i])
+        {
+            throw invalid_argument(
+                string("Type error: expected ") +
+                (expected[i] == ValueType::String ? "a string"
+                                                  : "an integer") +
+                " but found " + get_flat_string(ast, i));
+        }
+    }
+}
+
+Value eval_flat_node(const FlatAst &ast, uint32_t index, int t)
+{
+    const FlatNode &node = ast.get_nodes()[index];
+    const uint32_t *operands = node.operands;
+    switch (node.type)
+    {
+    case AstType::Undefined:
+        return Value();
+    case AstType::Identifier:
+        return t;
+    case AstType::Integer:
+        return node.value;
+    case AstType::String:
+        return ast.get_strings()[node.value];
+    case AstType::TernaryIf:
+    {
+        Value pred = eval_flat_node(ast, operands[0], t);
+        if (!pred.is_int())
+        {
+            return Value();
+        }
+        return eval_flat_node(ast, operands[pred.to_int() ? 1 : 2], t);
+    }
+    case AstType::Subscript:
+    {
+        Value base = eval_flat_node(ast, operands[0], t);
+        Value i = eval_flat_node(ast, operands[1], t);
+        if (!base.is_str() || !i.is_int() || i.to_int() < 0 ||
+            i.to_int() >= static_cast<int>(base.to_str().length()))
+        {
+            return Value();
+        }
+        return base.to_str()[i.to_int()];
+    }
+    default:
+        break;
+    }
+
+    // The operands of an integer operator are integers once type checked
+    bool defined = true;
+    int value = eval_flat_child(ast, index, t, defined);
+    return defined ? Value(value) : Value();
+}
+
+int eval_flat_undefined(const FlatAst &ast, const FlatNode &node, int t,
+                        bool &defined)
+{
+    defined = false;
+    return 0;
+}
+
+int eval_flat_identifier(const FlatAst &ast, const FlatNode &node, int t,
+                         bool &defined)
+{
+    return t;
+}
+
+/** Integers evaluate to their value and strings to their table index */
+int eval_flat_value(const FlatAst &ast, const FlatNode &node, int t,
+                    bool &defined)
+{
+    return node.value;
+}
+
+int eval_flat_ternary(const FlatAst &ast, const FlatNode &node, int t,
+                      bool &defined)
+{
+    int pred = eval_flat_child(ast, node.operands[0], t, defined);
+    return eval_flat_child(ast, node.operands[pred ? 1 : 2], t, defined);
+}
+
+int eval_flat_subscript(const FlatAst &ast, const FlatNode &node, int t,
+                        bool &defined)
+{
+    int base = eval_flat_child(ast, node.operands[0], t, defined);
+    int i = eval_flat_child(ast, node.operands[1], t, defined);
+    const string &s = ast.get_strings()[base];
+    if (i < 0 || i >= static_cast<int>(s.length()))
+    {
+        defined = false;
+        return 0;
+    }
+    return s[i];
+}
+
+template <typename Op>
+int eval_flat_unary(const FlatAst &ast, const FlatNode &node, int t,
+                    bool &defined)
+{
+    return Op::apply(eval_flat_child(ast, node.operands[0], t, defined));
+}
+
+template <typename Op>
+int eval_flat_binary(const FlatAst &ast, const FlatNode &node, int t,
+                     bool &defined)
+{
+    int a = eval_flat_child(ast, node.operands[0], t, defined);
+    int b = eval_flat_child(ast, node.operands[1], t, defined);
+    if (!Op::is_defined(a, b))
+    {
+        defined = false;
+        return 0;
+    }
+    return Op::apply(a, b);
+}
+
+/** `expr op CONST`, with the constant copied into the node's value */
+template <typename Op>
+int eval_flat_constant(const FlatAst &ast, const FlatNode &node, int t,
+                       bool &defined)
+{
+    int a = eval_flat_child(ast, node.operands[0], t, defined);
+    if (!Op::is_defined(a, node.value))
+    {
+        defined = false;
+        return 0;
+    }
+    return Op::apply(a, node.value);
+}
+
+/** `t op CONST`, evaluated without visiting either operand */
+template <typename Op>
+int eval_flat_identifier_constant(const FlatAst &ast, const FlatNode &node,
+                                  int t, bool &defined)
+{
+    if (!Op::is_defined(t, node.value))
+    {
+        defined = false;
+        return 0;
+    }
+    return Op::apply(t, node.value);
+}
+
+/** Choose the evaluation function for a binary operator, as make_binary does */
+template <typename Op>
+FlatEval get_flat_binary_eval(const FlatNode &left, const FlatNode &right)
+{
+    if (right.type != AstType::Integer)
+    {
+        return eval_flat_binary<Op>;
+    }
+    if (left.type == AstType::Identifier)
+    {
+        return eval_flat_identifier_constant<Op>;
+    }
+    return eval_flat_constant<Op>;
+}
+
+/**
+ * Choose the evaluation function for a node. Left and right are the
+ * operands of a binary operator, and null for other nodes.
+ */
+FlatEval get_flat_eval(AstType type, const FlatNode *left,
+                       const FlatNode *right)
+{
+    switch (type)
+    {
+    case AstType::Identifier:
+        return eval_flat_identifier;
+    case AstType::Integer:
+    case AstType::String:
+        return eval_flat_value;
+    case AstType::Negate:
+        return eval_flat_unary<NegateOp>;
+    case AstType::BitwiseComplement:
+        return eval_flat_unary<BitwiseComplementOp>;
+    case AstType::Not:
+        return eval_flat_unary<NotOp>;
+    case AstType::Subscript:
+        return eval_flat_subscript;
+    case AstType::Add:
+        return get_flat_binary_eval<AddOp>(*left, *right);
+    case AstType::Subtract:
+        return get_flat_binary_eval<SubtractOp>(*left, *right);
+    case AstType::Multiply:
+        return get_flat_binary_eval<MultiplyOp>(*left, *right);
+    case AstType::Divide:
+        return get_flat_binary_eval<DivideOp>(*left, *right);
+    case AstType::Modulo:
+        return get_flat_binary_eval<ModuloOp>(*left, *right);
+    case AstType::BitwiseAnd:
+        return get_flat_binary_eval<BitwiseAndOp>(*left, *right);
+    case AstType::BitwiseOr:
+        return get_flat_binary_eval<BitwiseOrOp>(*left, *right);
+    case AstType::BitwiseXor:
+        return get_flat_binary_eval<BitwiseXorOp>(*left, *right);
+    case AstType::BitwiseShiftLeft:
+        return get_flat_binary_eval<BitwiseShiftLeftOp>(*left, *right);
+    case AstType::BitwiseShiftRight:
+        return get_flat_binary_eval<BitwiseShiftRightOp>(*left, *right);
+    case AstType::LessThan:
+        return get_flat_binary_eval<LessThanOp>(*left, *right);
+    case AstType::LessThanEqual:
+        return get_flat_binary_eval<LessThanEqualOp>(*left, *right);
+    case AstType::GreaterThan:
+        return get_flat_binary_eval<GreaterThanOp>(*left, *right);
+    case AstType::GreaterThanEqual:
+        return get_flat_binary_eval<GreaterThanEqualOp>(*left, *right);
+    case AstType::Equal:
+        return get_flat_binary_eval<EqualOp>(*left, *right);
+    case AstType::NotEqual:
+        return get_flat_binary_eval<NotEqualOp>(*left, *right);
+    case AstType::TernaryIf:
+        return eval_flat_ternary;
+    default:
+        return eval_flat_undefined;
+    }
+}
+
+/** Print a subtree from an explicit stack, as Ast::operator string does */
+string get_flat_string(const FlatAst &ast, uint32_t index)
+{
+    struct Item
+    {
+        const FlatNode *node;
+        const char *text;
+    };
+
+    const vector<FlatNode> &nodes = ast.get_nodes();
+    string out;
+    vector<Item> stack{{&nodes[index], nullptr}};
+    while (!stack.empty())
+    {
+        Item item = stack.back();
+        stack.pop_back();
+        if (!item.node)
+        {
+            out += item.text;
+            continue;
+        }
+
+        const FlatNode &node = *item.node;
+        const uint32_t *operands = node.operands;
+        switch (node.type)
+        {
+        case AstType::Undefined:
+            out += "UNDEFINED";
+            break;
+        case AstType::Identifier:
+            out += "t";
+            break;
+        case AstType::Integer:
+            out += to_string(node.value);
+            break;
+        case AstType::String:
+            out += "\"";
+            out += ast.get_strings()[node.value];
+            out += "\"";
+            break;
+        case AstType::Negate:
+        case AstType::BitwiseComplement:
+        case AstType::Not:
+            out += "(";
+            out += get_operator_symbol(node.type);
+            stack.push_back({nullptr, ")"});
+            stack.push_back({&nodes[operands[0]], nullptr});
+            break;
+        case AstType::TernaryIf:
+            out += "(";
+            stack.push_back({nullptr, ")"});
+            stack.push_back({&nodes[operands[2]], nullptr});
+            stack.push_back({nullptr, ":"});
+            stack.push_back({&nodes[operands[1]], nullptr});
+            stack.push_back({nullptr, "?"});
+            stack.push_back({&nodes[operands[0]], nullptr});
+            break;
+        default:
+        {
+            bool subscript = node.type == AstType::Subscript;
+            out += "(";
+            stack.push_back({nullptr, subscript ? "])" : ")"});
+            stack.push_back({&nodes[operands[1]], nullptr});
+            stack.push_back(
+                {nullptr, subscript ? "[" : get_operator_symbol(node.type)});
+            stack.push_back({&nodes[operands[0]], nullptr});
+            break;
+        }
+        }
+    }
+    return out;
+}
+
+int get_operand_count(AstType type)
+{
+    switch (type)
+    {
+    case AstType::Undefined:
+    case AstType::Identifier:
+    case AstType::Integer:
+    case AstType::String:
+        return 0;
+    case AstType::Negate:
+    case AstType::BitwiseComplement:
+    case AstType::Not:
+        return 1;
+    case AstType::TernaryIf:
+        return 3;
+    default:
+        return 2;
+    }
+}
+
+const char *get_operator_symbol(AstType type)
+{
+    switch (type)
+    {
+    case AstType::Negate:
+        return NegateOp::symbol();
+    case AstType::BitwiseComplement:
+        return BitwiseComplementOp::symbol();
+    case AstType::Not:
+        return NotOp::symbol();
+    case AstType::Add:
+        return AddOp::symbol();
+    case AstType::Subtract:
+        return SubtractOp::symbol();
+    case AstType::Multiply:
+        return MultiplyOp::symbol();
+    case AstType::Divide:
+        return DivideOp::symbol();
+    case AstType::Modulo:
+        return ModuloOp::symbol();
+    case AstType::BitwiseAnd:
+        return BitwiseAndOp::symbol();
+    case AstType::BitwiseOr:
+        return BitwiseOrOp::symbol();
+    case AstType::BitwiseXor:
+        return BitwiseXorOp::symbol();
+    case AstType::BitwiseShiftLeft:
+        return BitwiseShiftLeftOp::symbol();
+    case AstType::BitwiseShiftRight:
+        return BitwiseShiftRightOp::symbol();
+    case AstType::LessThan:
+        return LessThanOp::symbol();
+    case AstType::LessThanEqual:
+        return LessThanEqualOp::symbol();
+    case AstType::GreaterThan:
+        return GreaterThanOp::symbol();
+    case AstType::GreaterThanEqual:
+        return GreaterThanEqualOp::symbol();
+    case AstType::Equal:
+        return EqualOp::symbol();
+    case AstType::NotEqual:
+        return NotEqualOp::symbol();
+    default:
+        return "";
+    }
+}
+
+} // namespace bb
@@ -0,0 +1,397 @@
+#include "image.hpp"
+#include "flat.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "period.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * Node types are stored as their AstType, so reordering AstType changes the
+ * layout and needs a new kImageVersion
+ */
+static_assert(static_cast<int>(AstType::TernaryIf) == 24,
+              "AstType values are part of the program image layout");
+
+void put_u32(vector<uint8_t> &out, uint32_t value);
+void put_u64(vector<uint8_t> &out, uint64_t value);
+void pad_image(vector<uint8_t> &out);
+uint32_t get_u32(const uint8_t *p);
+uint64_t get_u64(const uint8_t *p);
+uint64_t round_up_8(uint64_t bytes);
+
+/**
+ * The header is followed by the nodes, the offset and length of each
+ * string, the characters of the strings, the samples of the period and a
+ * bit per sample for whether it is defined, in 64-bit words. The words are
+ * left out when every sample is defined. Sections after the nodes are
+ * padded to a multiple of 8 bytes.
+ *
+ *   0  magic         8 bytes
+ *   8  version       u32
+ *  12  nodes         u32
+ *  16  strings       u32
+ *  20  string bytes  u32
+ *  24  period        u32
+ *  28  defined words u32
+ *  32  image bytes   u64
+ */
+vector<uint8_t> write_image(const Ast &ast, size_t period_bytes)
+{
+    struct Item
+    {
+        const Ast *node;
+        bool visited;
+    };
+
+    // Nodes follow their operands, as they would be evaluated on a stack
+    vector<const Ast *> nodes;
+    vector<Item> stack{{&ast, false}};
+    while (!stack.empty())
+    {
+        Item item = stack.back();
+        stack.pop_back();
+        const Ast &node = *item.node;
+        AstType type = node.type();
+        if (item.visited || !get_operand_count(type))
+        {
+            nodes.push_back(item.node);
+            continue;
+        }
+
+        stack.push_back({item.node, true});
+        if (type == AstType::TernaryIf)
+        {
+            auto &ternary = static_cast<const TernaryIf &>(node);
+            stack.push_back({&ternary.get_fail(), false});
+            stack.push_back({&ternary.get_pass(), false});
+            stack.push_back({&ternary.get_pred(), false});
+        }
+        else if (get_operand_count(type) == 1)
+        {
+            auto &unary = static_cast<const UnaryOperator &>(node);
+            stack.push_back({&unary.get_inner(), false});
+        }
+        else
+        {
+            auto &binary = static_cast<const BinaryOperator &>(node);
+            stack.push_back({&binary.get_right(), false});
+            stack.push_back({&binary.get_left(), false});
+        }
+    }
+
+    vector<string> strings;
+    vector<int> values;
+    for (const Ast *node : nodes)
+    {
+        int value = 0;
+        if (node->type() == AstType::Integer)
+        {
+            value = static_cast<const Integer &>(*node).get_value();
+        }
+        else if (node->type() == AstType::String)
+        {
+            const string &s = static_cast<const String &>(*node).get_value();
+            auto it = find(strings.begin(), strings.end(), s);
+            value = it - strings.begin();
+            if (it == strings.end())
+            {
+                strings.push_back(s);
+            }
+        }
+        values.push_back(value);
+    }
+
+    unique_ptr<PeriodicProgram> periodic;
+    if (period_bytes)
+    {
+        periodic.reset(new PeriodicProgram(ast, period_bytes));
+        if (!periodic->is_periodic())
+        {
+            periodic.reset();
+        }
+    }
+
+    uint32_t string_bytes = 0;
+    for (const string &s : strings)
+    {
+        string_bytes += s.size();
+    }
+    uint32_t period = periodic ? periodic->get_period() : 0;
+    uint32_t defined_words =
+        periodic ? periodic->get_defined_words().size() : 0;
+
+    vector<uint8_t> out(kImageMagic, kImageMagic + sizeof(kImageMagic));
+    put_u32(out, kImageVersion);
+    put_u32(out, nodes.size());
+    put_u32(out, strings.size());
+    put_u32(out, string_bytes);
+    put_u32(out, period);
+    put_u32(out, defined_words);
+    put_u64(out, 0);
+
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        put_u32(out, static_cast<uint32_t>(nodes[i]->type()));
+        put_u32(out, static_cast<uint32_t>(values[i]));
+    }
+
+    uint32_t offset = 0;
+    for (const string &s : strings)
+    {
+        put_u32(out, offset);
+        put_u32(out, s.size());
+        offset += s.size();
+    }
+    for (const string &s : strings)
+    {
+        out.insert(out.end(), s.begin(), s.end());
+    }
+    pad_image(out);
+
+    if (periodic)
+    {
+        const vector<uint8_t> &samples = periodic->get_samples();
+        out.insert(out.end(), samples.begin(), samples.end());
+        pad_image(out);
+        for (uint64_t word : periodic->get_defined_words())
+        {
+            put_u64(out, word);
+        }
+    }
+
+    uint64_t size = out.size();
+    for (int i = 0; i < 8; ++i)
+    {
+        out[32 + i] = size >> (8 * i);
+    }
+    return out;
+}
+
+ProgramImage::ProgramImage(const uint8_t *data, size_t size) : data(data)
+{
+    if (size < kImageHeaderBytes ||
+        memcmp(data, kImageMagic, sizeof(kImageMagic)) != 0)
+    {
+        throw invalid_argument("Not a program image");
+    }
+    uint32_t version = get_u32(data + 8);
+    if (version != kImageVersion)
+    {
+        throw invalid_argument("Unsupported program image version " +
+                               to_string(version));
+    }
+    node_count = get_u32(data + 12);
+    string_count = get_u32(data + 16);
+    uint32_t string_bytes = get_u32(data + 20);
+    period = get_u32(data + 24);
+    defined_words = get_u32(data + 28);
+
+    // Counts are at most 32 bits, so none of these overflow 64 bits, and
+    // once they are checked against the size none overflow a size_t
+    uint64_t offsets[5];
+    offsets[0] = kImageHeaderBytes + uint64_t(node_count) * kImageNodeBytes;
+    offsets[1] = offsets[0] + uint64_t(string_count) * kImageStringBytes;
+    offsets[2] = offsets[1] + round_up_8(string_bytes);
+    offsets[3] = offsets[2] + round_up_8(period);
+    offsets[4] = offsets[3] + uint64_t(defined_words) * 8;
+    if (get_u64(data + 32) != offsets[4] || size != offsets[4])
+    {
+        throw invalid_argument("Program image is truncated or corrupt");
+    }
+    strings_offset = offsets[0];
+    string_bytes_offset = offsets[1];
+    samples_offset = offsets[2];
+    defined_offset = offsets[3];
+
+    if (period && (period > uint32_t(1) << 31 || (period & (period - 1))))
+    {
+        throw invalid_argument("Program image period is not a power of two");
+    }
+    if (defined_words && defined_words != (uint64_t(period) + 63) / 64)
+    {
+        throw invalid_argument("Program image has the wrong defined bits");
+    }
+
+    for (uint32_t i = 0; i < string_count; ++i)
+    {
+        const uint8_t *entry = data + strings_offset + i * kImageStringBytes;
+        if (uint64_t(get_u32(entry)) + get_u32(entry + 4) > string_bytes)
+        {
+            throw invalid_argument("Program image string is out of range");
+        }
+    }
+
+    // Replay the stack the nodes would be evaluated on, so that building
+    // the tree cannot run out of operands
+    uint64_t depth = 0;
+    for (uint32_t i = 0; i < node_count; ++i)
+    {
+        const uint8_t *node = data + kImageHeaderBytes + i * kImageNodeBytes;
+        uint32_t type = get_u32(node);
+        uint32_t value = get_u32(node + 4);
+        if (type > static_cast<uint32_t>(AstType::TernaryIf))
+        {
+            throw invalid_argument("Program image node has an unknown type");
+        }
+        AstType ast_type = static_cast<AstType>(type);
+        if (ast_type == AstType::String && value >= string_count)
+        {
+            throw invalid_argument("Program image string is out of range");
+        }
+        if (ast_type != AstType::String && ast_type != AstType::Integer &&
+            value != 0)
+        {
+            throw invalid_argument("Program image node has a value");
+        }
+        int operands = get_operand_count(ast_type);
+        if (depth < static_cast<uint64_t>(operands))
+        {
+            throw invalid_argument("Program image node is missing operands");
+        }
+        depth = depth - operands + 1;
+    }
+    if (depth != 1)
+    {
+        throw invalid_argument("Program image must hold one expression");
+    }
+}
+
+AstPtr ProgramImage::get_ast() const
+{
+    // The depth of each tree on the stack, since the passes over the tree
+    // recurse and a crafted image could nest it arbitrarily deep
+    vector<AstPtr> stack;
+    vector<uint32_t> depths;
+    for (uint32_t i = 0; i < node_count; ++i)
+    {
+        const uint8_t *node = data + kImageHeaderBytes + i * kImageNodeBytes;
+        AstType type = static_cast<AstType>(get_u32(node));
+        uint32_t value = get_u32(node + 4);
+        int operands = get_operand_count(type);
+        uint32_t depth = 0;
+        for (int j = 0; j < operands; ++j)
+        {
+            depth = max(depth, depths.back());
+            depths.pop_back();
+        }
+        if (depth >= kMaxRecursionDepth)
+        {
+            throw invalid_argument("Program image is nested too deeply");
+        }
+        depths.push_back(depth + 1);
+        switch (type)
+        {
+        case AstType::Undefined:
+            stack.push_back(AstPtr(new Undefined()));
+            break;
+        case AstType::Identifier:
+            stack.push_back(AstPtr(new Identifier()));
+            break;
+        case AstType::Integer:
+            stack.push_back(AstPtr(new Integer(static_cast<int>(value))));
+            break;
+        case AstType::String:
+        {
+            const uint8_t *entry =
+                data + strings_offset + value * kImageStringBytes;
+            const char *chars = reinterpret_cast<const char *>(
+                data + string_bytes_offset + get_u32(entry));
+            stack.push_back(
+                AstPtr(new String(string(chars, get_u32(entry + 4)))));
+            break;
+        }
+        case AstType::Negate:
+        case AstType::BitwiseComplement:
+        case AstType::Not:
+            stack.back() = make_unary_node(type, move(stack.back()));
+            break;
+        case AstType::TernaryIf:
+        {
+            AstPtr fail = move(stack.back());
+            stack.pop_back();
+            AstPtr pass = move(stack.back());
+            stack.pop_back();
+            stack.back() = AstPtr(
+                new TernaryIf(move(stack.back()), move(pass), move(fail)));
+            break;
+        }
+        default:
+        {
+            // The node class, including whether a division is checked, is
+            // chosen again from the operands rather than trusted
+            AstPtr right = move(stack.back());
+            stack.pop_back();
+            stack.back() =
+                make_binary_node(type, move(stack.back()), move(right));
+            break;
+        }
+        }
+    }
+
+    AstPtr ast = move(stack.back());
+    check_types(*ast);
+    return ast;
+}
+
+unique_ptr<TieredProgram> ProgramImage::load() const
+{
+    AstPtr ast = get_ast();
+    if (!period)
+    {
+        return unique_ptr<TieredProgram>(new TieredProgram(move(ast)));
+    }
+
+    vector<uint8_t> samples(data + samples_offset,
+                            data + samples_offset + period);
+    vector<uint64_t> defined(defined_words);
+    for (uint32_t i = 0; i < defined_words; ++i)
+    {
+        defined[i] = get_u64(data + defined_offset + i * 8);
+    }
+    unique_ptr<PeriodicProgram> periodic(
+        new PeriodicProgram(*ast, move(samples), move(defined)));
+    return unique_ptr<TieredProgram>(
+        new TieredProgram(move(ast), move(periodic)));
+}
+
+void put_u32(vector<uint8_t> &out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        out.push_back(value >> (8 * i));
+    }
+}
+
+void put_u64(vector<uint8_t> &out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        out.push_back(value >> (8 * i));
+    }
+}
+
+void pad_image(vector<uint8_t> &out) { out.resize(round_up_8(out.size())); }
+
+uint32_t get_u32(const uint8_t *p)
+{
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 |
+           uint32_t(p[3]) << 24;
+}
+
+uint64_t get_u64(const uint8_t *p)
+{
+    return uint64_t(get_u32(p)) | uint64_t(get_u32(p + 4)) << 32;
+}
+
+uint64_t round_up_8(uint64_t bytes) { return (bytes + 7) & ~uint64_t(7); }
+
+} // namespace bb
@@ -0,0 +1,539 @@
+#include "jit.hpp"
+
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define BB_JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace bb
+{
+
+#if defined(BB_JIT_X86_64)
+
+/** Undefined results set bit 32 of the value returned by the kernel */
+const uint64_t kUndefinedBit = uint64_t(1) << 32;
+
+/**
+ * A minimal x86-64 assembler. Instructions are emitted as raw bytes and
+ * jumps are emitted with 32-bit displacements that are patched once the
+ * target offsets are known.
+ */
+class Assembler
+{
+public:
+    void emit(initializer_list<uint8_t> bs)
+    {
+        bytes.insert(bytes.end(), bs.begin(), bs.end());
+    }
+
+    void emit32(uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            bytes.push_back(value >> (8 * i));
+        }
+    }
+
+    /** Emit a 32-bit displacement to be patched later and return its offset */
+    size_t emit_fixup()
+    {
+        size_t at = bytes.size();
+        emit32(0);
+        return at;
+    }
+
+    /** Point the displacement at the given offset to target */
+    void patch(size_t at, size_t target)
+    {
+        uint32_t rel = target - (at + 4);
+        memcpy(&bytes[at], &rel, 4);
+    }
+
+    size_t size() const { return bytes.size(); }
+    const vector<uint8_t> &get_bytes() const { return bytes; }
+
+private:
+    vector<uint8_t> bytes;
+};
+
+struct Fixup
+{
+    size_t at;
+    size_t target;
+};
+
+/** The setcc opcode byte for each comparison */
+uint8_t get_setcc(OpCode op)
+{
+    switch (op)
+    {
+    case OpCode::LessThan:
+    case OpCode::LessThanConstant:
+        return 0x9C;
+    case OpCode::LessThanEqual:
+    case OpCode::LessThanEqualConstant:
+        return 0x9E;
+    case OpCode::GreaterThan:
+    case OpCode::GreaterThanConstant:
+        return 0x9F;
+    case OpCode::GreaterThanEqual:
+    case OpCode::GreaterThanEqualConstant:
+        return 0x9D;
+    case OpCode::Equal:
+    case OpCode::EqualConstant:
+        return 0x94;
+    default:
+        return 0x95;
+    }
+}
+
+/**
+ * Divide eax by ecx. A zero divisor jumps to the Undefined exit, and a
+ * divisor of -1 is handled without idiv, which traps on INT_MIN / -1.
+ */
+void emit_divide(Assembler &as, vector<size_t> &undefined, bool modulo)
+{
+    as.emit({0x85, 0xC9}); // test ecx, ecx
+    as.emit({0x0F, 0x84}); // jz undefined
+    undefined.push_back(as.emit_fixup());
+    as.emit({0x83, 0xF9, 0xFF}); // cmp ecx, -1
+    as.emit({0x75, 0x04});       // jne divide
+    if (modulo)
+    {
+        as.emit({0x31, 0xC0}); // xor eax, eax
+    }
+    else
+    {
+        as.emit({0xF7, 0xD8}); // neg eax
+    }
+    as.emit({0xEB, static_cast<uint8_t>(modulo ? 0x05 : 0x03)}); // jmp end
+    as.emit({0x99});       // divide: cdq
+    as.emit({0xF7, 0xF9}); // idiv ecx
+    if (modulo)
+    {
+        as.emit({0x89, 0xD0}); // mov eax, edx
+    }
+}
+
+/**
+ * Emit the kernel, which evaluates the program for the t in edi. The
+ * result is returned in rax, with kUndefinedBit set for Undefined results.
+ * References to the string table are returned through string_fixups.
+ */
+void emit_kernel(Assembler &as, const Program &program,
+                 vector<Fixup> &string_fixups)
+{
+    const vector<Instruction> &code = program.get_code();
+    vector<size_t> offsets(code.size());
+    vector<Fixup> jumps;
+    vector<size_t> undefined;
+
+    as.emit({0x55});             // push rbp
+    as.emit({0x48, 0x89, 0xE5}); // mov rbp, rsp
+
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const Instruction &ins = code[i];
+        offsets[i] = as.size();
+
+        switch (ins.op)
+        {
+        case OpCode::Identifier:
+            as.emit({0x50});       // push rax
+            as.emit({0x89, 0xF8}); // mov eax, edi
+            break;
+        case OpCode::Integer:
+            as.emit({0x50, 0xB8}); // push rax; mov eax, imm32
+            as.emit32(ins.arg);
+            break;
+        case OpCode::String:
+            as.emit({0x50});             // push rax
+            as.emit({0x48, 0x8D, 0x05}); // lea rax, [rip + string]
+            string_fixups.push_back(Fixup{as.emit_fixup(),
+                                          static_cast<size_t>(ins.arg)});
+            break;
+        case OpCode::Undefined:
+            as.emit({0xE9}); // jmp undefined
+            undefined.push_back(as.emit_fixup());
+            break;
+        case OpCode::Negate:
+            as.emit({0xF7, 0xD8}); // neg eax
+            break;
+        case OpCode::BitwiseComplement:
+            as.emit({0xF7, 0xD0}); // not eax
+            break;
+        case OpCode::Not:
+            as.emit({0x85, 0xC0});       // test eax, eax
+            as.emit({0x0F, 0x94, 0xC0}); // sete al
+            as.emit({0x0F, 0xB6, 0xC0}); // movzx eax, al
+            break;
+        case OpCode::Subscript:
+            // Strings are laid out as a 32-bit length followed by the bytes.
+            // The unsigned comparison also rejects negative indices.
+            as.emit({0x89, 0xC1, 0x58}); // mov ecx, eax; pop rax
+            as.emit({0x3B, 0x08});       // cmp ecx, [rax]
+            as.emit({0x0F, 0x83});       // jae undefined
+            undefined.push_back(as.emit_fixup());
+            as.emit({0x0F, 0xBE, 0x44, 0x08, 0x04}); // movsx eax, [rax+rcx+4]
+            break;
+        case OpCode::SubscriptUnchecked:
+            as.emit({0x89, 0xC1, 0x58});             // mov ecx, eax; pop rax
+            as.emit({0x0F, 0xBE, 0x44, 0x08, 0x04}); // movsx eax, [rax+rcx+4]
+            break;
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Multiply:
+        case OpCode::Divide:
+        case OpCode::Modulo:
+        case OpCode::DivideUnchecked:
+        case OpCode::ModuloUnchecked:
+        case OpCode::BitwiseAnd:
+        case OpCode::BitwiseOr:
+        case OpCode::BitwiseXor:
+        case OpCode::BitwiseShiftLeft:
+        case OpCode::BitwiseShiftRight:
+        case OpCode::LessThan:
+        case OpCode::LessThanEqual:
+        case OpCode::GreaterThan:
+        case OpCode::GreaterThanEqual:
+        case OpCode::Equal:
+        case OpCode::NotEqual:
+            // Right operand to ecx, left operand back to eax
+            as.emit({0x89, 0xC1, 0x58}); // mov ecx, eax; pop rax
+            switch (ins.op)
+            {
+            case OpCode::Add:
+                as.emit({0x01, 0xC8}); // add eax, ecx
+                break;
+            case OpCode::Subtract:
+                as.emit({0x29, 0xC8}); // sub eax, ecx
+                break;
+            case OpCode::Multiply:
+                as.emit({0x0F, 0xAF, 0xC1}); // imul eax, ecx
+                break;
+            case OpCode::Divide:
+                emit_divide(as, undefined, false);
+                break;
+            case OpCode::Modulo:
+                emit_divide(as, undefined, true);
+                break;
+            case OpCode::DivideUnchecked:
+                as.emit({0x99, 0xF7, 0xF9}); // cdq; idiv ecx
+                break;
+            case OpCode::ModuloUnchecked:
+                as.emit({0x99, 0xF7, 0xF9}); // cdq; idiv ecx
+                as.emit({0x89, 0xD0});       // mov eax, edx
+                break;
+            case OpCode::BitwiseAnd:
+                as.emit({0x21, 0xC8}); // and eax, ecx
+                break;
+            case OpCode::BitwiseOr:
+                as.emit({0x09, 0xC8}); // or eax, ecx
+                break;
+            case OpCode::BitwiseXor:
+                as.emit({0x31, 0xC8}); // xor eax, ecx
+                break;
+            case OpCode::BitwiseShiftLeft:
+                as.emit({0xD3, 0xE0}); // shl eax, cl
+                break;
+            case OpCode::BitwiseShiftRight:
+                as.emit({0xD3, 0xF8}); // sar eax, cl
+                break;
+            default:
+                as.emit({0x39, 0xC8});                    // cmp eax, ecx
+                as.emit({0x0F, get_setcc(ins.op), 0xC0}); // setcc al
+                as.emit({0x0F, 0xB6, 0xC0});              // movzx eax, al
+                break;
+            }
+            break;
+        case OpCode::AddConstant:
+            as.emit({0x05}); // add eax, imm32
+            as.emit32(ins.arg);
+            break;
+        case OpCode::SubtractConstant:
+            as.emit({0x2D}); // sub eax, imm32
+            as.emit32(ins.arg);
+            break;
+        case OpCode::MultiplyConstant:
+            as.emit({0x69, 0xC0}); // imul eax, eax, imm32
+            as.emit32(ins.arg);
+            break;
+        case OpCode::DivideConstant:
+        case OpCode::ModuloConstant:
+        {
+            bool modulo = ins.op == OpCode::ModuloConstant;
+            if (ins.arg == -1)
+            {
+                if (modulo)
+                {
+                    as.emit({0x31, 0xC0}); // xor eax, eax
+                }
+                else
+                {
+                    as.emit({0xF7, 0xD8}); // neg eax
+                }
+                break;
+            }
+            as.emit({0xB9}); // mov ecx, imm32
+            as.emit32(ins.arg);
+            as.emit({0x99, 0xF7, 0xF9}); // cdq; idiv ecx
+            if (modulo)
+            {
+                as.emit({0x89, 0xD0}); // mov eax, edx
+            }
+            break;
+        }
+        case OpCode::BitwiseAndConstant:
+            as.emit({0x25}); // and eax, imm32
+            as.emit32(ins.arg);
+            break;
+        case OpCode::BitwiseOrConstant:
+            as.emit({0x0D}); // or eax, imm32
+            as.emit32(ins.arg);
+            break;
+        case OpCode::BitwiseXorConstant:
+            as.emit({0x35}); // xor eax, imm32
+            as.emit32(ins.arg);
+            break;
+        case OpCode::BitwiseShiftLeftConstant:
+            as.emit({0xC1, 0xE0, static_cast<uint8_t>(ins.arg)}); // shl
+            break;
+        case OpCode::BitwiseShiftRightConstant:
+            as.emit({0xC1, 0xF8, static_cast<uint8_t>(ins.arg)}); // sar
+            break;
+        case OpCode::LessThanConstant:
+        case OpCode::LessThanEqualConstant:
+        case OpCode::GreaterThanConstant:
+        case OpCode::GreaterThanEqualConstant:
+        case OpCode::EqualConstant:
+        case OpCode::NotEqualConstant:
+            as.emit({0x3D}); // cmp eax, imm32
+            as.emit32(ins.arg);
+            as.emit({0x0F, get_setcc(ins.op), 0xC0}); // setcc al
+            as.emit({0x0F, 0xB6, 0xC0});              // movzx eax, al
+            break;
+        case OpCode::JumpIfZero:
+            as.emit({0x89, 0xC1, 0x58}); // mov ecx, eax; pop rax
+            as.emit({0x85, 0xC9});       // test ecx, ecx
+            as.emit({0x0F, 0x84});       // jz target
+            jumps.push_back(
+                Fixup{as.emit_fixup(), static_cast<size_t>(ins.arg)});
+            break;
+        case OpCode::Jump:
+            as.emit({0xE9}); // jmp target
+            jumps.push_back(
+                Fixup{as.emit_fixup(), static_cast<size_t>(ins.arg)});
+            break;
+        case OpCode::Return:
+        case OpCode::Select:
+            as.emit({0x48, 0x89, 0xEC}); // mov rsp, rbp
+            as.emit({0x5D, 0xC3});       // pop rbp; ret
+            break;
+        }
+    }
+
+    size_t undefined_exit = as.size();
+    as.emit({0x48, 0x89, 0xEC}); // mov rsp, rbp
+    as.emit({0x5D});             // pop rbp
+    as.emit({0x48, 0xB8});       // movabs rax, kUndefinedBit
+    as.emit32(static_cast<uint32_t>(kUndefinedBit));
+    as.emit32(static_cast<uint32_t>(kUndefinedBit >> 32));
+    as.emit({0xC3}); // ret
+
+    for (const Fixup &jump : jumps)
+    {
+        as.patch(jump.at, offsets[jump.target]);
+    }
+    for (size_t at : undefined)
+    {
+        as.patch(at, undefined_exit);
+    }
+}
+
+/**
+ * Emit a loop that calls the kernel at offset 0 once per sample. The array
+ * variant reads t from memory, otherwise t counts up from the first
+ * argument. A null defined pointer is skipped.
+ */
+void emit_block(Assembler &as, bool array)
+{
+    as.emit({0x53});       // push rbx
+    as.emit({0x41, 0x54}); // push r12
+    as.emit({0x41, 0x55}); // push r13
+    as.emit({0x41, 0x56}); // push r14
+    if (array)
+    {
+        as.emit({0x48, 0x89, 0xFB}); // mov rbx, rdi
+    }
+    else
+    {
+        as.emit({0x89, 0xFB}); // mov ebx, edi
+    }
+    as.emit({0x41, 0x89, 0xF4}); // mov r12d, esi
+    as.emit({0x49, 0x89, 0xD5}); // mov r13, rdx
+    as.emit({0x49, 0x89, 0xCE}); // mov r14, rcx
+    as.emit({0x45, 0x85, 0xE4}); // test r12d, r12d
+    as.emit({0x0F, 0x8E});       // jle done
+    size_t done = as.emit_fixup();
+
+    size_t loop = as.size();
+    if (array)
+    {
+        as.emit({0x8B, 0x3B}); // mov edi, [rbx]
+    }
+    else
+    {
+        as.emit({0x89, 0xDF}); // mov edi, ebx
+    }
+    as.emit({0xE8}); // call kernel
+    as.patch(as.emit_fixup(), 0);
+    as.emit({0x48, 0x89, 0xC2});       // mov rdx, rax
+    as.emit({0x48, 0xC1, 0xEA, 0x20}); // shr rdx, 32
+    as.emit({0x83, 0xF2, 0x01});       // xor edx, 1
+    as.emit({0x4D, 0x85, 0xF6});       // test r14, r14
+    as.emit({0x74, 0x06});             // jz skip
+    as.emit({0x41, 0x88, 0x16});       // mov [r14], dl
+    as.emit({0x49, 0xFF, 0xC6});       // inc r14
+    as.emit({0x41, 0x89, 0x45, 0x00}); // skip: mov [r13], eax
+    as.emit({0x49, 0x83, 0xC5, 0x04}); // add r13, 4
+    if (array)
+    {
+        as.emit({0x48, 0x83, 0xC3, 0x04}); // add rbx, 4
+    }
+    else
+    {
+        as.emit({0xFF, 0xC3}); // inc ebx
+    }
+    as.emit({0x41, 0xFF, 0xCC}); // dec r12d
+    as.emit({0x0F, 0x85});       // jnz loop
+    as.patch(as.emit_fixup(), loop);
+
+    as.patch(done, as.size());
+    as.emit({0x41, 0x5E}); // pop r14
+    as.emit({0x41, 0x5D}); // pop r13
+    as.emit({0x41, 0x5C}); // pop r12
+    as.emit({0x5B, 0xC3}); // pop rbx; ret
+}
+
+#endif
+
+JitProgram::JitProgram(const Ast &ast)
+    : program(compile(ast)), memory(nullptr), size(0), scalar(nullptr),
+      block(nullptr), block_array(nullptr)
+{
+#if defined(BB_JIT_X86_64)
+    Assembler as;
+    vector<Fixup> string_fixups;
+    emit_kernel(as, program, string_fixups);
+
+    size_t block_offset = as.size();
+    emit_block(as, false);
+    size_t block_array_offset = as.size();
+    emit_block(as, true);
+
+    const vector<string> &strings = program.get_strings();
+    vector<size_t> string_offsets;
+    for (const string &s : strings)
+    {
+        while (as.size() % 4)
+        {
+            as.emit({0xCC});
+        }
+        string_offsets.push_back(as.size());
+        as.emit32(s.length());
+        for (char c : s)
+        {
+            as.emit({static_cast<uint8_t>(c)});
+        }
+    }
+    for (const Fixup &fixup : string_fixups)
+    {
+        as.patch(fixup.at, string_offsets[fixup.target]);
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = (as.size() + page - 1) / page * page;
+    void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return;
+    }
+
+    memcpy(mapping, as.get_bytes().data(), as.size());
+    if (mprotect(mapping, length, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(mapping, length);
+        return;
+    }
+
+    memory = mapping;
+    size = length;
+    uint8_t *base = static_cast<uint8_t *>(mapping);
+    scalar = reinterpret_cast<ScalarFn>(base);
+    block = reinterpret_cast<BlockFn>(base + block_offset);
+    block_array = reinterpret_cast<BlockArrayFn>(base + block_array_offset);
+#endif
+}
+
+JitProgram::~JitProgram()
+{
+#if defined(BB_JIT_X86_64)
+    if (memory)
+    {
+        munmap(memory, size);
+    }
+#endif
+}
+
+bool JitProgram::is_supported()
+{
+#if defined(BB_JIT_X86_64)
+    return true;
+#else
+    return false;
+#endif
+}
+
+Value JitProgram::eval(int t) const
+{
+    if (!scalar)
+    {
+        return program.eval(t);
+    }
+
+    uint64_t result = scalar(t);
+    if (result >> 32)
+    {
+        return Value();
+    }
+    return static_cast<int>(result);
+}
+
+void JitProgram::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    if (!block)
+    {
+        program.eval_block(t0, n, out, defined);
+        return;
+    }
+    block(t0, n, out, defined);
+}
+
+void JitProgram::eval_block(const int *t, int n, int *out,
+                            bool *defined) const
+{
+    if (!block_array)
+    {
+        program.eval_block(t, n, out, defined);
+        return;
+    }
+    block_array(t, n, out, defined);
+}
+
+} // namespace bb
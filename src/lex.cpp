@@ -1,5 +1,9 @@
 #include "lex.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstddef>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -8,17 +12,36 @@ namespace bb
 {
 
 TokenType get_terminal_type(char c);
+int decode_integer(const char *text, size_t length);
+size_t get_token_begin(const Token &token, const char *input);
+size_t get_token_end(const Token &token, const char *input);
+bool can_extend(const Token &token, char next);
+void move_tokens(Token *tokens, size_t count, const char *from,
+                 const char *to, ptrdiff_t shift);
 
 vector<Token> lex(const string &input)
 {
+    return lex(input.data(), input.length());
+}
+
+/**
+ * The input need not be null terminated, so nothing past `length` is read.
+ * Whitespace includes line breaks, so expressions can be read from files.
+ */
+vector<Token> lex(const char *data, size_t length)
+{
+    // There is at most one token per character. Capacity that is never
+    // written to is never touched, so this costs little beyond the tokens.
     vector<Token> tokens;
+    tokens.reserve(length);
 
-    for (int i = 0; i < input.length(); ++i)
+    for (size_t i = 0; i < length; ++i)
     {
-        char c = input[i];
+        char c = data[i];
+        size_t start = i;
 
         // Whitespace
-        if (c == ' ')
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
         {
             continue;
         }
@@ -26,15 +49,13 @@ vector<Token> lex(const string &input)
         // Integer constant
         if (isdigit(c))
         {
-            string buffer{c};
             bool is_hex = false;
-            while (i < input.length() - 1)
+            while (i + 1 < length)
             {
-                c = input[i + 1];
+                c = data[i + 1];
                 if (!is_hex && !isdigit(c) || is_hex && !isxdigit(c))
                 {
-                    if (tolower(c) == 'x' && buffer.length() == 1 &&
-                        buffer[0] == '0')
+                    if (tolower(c) == 'x' && i == start && data[i] == '0')
                     {
                         is_hex = true;
                     }
@@ -43,18 +64,19 @@ vector<Token> lex(const string &input)
                         break;
                     }
                 }
-                buffer.push_back(c);
                 ++i;
             }
 
-            if (buffer.length() == 2 && buffer[1] == 'x')
+            size_t token_length = i + 1 - start;
+            if (token_length == 2 && is_hex)
             {
                 throw invalid_argument("Invalid hexadecimal integer: 0x");
             }
 
             tokens.push_back({
                 TokenType::Integer,
-                buffer,
+                TokenText(data + start, token_length),
+                decode_integer(data + start, token_length),
             });
             continue;
         }
@@ -63,10 +85,7 @@ vector<Token> lex(const string &input)
         auto terminal_type = get_terminal_type(c);
         if (terminal_type != TokenType::Unknown)
         {
-            tokens.push_back(Token{
-                terminal_type,
-                string{c},
-            });
+            tokens.push_back({terminal_type, TokenText(data + start, 1), 0});
             continue;
         }
 
@@ -74,24 +93,21 @@ vector<Token> lex(const string &input)
         if (c == '<')
         {
             TokenType type = TokenType::LessThan;
-            string buffer{c};
-            if (i < input.length())
+            if (i + 1 < length)
             {
-                c = input[i + 1];
+                c = data[i + 1];
                 if (c == '<')
                 {
                     type = TokenType::BitwiseShiftLeft;
-                    buffer.push_back(c);
                     ++i;
                 }
                 else if (c == '=')
                 {
                     type = TokenType::LessThanEqual;
-                    buffer.push_back(c);
                     ++i;
                 }
             }
-            tokens.push_back({type, buffer});
+            tokens.push_back({type, TokenText(data + start, i + 1 - start), 0});
             continue;
         }
 
@@ -99,24 +115,21 @@ vector<Token> lex(const string &input)
         if (c == '>')
         {
             TokenType type = TokenType::GreaterThan;
-            string buffer{c};
-            if (i < input.length())
+            if (i + 1 < length)
             {
-                c = input[i + 1];
+                c = data[i + 1];
                 if (c == '>')
                 {
                     type = TokenType::BitwiseShiftRight;
-                    buffer.push_back(c);
                     ++i;
                 }
                 else if (c == '=')
                 {
                     type = TokenType::GreaterThanEqual;
-                    buffer.push_back(c);
                     ++i;
                 }
             }
-            tokens.push_back({type, buffer});
+            tokens.push_back({type, TokenText(data + start, i + 1 - start), 0});
             continue;
         }
 
@@ -124,38 +137,34 @@ vector<Token> lex(const string &input)
         if (c == '!')
         {
             TokenType type = TokenType::Not;
-            string buffer{c};
-            if (i < input.length())
+            if (i + 1 < length)
             {
-                c = input[i + 1];
+                c = data[i + 1];
                 if (c == '=')
                 {
                     type = TokenType::NotEqual;
-                    buffer.push_back(c);
                     ++i;
                 }
             }
-            tokens.push_back({type, buffer});
+            tokens.push_back({type, TokenText(data + start, i + 1 - start), 0});
             continue;
         }
 
         // Equal
         if (c == '=')
         {
-            if (i == input.length() - 1)
+            if (i + 1 == length)
             {
                 throw invalid_argument("Invalid token: = (EOF)");
             }
 
-            string buffer{c};
-            c = input[i + 1];
+            c = data[i + 1];
             if (c != '=')
             {
                 throw invalid_argument("Invalid token: =");
             }
             ++i;
-            buffer.push_back(c);
-            tokens.push_back({TokenType::Equal, buffer});
+            tokens.push_back({TokenType::Equal, TokenText(data + start, 2), 0});
             continue;
         }
 
@@ -163,18 +172,16 @@ vector<Token> lex(const string &input)
         if (c == '&')
         {
             TokenType type = TokenType::BitwiseAnd;
-            string buffer{c};
-            if (i < input.length())
+            if (i + 1 < length)
             {
-                c = input[i + 1];
+                c = data[i + 1];
                 if (c == '&')
                 {
                     type = TokenType::And;
-                    buffer.push_back(c);
                     ++i;
                 }
             }
-            tokens.push_back({type, buffer});
+            tokens.push_back({type, TokenText(data + start, i + 1 - start), 0});
             continue;
         }
 
@@ -182,48 +189,44 @@ vector<Token> lex(const string &input)
         if (c == '|')
         {
             TokenType type = TokenType::BitwiseOr;
-            string buffer{c};
-            if (i < input.length())
+            if (i + 1 < length)
             {
-                c = input[i + 1];
+                c = data[i + 1];
                 if (c == '|')
                 {
                     type = TokenType::Or;
-                    buffer.push_back(c);
                     ++i;
                 }
             }
-            tokens.push_back({type, buffer});
+            tokens.push_back({type, TokenText(data + start, i + 1 - start), 0});
             continue;
         }
 
         // String literal
         if (c == '"')
         {
-            if (i == input.length() - 1)
+            if (i + 1 == length)
             {
                 throw invalid_argument("Invalid string: \" (EOF)");
             }
 
-            string buffer;
             ++i;
-            while (i < input.length())
+            while (i < length && data[i] != '"')
             {
-                c = input[i];
-                if (c == '"')
-                {
-                    break;
-                }
-                buffer.push_back(input[i]);
                 ++i;
             }
 
-            if (i == input.length())
+            if (i == length)
             {
-                throw invalid_argument("Invalid string: \"" + buffer);
+                throw invalid_argument("Invalid string: " +
+                                       string(data + start, length - start));
             }
 
-            tokens.push_back({TokenType::String, buffer});
+            tokens.push_back({
+                TokenType::String,
+                TokenText(data + start + 1, i - start - 1),
+                0,
+            });
             continue;
         }
 
@@ -236,6 +239,158 @@ vector<Token> lex(const string &input)
     return tokens;
 }
 
+/**
+ * A token is copied from the start of the original if it was not edited,
+ * nor was the character after it that ended it. Lexing resumes after the
+ * last such token, and stops at a token of the unchanged end of the input
+ * that the new tokens line up with. They line up if the last new token
+ * cannot run on into that token.
+ */
+vector<Token> relex(const char *previous, size_t previous_length,
+                    const vector<Token> &tokens, const char *input,
+                    size_t length, TokenEdit &edit)
+{
+    size_t shorter = min(previous_length, length);
+    size_t same_start = 0;
+    while (same_start < shorter && previous[same_start] == input[same_start])
+    {
+        ++same_start;
+    }
+    if (same_start == previous_length && same_start == length)
+    {
+        edit = {tokens.size(), tokens.size(), tokens.size()};
+        vector<Token> out = tokens;
+        move_tokens(out.data(), out.size(), previous, input, 0);
+        return out;
+    }
+
+    size_t same_end = 0;
+    while (same_end < shorter - same_start &&
+           previous[previous_length - 1 - same_end] ==
+               input[length - 1 - same_end])
+    {
+        ++same_end;
+    }
+
+    // Tokens are in order, so are found by binary search
+    size_t prefix =
+        partition_point(tokens.begin(), tokens.end(),
+                        [&](const Token &token) {
+                            return get_token_end(token, previous) < same_start;
+                        }) -
+        tokens.begin();
+    // A token that the edit begins right after is kept if the edited
+    // character that follows it cannot run on into it
+    if (prefix < tokens.size() &&
+        get_token_end(tokens[prefix], previous) == same_start &&
+        (same_start == length ||
+         !can_extend(tokens[prefix], input[same_start])))
+    {
+        ++prefix;
+    }
+    size_t start = prefix ? get_token_end(tokens[prefix - 1], previous) : 0;
+
+    size_t suffix =
+        partition_point(tokens.begin() + prefix, tokens.end(),
+                        [&](const Token &token) {
+                            return get_token_begin(token, previous) <
+                                   previous_length - same_end;
+                        }) -
+        tokens.begin();
+
+    vector<Token> middle;
+    while (suffix < tokens.size())
+    {
+        size_t stop = get_token_begin(tokens[suffix], previous) + length -
+                      previous_length;
+        try
+        {
+            middle = lex(input + start, stop - start);
+        }
+        catch (logic_error &)
+        {
+            // Lexing up to the unchanged end may have cut a token short
+            suffix = tokens.size();
+            break;
+        }
+        if (middle.empty() || get_token_end(middle.back(), input) < stop ||
+            !can_extend(middle.back(), input[stop]))
+        {
+            break;
+        }
+        ++suffix;
+    }
+    if (suffix == tokens.size())
+    {
+        middle = lex(input + start, length - start);
+    }
+
+    edit = {prefix, suffix, prefix + middle.size()};
+    vector<Token> out;
+    out.reserve(prefix + middle.size() + tokens.size() - suffix);
+    out.insert(out.end(), tokens.begin(), tokens.begin() + prefix);
+    out.insert(out.end(), middle.begin(), middle.end());
+    out.insert(out.end(), tokens.begin() + suffix, tokens.end());
+    move_tokens(out.data(), prefix, previous, input, 0);
+
+    // Tokens of the unchanged end are at the same distance from the end of
+    // the input as before
+    move_tokens(out.data() + edit.new_suffix, out.size() - edit.new_suffix,
+                previous, input,
+                static_cast<ptrdiff_t>(length) -
+                    static_cast<ptrdiff_t>(previous_length));
+    return out;
+}
+
+/** Offset of the first character of a token, including a string's quote */
+size_t get_token_begin(const Token &token, const char *input)
+{
+    size_t begin = token.value.data - input;
+    return token.type == TokenType::String ? begin - 1 : begin;
+}
+
+/** Offset just past a token, including a string's closing quote */
+size_t get_token_end(const Token &token, const char *input)
+{
+    size_t end = token.value.data + token.value.length - input;
+    return token.type == TokenType::String ? end + 1 : end;
+}
+
+/** True if the lexer would take `next` as part of the token */
+bool can_extend(const Token &token, char next)
+{
+    switch (token.type)
+    {
+    case TokenType::Integer:
+        return isalnum(next);
+    case TokenType::LessThan:
+        return next == '<' || next == '=';
+    case TokenType::GreaterThan:
+        return next == '>' || next == '=';
+    case TokenType::Not:
+        return next == '=';
+    case TokenType::BitwiseAnd:
+        return next == '&';
+    case TokenType::BitwiseOr:
+        return next == '|';
+    default:
+        return false;
+    }
+}
+
+/**
+ * Point tokens lexed from `from` at the same characters of a copy of it
+ * that starts at `to`, moved along by `shift` characters
+ */
+void move_tokens(Token *tokens, size_t count, const char *from,
+                 const char *to, ptrdiff_t shift)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        tokens[i].value.data = to + (tokens[i].value.data - from + shift);
+    }
+}
+
 TokenType get_terminal_type(char c)
 {
     switch (c)
@@ -273,4 +428,44 @@ TokenType get_terminal_type(char c)
     }
 }
 
+/**
+ * Decode an integer constant as stoi does with an automatically detected
+ * base: hexadecimal after 0x, octal after a leading 0 up to the first digit
+ * that is not octal, and decimal otherwise. Throws out_of_range if the
+ * value does not fit in an int.
+ */
+int decode_integer(const char *text, size_t length)
+{
+    int base = 10;
+    size_t i = 0;
+    if (length > 2 && text[0] == '0' && tolower(text[1]) == 'x')
+    {
+        base = 16;
+        i = 2;
+    }
+    else if (length > 1 && text[0] == '0')
+    {
+        base = 8;
+        i = 1;
+    }
+
+    long long value = 0;
+    for (; i < length; ++i)
+    {
+        char c = tolower(text[i]);
+        int digit = isdigit(c) ? c - '0' : c - 'a' + 10;
+        if (digit >= base)
+        {
+            break;
+        }
+        value = value * base + digit;
+        if (value > INT_MAX)
+        {
+            throw out_of_range("Integer out of range: " +
+                               string(text, length));
+        }
+    }
+    return static_cast<int>(value);
+}
+
 } // namespace bb
@@ -0,0 +1,102 @@
+#include "lookup.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+using namespace std;
+
+namespace bb
+{
+
+int get_lowest_bit(uint32_t bits);
+
+int get_lookup_bits(const Ast &ast, uint32_t demanded)
+{
+    uint32_t bits = get_t_bits(ast, demanded);
+    if (!bits)
+    {
+        return 0;
+    }
+    int high = 31;
+    while (!(bits >> high))
+    {
+        --high;
+    }
+    return high - get_lowest_bit(bits) + 1;
+}
+
+bool is_lookup_sized(const Ast &ast, uint32_t demanded)
+{
+    return get_lookup_bits(ast, demanded) <= kMaxLookupBits;
+}
+
+LookupProgram::LookupProgram(const Ast &ast, uint32_t demanded)
+{
+    bits = get_lookup_bits(ast, demanded);
+    if (bits > kMaxLookupBits)
+    {
+        throw invalid_argument("Expression depends on " + to_string(bits) +
+                               " bits of t, more than a lookup table holds");
+    }
+    shift = get_lowest_bit(get_t_bits(ast, demanded));
+
+    // Bits of t outside the index cannot change the result, so they are left
+    // clear when the table is filled
+    size_t size = size_t(1) << bits;
+    vector<int> t(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        t[i] = static_cast<int>(static_cast<uint32_t>(i) << shift);
+    }
+    values.resize(size);
+    unique_ptr<bool[]> defined(new bool[size]);
+    compile(ast).eval_block(t.data(), size, values.data(), defined.get());
+    if (!all_of(defined.get(), defined.get() + size, [](bool d) { return d; }))
+    {
+        defined_values.assign(defined.get(), defined.get() + size);
+    }
+}
+
+void LookupProgram::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    uint32_t mask = (uint32_t(1) << bits) - 1;
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t index = (static_cast<uint32_t>(t0) + i) >> shift & mask;
+        out[i] = values[index];
+        if (defined)
+        {
+            defined[i] = defined_values.empty() || defined_values[index];
+        }
+    }
+}
+
+void LookupProgram::eval_block(const int *t, int n, int *out,
+                               bool *defined) const
+{
+    uint32_t mask = (uint32_t(1) << bits) - 1;
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t index = static_cast<uint32_t>(t[i]) >> shift & mask;
+        out[i] = values[index];
+        if (defined)
+        {
+            defined[i] = defined_values.empty() || defined_values[index];
+        }
+    }
+}
+
+/** Index of the lowest set bit, or 0 if there is none */
+int get_lowest_bit(uint32_t bits)
+{
+    int low = 0;
+    while (low < 31 && !(bits >> low & 1))
+    {
+        ++low;
+    }
+    return low;
+}
+
+} // namespace bb
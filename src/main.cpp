@@ -1,18 +1,260 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bitslice.hpp"
+#include "codegen.hpp"
+#include "dag.hpp"
+#include "flat.hpp"
+#include "image.hpp"
+#include "jit.hpp"
+#include "lookup.hpp"
+#include "narrow.hpp"
+#include "optimize.hpp"
 #include "parse.hpp"
+#include "period.hpp"
+#include "preset.hpp"
+#include "tier.hpp"
+#include "vm.hpp"
 
 using namespace std;
 using namespace bb;
 
+void render(const Ast &expr)
+{
+    int t = 0;
+    while (true)
+    {
+        bool defined = true;
+        int value = expr.eval_int(t++, defined);
+        putchar(defined ? value : 0);
+    }
+}
+
+/**
+ * Samples rendered per call, so that programs which keep state between the
+ * blocks of one call, such as the hoisted nodes of a Dag, can reuse it
+ */
+const int kRenderSize = 16 * kBlockSize;
+
+template <typename Expr> void render_blocks(const Expr &program)
+{
+    int values[kRenderSize];
+    unsigned char bytes[kRenderSize];
+    int t = 0;
+    while (true)
+    {
+        program.eval_block(t, kRenderSize, values, nullptr);
+        for (int i = 0; i < kRenderSize; ++i)
+        {
+            bytes[i] = values[i];
+        }
+        fwrite(bytes, 1, kRenderSize, stdout);
+        t += kRenderSize;
+    }
+}
+
+void render_tiered(TieredProgram &program)
+{
+    Tier tier = program.get_tier();
+    int values[kBlockSize];
+    unsigned char bytes[kBlockSize];
+    int t = 0;
+    while (true)
+    {
+        program.eval_block(t, kBlockSize, values, nullptr);
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            bytes[i] = values[i];
+        }
+        fwrite(bytes, 1, kBlockSize, stdout);
+        t += kBlockSize;
+
+        // Report each tier once it has been replaced by a faster one
+        Tier next = program.get_tier();
+        if (next != tier)
+        {
+            TierStats prev = program.get_stats(tier);
+            TierStats ready = program.get_stats(next);
+            cerr << get_tier_name(tier) << ": first block after "
+                 << prev.first_block_ns / 1000 << "us, "
+                 << prev.ns_per_sample() << "ns/sample over " << prev.samples
+                 << " samples; " << get_tier_name(next) << " ready after "
+                 << ready.ready_ns / 1000 << "us" << endl;
+            tier = next;
+        }
+    }
+}
+
+/**
+ * The contents of an expression file or program image. Files are mapped
+ * rather than read, so a generated expression or a cached period of many
+ * megabytes is never copied.
+ */
+class ExpressionFile
+{
+public:
+    explicit ExpressionFile(const char *path)
+    {
+#if !defined(_WIN32)
+        int fd = open(path, O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            throw runtime_error(string("cannot open ") + path);
+        }
+        length = info.st_size;
+        if (length > 0)
+        {
+            mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = nullptr;
+            throw runtime_error(string("cannot map ") + path);
+        }
+        data = static_cast<const char *>(mapping);
+#else
+        ifstream file(path, ios::binary);
+        if (!file)
+        {
+            throw runtime_error(string("cannot open ") + path);
+        }
+        ostringstream contents;
+        contents << file.rdbuf();
+        buffer = contents.str();
+        data = buffer.data();
+        length = buffer.length();
+#endif
+    }
+
+    ~ExpressionFile()
+    {
+#if !defined(_WIN32)
+        if (mapping)
+        {
+            munmap(mapping, length);
+        }
+#endif
+    }
+
+    ExpressionFile(const ExpressionFile &) = delete;
+    ExpressionFile &operator=(const ExpressionFile &) = delete;
+
+    const char *data = "";
+    size_t length = 0;
+
+private:
+#if !defined(_WIN32)
+    void *mapping = nullptr;
+#else
+    string buffer;
+#endif
+};
+
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    string backend = "vm";
+    bool chosen = false;
+    size_t period_bytes = kDefaultPeriodBytes;
+    const char *path = nullptr;
+    const char *image_path = nullptr;
+    const char *out_path = nullptr;
+    int arg = 1;
+    while (arg + 1 < argc &&
+           (string{argv[arg]} == "-b" || string{argv[arg]} == "-p" ||
+            string{argv[arg]} == "-f" || string{argv[arg]} == "-i" ||
+            string{argv[arg]} == "-o"))
+    {
+        if (string{argv[arg]} == "-b")
+        {
+            backend = argv[arg + 1];
+            chosen = true;
+        }
+        else if (string{argv[arg]} == "-p")
+        {
+            period_bytes = strtoull(argv[arg + 1], nullptr, 10);
+        }
+        else if (string{argv[arg]} == "-i")
+        {
+            image_path = argv[arg + 1];
+        }
+        else if (string{argv[arg]} == "-o")
+        {
+            out_path = argv[arg + 1];
+        }
+        else
+        {
+            path = argv[arg + 1];
+        }
+        arg += 2;
+    }
+
+    if (argc != arg + (path || image_path ? 0 : 1) ||
+        (backend != "tree" && backend != "vm" && backend != "jit" &&
+         backend != "c" && backend != "tiered" && backend != "dag" &&
+         backend != "narrow" && backend != "bitslice" &&
+         backend != "lookup" && backend != "period" &&
+         backend != "preset"))
     {
         cout << endl;
         cout << "  usage:" << endl;
-        cout << "    ./bytebeat [EXPRESSION] | head -c [BYTES] > [OUT].raw"
+        cout << "    ./bytebeat [-b BACKEND] [-p BYTES] [EXPRESSION] | head -c "
+                "[BYTES] > [OUT].raw"
+             << endl;
+        cout << "    ./bytebeat [-b BACKEND] [-p BYTES] -f [FILE] | head -c "
+                "[BYTES] > [OUT].raw"
+             << endl;
+        cout << "    ./bytebeat [-p BYTES] -o [IMAGE] [EXPRESSION]" << endl;
+        cout << "    ./bytebeat -i [IMAGE] | head -c [BYTES] > [OUT].raw"
+             << endl;
+        cout << endl;
+        cout << "  options:" << endl;
+        cout << "    -p     most bytes to cache a period in for period, "
+                "tiered and -o (default "
+             << kDefaultPeriodBytes << ", 0 disables)" << endl;
+        cout << "    -f     read the expression from a file" << endl;
+        cout << "    -o     write a program image instead of rendering"
+             << endl;
+        cout << "    -i     play a program image written with -o" << endl;
+        cout << endl;
+        cout << "  backends:" << endl;
+        cout << "    tree   evaluate the expression tree directly" << endl;
+        cout << "    vm     compile to bytecode (default, or lookup or "
+                "bitslice when faster)"
+             << endl;
+        cout << "    jit    compile to native x86-64 code" << endl;
+        cout << "    c      compile to C with the system compiler ($CC or cc)"
+             << endl;
+        cout << "    dag    evaluate shared sub-expressions once per sample"
+             << endl;
+        cout << "    narrow compute each sub-expression in 8, 16 or 32-bit lanes"
+             << endl;
+        cout << "    bitslice evaluate bitwise operators 64 samples per word"
+             << endl;
+        cout << "    lookup tabulate expressions of at most "
+             << kMaxLookupBits << " bits of t" << endl;
+        cout << "    period play back one period of the output once found"
+             << endl;
+        cout << "    tiered start on the tree, switch to vm and jit when ready"
+             << endl;
+        cout << "    preset play a built-in expression compiled ahead of time"
              << endl;
         cout << endl;
         cout << "  expression tokens:" << endl;
@@ -26,21 +268,203 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    string input{argv[1]};
+    if (image_path)
+    {
+        unique_ptr<TieredProgram> program;
+        try
+        {
+            ExpressionFile file(image_path);
+            ProgramImage image(reinterpret_cast<const uint8_t *>(file.data),
+                               file.length);
+            program = image.load();
+            cerr << "image: " << image.get_node_count() << " nodes";
+            if (image.get_period())
+            {
+                cerr << ", period of " << image.get_period() << " samples";
+            }
+            cerr << endl;
+        }
+        catch (exception &ex)
+        {
+            cerr << "failed to load program image. " << ex.what() << endl;
+            return 1;
+        }
+        render_tiered(*program);
+    }
+
+    unique_ptr<ExpressionFile> file;
+    const char *input = path ? nullptr : argv[arg];
+    size_t length = path ? 0 : strlen(input);
+    if (path)
+    {
+        try
+        {
+            file.reset(new ExpressionFile(path));
+        }
+        catch (runtime_error &ex)
+        {
+            cerr << "failed to read expression. " << ex.what() << endl;
+            return 1;
+        }
+        input = file->data;
+        length = file->length;
+    }
+
     AstPtr expr;
     try
     {
-        expr = parse(input);
+        // The passes over an Ast recurse, so an expression too deep for them
+        // is only ever evaluated as a flat tree
+        FlatAst flat = parse_flat(input, length);
+        if (flat.get_depth() > kMaxRecursionDepth)
+        {
+            if (out_path)
+            {
+                cerr << "expression is nested " << flat.get_depth()
+                     << " deep, too deep to write as a program image" << endl;
+                return 1;
+            }
+            cerr << "expression is nested " << flat.get_depth()
+                 << " deep, evaluating it without recursion" << endl;
+            render_blocks(flat);
+        }
+        expr = optimize(flat.get_ast());
     }
-    catch (invalid_argument &ex)
+    catch (logic_error &ex)
     {
         cerr << "failed to parse expression. " << ex.what() << endl;
         return 1;
     }
 
-    int t = 0;
-    while (true)
+    if (out_path)
+    {
+        vector<uint8_t> image = write_image(*expr, period_bytes);
+        ofstream out(out_path, ios::binary);
+        out.write(reinterpret_cast<const char *>(image.data()), image.size());
+        if (!out)
+        {
+            cerr << "failed to write program image to " << out_path << endl;
+            return 1;
+        }
+        uint32_t period =
+            ProgramImage(image.data(), image.size()).get_period();
+        cerr << "image: " << image.size() << " bytes";
+        if (period)
+        {
+            cerr << ", period of " << period << " samples";
+        }
+        cerr << endl;
+        return 0;
+    }
+
+    if (backend == "tree")
+    {
+        render(*expr);
+    }
+    if (backend == "jit")
+    {
+        render_blocks(JitProgram(*expr));
+    }
+    if (backend == "dag")
+    {
+        Dag dag(*expr);
+        cerr << "dag: " << dag.get_nodes().size() << " nodes, "
+             << dag.get_merged() << " of " << dag.get_tree_size()
+             << " tree nodes merged, " << dag.get_hoisted_count() << " of "
+             << dag.get_operator_count() << " operators hoisted" << endl;
+        render_blocks(dag);
+    }
+    if (backend == "narrow")
+    {
+        NarrowProgram program(*expr);
+        cerr << "narrow: " << program.get_node_count(8) << " 8-bit, "
+             << program.get_node_count(16) << " 16-bit and "
+             << program.get_node_count(32) << " 32-bit nodes" << endl;
+        render_blocks(program);
+    }
+    if (backend == "bitslice")
+    {
+        if (is_bit_sliceable(*expr))
+        {
+            BitSliceProgram program(*expr);
+            cerr << "bitslice: " << program.get_slice_count()
+                 << " words per block of " << kBlockSize << endl;
+            render_blocks(program);
+        }
+        cerr << "expression uses more than bitwise operators, falling back "
+                "to vm"
+             << endl;
+    }
+    if (backend == "lookup")
+    {
+        if (is_lookup_sized(*expr))
+        {
+            LookupProgram program(*expr);
+            cerr << "lookup: " << program.get_table_bits()
+                 << " bits of t from bit " << program.get_table_shift()
+                 << endl;
+            render_blocks(program);
+        }
+        cerr << "expression depends on " << get_lookup_bits(*expr)
+             << " bits of t, falling back to vm" << endl;
+    }
+    if (backend == "period")
+    {
+        PeriodicProgram program(*expr, period_bytes);
+        if (program.is_periodic())
+        {
+            cerr << "period: " << program.get_period() << " samples in "
+                 << program.get_cache_bytes() << " bytes" << endl;
+        }
+        else
+        {
+            cerr << "no period found within " << period_bytes
+                 << " bytes, evaluating with vm" << endl;
+        }
+        render_blocks(program);
+    }
+    if (backend == "preset")
+    {
+        const BuiltinPreset *preset = find_builtin_preset(*expr);
+        if (preset)
+        {
+            cerr << "preset: " << preset->name << endl;
+            render_blocks(*preset);
+        }
+        cerr << "expression is not a built-in preset, falling back to vm"
+             << endl;
+    }
+    if (backend == "tiered")
+    {
+        TieredProgram program(move(expr), period_bytes);
+        render_tiered(program);
+    }
+    if (backend == "c")
+    {
+        const char *cc = getenv("CC");
+        NativeProgram program(*expr, cc && *cc ? cc : "cc");
+        if (!program.is_native())
+        {
+            cerr << "failed to compile expression with the C compiler, "
+                    "falling back to vm"
+                 << endl;
+        }
+        render_blocks(program);
+    }
+
+    // Without a backend, expressions of few bits of t are tabulated and long
+    // enough runs of bitwise operators are sliced
+    if (!chosen && is_lookup_sized(*expr))
+    {
+        render_blocks(LookupProgram(*expr));
+    }
+    if (!chosen && is_bit_sliceable(*expr))
     {
-        putchar(expr->eval(t++).to_int());
+        BitSliceProgram program(*expr);
+        if (program.is_faster_than_vm())
+        {
+            render_blocks(program);
+        }
     }
+    render_blocks(compile(*expr));
 }
@@ -0,0 +1,709 @@
+#include "narrow.hpp"
+#include "range.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace bb
+{
+
+/** Programs with more nodes than this allocate their lanes */
+const size_t kInlineNarrowNodes = 64;
+
+/** The lanes of one node for a block, in the width it is computed in */
+struct alignas(32) NarrowLanes
+{
+    union
+    {
+        uint8_t u8[kBlockSize];
+        uint16_t u16[kBlockSize];
+        uint32_t u32[kBlockSize];
+    };
+    uint64_t undef;
+};
+
+struct NarrowBuilder
+{
+    vector<NarrowNode> nodes;
+    vector<string> strings;
+};
+
+int flatten(const Ast &ast, ValueType expected, uint32_t demanded,
+            NarrowBuilder &builder);
+int push_node(NarrowBuilder &builder, NarrowNode node);
+int intern_narrow_string(NarrowBuilder &builder, const string &s);
+void run_block(const vector<NarrowNode> &nodes, const vector<string> &strings,
+               const int *t, int t0, NarrowLanes *lanes);
+void run_wide(const NarrowNode &node, const vector<NarrowNode> &nodes,
+              const vector<string> &strings, NarrowLanes *lanes,
+              NarrowLanes &out);
+uint64_t get_operand_undef(const NarrowNode &node, const NarrowLanes *lanes);
+template <typename T>
+const NarrowLanes &read_lanes(const NarrowLanes &lanes, int bits,
+                              NarrowLanes &scratch);
+template <typename T>
+void write_result(const T *v, uint64_t undef, int count, int *out,
+                  bool *defined);
+
+NarrowProgram::NarrowProgram(const Ast &ast, uint32_t demanded)
+{
+    NarrowBuilder builder;
+    flatten(ast, ValueType::Integer, demanded, builder);
+    nodes = move(builder.nodes);
+    strings = move(builder.strings);
+}
+
+int NarrowProgram::get_node_count(int bits) const
+{
+    return count_if(nodes.begin(), nodes.end(),
+                    [bits](const NarrowNode &node) { return node.bits == bits; });
+}
+
+/**
+ * Append the nodes of a tree in evaluation order. As in the bytecode
+ * compiler, a node of the wrong type for its parent is replaced by an
+ * Undefined node.
+ */
+int flatten(const Ast &ast, ValueType expected, uint32_t demanded,
+            NarrowBuilder &builder)
+{
+    AstType type = ast.type();
+    NarrowNode node{type, 0, {-1, -1, -1}, 32, false, false, false};
+    NarrowNode undefined{AstType::Undefined, 0, {-1, -1, -1}, 32,
+                         false, false, false};
+
+    if (type == AstType::TernaryIf)
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        node.operands[0] =
+            flatten(ternary.get_pred(), ValueType::Integer,
+                    get_operand_bits(ast, 0, demanded), builder);
+        node.operands[1] = flatten(ternary.get_pass(), expected,
+                                   get_operand_bits(ast, 1, demanded), builder);
+        node.operands[2] = flatten(ternary.get_fail(), expected,
+                                   get_operand_bits(ast, 2, demanded), builder);
+        node.bits = expected == ValueType::Integer ? get_lane_bits(demanded)
+                                                   : 32;
+        node.narrow = true;
+        return push_node(builder, node);
+    }
+
+    if (type == AstType::String)
+    {
+        if (expected != ValueType::String)
+        {
+            return push_node(builder, undefined);
+        }
+        node.value = intern_narrow_string(
+            builder, static_cast<const String &>(ast).get_value());
+        return push_node(builder, node);
+    }
+
+    if (type == AstType::Undefined || expected != ValueType::Integer)
+    {
+        return push_node(builder, undefined);
+    }
+
+    if (type == AstType::Integer)
+    {
+        node.value = static_cast<const Integer &>(ast).get_value();
+    }
+    else if (type == AstType::Negate || type == AstType::BitwiseComplement ||
+             type == AstType::Not)
+    {
+        node.operands[0] =
+            flatten(static_cast<const UnaryOperator &>(ast).get_inner(),
+                    ValueType::Integer, get_operand_bits(ast, 0, demanded),
+                    builder);
+    }
+    else if (type != AstType::Identifier)
+    {
+        auto &binary = static_cast<const BinaryOperator &>(ast);
+        const Ast &right = binary.get_right();
+        node.operands[0] = flatten(binary.get_left(),
+                                   type == AstType::Subscript
+                                       ? ValueType::String
+                                       : ValueType::Integer,
+                                   get_operand_bits(ast, 0, demanded), builder);
+        if (right.type() == AstType::Integer)
+        {
+            node.value = static_cast<const Integer &>(right).get_value();
+            node.constant = true;
+        }
+        else
+        {
+            node.operands[1] = flatten(
+                right, ValueType::Integer, get_operand_bits(ast, 1, demanded),
+                builder);
+        }
+        node.guarded = needs_guard(ast);
+    }
+
+    node.narrow = is_narrow_op(ast);
+    node.bits = node.narrow ? get_lane_bits(demanded) : 32;
+    if (type == AstType::BitwiseShiftRight && node.narrow)
+    {
+        // Shifting by a constant runs at the width of its operand, which
+        // holds every bit that is shifted down into the demanded ones
+        node.bits = max(node.bits, builder.nodes[node.operands[0]].bits);
+    }
+    return push_node(builder, node);
+}
+
+/**
+ * Append a node, or reuse an equal one, so that repeated subexpressions such
+ * as t in the same width are computed once per block
+ */
+int push_node(NarrowBuilder &builder, NarrowNode node)
+{
+    for (size_t id = 0; id < builder.nodes.size(); ++id)
+    {
+        const NarrowNode &other = builder.nodes[id];
+        if (other.type == node.type && other.value == node.value &&
+            equal(other.operands, other.operands + 3, node.operands) &&
+            other.bits == node.bits && other.constant == node.constant)
+        {
+            return id;
+        }
+    }
+    builder.nodes.push_back(node);
+    return builder.nodes.size() - 1;
+}
+
+int intern_narrow_string(NarrowBuilder &builder, const string &s)
+{
+    auto it = find(builder.strings.begin(), builder.strings.end(), s);
+    if (it != builder.strings.end())
+    {
+        return it - builder.strings.begin();
+    }
+    builder.strings.push_back(s);
+    return builder.strings.size() - 1;
+}
+
+void NarrowProgram::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    eval(nullptr, t0, n, out, defined);
+}
+
+void NarrowProgram::eval_block(const int *t, int n, int *out,
+                               bool *defined) const
+{
+    eval(t, 0, n, out, defined);
+}
+
+/**
+ * Evaluate either the values of t in the array, or consecutive values from t0
+ * when there is no array, which spares the identifier a load per lane.
+ */
+void NarrowProgram::eval(const int *t, int t0, int n, int *out,
+                         bool *defined) const
+{
+    NarrowLanes inline_lanes[kInlineNarrowNodes];
+    vector<NarrowLanes> heap_lanes;
+    NarrowLanes *lanes = inline_lanes;
+    if (nodes.size() > kInlineNarrowNodes)
+    {
+        heap_lanes.resize(nodes.size());
+        lanes = heap_lanes.data();
+    }
+
+    int root_bits = nodes.back().bits;
+    NarrowLanes &result = lanes[nodes.size() - 1];
+    int block_t[kBlockSize];
+    for (int offset = 0; offset < n; offset += kBlockSize)
+    {
+        // Pad the final partial block so that every lane is valid
+        int count = min(kBlockSize, n - offset);
+        if (t)
+        {
+            copy(t + offset, t + offset + count, block_t);
+            fill(block_t + count, block_t + kBlockSize, 0);
+        }
+        run_block(nodes, strings, t ? block_t : nullptr,
+                  static_cast<int>(static_cast<unsigned>(t0) + offset), lanes);
+
+        if (root_bits == 8)
+        {
+            write_result(result.u8, result.undef, count, out + offset,
+                         defined ? defined + offset : nullptr);
+        }
+        else if (root_bits == 16)
+        {
+            write_result(result.u16, result.undef, count, out + offset,
+                         defined ? defined + offset : nullptr);
+        }
+        else
+        {
+            write_result(result.u32, result.undef, count, out + offset,
+                         defined ? defined + offset : nullptr);
+        }
+    }
+}
+
+/** Zero extend the result lanes into samples, with 0 for undefined lanes */
+template <typename T>
+void write_result(const T *v, uint64_t undef, int count, int *out,
+                  bool *defined)
+{
+    if (!undef)
+    {
+        // The common case converts without testing each lane
+        copy(v, v + count, out);
+        if (defined)
+        {
+            fill(defined, defined + count, true);
+        }
+        return;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        out[i] = undef >> i & 1 ? 0 : static_cast<int>(v[i]);
+    }
+    if (defined)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            defined[i] = !(undef >> i & 1);
+        }
+    }
+}
+
+template <typename T> T *get_lanes(NarrowLanes &lanes);
+template <> uint8_t *get_lanes<uint8_t>(NarrowLanes &lanes) { return lanes.u8; }
+template <> uint16_t *get_lanes<uint16_t>(NarrowLanes &lanes)
+{
+    return lanes.u16;
+}
+template <> uint32_t *get_lanes<uint32_t>(NarrowLanes &lanes)
+{
+    return lanes.u32;
+}
+
+template <typename T> const T *get_lanes(const NarrowLanes &lanes)
+{
+    return get_lanes<T>(const_cast<NarrowLanes &>(lanes));
+}
+
+template <typename T, typename U> void convert(const U *from, T *to)
+{
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        to[i] = static_cast<T>(from[i]);
+    }
+}
+
+/**
+ * The lanes of an operand as T. Operands of another width are truncated or
+ * zero extended into scratch, which is exact for every demanded bit.
+ */
+template <typename T>
+const NarrowLanes &read_lanes(const NarrowLanes &lanes, int bits,
+                              NarrowLanes &scratch)
+{
+    if (bits == 8 * static_cast<int>(sizeof(T)))
+    {
+        return lanes;
+    }
+    if (bits == 8)
+    {
+        convert(lanes.u8, get_lanes<T>(scratch));
+    }
+    else if (bits == 16)
+    {
+        convert(lanes.u16, get_lanes<T>(scratch));
+    }
+    else
+    {
+        convert(lanes.u32, get_lanes<T>(scratch));
+    }
+    return scratch;
+}
+
+/** A lane of T repeated across a 32-bit word */
+template <typename T> uint32_t repeat_lane(T lane)
+{
+    return lane * (~uint32_t(0) / static_cast<T>(~T(0)));
+}
+
+/**
+ * Apply a binary operation lane by lane. A constant right operand stays a
+ * scalar, so that shifting by a constant is a single vector shift.
+ */
+template <typename T, typename F>
+void apply_binary(const NarrowNode &node, const T *a, const T *b, T *v, F f)
+{
+    if (node.constant)
+    {
+        T c = static_cast<T>(node.value);
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = f(a[i], c);
+        }
+        return;
+    }
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        v[i] = f(a[i], b[i]);
+    }
+}
+
+/**
+ * Run a node that is computed in lanes of type T. Arithmetic is unsigned, so
+ * it wraps in every width and the low bits match the 32-bit result.
+ */
+template <typename T>
+void run_narrow(const NarrowNode &node, const vector<NarrowNode> &nodes,
+                const int *t, int t0, NarrowLanes *lanes, NarrowLanes &out)
+{
+    NarrowLanes scratch[3];
+    const NarrowLanes *operands[3] = {};
+    for (int i = node.type == AstType::TernaryIf ? 1 : 0; i < 3; ++i)
+    {
+        int operand = node.operands[i];
+        if (operand >= 0)
+        {
+            operands[i] = &read_lanes<T>(lanes[operand], nodes[operand].bits,
+                                         scratch[i]);
+        }
+    }
+    const T *a = operands[0] ? get_lanes<T>(*operands[0]) : nullptr;
+    const T *b = operands[1] ? get_lanes<T>(*operands[1]) : nullptr;
+    T *v = get_lanes<T>(out);
+
+    // A shift by a constant works on whole 32-bit words and masks off the
+    // bits that cross into the next lane, as SSE2 has no 8-bit shifts
+    const int word_count = kBlockSize * sizeof(T) / sizeof(uint32_t);
+    const int lane_bits = 8 * sizeof(T);
+
+    switch (node.type)
+    {
+    case AstType::Identifier:
+        if (t)
+        {
+            for (int i = 0; i < kBlockSize; ++i)
+            {
+                v[i] = static_cast<T>(t[i]);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < kBlockSize; ++i)
+            {
+                v[i] = static_cast<T>(static_cast<unsigned>(t0) + i);
+            }
+        }
+        break;
+    case AstType::Integer:
+        fill(v, v + kBlockSize, static_cast<T>(node.value));
+        break;
+    case AstType::Negate:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = static_cast<T>(0u - a[i]);
+        }
+        break;
+    case AstType::BitwiseComplement:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = static_cast<T>(~a[i]);
+        }
+        break;
+    case AstType::Add:
+        apply_binary(node, a, b, v,
+                     [](T x, T y) { return static_cast<T>(x + y); });
+        break;
+    case AstType::Subtract:
+        apply_binary(node, a, b, v,
+                     [](T x, T y) { return static_cast<T>(x - y); });
+        break;
+    case AstType::Multiply:
+        apply_binary(node, a, b, v, [](T x, T y) {
+            return static_cast<T>(static_cast<uint32_t>(x) * y);
+        });
+        break;
+    case AstType::BitwiseAnd:
+        apply_binary(node, a, b, v,
+                     [](T x, T y) { return static_cast<T>(x & y); });
+        break;
+    case AstType::BitwiseOr:
+        apply_binary(node, a, b, v,
+                     [](T x, T y) { return static_cast<T>(x | y); });
+        break;
+    case AstType::BitwiseXor:
+        apply_binary(node, a, b, v,
+                     [](T x, T y) { return static_cast<T>(x ^ y); });
+        break;
+    case AstType::BitwiseShiftLeft:
+        if (node.constant)
+        {
+            int shift = node.value & 31;
+            if (shift >= lane_bits)
+            {
+                fill(v, v + kBlockSize, T(0));
+                break;
+            }
+            uint32_t mask = repeat_lane(static_cast<T>(~0u << shift));
+            for (int i = 0; i < word_count; ++i)
+            {
+                out.u32[i] = operands[0]->u32[i] << shift & mask;
+            }
+            break;
+        }
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = static_cast<T>(static_cast<uint32_t>(a[i]) << (b[i] & 31));
+        }
+        break;
+    case AstType::BitwiseShiftRight:
+    {
+        // The operand has the same width as the node. Bits shifted in from
+        // above a narrow lane are never demanded, so only 32-bit lanes need
+        // the arithmetic shift.
+        int shift = node.value & 31;
+        if (lane_bits == 32)
+        {
+            for (int i = 0; i < kBlockSize; ++i)
+            {
+                v[i] = static_cast<T>(static_cast<int32_t>(a[i]) >> shift);
+            }
+            break;
+        }
+        if (shift >= lane_bits)
+        {
+            fill(v, v + kBlockSize, T(0));
+            break;
+        }
+        uint32_t mask = repeat_lane(static_cast<T>(T(~T(0)) >> shift));
+        for (int i = 0; i < word_count; ++i)
+        {
+            out.u32[i] = operands[0]->u32[i] >> shift & mask;
+        }
+        break;
+    }
+    case AstType::TernaryIf:
+    {
+        const uint32_t *pred = lanes[node.operands[0]].u32;
+        const T *c = get_lanes<T>(*operands[2]);
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = pred[i] ? b[i] : c[i];
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * Evaluate every node for a full block. Undefined lanes are tracked as a bit
+ * mask per node, as in the bytecode block evaluator.
+ */
+void run_block(const vector<NarrowNode> &nodes, const vector<string> &strings,
+               const int *t, int t0, NarrowLanes *lanes)
+{
+    for (size_t id = 0; id < nodes.size(); ++id)
+    {
+        const NarrowNode &node = nodes[id];
+        NarrowLanes &out = lanes[id];
+        out.undef = get_operand_undef(node, lanes);
+
+        if (node.bits == 8)
+        {
+            run_narrow<uint8_t>(node, nodes, t, t0, lanes, out);
+        }
+        else if (node.bits == 16)
+        {
+            run_narrow<uint16_t>(node, nodes, t, t0, lanes, out);
+        }
+        else if (node.narrow)
+        {
+            run_narrow<uint32_t>(node, nodes, t, t0, lanes, out);
+        }
+        else
+        {
+            run_wide(node, nodes, strings, lanes, out);
+        }
+    }
+}
+
+uint64_t get_operand_undef(const NarrowNode &node, const NarrowLanes *lanes)
+{
+    if (node.type == AstType::Undefined)
+    {
+        return ~uint64_t(0);
+    }
+    if (node.type == AstType::TernaryIf)
+    {
+        // Only the selected arm can make a lane undefined
+        const NarrowLanes &pred = lanes[node.operands[0]];
+        uint64_t taken = 0;
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            taken |= static_cast<uint64_t>(pred.u32[i] != 0) << i;
+        }
+        return pred.undef | (taken & lanes[node.operands[1]].undef) |
+               (~taken & lanes[node.operands[2]].undef);
+    }
+    uint64_t undef = 0;
+    for (int operand : node.operands)
+    {
+        if (operand >= 0)
+        {
+            undef |= lanes[operand].undef;
+        }
+    }
+    return undef;
+}
+
+/**
+ * Run a node that needs every bit of its operands, in signed 32-bit lanes.
+ * Guarded division and subscripts mark their own undefined lanes.
+ */
+void run_wide(const NarrowNode &node, const vector<NarrowNode> &nodes,
+              const vector<string> &strings, NarrowLanes *lanes,
+              NarrowLanes &out)
+{
+    NarrowLanes scratch[2];
+    const int32_t *operands[2] = {};
+    for (int i = 0; i < 2; ++i)
+    {
+        int operand = node.operands[i];
+        if (operand >= 0)
+        {
+            operands[i] = reinterpret_cast<const int32_t *>(
+                read_lanes<uint32_t>(lanes[operand], nodes[operand].bits,
+                                     scratch[i])
+                    .u32);
+        }
+    }
+    if (node.constant)
+    {
+        fill(scratch[1].u32, scratch[1].u32 + kBlockSize,
+             static_cast<uint32_t>(node.value));
+        operands[1] = reinterpret_cast<const int32_t *>(scratch[1].u32);
+    }
+    const int32_t *a = operands[0];
+    const int32_t *b = operands[1];
+    int32_t *v = reinterpret_cast<int32_t *>(out.u32);
+
+    switch (node.type)
+    {
+    case AstType::Undefined:
+    case AstType::String:
+        fill(v, v + kBlockSize, node.value);
+        break;
+    case AstType::Not:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = !a[i];
+        }
+        break;
+    case AstType::Subscript:
+        if (!node.guarded)
+        {
+            for (int i = 0; i < kBlockSize; ++i)
+            {
+                v[i] = strings[a[i]][b[i]];
+            }
+            break;
+        }
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = 0;
+            if (out.undef >> i & 1)
+            {
+                continue;
+            }
+            const string &s = strings[a[i]];
+            if (b[i] < 0 || b[i] >= static_cast<int>(s.length()))
+            {
+                out.undef |= uint64_t(1) << i;
+                continue;
+            }
+            v[i] = s[b[i]];
+        }
+        break;
+    case AstType::Divide:
+    case AstType::Modulo:
+    {
+        bool modulo = node.type == AstType::Modulo;
+        if (!node.guarded)
+        {
+            for (int i = 0; i < kBlockSize; ++i)
+            {
+                v[i] = modulo ? a[i] % b[i] : a[i] / b[i];
+            }
+            break;
+        }
+        // As in the other backends, x / -1 is computed as a negation
+        // because INT_MIN / -1 traps
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            if (b[i] == 0)
+            {
+                out.undef |= uint64_t(1) << i;
+                v[i] = 0;
+            }
+            else if (b[i] == -1)
+            {
+                v[i] = modulo ? 0 : 0u - a[i];
+            }
+            else
+            {
+                v[i] = modulo ? a[i] % b[i] : a[i] / b[i];
+            }
+        }
+        break;
+    }
+    case AstType::BitwiseShiftRight:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = a[i] >> (b[i] & 31);
+        }
+        break;
+    case AstType::LessThan:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = a[i] < b[i];
+        }
+        break;
+    case AstType::LessThanEqual:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = a[i] <= b[i];
+        }
+        break;
+    case AstType::GreaterThan:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = a[i] > b[i];
+        }
+        break;
+    case AstType::GreaterThanEqual:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = a[i] >= b[i];
+        }
+        break;
+    case AstType::Equal:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = a[i] == b[i];
+        }
+        break;
+    case AstType::NotEqual:
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            v[i] = a[i] != b[i];
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+} // namespace bb
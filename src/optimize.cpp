@@ -0,0 +1,466 @@
+#include "optimize.hpp"
+#include "range.hpp"
+
+#include <climits>
+#include <stdexcept>
+
+using namespace std;
+
+namespace bb
+{
+
+AstPtr optimize_node(const Ast &ast);
+AstPtr optimize_constant(AstType type, AstPtr left, int value);
+AstPtr make_integer(int value);
+AstPtr make_undefined();
+AstPtr fold(AstPtr ast);
+bool is_commutative(AstType type);
+AstType mirror_comparison(AstType type);
+bool may_be_string(const Ast &ast);
+bool is_always_int(const Ast &ast);
+int get_integer(const Ast &ast);
+int log2_exact(int value);
+
+AstPtr optimize(AstPtr ast) { return optimize_node(*ast); }
+
+AstPtr optimize_node(const Ast &ast)
+{
+    AstType type = ast.type();
+    switch (type)
+    {
+    case AstType::Undefined:
+        return make_undefined();
+    case AstType::Identifier:
+        return AstPtr(new Identifier());
+    case AstType::Integer:
+        return make_integer(get_integer(ast));
+    case AstType::String:
+        return AstPtr(new String(static_cast<const String &>(ast).get_value()));
+    case AstType::Negate:
+    case AstType::BitwiseComplement:
+    case AstType::Not:
+        return optimize_unary(
+            type,
+            optimize_node(static_cast<const UnaryOperator &>(ast).get_inner()));
+    case AstType::TernaryIf:
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        AstPtr pred = optimize_node(ternary.get_pred());
+        AstType pred_type = pred->type();
+        if (pred_type == AstType::Integer)
+        {
+            return optimize_node(get_integer(*pred) ? ternary.get_pass()
+                                                    : ternary.get_fail());
+        }
+        if (pred_type == AstType::Undefined || pred_type == AstType::String)
+        {
+            return make_undefined();
+        }
+        return AstPtr(new TernaryIf(move(pred),
+                                    optimize_node(ternary.get_pass()),
+                                    optimize_node(ternary.get_fail())));
+    }
+    default:
+    {
+        auto &binary = static_cast<const BinaryOperator &>(ast);
+        return optimize_binary(type, optimize_node(binary.get_left()),
+                               optimize_node(binary.get_right()));
+    }
+    }
+}
+
+AstPtr optimize_unary(AstType type, AstPtr inner)
+{
+    AstType inner_type = inner->type();
+    if (inner_type == AstType::Undefined || inner_type == AstType::String)
+    {
+        return make_undefined();
+    }
+    if (inner_type == AstType::Integer)
+    {
+        return fold(make_unary_node(type, move(inner)));
+    }
+
+    // -(-x) and ~(~x) cancel out, but !(!x) only normalizes x to 0 or 1
+    if (inner_type == type && type != AstType::Not)
+    {
+        auto &unary = static_cast<const UnaryOperator &>(*inner);
+        if (!may_be_string(unary.get_inner()))
+        {
+            return optimize_node(unary.get_inner());
+        }
+    }
+    return make_unary_node(type, move(inner));
+}
+
+AstPtr optimize_binary(AstType type, AstPtr left, AstPtr right)
+{
+    AstType left_type = left->type();
+    AstType right_type = right->type();
+
+    if (left_type == AstType::Undefined || right_type == AstType::Undefined)
+    {
+        return make_undefined();
+    }
+
+    if (type == AstType::Subscript)
+    {
+        if (!may_be_string(*left) || right_type == AstType::String)
+        {
+            return make_undefined();
+        }
+        if (left_type == AstType::String && right_type == AstType::Integer)
+        {
+            return fold(make_binary_node(type, move(left), move(right)));
+        }
+        return make_binary_node(type, move(left), move(right));
+    }
+
+    // Strings are only meaningful as the base of a subscript
+    if (left_type == AstType::String || right_type == AstType::String)
+    {
+        return make_undefined();
+    }
+
+    if (left_type == AstType::Integer && right_type == AstType::Integer)
+    {
+        return fold(make_binary_node(type, move(left), move(right)));
+    }
+
+    // Move constants to the right, where they can be fused
+    if (left_type == AstType::Integer)
+    {
+        if (is_commutative(type))
+        {
+            return optimize_constant(type, move(right), get_integer(*left));
+        }
+        AstType mirrored = mirror_comparison(type);
+        if (mirrored != type)
+        {
+            return optimize_constant(mirrored, move(right),
+                                     get_integer(*left));
+        }
+    }
+
+    if (right_type == AstType::Integer)
+    {
+        return optimize_constant(type, move(left), get_integer(*right));
+    }
+    return make_binary_node(type, move(left), move(right));
+}
+
+/**
+ * Unlike optimize_node, which only optimizes the arm a constant predicate
+ * takes, this receives both arms already optimized
+ */
+AstPtr optimize_ternary(AstPtr pred, AstPtr pass, AstPtr fail)
+{
+    AstType pred_type = pred->type();
+    if (pred_type == AstType::Integer)
+    {
+        return get_integer(*pred) ? move(pass) : move(fail);
+    }
+    if (pred_type == AstType::Undefined || pred_type == AstType::String)
+    {
+        return make_undefined();
+    }
+    return AstPtr(new TernaryIf(move(pred), move(pass), move(fail)));
+}
+
+/** Simplify `left op value`, where left is not itself a constant */
+AstPtr optimize_constant(AstType type, AstPtr left, int value)
+{
+    bool is_int = !may_be_string(*left);
+    bool always_int = is_always_int(*left);
+
+    if ((type == AstType::Divide || type == AstType::Modulo) && value == 0)
+    {
+        return make_undefined();
+    }
+
+    // x - c is x + (-c), which lets it combine with other additions
+    if (type == AstType::Subtract)
+    {
+        type = AstType::Add;
+        value = static_cast<int>(0u - static_cast<unsigned>(value));
+    }
+
+    // Identities
+    if (is_int && ((value == 0 && (type == AstType::Add ||
+                                   type == AstType::BitwiseOr ||
+                                   type == AstType::BitwiseXor ||
+                                   type == AstType::BitwiseShiftLeft ||
+                                   type == AstType::BitwiseShiftRight)) ||
+                   (value == 1 && (type == AstType::Multiply ||
+                                   type == AstType::Divide)) ||
+                   (value == -1 && type == AstType::BitwiseAnd)))
+    {
+        return left;
+    }
+
+    // Absorbing constants, which drop the left operand entirely. It must
+    // never be undefined, or the result would become defined.
+    if (always_int)
+    {
+        if (value == 0 &&
+            (type == AstType::Multiply || type == AstType::BitwiseAnd))
+        {
+            return make_integer(0);
+        }
+        if ((value == 1 || value == -1) && type == AstType::Modulo)
+        {
+            return make_integer(0);
+        }
+        if (value == -1 && type == AstType::BitwiseOr)
+        {
+            return make_integer(-1);
+        }
+    }
+
+    // Reassociate (x op c1) op c2 into x op (c1 op c2)
+    AstType left_type = left->type();
+    if (left_type == type &&
+        (type == AstType::Add || type == AstType::Multiply ||
+         type == AstType::BitwiseAnd || type == AstType::BitwiseOr ||
+         type == AstType::BitwiseXor))
+    {
+        auto &inner = static_cast<const BinaryOperator &>(*left);
+        if (inner.get_right().type() == AstType::Integer)
+        {
+            int first = get_integer(inner.get_right());
+            AstPtr combined = fold(make_binary_node(
+                type, make_integer(first), make_integer(value)));
+            return optimize_constant(type, optimize_node(inner.get_left()),
+                                     get_integer(*combined));
+        }
+    }
+
+    // (x >> a) >> b is x >> (a + b) while the total stays within the word
+    if (left_type == type && (type == AstType::BitwiseShiftLeft ||
+                              type == AstType::BitwiseShiftRight))
+    {
+        auto &inner = static_cast<const BinaryOperator &>(*left);
+        if (inner.get_right().type() == AstType::Integer)
+        {
+            int first = get_integer(inner.get_right());
+            if (first >= 0 && first < 32 && value >= 0 && value < 32 &&
+                first + value < 32)
+            {
+                return optimize_constant(type, optimize_node(inner.get_left()),
+                                         first + value);
+            }
+        }
+    }
+
+    // Strength reduction. A wrapping multiply by 2^k is a shift for every
+    // x, but division truncates toward zero, so divide and modulo only
+    // become shifts and masks when x cannot be negative.
+    int shift = log2_exact(value);
+    if (shift > 0)
+    {
+        if (type == AstType::Multiply)
+        {
+            return make_binary_node(AstType::BitwiseShiftLeft, move(left),
+                                    make_integer(shift));
+        }
+        if (type == AstType::Divide && get_range(*left).min >= 0)
+        {
+            return make_binary_node(AstType::BitwiseShiftRight, move(left),
+                                    make_integer(shift));
+        }
+        if (type == AstType::Modulo && get_range(*left).min >= 0)
+        {
+            int mask = static_cast<int>(static_cast<unsigned>(value) - 1);
+            return make_binary_node(AstType::BitwiseAnd, move(left),
+                                    make_integer(mask));
+        }
+    }
+
+    return make_binary_node(type, move(left), make_integer(value));
+}
+
+AstPtr make_unary_node(AstType type, AstPtr inner)
+{
+    switch (type)
+    {
+    case AstType::Negate:
+        return AstPtr(new Negate(move(inner)));
+    case AstType::BitwiseComplement:
+        return AstPtr(new BitwiseComplement(move(inner)));
+    case AstType::Not:
+        return AstPtr(new Not(move(inner)));
+    default:
+        throw invalid_argument("Unrecognized unary operator");
+    }
+}
+
+AstPtr make_binary_node(AstType type, AstPtr left, AstPtr right)
+{
+    switch (type)
+    {
+    case AstType::Subscript:
+        return AstPtr(new Subscript(move(left), move(right)));
+    case AstType::Add:
+        return make_binary<AddOp>(move(left), move(right));
+    case AstType::Subtract:
+        return make_binary<SubtractOp>(move(left), move(right));
+    case AstType::Multiply:
+        return make_binary<MultiplyOp>(move(left), move(right));
+    case AstType::Divide:
+        if (!needs_guard(type, *left, *right))
+        {
+            return make_binary<UncheckedDivideOp>(move(left), move(right));
+        }
+        return make_binary<DivideOp>(move(left), move(right));
+    case AstType::Modulo:
+        if (!needs_guard(type, *left, *right))
+        {
+            return make_binary<UncheckedModuloOp>(move(left), move(right));
+        }
+        return make_binary<ModuloOp>(move(left), move(right));
+    case AstType::BitwiseAnd:
+        return make_binary<BitwiseAndOp>(move(left), move(right));
+    case AstType::BitwiseOr:
+        return make_binary<BitwiseOrOp>(move(left), move(right));
+    case AstType::BitwiseXor:
+        return make_binary<BitwiseXorOp>(move(left), move(right));
+    case AstType::BitwiseShiftLeft:
+        return make_binary<BitwiseShiftLeftOp>(move(left), move(right));
+    case AstType::BitwiseShiftRight:
+        return make_binary<BitwiseShiftRightOp>(move(left), move(right));
+    case AstType::LessThan:
+        return make_binary<LessThanOp>(move(left), move(right));
+    case AstType::LessThanEqual:
+        return make_binary<LessThanEqualOp>(move(left), move(right));
+    case AstType::GreaterThan:
+        return make_binary<GreaterThanOp>(move(left), move(right));
+    case AstType::GreaterThanEqual:
+        return make_binary<GreaterThanEqualOp>(move(left), move(right));
+    case AstType::Equal:
+        return make_binary<EqualOp>(move(left), move(right));
+    case AstType::NotEqual:
+        return make_binary<NotEqualOp>(move(left), move(right));
+    default:
+        throw invalid_argument("Unrecognized operator");
+    }
+}
+
+AstPtr make_integer(int value) { return AstPtr(new Integer(value)); }
+
+AstPtr make_undefined() { return AstPtr(new Undefined()); }
+
+/** Evaluate a node whose operands are all constants */
+AstPtr fold(AstPtr ast)
+{
+    Value value = ast->eval(0);
+    if (value.is_int())
+    {
+        return make_integer(value.to_int());
+    }
+    return make_undefined();
+}
+
+bool is_commutative(AstType type)
+{
+    return type == AstType::Add || type == AstType::Multiply ||
+           type == AstType::BitwiseAnd || type == AstType::BitwiseOr ||
+           type == AstType::BitwiseXor || type == AstType::Equal ||
+           type == AstType::NotEqual;
+}
+
+/** The comparison with its operands swapped, or type if there is none */
+AstType mirror_comparison(AstType type)
+{
+    switch (type)
+    {
+    case AstType::LessThan:
+        return AstType::GreaterThan;
+    case AstType::LessThanEqual:
+        return AstType::GreaterThanEqual;
+    case AstType::GreaterThan:
+        return AstType::LessThan;
+    case AstType::GreaterThanEqual:
+        return AstType::LessThanEqual;
+    default:
+        return type;
+    }
+}
+
+/** True if the node can evaluate to a string */
+bool may_be_string(const Ast &ast)
+{
+    AstType type = ast.type();
+    if (type == AstType::String)
+    {
+        return true;
+    }
+    if (type == AstType::TernaryIf)
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        return may_be_string(ternary.get_pass()) ||
+               may_be_string(ternary.get_fail());
+    }
+    return false;
+}
+
+/** True if the node evaluates to an integer for every t */
+bool is_always_int(const Ast &ast)
+{
+    AstType type = ast.type();
+    switch (type)
+    {
+    case AstType::Identifier:
+    case AstType::Integer:
+        return true;
+    case AstType::Undefined:
+    case AstType::String:
+    case AstType::Subscript:
+        return false;
+    case AstType::Negate:
+    case AstType::BitwiseComplement:
+    case AstType::Not:
+        return is_always_int(
+            static_cast<const UnaryOperator &>(ast).get_inner());
+    case AstType::TernaryIf:
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        return is_always_int(ternary.get_pred()) &&
+               is_always_int(ternary.get_pass()) &&
+               is_always_int(ternary.get_fail());
+    }
+    default:
+    {
+        auto &binary = static_cast<const BinaryOperator &>(ast);
+        const Ast &right = binary.get_right();
+        if (type == AstType::Divide || type == AstType::Modulo)
+        {
+            return is_always_int(binary.get_left()) &&
+                   right.type() == AstType::Integer && get_integer(right);
+        }
+        return is_always_int(binary.get_left()) && is_always_int(right);
+    }
+    }
+}
+
+int get_integer(const Ast &ast)
+{
+    return static_cast<const Integer &>(ast).get_value();
+}
+
+/** k if value is 2^k for some k > 0, otherwise -1 */
+int log2_exact(int value)
+{
+    unsigned u = value;
+    if (u < 2 || (u & (u - 1)))
+    {
+        return -1;
+    }
+    int k = 0;
+    while (u >>= 1)
+    {
+        ++k;
+    }
+    return k;
+}
+
+} // namespace bb
@@ -1,359 +1,799 @@
 #include "parse.hpp"
 #include "lex.hpp"
+#include "optimize.hpp"
 
+#include <algorithm>
+#include <iterator>
 #include <stdexcept>
 
 namespace bb
 {
 
+/**
+ * How a token acts as an operator: its binding power as a binary operator,
+ * or -1 if it is not one, and the nodes it builds as a binary or prefix
+ * operator
+ */
+struct OperatorInfo
+{
+    int precedence;
+    AstType binary;
+    AstType unary;
+    AstPtr (*make_binary)(AstPtr left, AstPtr right);
+    AstPtr (*make_unary)(AstPtr inner);
+};
+
+const OperatorInfo &get_operator(TokenType type);
 int get_precedence(TokenType type);
 AstPtr make_unary_op(TokenType type, AstPtr inner);
 AstPtr make_binary_op(TokenType type, AstPtr left, AstPtr right);
+AstType get_unary_type(TokenType type);
+AstType get_binary_type(TokenType type);
+template <typename Op> AstPtr make_unary(AstPtr inner);
+AstPtr make_subscript(AstPtr left, AstPtr right);
 
 using TokenIter = vector<Token>::iterator;
 
-AstPtr parse_expression(TokenIter &it, TokenIter &end);
-AstPtr parse_expression_inner(TokenIter &it, TokenIter &end, AstPtr lhs,
-                              int min_precedence);
-AstPtr parse_primary(TokenIter &it, TokenIter &end);
+/**
+ * Groups longer than this are always parsed, which bounds the copies a
+ * Reparser keeps of nested groups
+ */
+const size_t kMaxGroupTokens = 1024;
 
-AstPtr parse(const string &input)
+/** Builds an Ast from the parser's nodes, one heap object per node */
+struct AstBuilder
 {
-    auto tokens = lex(input);
-    if (tokens.empty())
+    using Node = AstPtr;
+
+    Node identifier() { return AstPtr(new Identifier()); }
+    Node integer(int value) { return AstPtr(new Integer(value)); }
+    Node string_literal(const string &s) { return AstPtr(new String(s)); }
+
+    Node unary(TokenType type, Node inner)
     {
-        throw invalid_argument("No tokens to parse");
+        return make_unary_op(type, move(inner));
     }
 
-    TokenIter it = tokens.begin();
-    TokenIter end = tokens.end();
-    AstPtr expr = parse_expression(it, end);
+    Node binary(TokenType type, Node left, Node right)
+    {
+        return make_binary_op(type, move(left), move(right));
+    }
 
-    if (it != tokens.end())
+    Node ternary(Node pred, Node pass, Node fail)
     {
-        throw invalid_argument("Not all tokens consumed");
+        return AstPtr(new TernaryIf(move(pred), move(pass), move(fail)));
     }
 
-    return expr;
-}
+    /** Every group is parsed from its tokens */
+    bool reuse_group(size_t, size_t &, Node &) { return false; }
+    void end_group(size_t, size_t, const Node &) {}
+};
 
 /**
- * An operator-precedence parser
- *
- * See:
- * - https://en.wikipedia.org/wiki/Operator-precedence_parser
- * - https://en.cppreference.com/w/c/language/operator_precedence
- * - https://www.lysator.liu.se/c/ANSI-C-grammar-y.html
+ * Builds a FlatAst from the parser's nodes. The parser finishes every
+ * operand before the node that uses it, so nodes are appended in
+ * evaluation order.
  */
-AstPtr parse_expression(TokenIter &it, TokenIter &end)
+struct FlatBuilder
 {
-    AstPtr lhs = parse_primary(it, end);
-    return parse_expression_inner(it, end, move(lhs), 0);
-}
+    using Node = uint32_t;
 
-AstPtr parse_expression_inner(TokenIter &it, TokenIter &end, AstPtr lhs,
-                              int min_precedence)
-{
-    if (it == end)
-    {
-        return lhs;
-    }
+    FlatAst &ast;
 
-    TokenType lookahead = it->type;
-    int precedence = get_precedence(lookahead);
+    Node identifier() { return add(AstType::Identifier, 0); }
+    Node integer(int value) { return add(AstType::Integer, value); }
 
-    while (precedence >= min_precedence)
+    Node string_literal(const string &s)
     {
-        TokenType op = lookahead;
-        ++it;
-
-        AstPtr rhs;
-        if (op == TokenType::LeftBracket)
-        {
-            rhs = parse_expression(it, end);
-            if (it->type != TokenType::RightBracket)
-            {
-                throw invalid_argument("Unbalanced brackets");
-            }
-            ++it;
-        }
-        else if (op == TokenType::TernaryIf)
-        {
-            auto pass = parse_expression(it, end);
-            if (it->type != TokenType::TernaryElse)
-            {
-                throw invalid_argument("Missing ternary else");
-            }
-            ++it;
-            auto fail = parse_expression(it, end);
-            return AstPtr(new TernaryIf(move(lhs), move(pass), move(fail)));
-        }
-        else
-        {
-            rhs = parse_primary(it, end);
-        }
-
-        if (it == end)
-        {
-            return make_binary_op(op, move(lhs), move(rhs));
-        }
-
-        lookahead = it->type;
-        int next_precedence = get_precedence(lookahead);
-
-        while (next_precedence > precedence)
-        {
-            rhs = parse_expression_inner(it, end, move(rhs), next_precedence);
-            if (it == end)
-            {
-                next_precedence = -1;
-                break;
-            }
-
-            lookahead = it->type;
-            next_precedence = get_precedence(lookahead);
-        }
-
-        precedence = next_precedence;
-        lhs = make_binary_op(op, move(lhs), move(rhs));
+        return add(AstType::String, ast.add_string(s));
     }
 
-    return lhs;
-}
-
-AstPtr parse_primary(TokenIter &it, TokenIter &end)
-{
-    if (it == end)
+    Node unary(TokenType type, Node inner)
     {
-        throw invalid_argument("Expected primary token but got end of input");
+        return add(get_unary_type(type), 0, inner);
     }
 
-    TokenType type = it->type;
-
-    if (type == TokenType::Identifier)
+    Node binary(TokenType type, Node left, Node right)
     {
-        ++it;
-        return AstPtr(new Identifier());
+        return add(get_binary_type(type), 0, left, right);
     }
 
-    if (type == TokenType::Integer)
+    Node ternary(Node pred, Node pass, Node fail)
     {
-        int n = stoi(it->value, 0, 0); // automatically detect base
-        ++it;
-        return AstPtr(new Integer(n));
+        return add(AstType::TernaryIf, 0, pred, pass, fail);
     }
 
-    if (type == TokenType::String)
-    {
-        string s = it->value;
-        ++it;
-        return AstPtr(new String(s));
-    }
+    /** Every group is parsed from its tokens */
+    bool reuse_group(size_t, size_t &, Node &) { return false; }
+    void end_group(size_t, size_t, const Node &) {}
 
-    if (type == TokenType::LeftParen)
+    Node add(AstType type, int value, Node a = 0, Node b = 0, Node c = 0)
     {
-        ++it;
-        AstPtr inner = parse_expression(it, end);
-        if (it == end || it->type != TokenType::RightParen)
-        {
-            throw invalid_argument("Unbalanced parentheses");
-        }
-        ++it;
-        return inner;
+        return ast.add_node(type, value, a, b, c);
     }
+};
 
-    if (type == TokenType::Minus || type == TokenType::BitwiseComplement ||
-        type == TokenType::Not)
-    {
-        ++it;
-        if (it == end)
-        {
-            throw invalid_argument("Expected primary token for unary prefix "
-                                   "operator but got end-of-input");
-        }
-        AstPtr inner = parse_primary(it, end);
-        return make_unary_op(type, move(inner));
-    }
+/** A type error found while building, reported again by check_types */
+class ReparseTypeError : public invalid_argument
+{
+public:
+    ReparseTypeError() : invalid_argument("Type error") {}
+};
 
-    throw invalid_argument("Unexpected primary token");
-}
+/** An optimized tree and the type of the expression it was built from */
+struct TypedAst
+{
+    AstPtr ast;
+    ValueType type;
 
-int get_precedence(TokenType type)
+    /** Depth of the parsed tree, which optimizing can only reduce */
+    uint32_t depth;
+};
+
+/**
+ * Builds each node in optimized form from operands that already are, which
+ * gives the tree that optimize would make of the parsed one, and checks
+ * types on the way up as check_types would on the way down. A group that
+ * the edit left alone is copied from the previous parse instead of parsed.
+ */
+struct ReparseBuilder
 {
-    if (type == TokenType::LeftBracket)
-    {
-        return 11;
-    }
+    using Node = TypedAst;
 
-    if (type == TokenType::Multiply || type == TokenType::Divide ||
-        type == TokenType::Modulo)
-    {
-        return 10;
-    }
+    const TokenEdit &edit;
+    const vector<ParsedGroup> &previous;
+    vector<ParsedGroup> &parsed;
+    size_t reused;
 
-    if (type == TokenType::Plus || type == TokenType::Minus)
+    Node identifier()
     {
-        return 9;
+        return {AstPtr(new Identifier()), ValueType::Integer, 1};
     }
 
-    if (type == TokenType::BitwiseShiftLeft ||
-        type == TokenType::BitwiseShiftRight)
+    Node integer(int value)
     {
-        return 8;
+        return {AstPtr(new Integer(value)), ValueType::Integer, 1};
     }
 
-    if (type == TokenType::LessThan || type == TokenType::LessThanEqual ||
-        type == TokenType::GreaterThan || type == TokenType::GreaterThanEqual)
+    Node string_literal(const string &s)
     {
-        return 7;
+        return {AstPtr(new String(s)), ValueType::String, 1};
     }
 
-    if (type == TokenType::Equal || type == TokenType::NotEqual)
+    Node unary(TokenType type, Node inner)
     {
-        return 6;
+        expect(inner, ValueType::Integer);
+        return {optimize_unary(get_unary_type(type), move(inner.ast)),
+                ValueType::Integer, inner.depth + 1};
     }
 
-    if (type == TokenType::BitwiseAnd)
+    Node binary(TokenType type, Node left, Node right)
     {
-        return 5;
+        AstType ast_type = get_binary_type(type);
+        expect(left, ast_type == AstType::Subscript ? ValueType::String
+                                                    : ValueType::Integer);
+        expect(right, ValueType::Integer);
+        uint32_t depth = max(left.depth, right.depth) + 1;
+        return {optimize_binary(ast_type, move(left.ast), move(right.ast)),
+                ValueType::Integer, depth};
     }
 
-    if (type == TokenType::BitwiseXor)
+    Node ternary(Node pred, Node pass, Node fail)
     {
-        return 4;
+        expect(pred, ValueType::Integer);
+        expect(fail, pass.type);
+        uint32_t depth = max({pred.depth, pass.depth, fail.depth}) + 1;
+        return {optimize_ternary(move(pred.ast), move(pass.ast),
+                                 move(fail.ast)),
+                pass.type, depth};
     }
 
-    if (type == TokenType::BitwiseOr)
+    bool reuse_group(size_t open, size_t &close, Node &node)
     {
-        return 3;
-    }
+        // Map the group to the tokens it was parsed from last time
+        size_t old_open;
+        if (open < edit.prefix)
+        {
+            old_open = open;
+        }
+        else if (open >= edit.new_suffix)
+        {
+            old_open = open - edit.new_suffix + edit.old_suffix;
+        }
+        else
+        {
+            return false;
+        }
 
-    if (type == TokenType::And)
-    {
-        return 2;
+        auto found = lower_bound(
+            previous.begin(), previous.end(), old_open,
+            [](const ParsedGroup &g, size_t i) { return g.open < i; });
+        if (found == previous.end() || found->open != old_open ||
+            (open < edit.prefix && found->close >= edit.prefix))
+        {
+            return false;
+        }
+
+        close = found->close - old_open + open;
+        node = {found->ast->clone(), found->type, found->depth};
+        ++reused;
+        return true;
     }
 
-    if (type == TokenType::Or)
+    void end_group(size_t open, size_t close, const Node &node)
     {
-        return 1;
+        if (close - open <= kMaxGroupTokens)
+        {
+            parsed.push_back(
+                {open, close, node.type, node.depth, node.ast->clone()});
+        }
     }
 
-    if (type == TokenType::TernaryIf)
+    static void expect(const Node &node, ValueType type)
     {
-        return 0;
+        if (node.type != type)
+        {
+            throw ReparseTypeError();
+        }
     }
+};
 
-    return -1;
-}
+/** What ends the expression that a ParseFrame holds */
+enum class FrameType
+{
+    Input,
+    Paren,
+    Bracket,
+    TernaryPass,
+    TernaryFail,
+};
 
-AstPtr make_unary_op(TokenType type, AstPtr inner)
+/**
+ * An expression being parsed. Its operands and pending operators are those
+ * above the given sizes of the parser's stacks.
+ */
+struct ParseFrame
 {
-    if (type == TokenType::Minus)
-    {
-        return AstPtr(new Negate(move(inner)));
-    }
+    FrameType type;
+    size_t operands;
+    size_t operators;
 
-    if (type == TokenType::BitwiseComplement)
-    {
-        return AstPtr(new BitwiseComplement(move(inner)));
-    }
+    /** Index of the token that opened a Paren frame */
+    size_t start;
+};
 
-    if (type == TokenType::Not)
-    {
-        return AstPtr(new Not(move(inner)));
-    }
+/** An operator waiting for its operands, either binary or prefix */
+struct PendingOperator
+{
+    TokenType type;
+    bool unary;
+};
 
-    throw invalid_argument("Unrecognized unary operator");
+/**
+ * The parser's explicit stacks. Nesting only grows these, never the call
+ * stack, so the depth of an expression is limited by memory alone.
+ */
+template <typename Builder> struct ParseState
+{
+    Builder &builder;
+    vector<typename Builder::Node> operands;
+    vector<PendingOperator> operators;
+    vector<ParseFrame> frames;
+};
+
+template <typename Builder>
+typename Builder::Node parse_tokens(vector<Token> &tokens, Builder &builder);
+template <typename Builder>
+void reduce_binary(ParseState<Builder> &state, int min_precedence);
+template <typename Builder> void reduce_unary(ParseState<Builder> &state);
+
+AstPtr parse(const string &input)
+{
+    return parse(input.data(), input.length());
 }
 
-AstPtr make_binary_op(TokenType type, AstPtr left, AstPtr right)
+AstPtr parse(const char *input, size_t length)
 {
-    if (type == TokenType::LeftBracket)
-    {
-        return AstPtr(new Subscript(move(left), move(right)));
-    }
+    auto tokens = lex(input, length);
+    AstBuilder builder;
+    AstPtr expr = parse_tokens(tokens, builder);
+    check_types(*expr);
+    return expr;
+}
 
-    if (type == TokenType::Plus)
-    {
-        return AstPtr(new Add(move(left), move(right)));
-    }
+FlatAst parse_flat(const string &input)
+{
+    return parse_flat(input.data(), input.length());
+}
 
-    if (type == TokenType::Minus)
-    {
-        return AstPtr(new Subtract(move(left), move(right)));
-    }
+FlatAst parse_flat(const char *input, size_t length)
+{
+    auto tokens = lex(input, length);
+
+    // There is at most one node per token, so the nodes never move
+    FlatAst ast;
+    ast.reserve(tokens.size());
+    FlatBuilder builder{ast};
+    parse_tokens(tokens, builder);
+    check_flat_types(ast);
+    return ast;
+}
 
-    if (type == TokenType::Multiply)
-    {
-        return AstPtr(new Multiply(move(left), move(right)));
-    }
+Reparser::Reparser() : unchanged(false), lexed_tokens(0), reused_groups(0) {}
+
+AstPtr Reparser::parse(const string &input)
+{
+    vector<char> next(input.begin(), input.end());
+    TokenEdit edit;
+    vector<Token> next_tokens = relex(source.data(), source.size(), tokens,
+                                      next.data(), next.size(), edit);
 
-    if (type == TokenType::Divide)
+    vector<ParsedGroup> parsed;
+    ReparseBuilder builder{edit, groups, parsed, 0};
+    TypedAst expr;
+    try
     {
-        return AstPtr(new Divide(move(left), move(right)));
+        expr = parse_tokens(next_tokens, builder);
+        ReparseBuilder::expect(expr, ValueType::Integer);
     }
-
-    if (type == TokenType::Modulo)
+    catch (ReparseTypeError &)
     {
-        return AstPtr(new Modulo(move(left), move(right)));
+        // Report the error as check_types would, or a syntax error that
+        // the parser had yet to reach
+        bb::parse(input);
+        throw;
     }
-
-    if (type == TokenType::BitwiseAnd)
+    if (expr.depth > kMaxRecursionDepth)
     {
-        return AstPtr(new BitwiseAnd(move(left), move(right)));
+        throw invalid_argument("Expression is nested too deeply");
     }
 
-    if (type == TokenType::BitwiseOr)
+    unchanged = !tokens.empty() && next_tokens == tokens;
+    lexed_tokens = edit.new_suffix - edit.prefix;
+    reused_groups = builder.reused;
+
+    // Groups outside the edit are still valid at their new indices. The
+    // groups just parsed were added as they closed, so are ordered by the
+    // index of their closing parenthesis instead.
+    auto by_open = [](const ParsedGroup &a, const ParsedGroup &b) {
+        return a.open < b.open;
+    };
+    sort(parsed.begin(), parsed.end(), by_open);
+    vector<ParsedGroup> kept;
+    kept.reserve(groups.size() + parsed.size());
+    for (auto &group : groups)
     {
-        return AstPtr(new BitwiseOr(move(left), move(right)));
+        if (group.close < edit.prefix)
+        {
+            kept.push_back(move(group));
+        }
+        else if (group.open >= edit.old_suffix)
+        {
+            group.open = group.open - edit.old_suffix + edit.new_suffix;
+            group.close = group.close - edit.old_suffix + edit.new_suffix;
+            kept.push_back(move(group));
+        }
     }
+    groups.clear();
+    merge(make_move_iterator(kept.begin()), make_move_iterator(kept.end()),
+          make_move_iterator(parsed.begin()),
+          make_move_iterator(parsed.end()), back_inserter(groups), by_open);
 
-    if (type == TokenType::BitwiseXor)
+    source = move(next);
+    tokens = move(next_tokens);
+    return move(expr.ast);
+}
+
+/**
+ * An operator-precedence parser
+ *
+ * See:
+ * - https://en.wikipedia.org/wiki/Operator-precedence_parser
+ * - https://en.cppreference.com/w/c/language/operator_precedence
+ * - https://www.lysator.liu.se/c/ANSI-C-grammar-y.html
+ *
+ * Binary operators wait on a stack until an operator that binds no tighter
+ * follows, which makes them left associative. Prefix operators apply to
+ * the primary that follows them. Parentheses, subscripts and the arms of a
+ * ternary each open a frame that ends at the first token that cannot
+ * continue it. A ternary binds loosest, so the frame around it ends with
+ * its else arm.
+ */
+template <typename Builder>
+typename Builder::Node parse_tokens(vector<Token> &tokens, Builder &builder)
+{
+    if (tokens.empty())
     {
-        return AstPtr(new BitwiseXor(move(left), move(right)));
+        throw invalid_argument("No tokens to parse");
     }
 
-    if (type == TokenType::BitwiseShiftLeft)
+    ParseState<Builder> state{builder, {}, {}, {}};
+    state.operands.reserve(tokens.size());
+    state.frames.push_back({FrameType::Input, 0, 0, 0});
+
+    TokenIter it = tokens.begin();
+    TokenIter end = tokens.end();
+    bool expect_operand = true;
+    bool after_unary = false;
+    for (;;)
     {
-        return AstPtr(new BitwiseShiftLeft(move(left), move(right)));
+        if (expect_operand)
+        {
+            if (it == end)
+            {
+                throw invalid_argument(
+                    after_unary ? "Expected primary token for unary prefix "
+                                  "operator but got end-of-input"
+                                : "Expected primary token but got end of "
+                                  "input");
+            }
+
+            TokenType type = it->type;
+            ++it;
+            after_unary = false;
+            if (type == TokenType::LeftParen)
+            {
+                size_t open = it - 1 - tokens.begin();
+                size_t close;
+                typename Builder::Node group;
+                if (builder.reuse_group(open, close, group))
+                {
+                    it = tokens.begin() + close + 1;
+                    state.operands.push_back(move(group));
+                    reduce_unary(state);
+                    expect_operand = false;
+                    continue;
+                }
+                state.frames.push_back({FrameType::Paren,
+                                        state.operands.size(),
+                                        state.operators.size(), open});
+                continue;
+            }
+            if (get_operator(type).unary != AstType::Undefined)
+            {
+                state.operators.push_back({type, true});
+                after_unary = true;
+                continue;
+            }
+
+            if (type == TokenType::Identifier)
+            {
+                state.operands.push_back(builder.identifier());
+            }
+            else if (type == TokenType::Integer)
+            {
+                state.operands.push_back(builder.integer((it - 1)->integer));
+            }
+            else if (type == TokenType::String)
+            {
+                state.operands.push_back(
+                    builder.string_literal((it - 1)->value.str()));
+            }
+            else
+            {
+                throw invalid_argument("Unexpected primary token");
+            }
+            reduce_unary(state);
+            expect_operand = false;
+            continue;
+        }
+
+        // A binary operator or a ternary continues the expression
+        TokenType type = it == end ? TokenType::Unknown : it->type;
+        int precedence = get_precedence(type);
+        if (precedence > 0)
+        {
+            reduce_binary(state, precedence);
+            state.operators.push_back({type, false});
+            ++it;
+            if (type == TokenType::LeftBracket)
+            {
+                state.frames.push_back({FrameType::Bracket,
+                                        state.operands.size(),
+                                        state.operators.size(), 0});
+            }
+            expect_operand = true;
+            continue;
+        }
+        if (precedence == 0)
+        {
+            reduce_binary(state, 0);
+            ++it;
+            state.frames.push_back({FrameType::TernaryPass,
+                                    state.operands.size(),
+                                    state.operators.size(), 0});
+            expect_operand = true;
+            continue;
+        }
+
+        // Anything else ends the innermost frame
+        reduce_binary(state, 0);
+        ParseFrame &frame = state.frames.back();
+        switch (frame.type)
+        {
+        case FrameType::Input:
+            if (it != end)
+            {
+                throw invalid_argument("Not all tokens consumed");
+            }
+            return move(state.operands.back());
+        case FrameType::Paren:
+            if (type != TokenType::RightParen)
+            {
+                throw invalid_argument("Unbalanced parentheses");
+            }
+            builder.end_group(frame.start, it - tokens.begin(),
+                              state.operands.back());
+            ++it;
+            state.frames.pop_back();
+            reduce_unary(state);
+            break;
+        case FrameType::Bracket:
+            if (type != TokenType::RightBracket)
+            {
+                throw invalid_argument("Unbalanced brackets");
+            }
+            ++it;
+            state.frames.pop_back();
+            break;
+        case FrameType::TernaryPass:
+            if (type != TokenType::TernaryElse)
+            {
+                throw invalid_argument("Missing ternary else");
+            }
+            ++it;
+            frame.type = FrameType::TernaryFail;
+            frame.operands = state.operands.size();
+            expect_operand = true;
+            break;
+        case FrameType::TernaryFail:
+        {
+            // The same token ends the frame that the ternary is in
+            auto fail = move(state.operands.back());
+            state.operands.pop_back();
+            auto pass = move(state.operands.back());
+            state.operands.pop_back();
+            auto pred = move(state.operands.back());
+            state.operands.pop_back();
+            state.operands.push_back(
+                builder.ternary(move(pred), move(pass), move(fail)));
+            state.frames.pop_back();
+            break;
+        }
+        }
     }
+}
 
-    if (type == TokenType::BitwiseShiftRight)
-    {
-        return AstPtr(new BitwiseShiftRight(move(left), move(right)));
+/**
+ * Build the pending binary operators of the innermost frame that bind at
+ * least as tightly as min_precedence
+ */
+template <typename Builder>
+void reduce_binary(ParseState<Builder> &state, int min_precedence)
+{
+    size_t base = state.frames.back().operators;
+    while (state.operators.size() > base &&
+           get_precedence(state.operators.back().type) >= min_precedence)
+    {
+        TokenType type = state.operators.back().type;
+        state.operators.pop_back();
+        auto right = move(state.operands.back());
+        state.operands.pop_back();
+        auto left = move(state.operands.back());
+        state.operands.pop_back();
+        state.operands.push_back(
+            state.builder.binary(type, move(left), move(right)));
     }
+}
 
-    if (type == TokenType::LessThan)
+/** Apply the prefix operators that precede the primary just parsed */
+template <typename Builder> void reduce_unary(ParseState<Builder> &state)
+{
+    size_t base = state.frames.back().operators;
+    while (state.operators.size() > base && state.operators.back().unary)
     {
-        return AstPtr(new LessThan(move(left), move(right)));
+        TokenType type = state.operators.back().type;
+        state.operators.pop_back();
+        auto inner = move(state.operands.back());
+        state.operands.pop_back();
+        state.operands.push_back(state.builder.unary(type, move(inner)));
     }
+}
 
-    if (type == TokenType::GreaterThan)
-    {
-        return AstPtr(new GreaterThan(move(left), move(right)));
+/**
+ * Strings are the only values besides integers, so every node's type is
+ * known from its operands. An Undefined node, which the optimizer may
+ * produce, fits wherever it appears.
+ *
+ * Nodes are checked after their operands, as a recursive check would, but
+ * from an explicit stack.
+ */
+void check_types(const Ast &ast, ValueType expected)
+{
+    struct Item
+    {
+        const Ast *node;
+        ValueType expected;
+        bool visited;
+    };
+
+    vector<Item> stack{{&ast, expected, false}};
+    while (!stack.empty())
+    {
+        Item item = stack.back();
+        stack.pop_back();
+        const Ast &node = *item.node;
+        AstType type = node.type();
+        if (type == AstType::Undefined ||
+            (type == AstType::TernaryIf && item.visited))
+        {
+            continue;
+        }
+
+        if (!item.visited)
+        {
+            stack.push_back({item.node, item.expected, true});
+            if (type == AstType::TernaryIf)
+            {
+                auto &ternary = static_cast<const TernaryIf &>(node);
+                stack.push_back({&ternary.get_fail(), item.expected, false});
+                stack.push_back({&ternary.get_pass(), item.expected, false});
+                stack.push_back(
+                    {&ternary.get_pred(), ValueType::Integer, false});
+            }
+            else if (type == AstType::Negate ||
+                     type == AstType::BitwiseComplement ||
+                     type == AstType::Not)
+            {
+                auto &unary = static_cast<const UnaryOperator &>(node);
+                stack.push_back(
+                    {&unary.get_inner(), ValueType::Integer, false});
+            }
+            else if (type != AstType::Identifier &&
+                     type != AstType::Integer && type != AstType::String)
+            {
+                auto &binary = static_cast<const BinaryOperator &>(node);
+                stack.push_back(
+                    {&binary.get_right(), ValueType::Integer, false});
+                stack.push_back({&binary.get_left(),
+                                 type == AstType::Subscript
+                                     ? ValueType::String
+                                     : ValueType::Integer,
+                                 false});
+            }
+            continue;
+        }
+
+        ValueType actual = type == AstType::String ? ValueType::String
+                                                   : ValueType::Integer;
+        if (actual != item.expected)
+        {
+            throw invalid_argument(
+                string("Type error: expected ") +
+                (item.expected == ValueType::String ? "a string"
+                                                    : "an integer") +
+                " but found " + node.operator string());
+        }
     }
+}
+
+int get_precedence(TokenType type)
+{
+    return get_operator(type).precedence;
+}
 
-    if (type == TokenType::LessThanEqual)
+AstType get_unary_type(TokenType type)
+{
+    AstType unary = get_operator(type).unary;
+    if (unary == AstType::Undefined)
     {
-        return AstPtr(new LessThanEqual(move(left), move(right)));
+        throw invalid_argument("Unrecognized unary operator");
     }
+    return unary;
+}
 
-    if (type == TokenType::GreaterThanEqual)
+AstType get_binary_type(TokenType type)
+{
+    const OperatorInfo &info = get_operator(type);
+    if (!info.make_binary)
     {
-        return AstPtr(new GreaterThanEqual(move(left), move(right)));
+        throw invalid_argument("Unrecognized operator");
     }
+    return info.binary;
+}
 
-    if (type == TokenType::Equal)
+AstPtr make_unary_op(TokenType type, AstPtr inner)
+{
+    const OperatorInfo &info = get_operator(type);
+    if (!info.make_unary)
     {
-        return AstPtr(new Equal(move(left), move(right)));
+        throw invalid_argument("Unrecognized unary operator");
     }
+    return info.make_unary(move(inner));
+}
 
-    if (type == TokenType::NotEqual)
+AstPtr make_binary_op(TokenType type, AstPtr left, AstPtr right)
+{
+    const OperatorInfo &info = get_operator(type);
+    if (!info.make_binary)
     {
-        return AstPtr(new NotEqual(move(left), move(right)));
+        throw invalid_argument("Unrecognized operator");
     }
+    return info.make_binary(move(left), move(right));
+}
 
-    throw invalid_argument("Unrecognized operator");
+template <typename Op> AstPtr make_unary(AstPtr inner)
+{
+    return AstPtr(new UnaryNode<Op>(move(inner)));
+}
+
+AstPtr make_subscript(AstPtr left, AstPtr right)
+{
+    return AstPtr(new Subscript(move(left), move(right)));
+}
+
+const OperatorInfo &get_operator(TokenType type)
+{
+    // Rows are in TokenType order. The logical operators bind but have no
+    // node, so they fail when their expression is built.
+    static const OperatorInfo operators[] = {
+        // Unknown, Identifier, Integer, String, LeftParen, RightParen
+        {-1, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        {-1, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        {-1, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        {-1, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        {-1, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        {-1, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        // LeftBracket, RightBracket
+        {11, AstType::Subscript, AstType::Undefined, make_subscript, nullptr},
+        {-1, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        // Plus, Minus, Multiply, Divide, Modulo
+        {9, AstType::Add, AstType::Undefined, make_binary<AddOp>, nullptr},
+        {9, AstType::Subtract, AstType::Negate, make_binary<SubtractOp>,
+         make_unary<NegateOp>},
+        {10, AstType::Multiply, AstType::Undefined, make_binary<MultiplyOp>,
+         nullptr},
+        {10, AstType::Divide, AstType::Undefined, make_binary<DivideOp>,
+         nullptr},
+        {10, AstType::Modulo, AstType::Undefined, make_binary<ModuloOp>,
+         nullptr},
+        // BitwiseAnd, BitwiseOr, BitwiseXor
+        {5, AstType::BitwiseAnd, AstType::Undefined, make_binary<BitwiseAndOp>,
+         nullptr},
+        {3, AstType::BitwiseOr, AstType::Undefined, make_binary<BitwiseOrOp>,
+         nullptr},
+        {4, AstType::BitwiseXor, AstType::Undefined, make_binary<BitwiseXorOp>,
+         nullptr},
+        // BitwiseShiftLeft, BitwiseShiftRight, BitwiseComplement
+        {8, AstType::BitwiseShiftLeft, AstType::Undefined,
+         make_binary<BitwiseShiftLeftOp>, nullptr},
+        {8, AstType::BitwiseShiftRight, AstType::Undefined,
+         make_binary<BitwiseShiftRightOp>, nullptr},
+        {-1, AstType::Undefined, AstType::BitwiseComplement, nullptr,
+         make_unary<BitwiseComplementOp>},
+        // LessThan, GreaterThan, LessThanEqual, GreaterThanEqual
+        {7, AstType::LessThan, AstType::Undefined, make_binary<LessThanOp>,
+         nullptr},
+        {7, AstType::GreaterThan, AstType::Undefined,
+         make_binary<GreaterThanOp>, nullptr},
+        {7, AstType::LessThanEqual, AstType::Undefined,
+         make_binary<LessThanEqualOp>, nullptr},
+        {7, AstType::GreaterThanEqual, AstType::Undefined,
+         make_binary<GreaterThanEqualOp>, nullptr},
+        // Equal, NotEqual, Not
+        {6, AstType::Equal, AstType::Undefined, make_binary<EqualOp>, nullptr},
+        {6, AstType::NotEqual, AstType::Undefined, make_binary<NotEqualOp>,
+         nullptr},
+        {-1, AstType::Undefined, AstType::Not, nullptr, make_unary<NotOp>},
+        // And, Or, TernaryIf, TernaryElse
+        {2, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        {1, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        {0, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+        {-1, AstType::Undefined, AstType::Undefined, nullptr, nullptr},
+    };
+    static_assert(sizeof(operators) / sizeof(operators[0]) == kTokenTypeCount,
+                  "Every token type needs a row");
+    return operators[static_cast<int>(type)];
 }
 
 } // namespace bb
@@ -0,0 +1,193 @@
+#include "period.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+namespace bb
+{
+
+/** Scattered points of t that a period is checked at */
+const uint32_t kPeriodCheckPoints = 8;
+
+size_t get_period_bytes(uint64_t period);
+
+PeriodicProgram::PeriodicProgram(const Ast &ast, size_t max_bytes)
+    : program(compile(ast)), period(0)
+{
+    uint32_t max_period = 0;
+    for (uint64_t p = 1;
+         p <= uint64_t(1) << 31 && get_period_bytes(p) <= max_bytes; p *= 2)
+    {
+        max_period = p;
+    }
+
+    // Release the rendered samples if the expression has to run live
+    if (!max_period || !find_period(max_period))
+    {
+        period = 0;
+        vector<uint8_t>().swap(samples);
+        vector<uint64_t>().swap(defined_words);
+    }
+}
+
+PeriodicProgram::PeriodicProgram(const Ast &ast, vector<uint8_t> samples,
+                                 vector<uint64_t> defined_words)
+    : program(compile(ast)), period(samples.size()), samples(move(samples)),
+      defined_words(move(defined_words))
+{
+    if (!period || period > uint32_t(1) << 31 || (period & (period - 1)) ||
+        this->samples.size() != period)
+    {
+        throw invalid_argument("Period must be a power of two");
+    }
+    if (!this->defined_words.empty() &&
+        this->defined_words.size() != (period + 63) / 64)
+    {
+        throw invalid_argument("Expected a defined bit per sample");
+    }
+}
+
+void PeriodicProgram::eval_block(int t0, int n, int *out, bool *defined) const
+{
+    if (!period)
+    {
+        program.eval_block(t0, n, out, defined);
+        return;
+    }
+    uint32_t mask = period - 1;
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t index = (static_cast<uint32_t>(t0) + i) & mask;
+        out[i] = samples[index];
+        if (defined)
+        {
+            defined[i] = is_defined(index);
+        }
+    }
+}
+
+void PeriodicProgram::eval_block(const int *t, int n, int *out,
+                                 bool *defined) const
+{
+    if (!period)
+    {
+        program.eval_block(t, n, out, defined);
+        return;
+    }
+    uint32_t mask = period - 1;
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t index = static_cast<uint32_t>(t[i]) & mask;
+        out[i] = samples[index];
+        if (defined)
+        {
+            defined[i] = is_defined(index);
+        }
+    }
+}
+
+size_t PeriodicProgram::get_cache_bytes() const
+{
+    return samples.size() + defined_words.size() * sizeof(uint64_t);
+}
+
+bool PeriodicProgram::is_defined(uint32_t index) const
+{
+    return defined_words.empty() ||
+           (defined_words[index >> 6] >> (index & 63) & 1);
+}
+
+/**
+ * Render max_period samples from t = 0 and take the shortest power of two
+ * they repeat with, or max_period itself, as the period. Returns false if
+ * the period does not hold at the verification points.
+ */
+bool PeriodicProgram::find_period(uint32_t max_period)
+{
+    samples.resize(max_period);
+    defined_words.assign((max_period + 63) / 64, 0);
+    int values[kPeriodCheckSamples];
+    bool defined[kPeriodCheckSamples];
+    bool all_defined = true;
+    for (uint32_t offset = 0; offset < max_period;
+         offset += kPeriodCheckSamples)
+    {
+        int n = min<uint32_t>(kPeriodCheckSamples, max_period - offset);
+        program.eval_block(static_cast<int>(offset), n, values, defined);
+        for (int i = 0; i < n; ++i)
+        {
+            uint32_t index = offset + i;
+            samples[index] = values[i];
+            defined_words[index >> 6] |= uint64_t(defined[i]) << (index & 63);
+            all_defined = all_defined && defined[i];
+        }
+    }
+
+    period = max_period;
+    for (uint32_t p = 1; p < max_period; p *= 2)
+    {
+        if (!equal(samples.begin() + p, samples.end(), samples.begin()))
+        {
+            continue;
+        }
+        bool repeats = true;
+        for (uint32_t i = p; i < max_period && repeats && !all_defined; ++i)
+        {
+            repeats = is_defined(i) == is_defined(i - p);
+        }
+        if (repeats)
+        {
+            period = p;
+            break;
+        }
+    }
+    samples.resize(period);
+    samples.shrink_to_fit();
+    defined_words.resize(all_defined ? 0 : (period + 63) / 64);
+    defined_words.shrink_to_fit();
+
+    // Check just past the rendered samples, where a period as long as the
+    // cache has not been seen to repeat, just below zero, and at scattered
+    // points whose high bits of t differ from those that were rendered
+    if (!check_period(max_period) || !check_period(0u - kPeriodCheckSamples))
+    {
+        return false;
+    }
+    for (uint32_t k = 1; k <= kPeriodCheckPoints; ++k)
+    {
+        if (!check_period(k * 0x9E3779B9u))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** True if kPeriodCheckSamples samples from t0 match the cached period */
+bool PeriodicProgram::check_period(uint32_t t0) const
+{
+    int values[kPeriodCheckSamples];
+    bool defined[kPeriodCheckSamples];
+    program.eval_block(static_cast<int>(t0), kPeriodCheckSamples, values,
+                       defined);
+    for (int i = 0; i < kPeriodCheckSamples; ++i)
+    {
+        uint32_t index = (t0 + i) & (period - 1);
+        if (static_cast<uint8_t>(values[i]) != samples[index] ||
+            defined[i] != is_defined(index))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Bytes needed to cache a period, with a bit per sample for definedness */
+size_t get_period_bytes(uint64_t period)
+{
+    return period + (period + 63) / 64 * sizeof(uint64_t);
+}
+
+} // namespace bb
@@ -0,0 +1,66 @@
+#include "preset.hpp"
+#include "cache.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace bb
+{
+
+struct CrowdSource
+{
+    static constexpr const char *text =
+        "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+};
+
+struct FortyTwoSource
+{
+    static constexpr const char *text = "t*(42&t>>10)";
+};
+
+struct SierpinskiSource
+{
+    static constexpr const char *text = "t&t>>8";
+};
+
+struct MelodySource
+{
+    static constexpr const char *text =
+        "\"0123456789\"[t>>10&7]*(t&0x3FF)>>4";
+};
+
+const vector<BuiltinPreset> &get_builtin_presets()
+{
+    static const vector<BuiltinPreset> presets = {
+        {"crowd", CrowdSource::text, Preset<CrowdSource>::eval_block},
+        {"forty-two", FortyTwoSource::text,
+         Preset<FortyTwoSource>::eval_block},
+        {"sierpinski", SierpinskiSource::text,
+         Preset<SierpinskiSource>::eval_block},
+        {"melody", MelodySource::text, Preset<MelodySource>::eval_block},
+    };
+    return presets;
+}
+
+/**
+ * A preset evaluates the expression as written, which gives the same
+ * samples as any tree that canonicalizes to the same one
+ */
+const BuiltinPreset *find_builtin_preset(const Ast &ast)
+{
+    string text = *canonicalize(ast).ast;
+    for (const BuiltinPreset &preset : get_builtin_presets())
+    {
+        if (string(*canonicalize(*optimize(parse(preset.text))).ast) == text)
+        {
+            return &preset;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace bb
@@ -0,0 +1,240 @@
+#include "range.hpp"
+
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+namespace bb
+{
+
+Range make_range(int64_t min, int64_t max);
+Range get_quotient_range(Range a, int64_t min, int64_t max);
+Range get_shift_count(Range b);
+bool needs_division_guard(Range a, Range b);
+bool get_string_bounds(const Ast &ast, size_t &min_length, Range &chars);
+
+Range get_range(const Ast &ast) { return ast.get_range(); }
+
+bool needs_guard(AstType type, const Ast &left, const Ast &right)
+{
+    if (type == AstType::Divide || type == AstType::Modulo)
+    {
+        return needs_division_guard(get_range(left), get_range(right));
+    }
+    if (type == AstType::Subscript)
+    {
+        size_t min_length;
+        Range chars;
+        if (!get_string_bounds(left, min_length, chars))
+        {
+            return true;
+        }
+        Range index = get_range(right);
+        return index.min < 0 || index.max >= static_cast<int64_t>(min_length);
+    }
+    return false;
+}
+
+bool needs_guard(const Ast &ast)
+{
+    AstType type = ast.type();
+    if (type != AstType::Divide && type != AstType::Modulo &&
+        type != AstType::Subscript)
+    {
+        return false;
+    }
+    auto &binary = static_cast<const BinaryOperator &>(ast);
+    return needs_guard(type, binary.get_left(), binary.get_right());
+}
+
+Range get_subscript_range(const Ast &left, Range index)
+{
+    size_t min_length;
+    Range chars;
+    if (!get_string_bounds(left, min_length, chars))
+    {
+        return kFullRange;
+    }
+    if (index.min < 0 || index.max >= static_cast<int64_t>(min_length))
+    {
+        chars = unite(chars, Range{0, 0});
+    }
+    return chars;
+}
+
+/** The range [min, max], or the full range if the operation may wrap */
+Range make_range(int64_t min, int64_t max)
+{
+    if (min < INT_MIN || max > INT_MAX)
+    {
+        return kFullRange;
+    }
+    return Range{min, max};
+}
+
+Range unite(Range a, Range b)
+{
+    return Range{std::min(a.min, b.min), std::max(a.max, b.max)};
+}
+
+Range get_unary_range(AstType type, Range a)
+{
+    switch (type)
+    {
+    case AstType::Negate:
+        return make_range(-a.max, -a.min);
+    case AstType::BitwiseComplement:
+        return Range{~a.max, ~a.min};
+    default:
+        return Range{0, 1};
+    }
+}
+
+Range get_binary_range(AstType type, Range a, Range b)
+{
+    switch (type)
+    {
+    case AstType::Add:
+        return make_range(a.min + b.min, a.max + b.max);
+    case AstType::Subtract:
+        return make_range(a.min - b.max, a.max - b.min);
+    case AstType::Multiply:
+    {
+        int64_t p[] = {a.min * b.min, a.min * b.max, a.max * b.min,
+                       a.max * b.max};
+        return make_range(*min_element(p, p + 4), *max_element(p, p + 4));
+    }
+    case AstType::Divide:
+    {
+        // Split the divisor around zero, where the quotient is undefined
+        Range result{0, 0};
+        bool empty = !b.contains(0);
+        if (b.min < 0)
+        {
+            Range q =
+                get_quotient_range(a, b.min, std::min(b.max, -int64_t(1)));
+            result = empty ? q : unite(result, q);
+            empty = false;
+        }
+        if (b.max > 0)
+        {
+            Range q = get_quotient_range(a, std::max(b.min, int64_t(1)), b.max);
+            result = empty ? q : unite(result, q);
+        }
+        return make_range(result.min, result.max);
+    }
+    case AstType::Modulo:
+    {
+        // The remainder takes the sign of the dividend and is smaller than
+        // the divisor in magnitude
+        int64_t bound = std::max(-b.min, b.max) - 1;
+        bound = std::max(bound, int64_t(0));
+        return Range{a.min < 0 ? -std::min(-a.min, bound) : 0,
+                     a.max > 0 ? std::min(a.max, bound) : 0};
+    }
+    case AstType::BitwiseAnd:
+        if (a.min >= 0 && b.min >= 0)
+        {
+            return Range{0, std::min(a.max, b.max)};
+        }
+        if (a.min >= 0 || b.min >= 0)
+        {
+            return Range{0, a.min >= 0 ? a.max : b.max};
+        }
+        return kFullRange;
+    case AstType::BitwiseOr:
+    case AstType::BitwiseXor:
+    {
+        if (a.min < 0 || b.min < 0)
+        {
+            return kFullRange;
+        }
+        int64_t mask = 0;
+        while (mask < std::max(a.max, b.max))
+        {
+            mask = mask * 2 + 1;
+        }
+        return Range{0, mask};
+    }
+    case AstType::BitwiseShiftLeft:
+    {
+        Range count = get_shift_count(b);
+        int64_t low = int64_t(1) << count.min;
+        int64_t high = int64_t(1) << count.max;
+        return make_range(std::min(a.min * low, a.min * high),
+                          std::max(a.max * low, a.max * high));
+    }
+    case AstType::BitwiseShiftRight:
+    {
+        Range count = get_shift_count(b);
+        return Range{a.min >> (a.min < 0 ? count.min : count.max),
+                     a.max >> (a.max < 0 ? count.max : count.min)};
+    }
+    default:
+        return Range{0, 1};
+    }
+}
+
+/** Range of a / b for a divisor in [min, max], which does not contain 0 */
+Range get_quotient_range(Range a, int64_t min, int64_t max)
+{
+    int64_t q[] = {a.min / min, a.min / max, a.max / min, a.max / max};
+    return Range{*min_element(q, q + 4), *max_element(q, q + 4)};
+}
+
+/** Shift counts use their low five bits */
+Range get_shift_count(Range b)
+{
+    if (b.min >= 0 && b.max <= 31)
+    {
+        return b;
+    }
+    return Range{0, 31};
+}
+
+bool needs_division_guard(Range a, Range b)
+{
+    return b.contains(0) || (b.contains(-1) && a.contains(INT_MIN));
+}
+
+/**
+ * Find the shortest string and the range of characters that a string
+ * expression may evaluate to. Returns false unless every value the
+ * expression can produce is a string constant.
+ */
+bool get_string_bounds(const Ast &ast, size_t &min_length, Range &chars)
+{
+    if (ast.type() == AstType::TernaryIf)
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        size_t fail_length;
+        Range fail_chars;
+        if (!get_string_bounds(ternary.get_pass(), min_length, chars) ||
+            !get_string_bounds(ternary.get_fail(), fail_length, fail_chars))
+        {
+            return false;
+        }
+        min_length = std::min(min_length, fail_length);
+        chars = unite(chars, fail_chars);
+        return true;
+    }
+
+    if (ast.type() != AstType::String)
+    {
+        return false;
+    }
+
+    // Characters are read as char, as in the tree
+    const string &s = static_cast<const String &>(ast).get_value();
+    min_length = s.length();
+    chars = Range{0, 0};
+    if (!s.empty())
+    {
+        chars = Range{*min_element(s.begin(), s.end()),
+                      *max_element(s.begin(), s.end())};
+    }
+    return true;
+}
+
+} // namespace bb
@@ -0,0 +1,321 @@
+#include "tier.hpp"
+
+#include "jit.hpp"
+#include "lookup.hpp"
+#include "period.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+using namespace std;
+
+namespace bb
+{
+
+/**
+ * State shared between a TieredProgram and its compiler thread. Each tier is
+ * written before `ready` is published with release ordering, so a reader
+ * that observes a tier through an acquire load may use it without locking.
+ */
+struct TierState
+{
+    AstPtr ast;
+    unique_ptr<Program> program;
+    unique_ptr<JitProgram> jit;
+    unique_ptr<PeriodicProgram> periodic;
+    unique_ptr<LookupProgram> table;
+    size_t period_bytes;
+    chrono::steady_clock::time_point start;
+    int64_t ready_ns[kTierCount];
+
+    atomic<int> ready;
+    atomic<bool> cancelled;
+
+    /** Programs evaluating with these tiers */
+    atomic<int> owners;
+
+    mutex done_mutex;
+    condition_variable done_cond;
+    bool done;
+};
+
+int64_t elapsed_ns(chrono::steady_clock::time_point since);
+void init_state(TierState &state, AstPtr ast, size_t period_bytes);
+void init_stats(TierStats *stats);
+void publish_tier(TierState &state, Tier tier);
+void compile_tiers(shared_ptr<TierState> state);
+
+TieredProgram::TieredProgram(AstPtr ast, size_t period_bytes)
+    : state(new TierState), created_ns(0)
+{
+    init_state(*state, move(ast), period_bytes);
+    init_stats(stats);
+
+    try
+    {
+        thread(compile_tiers, state).detach();
+    }
+    catch (system_error &)
+    {
+        // Without a thread, pay for compilation up front instead of staying
+        // on the slowest tier forever
+        compile_tiers(state);
+    }
+}
+
+TieredProgram::TieredProgram(AstPtr ast, unique_ptr<PeriodicProgram> periodic)
+    : state(new TierState), created_ns(0)
+{
+    init_state(*state, move(ast), 0);
+    init_stats(stats);
+
+    // A period that is already known is the last tier, so nothing is left
+    // to compile
+    state->periodic = move(periodic);
+    if (state->periodic->is_periodic())
+    {
+        publish_tier(*state, Tier::Period);
+    }
+    state->done = true;
+}
+
+TieredProgram::TieredProgram(shared_ptr<TierState> state)
+    : state(move(state))
+{
+    created_ns = elapsed_ns(this->state->start);
+    ++this->state->owners;
+    init_stats(stats);
+}
+
+TieredProgram::~TieredProgram()
+{
+    if (--state->owners == 0)
+    {
+        state->cancelled = true;
+    }
+}
+
+unique_ptr<TieredProgram> TieredProgram::share() const
+{
+    return unique_ptr<TieredProgram>(new TieredProgram(state));
+}
+
+void TieredProgram::eval_block(int t0, int n, int *out, bool *defined)
+{
+    Clock::time_point start;
+    Tier tier = begin_block(start);
+    if (tier == Tier::Table)
+    {
+        state->table->eval_block(t0, n, out, defined);
+    }
+    else if (tier == Tier::Period)
+    {
+        state->periodic->eval_block(t0, n, out, defined);
+    }
+    else if (tier == Tier::Native)
+    {
+        state->jit->eval_block(t0, n, out, defined);
+    }
+    else if (tier == Tier::Bytecode)
+    {
+        state->program->eval_block(t0, n, out, defined);
+    }
+    else
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            bool is_defined = true;
+            int value = state->ast->eval_int(t0 + i, is_defined);
+            out[i] = is_defined ? value : 0;
+            if (defined)
+            {
+                defined[i] = is_defined;
+            }
+        }
+    }
+    end_block(tier, start, n);
+}
+
+void TieredProgram::eval_block(const int *t, int n, int *out, bool *defined)
+{
+    Clock::time_point start;
+    Tier tier = begin_block(start);
+    if (tier == Tier::Table)
+    {
+        state->table->eval_block(t, n, out, defined);
+    }
+    else if (tier == Tier::Period)
+    {
+        state->periodic->eval_block(t, n, out, defined);
+    }
+    else if (tier == Tier::Native)
+    {
+        state->jit->eval_block(t, n, out, defined);
+    }
+    else if (tier == Tier::Bytecode)
+    {
+        state->program->eval_block(t, n, out, defined);
+    }
+    else
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            bool is_defined = true;
+            int value = state->ast->eval_int(t[i], is_defined);
+            out[i] = is_defined ? value : 0;
+            if (defined)
+            {
+                defined[i] = is_defined;
+            }
+        }
+    }
+    end_block(tier, start, n);
+}
+
+Tier TieredProgram::get_tier() const
+{
+    return static_cast<Tier>(state->ready.load(memory_order_acquire));
+}
+
+void TieredProgram::wait() const
+{
+    unique_lock<mutex> lock(state->done_mutex);
+    state->done_cond.wait(lock, [this] { return state->done; });
+}
+
+TierStats TieredProgram::get_stats(Tier tier) const
+{
+    int index = static_cast<int>(tier);
+    TierStats s = stats[index];
+    // Tiers below the one in use may have been skipped, and keep -1
+    if (index <= state->ready.load(memory_order_acquire) &&
+        state->ready_ns[index] >= 0)
+    {
+        s.ready_ns = max<int64_t>(state->ready_ns[index] - created_ns, 0);
+    }
+    return s;
+}
+
+Tier TieredProgram::begin_block(Clock::time_point &start)
+{
+    start = Clock::now();
+    return get_tier();
+}
+
+void TieredProgram::end_block(Tier tier, Clock::time_point start, int n)
+{
+    Clock::time_point end = Clock::now();
+    TierStats &s = stats[static_cast<int>(tier)];
+    if (s.first_block_ns < 0)
+    {
+        s.first_block_ns =
+            chrono::duration_cast<chrono::nanoseconds>(end - state->start)
+                .count() -
+            created_ns;
+    }
+    s.samples += n;
+    s.eval_ns +=
+        chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+}
+
+const char *get_tier_name(Tier tier)
+{
+    switch (tier)
+    {
+    case Tier::Tree:
+        return "tree";
+    case Tier::Bytecode:
+        return "vm";
+    case Tier::Native:
+        return "jit";
+    case Tier::Period:
+        return "period";
+    case Tier::Table:
+        return "table";
+    }
+    return "unknown";
+}
+
+int64_t elapsed_ns(chrono::steady_clock::time_point since)
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now() - since)
+        .count();
+}
+
+void init_state(TierState &state, AstPtr ast, size_t period_bytes)
+{
+    state.ast = move(ast);
+    state.period_bytes = period_bytes;
+    state.start = chrono::steady_clock::now();
+    for (int i = 0; i < kTierCount; ++i)
+    {
+        state.ready_ns[i] = -1;
+    }
+    state.ready_ns[0] = 0;
+    state.ready = static_cast<int>(Tier::Tree);
+    state.cancelled = false;
+    state.owners = 1;
+    state.done = false;
+}
+
+void init_stats(TierStats *stats)
+{
+    for (int i = 0; i < kTierCount; ++i)
+    {
+        stats[i] = TierStats{-1, -1, 0, 0};
+    }
+}
+
+void publish_tier(TierState &state, Tier tier)
+{
+    int index = static_cast<int>(tier);
+    state.ready_ns[index] = elapsed_ns(state.start);
+    state.ready.store(index, memory_order_release);
+}
+
+void compile_tiers(shared_ptr<TierState> state)
+{
+    if (!state->cancelled)
+    {
+        state->program.reset(new Program(compile(*state->ast)));
+        publish_tier(*state, Tier::Bytecode);
+    }
+
+    // Off x86-64 the JIT would only wrap another copy of the bytecode
+    if (!state->cancelled && JitProgram::is_supported())
+    {
+        state->jit.reset(new JitProgram(*state->ast));
+        if (state->jit->is_native())
+        {
+            publish_tier(*state, Tier::Native);
+        }
+    }
+
+    // Every bit of a table entry is exact, as for the other tiers
+    if (!state->cancelled && is_lookup_sized(*state->ast, kAllBits))
+    {
+        state->table.reset(new LookupProgram(*state->ast, kAllBits));
+        publish_tier(*state, Tier::Table);
+    }
+    else if (!state->cancelled && state->period_bytes)
+    {
+        state->periodic.reset(
+            new PeriodicProgram(*state->ast, state->period_bytes));
+        if (state->periodic->is_periodic())
+        {
+            publish_tier(*state, Tier::Period);
+        }
+    }
+
+    lock_guard<mutex> lock(state->done_mutex);
+    state->done = true;
+    state->done_cond.notify_all();
+}
+
+} // namespace bb
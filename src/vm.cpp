@@ -0,0 +1,578 @@
+#include "vm.hpp"
+#include "range.hpp"
+
+#include <algorithm>
+
+namespace bb
+{
+
+/** Programs needing more stack slots than this allocate their stack */
+const int kInlineStackSize = 256;
+
+struct CompileState
+{
+    vector<Instruction> code;
+    vector<string> strings;
+    int depth;
+    int max_depth;
+    bool block;
+};
+
+void emit(CompileState &state, OpCode op, int arg = 0);
+void emit_push(CompileState &state, OpCode op, int arg = 0);
+void compile_node(const Ast &ast, ValueType expected, CompileState &state);
+OpCode get_unary_opcode(AstType type);
+OpCode get_binary_opcode(AstType type);
+OpCode get_constant_opcode(AstType type);
+
+Program compile(const Ast &ast)
+{
+    CompileState state{{}, {}, 0, 0, false};
+    compile_node(ast, ValueType::Integer, state);
+    emit(state, OpCode::Return);
+
+    Program program;
+    program.code = move(state.code);
+    program.max_depth = state.max_depth;
+
+    state = CompileState{{}, move(state.strings), 0, 0, true};
+    compile_node(ast, ValueType::Integer, state);
+    program.block_code = move(state.code);
+    program.block_max_depth = state.max_depth;
+    program.strings = move(state.strings);
+    return program;
+}
+
+void emit(CompileState &state, OpCode op, int arg)
+{
+    state.code.push_back(Instruction{op, arg});
+}
+
+void emit_push(CompileState &state, OpCode op, int arg)
+{
+    emit(state, op, arg);
+    state.max_depth = max(state.max_depth, ++state.depth);
+}
+
+int intern_string(CompileState &state, const string &s)
+{
+    auto it = find(state.strings.begin(), state.strings.end(), s);
+    if (it != state.strings.end())
+    {
+        return it - state.strings.begin();
+    }
+    state.strings.push_back(s);
+    return state.strings.size() - 1;
+}
+
+/**
+ * Emit the instructions for a single node. The expected type is the type
+ * that the parent node is able to consume. Nodes that can only produce a
+ * different type would evaluate to Undefined in the tree, so they are
+ * replaced by an Undefined instruction.
+ *
+ * Block code cannot jump, so ternary expressions evaluate both arms and
+ * then select between them.
+ */
+void compile_node(const Ast &ast, ValueType expected, CompileState &state)
+{
+    AstType type = ast.type();
+
+    if (type == AstType::TernaryIf)
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        compile_node(ternary.get_pred(), ValueType::Integer, state);
+
+        if (state.block)
+        {
+            compile_node(ternary.get_pass(), expected, state);
+            compile_node(ternary.get_fail(), expected, state);
+            emit(state, OpCode::Select);
+            state.depth -= 2;
+            return;
+        }
+
+        size_t jump_if_zero = state.code.size();
+        emit(state, OpCode::JumpIfZero);
+        --state.depth;
+
+        compile_node(ternary.get_pass(), expected, state);
+        size_t jump = state.code.size();
+        emit(state, OpCode::Jump);
+        --state.depth;
+
+        state.code[jump_if_zero].arg = state.code.size();
+        compile_node(ternary.get_fail(), expected, state);
+        state.code[jump].arg = state.code.size();
+        return;
+    }
+
+    if (type == AstType::String)
+    {
+        if (expected != ValueType::String)
+        {
+            emit_push(state, OpCode::Undefined);
+            return;
+        }
+        auto &str = static_cast<const String &>(ast);
+        emit_push(state, OpCode::String, intern_string(state, str.get_value()));
+        return;
+    }
+
+    // Every remaining node produces an integer
+    if (type == AstType::Undefined || expected != ValueType::Integer)
+    {
+        emit_push(state, OpCode::Undefined);
+        return;
+    }
+
+    if (type == AstType::Identifier)
+    {
+        emit_push(state, OpCode::Identifier);
+        return;
+    }
+
+    if (type == AstType::Integer)
+    {
+        auto &integer = static_cast<const Integer &>(ast);
+        emit_push(state, OpCode::Integer, integer.get_value());
+        return;
+    }
+
+    if (type == AstType::Negate || type == AstType::BitwiseComplement ||
+        type == AstType::Not)
+    {
+        auto &unary = static_cast<const UnaryOperator &>(ast);
+        compile_node(unary.get_inner(), ValueType::Integer, state);
+        emit(state, get_unary_opcode(type));
+        return;
+    }
+
+    auto &binary = static_cast<const BinaryOperator &>(ast);
+    if (type == AstType::Subscript)
+    {
+        compile_node(binary.get_left(), ValueType::String, state);
+        compile_node(binary.get_right(), ValueType::Integer, state);
+        emit(state, needs_guard(ast) ? OpCode::Subscript
+                                     : OpCode::SubscriptUnchecked);
+        --state.depth;
+        return;
+    }
+
+    const Ast &right = binary.get_right();
+    if (right.type() == AstType::Integer)
+    {
+        int value = static_cast<const Integer &>(right).get_value();
+        if (value == 0 &&
+            (type == AstType::Divide || type == AstType::Modulo))
+        {
+            emit_push(state, OpCode::Undefined);
+            return;
+        }
+        if (value == -1 &&
+            (type == AstType::Divide || type == AstType::Modulo))
+        {
+            // INT_MIN / -1 traps, so x / -1 is -x and x % -1 is 0
+            compile_node(binary.get_left(), ValueType::Integer, state);
+            emit(state, type == AstType::Divide ? OpCode::Negate
+                                                : OpCode::BitwiseAndConstant);
+            return;
+        }
+        if (type == AstType::BitwiseShiftLeft ||
+            type == AstType::BitwiseShiftRight)
+        {
+            value &= 31;
+        }
+        compile_node(binary.get_left(), ValueType::Integer, state);
+        emit(state, get_constant_opcode(type), value);
+        return;
+    }
+
+    OpCode op = get_binary_opcode(type);
+    if (!needs_guard(ast))
+    {
+        op = op == OpCode::Divide   ? OpCode::DivideUnchecked
+             : op == OpCode::Modulo ? OpCode::ModuloUnchecked
+                                    : op;
+    }
+
+    compile_node(binary.get_left(), ValueType::Integer, state);
+    compile_node(right, ValueType::Integer, state);
+    emit(state, op);
+    --state.depth;
+}
+
+OpCode get_unary_opcode(AstType type)
+{
+    switch (type)
+    {
+    case AstType::Negate:
+        return OpCode::Negate;
+    case AstType::BitwiseComplement:
+        return OpCode::BitwiseComplement;
+    default:
+        return OpCode::Not;
+    }
+}
+
+OpCode get_binary_opcode(AstType type)
+{
+    switch (type)
+    {
+    case AstType::Add:
+        return OpCode::Add;
+    case AstType::Subtract:
+        return OpCode::Subtract;
+    case AstType::Multiply:
+        return OpCode::Multiply;
+    case AstType::Divide:
+        return OpCode::Divide;
+    case AstType::Modulo:
+        return OpCode::Modulo;
+    case AstType::BitwiseAnd:
+        return OpCode::BitwiseAnd;
+    case AstType::BitwiseOr:
+        return OpCode::BitwiseOr;
+    case AstType::BitwiseXor:
+        return OpCode::BitwiseXor;
+    case AstType::BitwiseShiftLeft:
+        return OpCode::BitwiseShiftLeft;
+    case AstType::BitwiseShiftRight:
+        return OpCode::BitwiseShiftRight;
+    case AstType::LessThan:
+        return OpCode::LessThan;
+    case AstType::LessThanEqual:
+        return OpCode::LessThanEqual;
+    case AstType::GreaterThan:
+        return OpCode::GreaterThan;
+    case AstType::GreaterThanEqual:
+        return OpCode::GreaterThanEqual;
+    case AstType::Equal:
+        return OpCode::Equal;
+    default:
+        return OpCode::NotEqual;
+    }
+}
+
+OpCode get_constant_opcode(AstType type)
+{
+    switch (type)
+    {
+    case AstType::Add:
+        return OpCode::AddConstant;
+    case AstType::Subtract:
+        return OpCode::SubtractConstant;
+    case AstType::Multiply:
+        return OpCode::MultiplyConstant;
+    case AstType::Divide:
+        return OpCode::DivideConstant;
+    case AstType::Modulo:
+        return OpCode::ModuloConstant;
+    case AstType::BitwiseAnd:
+        return OpCode::BitwiseAndConstant;
+    case AstType::BitwiseOr:
+        return OpCode::BitwiseOrConstant;
+    case AstType::BitwiseXor:
+        return OpCode::BitwiseXorConstant;
+    case AstType::BitwiseShiftLeft:
+        return OpCode::BitwiseShiftLeftConstant;
+    case AstType::BitwiseShiftRight:
+        return OpCode::BitwiseShiftRightConstant;
+    case AstType::LessThan:
+        return OpCode::LessThanConstant;
+    case AstType::LessThanEqual:
+        return OpCode::LessThanEqualConstant;
+    case AstType::GreaterThan:
+        return OpCode::GreaterThanConstant;
+    case AstType::GreaterThanEqual:
+        return OpCode::GreaterThanEqualConstant;
+    case AstType::Equal:
+        return OpCode::EqualConstant;
+    default:
+        return OpCode::NotEqualConstant;
+    }
+}
+
+Value Program::eval(int t) const
+{
+    bool defined = true;
+    int result;
+    if (max_depth <= kInlineStackSize)
+    {
+        int stack[kInlineStackSize];
+        result = run(t, stack, defined);
+    }
+    else
+    {
+        vector<int> stack(max_depth);
+        result = run(t, stack.data(), defined);
+    }
+
+    if (!defined)
+    {
+        return Value();
+    }
+    return result;
+}
+
+/**
+ * The dispatch loop. The accumulator holds the top of the stack, so pushing
+ * a value spills the accumulator and binary operators pop their left
+ * operand. Shift amounts are taken modulo 32, as x86 does for the tree.
+ *
+ * GCC and Clang dispatch through a table of label addresses, which gives
+ * every instruction its own indirect branch and predicts much better than a
+ * single switch. Other compilers fall back to the switch.
+ */
+#if defined(__GNUC__)
+#define BB_DISPATCH()                                                          \
+    ins = pc++;                                                                \
+    goto *labels[static_cast<int>(ins->op)];
+#define BB_CASE(op) label_##op
+#define BB_NEXT() BB_DISPATCH()
+#else
+#define BB_DISPATCH()                                                          \
+    ins = pc++;                                                                \
+    switch (ins->op)
+#define BB_CASE(op) case OpCode::op
+#define BB_NEXT() continue
+#endif
+
+int Program::run(int t, int *stack, bool &defined) const
+{
+#if defined(__GNUC__)
+    static void *const labels[] = {
+        &&label_Identifier,
+        &&label_Integer,
+        &&label_String,
+        &&label_Undefined,
+        &&label_Negate,
+        &&label_BitwiseComplement,
+        &&label_Not,
+        &&label_Subscript,
+        &&label_Add,
+        &&label_Subtract,
+        &&label_Multiply,
+        &&label_Divide,
+        &&label_Modulo,
+        &&label_BitwiseAnd,
+        &&label_BitwiseOr,
+        &&label_BitwiseXor,
+        &&label_BitwiseShiftLeft,
+        &&label_BitwiseShiftRight,
+        &&label_LessThan,
+        &&label_LessThanEqual,
+        &&label_GreaterThan,
+        &&label_GreaterThanEqual,
+        &&label_Equal,
+        &&label_NotEqual,
+        &&label_AddConstant,
+        &&label_SubtractConstant,
+        &&label_MultiplyConstant,
+        &&label_DivideConstant,
+        &&label_ModuloConstant,
+        &&label_BitwiseAndConstant,
+        &&label_BitwiseOrConstant,
+        &&label_BitwiseXorConstant,
+        &&label_BitwiseShiftLeftConstant,
+        &&label_BitwiseShiftRightConstant,
+        &&label_LessThanConstant,
+        &&label_LessThanEqualConstant,
+        &&label_GreaterThanConstant,
+        &&label_GreaterThanEqualConstant,
+        &&label_EqualConstant,
+        &&label_NotEqualConstant,
+        &&label_SubscriptUnchecked,
+        &&label_DivideUnchecked,
+        &&label_ModuloUnchecked,
+        &&label_JumpIfZero,
+        &&label_Jump,
+        &&label_Return,
+        &&label_Select,
+    };
+#endif
+
+    const Instruction *begin = code.data();
+    const Instruction *pc = begin;
+    const Instruction *ins;
+    int sp = 0;
+    int acc = 0;
+
+    for (;;)
+    {
+        BB_DISPATCH()
+        {
+            BB_CASE(Identifier) :
+                stack[sp++] = acc;
+                acc = t;
+                BB_NEXT();
+            BB_CASE(Integer) :
+            BB_CASE(String) :
+                stack[sp++] = acc;
+                acc = ins->arg;
+                BB_NEXT();
+            BB_CASE(Undefined) :
+                defined = false;
+                return 0;
+            BB_CASE(Negate) :
+                acc = -acc;
+                BB_NEXT();
+            BB_CASE(BitwiseComplement) :
+                acc = ~acc;
+                BB_NEXT();
+            BB_CASE(Not) :
+                acc = !acc;
+                BB_NEXT();
+            BB_CASE(Subscript) :
+            {
+                const string &s = strings[stack[--sp]];
+                if (acc < 0 || acc >= static_cast<int>(s.length()))
+                {
+                    defined = false;
+                    return 0;
+                }
+                acc = s[acc];
+                BB_NEXT();
+            }
+            BB_CASE(Add) :
+                acc = stack[--sp] + acc;
+                BB_NEXT();
+            BB_CASE(Subtract) :
+                acc = stack[--sp] - acc;
+                BB_NEXT();
+            BB_CASE(Multiply) :
+                acc = stack[--sp] * acc;
+                BB_NEXT();
+            BB_CASE(Divide) :
+                if (acc == 0)
+                {
+                    defined = false;
+                    return 0;
+                }
+                // INT_MIN / -1 traps, so negate as the other backends do
+                acc = acc == -1 ? -static_cast<unsigned>(stack[--sp])
+                                : stack[--sp] / acc;
+                BB_NEXT();
+            BB_CASE(Modulo) :
+                if (acc == 0)
+                {
+                    defined = false;
+                    return 0;
+                }
+                acc = acc == -1 ? (--sp, 0) : stack[--sp] % acc;
+                BB_NEXT();
+            BB_CASE(BitwiseAnd) :
+                acc = stack[--sp] & acc;
+                BB_NEXT();
+            BB_CASE(BitwiseOr) :
+                acc = stack[--sp] | acc;
+                BB_NEXT();
+            BB_CASE(BitwiseXor) :
+                acc = stack[--sp] ^ acc;
+                BB_NEXT();
+            BB_CASE(BitwiseShiftLeft) :
+                acc = stack[--sp] << (acc & 31);
+                BB_NEXT();
+            BB_CASE(BitwiseShiftRight) :
+                acc = stack[--sp] >> (acc & 31);
+                BB_NEXT();
+            BB_CASE(LessThan) :
+                acc = stack[--sp] < acc;
+                BB_NEXT();
+            BB_CASE(LessThanEqual) :
+                acc = stack[--sp] <= acc;
+                BB_NEXT();
+            BB_CASE(GreaterThan) :
+                acc = stack[--sp] > acc;
+                BB_NEXT();
+            BB_CASE(GreaterThanEqual) :
+                acc = stack[--sp] >= acc;
+                BB_NEXT();
+            BB_CASE(Equal) :
+                acc = stack[--sp] == acc;
+                BB_NEXT();
+            BB_CASE(NotEqual) :
+                acc = stack[--sp] != acc;
+                BB_NEXT();
+            BB_CASE(AddConstant) :
+                acc += ins->arg;
+                BB_NEXT();
+            BB_CASE(SubtractConstant) :
+                acc -= ins->arg;
+                BB_NEXT();
+            BB_CASE(MultiplyConstant) :
+                acc *= ins->arg;
+                BB_NEXT();
+            BB_CASE(DivideConstant) :
+                acc /= ins->arg;
+                BB_NEXT();
+            BB_CASE(ModuloConstant) :
+                acc %= ins->arg;
+                BB_NEXT();
+            BB_CASE(BitwiseAndConstant) :
+                acc &= ins->arg;
+                BB_NEXT();
+            BB_CASE(BitwiseOrConstant) :
+                acc |= ins->arg;
+                BB_NEXT();
+            BB_CASE(BitwiseXorConstant) :
+                acc ^= ins->arg;
+                BB_NEXT();
+            BB_CASE(BitwiseShiftLeftConstant) :
+                acc <<= ins->arg;
+                BB_NEXT();
+            BB_CASE(BitwiseShiftRightConstant) :
+                acc >>= ins->arg;
+                BB_NEXT();
+            BB_CASE(LessThanConstant) :
+                acc = acc < ins->arg;
+                BB_NEXT();
+            BB_CASE(LessThanEqualConstant) :
+                acc = acc <= ins->arg;
+                BB_NEXT();
+            BB_CASE(GreaterThanConstant) :
+                acc = acc > ins->arg;
+                BB_NEXT();
+            BB_CASE(GreaterThanEqualConstant) :
+                acc = acc >= ins->arg;
+                BB_NEXT();
+            BB_CASE(EqualConstant) :
+                acc = acc == ins->arg;
+                BB_NEXT();
+            BB_CASE(NotEqualConstant) :
+                acc = acc != ins->arg;
+                BB_NEXT();
+            BB_CASE(SubscriptUnchecked) :
+                acc = strings[stack[--sp]][acc];
+                BB_NEXT();
+            BB_CASE(DivideUnchecked) :
+                acc = stack[--sp] / acc;
+                BB_NEXT();
+            BB_CASE(ModuloUnchecked) :
+                acc = stack[--sp] % acc;
+                BB_NEXT();
+            BB_CASE(JumpIfZero) :
+            {
+                int pred = acc;
+                acc = stack[--sp];
+                if (!pred)
+                {
+                    pc = begin + ins->arg;
+                }
+                BB_NEXT();
+            }
+            BB_CASE(Jump) :
+                pc = begin + ins->arg;
+                BB_NEXT();
+            BB_CASE(Return) :
+            BB_CASE(Select) :
+                return acc;
+        }
+    }
+}
+
+#undef BB_DISPATCH
+#undef BB_CASE
+#undef BB_NEXT
+
+} // namespace bb
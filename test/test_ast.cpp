@@ -1,10 +1,50 @@
 #include <catch2/catch_test_macros.hpp>
 
+#include <cstdlib>
+#include <new>
+
 #include "ast.hpp"
+#include "parse.hpp"
+#include "vm.hpp"
 
 using namespace std;
 using namespace bb;
 
+/**
+ * Counts calls to operator new on one thread while alive. Other threads,
+ * such as detached tier builds, and the rest of the binary are not counted.
+ */
+class AllocationCounter
+{
+public:
+    AllocationCounter() : count(0), previous(active) { active = this; }
+    ~AllocationCounter() { active = previous; }
+
+    size_t count;
+
+    static thread_local AllocationCounter *active;
+
+private:
+    AllocationCounter *previous;
+};
+
+thread_local AllocationCounter *AllocationCounter::active = nullptr;
+
+// Only operator new is replaced: the default operator delete frees memory
+// from malloc, so the two still pair up.
+void *operator new(size_t size)
+{
+    if (AllocationCounter::active)
+    {
+        ++AllocationCounter::active->count;
+    }
+    if (void *p = malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw bad_alloc();
+}
+
 TEST_CASE("ast", "[ast]")
 {
     SECTION("array subscript")
@@ -103,6 +143,18 @@ TEST_CASE("ast", "[ast]")
         REQUIRE(val.is_undefined());
     }
 
+    SECTION("divide minimum integer by minus one")
+    {
+        // Wraps as in every other backend, rather than trapping
+        auto ast = parse("(t<<31)/-1");
+        REQUIRE(ast->eval(1).to_int() == -2147483647 - 1);
+        ast = parse("(t<<31)%(-(t<=t))");
+        REQUIRE(ast->eval(1).to_int() == 0);
+        bool defined = true;
+        REQUIRE(ast->eval_int(1, defined) == 0);
+        REQUIRE(defined);
+    }
+
     SECTION("bitwise and")
     {
         AstPtr l = AstPtr(new Identifier());
@@ -152,4 +204,100 @@ TEST_CASE("ast", "[ast]")
         REQUIRE(val.is_int());
         REQUIRE(val.to_int() == 2);
     }
+
+    SECTION("fused identifier constant")
+    {
+        AstPtr l = AstPtr(new Identifier());
+        AstPtr r = AstPtr(new Integer(2));
+        AstPtr ast = make_binary<BitwiseShiftRightOp>(move(l), move(r));
+        REQUIRE(ast->type() == AstType::BitwiseShiftRight);
+        REQUIRE((string)*ast == "(t>>2)");
+        Value val = ast->eval(12);
+        REQUIRE(val.is_int());
+        REQUIRE(val.to_int() == 3);
+    }
+
+    SECTION("fused constant")
+    {
+        AstPtr l = AstPtr(new Negate(AstPtr(new Identifier())));
+        AstPtr r = AstPtr(new Integer(0));
+        AstPtr ast = make_binary<ModuloOp>(move(l), move(r));
+        REQUIRE(ast->type() == AstType::Modulo);
+        REQUIRE(ast->eval(5).is_undefined());
+
+        l = AstPtr(new String("foo"));
+        r = AstPtr(new Integer(1));
+        ast = make_binary<AddOp>(move(l), move(r));
+        REQUIRE(ast->eval(0).is_undefined());
+    }
+
+    SECTION("unary operands")
+    {
+        AstPtr ast = AstPtr(new BitwiseComplement(AstPtr(new Identifier())));
+        REQUIRE((string)*ast == "(~t)");
+        ast = AstPtr(new Not(AstPtr(new Identifier())));
+        REQUIRE((string)*ast == "(!t)");
+    }
+
+    SECTION("eval int")
+    {
+        AstPtr l = AstPtr(new String("foo"));
+        AstPtr r = AstPtr(new Identifier());
+        AstPtr ast = AstPtr(new Subscript(move(l), move(r)));
+
+        bool defined = true;
+        REQUIRE(ast->eval_int(1, defined) == 'o');
+        REQUIRE(defined);
+        ast->eval_int(3, defined);
+        REQUIRE(!defined);
+
+        l = AstPtr(new Identifier());
+        r = AstPtr(new Integer(0));
+        ast = AstPtr(new Divide(move(l), move(r)));
+        defined = true;
+        ast->eval_int(1, defined);
+        REQUIRE(!defined);
+    }
+
+    SECTION("string values are not copied")
+    {
+        AstPtr ast = AstPtr(new String("foo"));
+        Value a = ast->eval(0);
+        Value b = ast->eval(1);
+        REQUIRE(&a.to_str() == &b.to_str());
+        REQUIRE(a.to_str() == "foo");
+    }
+
+    SECTION("eval does not allocate")
+    {
+        vector<string> in = {
+            "\"c d e f g a b c\"[t>>10&7]*t",
+            "(t>>12&1?\"melody one\":\"melody two\")[t>>9&7]",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7",
+            "t%3?\"foo\"[t&3]:t/(t&1)",
+        };
+        for (auto &s : in)
+        {
+            auto ast = parse(s);
+            Program program = compile(*ast);
+            int out[kBlockSize];
+            bool defined[kBlockSize];
+
+            size_t allocations;
+            int sum = 0;
+            {
+                AllocationCounter counter;
+                for (int t = 0; t < 10000; ++t)
+                {
+                    Value value = ast->eval(t);
+                    sum += value.is_int() ? value.to_int() : 0;
+                    sum += program.eval(t).is_int();
+                }
+                program.eval_block(0, kBlockSize, out, defined);
+                allocations = counter.count;
+            }
+            REQUIRE(allocations == 0);
+            REQUIRE(sum != 0);
+        }
+    }
 }
@@ -0,0 +1,149 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "batch.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "vm.hpp"
+
+#include <string>
+
+using namespace std;
+using namespace bb;
+
+vector<AstPtr> parse_all(const vector<string> &in)
+{
+    vector<AstPtr> asts;
+    for (const string &s : in)
+    {
+        asts.push_back(optimize(parse(s)));
+    }
+    return asts;
+}
+
+void require_same_batch(const vector<string> &in, int t0, int n)
+{
+    vector<AstPtr> asts = parse_all(in);
+    BatchProgram batch(asts);
+    REQUIRE(batch.size() == in.size());
+
+    vector<int> out(in.size() * n);
+    vector<char> defined(in.size() * n);
+    batch.eval_block(t0, n, out.data(),
+                     reinterpret_cast<bool *>(defined.data()));
+
+    for (size_t e = 0; e < in.size(); ++e)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            int t = static_cast<int>(static_cast<unsigned>(t0) + i);
+            Value expected = asts[e]->eval(t);
+            size_t index = e * n + i;
+            REQUIRE(static_cast<bool>(defined[index]) == expected.is_int());
+            REQUIRE(out[index] == (expected.is_int() ? expected.to_int() : 0));
+        }
+    }
+}
+
+vector<string> make_family(int count)
+{
+    vector<string> in;
+    for (int i = 0; i < count; ++i)
+    {
+        // Odd masks and non-zero shifts keep optimize from changing the shape
+        in.push_back("t*(" + to_string(3 + i * 14 % 90) + "&t>>" +
+                     to_string(1 + i % 12) + ")");
+    }
+    return in;
+}
+
+TEST_CASE("batch", "[batch]")
+{
+    SECTION("groups")
+    {
+        vector<string> in = make_family(70);
+        in.push_back("t*(t>>5|t>>8)");
+        vector<AstPtr> asts = parse_all(in);
+        BatchProgram batch(asts);
+
+        // Only constants differ within the family, which fills one group
+        // and starts another
+        REQUIRE(batch.get_groups().size() == 2);
+        REQUIRE(batch.get_groups()[0].expressions.size() == kBlockSize);
+        REQUIRE(batch.get_grouped_count() == 70);
+    }
+
+    SECTION("matches tree")
+    {
+        vector<string> in = make_family(70);
+        for (int i = 1; i <= 5; ++i)
+        {
+            string n = to_string(i);
+            in.push_back("t/(t>>" + n + "&" + n + ")");
+            in.push_back("t%" + to_string(i + 2) + "+t/" + to_string(i + 1));
+            in.push_back("t>" + n + "000?t>>" + n + ":-t");
+            in.push_back("t<<" + n + "^t<" + n + "^~t");
+            in.push_back("\"abc" + n + "\"[t>>" + n + "&7]");
+            in.push_back("\"xy" + n + "\"[t%3]");
+        }
+        in.push_back("t*(t>>5|t>>8)");
+        in.push_back("t/0");
+
+        require_same_batch(in, 0, 100);
+        require_same_batch(in, -1000, 300);
+        require_same_batch(in, 2147483647 - 149, 300);
+    }
+
+    SECTION("benchmarks")
+    {
+        vector<string> in = make_family(256);
+        vector<AstPtr> asts = parse_all(in);
+        BatchProgram batch(asts);
+        vector<Program> programs;
+        for (auto &ast : asts)
+        {
+            programs.push_back(compile(*ast));
+        }
+        vector<int> out(in.size() * kBlockSize);
+        vector<char> defined(in.size() * kBlockSize);
+        int t = 0;
+
+        BENCHMARK("eval 256 expressions at one t (batch)")
+        {
+            batch.eval_block(t, 1, out.data(),
+                             reinterpret_cast<bool *>(defined.data()));
+            t += 1;
+            return out[0];
+        };
+
+        BENCHMARK("eval 256 expressions at one t (vm)")
+        {
+            for (size_t i = 0; i < programs.size(); ++i)
+            {
+                out[i] = programs[i].eval(t).to_int();
+            }
+            t += 1;
+            return out[0];
+        };
+
+        BENCHMARK("eval 256 expressions (batch block of 64)")
+        {
+            batch.eval_block(t, kBlockSize, out.data(),
+                             reinterpret_cast<bool *>(defined.data()));
+            t += kBlockSize;
+            return out[0];
+        };
+
+        BENCHMARK("eval 256 expressions (vm block of 64)")
+        {
+            for (size_t i = 0; i < programs.size(); ++i)
+            {
+                programs[i].eval_block(
+                    t, kBlockSize, out.data() + i * kBlockSize,
+                    reinterpret_cast<bool *>(defined.data()) + i * kBlockSize);
+            }
+            t += kBlockSize;
+            return out[0];
+        };
+    }
+}
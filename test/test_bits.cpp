@@ -0,0 +1,104 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "bits.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+
+using namespace std;
+using namespace bb;
+
+int lane_bits(const string &in) { return get_expression_lane_bits(*parse(in)); }
+
+int lowest_t_bit(const string &in) { return get_lowest_t_bit(*parse(in)); }
+
+uint32_t left_bits(const string &in, uint32_t demanded)
+{
+    return get_operand_bits(*parse(in), 0, demanded);
+}
+
+TEST_CASE("bits", "[bits]")
+{
+    SECTION("fill low bits")
+    {
+        REQUIRE(fill_low_bits(0) == 0);
+        REQUIRE(fill_low_bits(0x80) == 0xFF);
+        REQUIRE(fill_low_bits(0x1200) == 0x1FFF);
+        REQUIRE(fill_low_bits(0x80000000) == 0xFFFFFFFF);
+    }
+
+    SECTION("lane bits")
+    {
+        REQUIRE(get_lane_bits(0) == 8);
+        REQUIRE(get_lane_bits(0xFF) == 8);
+        REQUIRE(get_lane_bits(0x100) == 16);
+        REQUIRE(get_lane_bits(0x10000) == 32);
+    }
+
+    SECTION("operand bits")
+    {
+        REQUIRE(left_bits("t+1", 0x10) == 0x1F);
+        REQUIRE(left_bits("t*3", 0xFF) == 0xFF);
+        REQUIRE(left_bits("t^3", 0x12) == 0x12);
+        REQUIRE(left_bits("t&0x0F", 0xFF) == 0x0F);
+        REQUIRE(left_bits("t|0x0F", 0xFF) == 0xF0);
+        REQUIRE(left_bits("t<<4", 0xFF) == 0x0F);
+        REQUIRE(left_bits("t>>4", 0xFF) == 0xFF0);
+        REQUIRE(left_bits("t>>28", 0xFF) == 0xF0000000);
+        REQUIRE(left_bits("t>>t", 0xFF) == 0xFFFFFFFF);
+        REQUIRE(left_bits("t/3", 0xFF) == 0xFFFFFFFF);
+        REQUIRE(left_bits("t<3", 1) == 0xFFFFFFFF);
+        REQUIRE(get_operand_bits(*parse("t<<t"), 1, 0xFF) == 31);
+        REQUIRE(get_operand_bits(*parse("t?t:1"), 0, 0xFF) == 0xFFFFFFFF);
+        REQUIRE(get_operand_bits(*parse("t?t:1"), 1, 0xFF) == 0xFF);
+    }
+
+    SECTION("expression lane bits")
+    {
+        REQUIRE(lane_bits("t*(t<<1)^t") == 8);
+        REQUIRE(lane_bits("t*(t>>10&42)") == 16);
+        REQUIRE(lane_bits("t*(t>>10)") == 32);
+        REQUIRE(lane_bits("(t>>4)%7") == 32);
+        REQUIRE(lane_bits("t<<t>>4") == 16);
+        REQUIRE(get_expression_lane_bits(*parse("t*3"), 0xFFFF) == 16);
+
+        auto ast = optimize(parse("t*(t-1)&t>>3|t<<2"));
+        REQUIRE(get_expression_lane_bits(*ast) == 16);
+    }
+
+    SECTION("t bits")
+    {
+        REQUIRE(get_t_bits(*parse("t")) == 0xFF);
+        REQUIRE(get_t_bits(*parse("t"), kAllBits) == kAllBits);
+        REQUIRE(get_t_bits(*parse("42")) == 0);
+        REQUIRE(get_t_bits(*parse("(t&0x3FF)*3+(t&0x3FF)>>2"), kAllBits) ==
+                0x3FF);
+        REQUIRE(get_t_bits(*parse("\"abcd\"[t>>8&3]")) == 0x300);
+        REQUIRE(get_t_bits(*parse("t>>8&15|t<<4")) == 0xF0F);
+        REQUIRE(get_t_bits(*parse("t*(t>>10&42)")) == 0xA8FF);
+        REQUIRE(get_t_bits(*parse("(t>>28)*t&0")) == 0);
+        REQUIRE(get_t_bits(*parse("1/(t&1)&0")) == 1);
+        REQUIRE(get_t_bits(*parse("t>>8?t:0")) == kAllBits);
+    }
+
+    SECTION("lowest t bit")
+    {
+        REQUIRE(lowest_t_bit("t") == 0);
+        REQUIRE(lowest_t_bit("42") == kNoTBits);
+        REQUIRE(lowest_t_bit("t>>12") == 12);
+        REQUIRE(lowest_t_bit("t>>12&t>>19") == 12);
+        REQUIRE(lowest_t_bit("(t>>12)*3") == 12);
+        REQUIRE(lowest_t_bit("t*3>>12") == 0);
+        REQUIRE(lowest_t_bit("t&0xFF00") == 8);
+        REQUIRE(lowest_t_bit("(t|255)>>4") == 8);
+        REQUIRE(lowest_t_bit("(t^255)>>4") == 4);
+        REQUIRE(lowest_t_bit("t<<4>>6") == 2);
+        REQUIRE(lowest_t_bit("t>>40") == 8);
+        REQUIRE(lowest_t_bit("t/(t>>10)") == 0);
+        REQUIRE(lowest_t_bit("(t>>8)/(t>>10)") == 8);
+        REQUIRE(lowest_t_bit("(t>>8)>(t>>10)") == 8);
+        REQUIRE(lowest_t_bit("\"abc\"[t>>9&3]") == 9);
+        REQUIRE(lowest_t_bit("t>>12?1:2") == 12);
+        REQUIRE(lowest_t_bit("t>>t") == 0);
+        REQUIRE(lowest_t_bit("(t>>16)<<(t>>20)") == 16);
+    }
+}
@@ -0,0 +1,138 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "bitslice.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "vm.hpp"
+
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+using namespace bb;
+
+void require_same_bitslice(const string &in, int t0, int n, uint32_t demanded)
+{
+    auto ast = optimize(parse(in));
+    REQUIRE(is_bit_sliceable(*ast));
+    BitSliceProgram program(*ast, demanded);
+
+    vector<int> t(n);
+    vector<int> out(n);
+    vector<int> out_t(n);
+    bool defined[1000];
+    for (int i = 0; i < n; ++i)
+    {
+        t[i] = static_cast<int>(static_cast<unsigned>(t0) + i);
+    }
+    program.eval_block(t0, n, out.data(), defined);
+    program.eval_block(t.data(), n, out_t.data(), nullptr);
+
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t value = ast->eval(t[i]).to_int();
+        REQUIRE(defined[i]);
+        REQUIRE((out[i] & demanded) == (value & demanded));
+        REQUIRE((out_t[i] & demanded) == (value & demanded));
+    }
+}
+
+TEST_CASE("bitslice", "[bitslice]")
+{
+    SECTION("sliceable expressions")
+    {
+        REQUIRE(is_bit_sliceable(*parse("t&t>>8")));
+        REQUIRE(is_bit_sliceable(*parse("~t^(t<<3|t>>5)")));
+        REQUIRE(is_bit_sliceable(*parse("1<<(t>>10)")));
+        REQUIRE(!is_bit_sliceable(*parse("t+1")));
+        REQUIRE(!is_bit_sliceable(*parse("t&t*3")));
+        REQUIRE(!is_bit_sliceable(*parse("t>2")));
+        REQUIRE(!is_bit_sliceable(*parse("t?1:2")));
+        REQUIRE(!is_bit_sliceable(*parse("\"abc\"[t&1]")));
+        REQUIRE_THROWS_AS(BitSliceProgram(*parse("t+1")), invalid_argument);
+    }
+
+    SECTION("demanded slices")
+    {
+        // t is sliced up to bit 15 for t>>8, which reuses its upper slices
+        BitSliceProgram program(*parse("t&t>>8"));
+        REQUIRE(program.get_nodes().size() == 3);
+        REQUIRE(program.get_slice_count() == 16 + 8);
+    }
+
+    SECTION("routing")
+    {
+        REQUIRE(!BitSliceProgram(*parse("t&t>>8")).is_faster_than_vm());
+        string chain = "t";
+        for (int shift = 1; shift < 16; ++shift)
+        {
+            chain += "^t>>" + to_string(shift);
+        }
+        REQUIRE(BitSliceProgram(*parse(chain)).is_faster_than_vm());
+        REQUIRE(!BitSliceProgram(*parse(chain + "^t>>(t&7)^t<<(t>>9)"))
+                     .is_faster_than_vm());
+    }
+
+    SECTION("matches tree")
+    {
+        vector<string> in = {
+            "t",
+            "42",
+            "~t",
+            "t&t>>8",
+            "t|t>>3",
+            "t^t<<5",
+            "t&0xF0|0x0F",
+            "~t&(t>>4^t>>7)",
+            "t>>31",
+            "t>>28&t<<3",
+            "1<<(t>>10)",
+            "t<<(t&31)",
+            "t>>(t>>6)",
+            "(t>>(t&3))^-8",
+            "(t|t>>11)^(t>>5&t>>9)",
+            "(t^t>>3)>>20",
+            "t>>24>>4^t<<7>>2",
+        };
+        for (auto &s : in)
+        {
+            for (uint32_t demanded : {0xFFu, 0xFFFFu, 0xFFFFFFFFu, 0x30u})
+            {
+                require_same_bitslice(s, -100, 200, demanded);
+                require_same_bitslice(s, 123457, 300, demanded);
+                require_same_bitslice(s, 2147483647 - 199, 200, demanded);
+            }
+        }
+    }
+
+    SECTION("benchmarks")
+    {
+        for (const string &in :
+             {string("t&t>>8"), string("(t|t>>11)^(t>>5&t>>9)"),
+              string("t^t>>1^t>>2^t>>3^t>>4^t>>5^t>>6^t>>7^t>>8^t>>9^t>>10^"
+                     "t>>11^t>>12^t>>13^t>>14^t>>15")})
+        {
+            auto ast = optimize(parse(in));
+            BitSliceProgram sliced(*ast);
+            Program program = compile(*ast);
+            int out[kBlockSize];
+            bool defined[kBlockSize];
+            int t = 0;
+
+            BENCHMARK("eval " + in + " (bitslice block of 64)")
+            {
+                sliced.eval_block(t, kBlockSize, out, defined);
+                t += kBlockSize;
+                return out[0];
+            };
+
+            BENCHMARK("eval " + in + " (vm block of 64)")
+            {
+                program.eval_block(t, kBlockSize, out, defined);
+                t += kBlockSize;
+                return out[0];
+            };
+        }
+    }
+}
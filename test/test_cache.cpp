@@ -0,0 +1,226 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "cache.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "tier.hpp"
+#include "vm.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace bb;
+
+void require_same_canonical(const string &a, const string &b)
+{
+    auto ast_a = optimize(parse(a));
+    auto ast_b = optimize(parse(b));
+    REQUIRE(hash_ast(*ast_a) == hash_ast(*ast_b));
+
+    CanonicalAst canonical_a = canonicalize(*ast_a);
+    CanonicalAst canonical_b = canonicalize(*ast_b);
+    REQUIRE(canonical_a.hash == canonical_b.hash);
+    REQUIRE(string(*canonical_a.ast) == string(*canonical_b.ast));
+}
+
+void require_canonical_matches(const string &in)
+{
+    auto ast = optimize(parse(in));
+    CanonicalAst canonical = canonicalize(*ast);
+    REQUIRE(canonical.hash == hash_ast(*ast));
+    REQUIRE(hash_ast(*canonical.ast) == canonical.hash);
+
+    // Canonicalizing again changes nothing
+    REQUIRE(string(*canonicalize(*canonical.ast).ast) ==
+            string(*canonical.ast));
+
+    for (int t : {-1000, -1, 0, 1, 255, 4096, 123456, 2147483647})
+    {
+        Value expected = ast->eval(t);
+        Value actual = canonical.ast->eval(t);
+        REQUIRE(actual.is_int() == expected.is_int());
+        if (expected.is_int())
+        {
+            REQUIRE(actual.to_int() == expected.to_int());
+        }
+    }
+}
+
+TEST_CASE("cache", "[cache]")
+{
+    string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+
+    SECTION("equivalent expressions")
+    {
+        require_same_canonical("t*(42&t>>10)", "((t>>10)&42)*t");
+        require_same_canonical("t*(42&t>>10)",
+                               " ( t * ( 42 & ( t >> 10 ) ) ) ");
+        require_same_canonical("t<(t>>1)", "(t>>1)>t");
+        require_same_canonical("t>=(t>>1)", "(t>>1)<=t");
+        require_same_canonical("t>3", "3<t");
+        require_same_canonical("t>t", "t<t");
+        require_same_canonical("(t|t>>8)==(t^5)", "(t^5)==(t>>8|t)");
+        require_same_canonical("t%5?\"ab\"[t&1]:t+1", "t%5?\"ab\"[1&t]:1+t");
+        require_same_canonical(in, "t>>7|(t>>(4-(1^(t>>19&7)))|"
+                                   "((t<<1)^((t>>12)&((t>>7)+(t<<1)))))");
+    }
+
+    SECTION("different expressions")
+    {
+        vector<string> in_list = {
+            "t*(42&t>>10)", "t*(42&t>>11)", "t-1",     "1-t",
+            "t<(t>>1)",     "t>(t>>1)",     "t<=t>>1", "t>>1",
+            "t<<1",         "\"ab\"[t&1]",  "\"ba\"[t&1]",
+            "t?t:t>>1",     "t?t>>1:t",     "-t",      "~t",
+        };
+        for (size_t i = 0; i < in_list.size(); ++i)
+        {
+            uint64_t hash = hash_ast(*optimize(parse(in_list[i])));
+            for (size_t j = 0; j < i; ++j)
+            {
+                REQUIRE(hash != hash_ast(*optimize(parse(in_list[j]))));
+            }
+        }
+    }
+
+    SECTION("canonical trees")
+    {
+        vector<string> in_list = {
+            "t",
+            "42",
+            "t+1",
+            "t>>4|t*3",
+            "t/(t&3)",
+            "t%(1+(t>>12&3))",
+            "(t>>4)>(t&7)",
+            "(t>>4)>=(t>>4)",
+            "t<3?t*2:t*3",
+            "t%5?\"foo\"[t%4]:1/0",
+            "(t>>10?\"ab\":\"cd\")[t&1]",
+            "(t*5&t>>7)|(t*3&t>>10)",
+            in,
+        };
+        for (auto &s : in_list)
+        {
+            require_canonical_matches(s);
+        }
+
+        // Constants stay on the right, where they are fused
+        REQUIRE(string(*canonicalize(*parse("3<t")).ast) == "(t>3)");
+        REQUIRE(string(*canonicalize(*parse("7&(t>>4)")).ast) ==
+                "((t>>4)&7)");
+    }
+
+    SECTION("deep trees")
+    {
+        string chain = "t";
+        for (int i = 0; i < 100000; ++i)
+        {
+            chain += i % 2 ? "^t" : "+1";
+        }
+        FlatAst flat = parse_flat(chain);
+        REQUIRE(flat.get_depth() > kMaxRecursionDepth);
+        REQUIRE(hash_ast(*parse(chain)) == hash_ast(*parse(chain)));
+    }
+
+    SECTION("program cache")
+    {
+        ProgramCache cache;
+        auto first = cache.parse("t*(42&t>>10)");
+        REQUIRE(cache.get_misses() == 1);
+        REQUIRE(cache.get_hits() == 0);
+        first->wait();
+
+        // An equivalent expression starts on the tiers already compiled
+        auto second = cache.parse("( (t >> 10) & 42 ) * t");
+        REQUIRE(cache.get_hits() == 1);
+        REQUIRE(second->get_tier() == first->get_tier());
+        REQUIRE(second->get_tier() != Tier::Tree);
+
+        auto ast = parse("t*(42&t>>10)");
+        int out[kBlockSize];
+        bool defined[kBlockSize];
+        second->eval_block(1000, kBlockSize, out, defined);
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            REQUIRE(defined[i]);
+            REQUIRE(out[i] == ast->eval(1000 + i).to_int());
+        }
+
+        // Expressions and period bounds are cached separately
+        cache.parse("t*(42&t>>11)");
+        cache.parse("t*t>>4");
+        auto periodic = cache.parse("t*t>>4", 1 << 16);
+        REQUIRE(cache.get_misses() == 4);
+        REQUIRE(cache.size() == 4);
+        periodic->wait();
+        REQUIRE(periodic->get_tier() == Tier::Period);
+
+        // Failed parses are not counted
+        REQUIRE_THROWS_AS(cache.parse("t*("), invalid_argument);
+        REQUIRE(cache.get_hits() + cache.get_misses() == 5);
+
+        cache.clear();
+        REQUIRE(cache.size() == 0);
+        REQUIRE(cache.get_hits() == 0);
+        REQUIRE(cache.get_misses() == 0);
+        cache.parse("t*(42&t>>10)");
+        REQUIRE(cache.get_misses() == 1);
+    }
+
+    SECTION("least recently used")
+    {
+        ProgramCache cache(2);
+        cache.parse("t>>4");
+        auto b = cache.parse("t>>5");
+        cache.parse("t>>4");
+        cache.parse("t>>6");
+        REQUIRE(cache.size() == 2);
+
+        // t>>5 was used least recently, so it was dropped
+        cache.parse("t>>4");
+        REQUIRE(cache.get_hits() == 2);
+        cache.parse("t>>5");
+        REQUIRE(cache.get_misses() == 4);
+
+        // A dropped program is still valid for its holders
+        int out[kBlockSize];
+        b->eval_block(256, kBlockSize, out, nullptr);
+        REQUIRE(out[0] == 8);
+    }
+
+    SECTION("benchmarks")
+    {
+        auto crowd = optimize(parse(in));
+        BENCHMARK("hash crowd") { return hash_ast(*crowd); };
+        BENCHMARK("canonicalize crowd") { return canonicalize(*crowd); };
+
+        // A program from the cache starts on its fastest tier, where a new
+        // one starts on the tree
+        int out[kBlockSize];
+        BENCHMARK("parse crowd to 64 blocks (new program)")
+        {
+            TieredProgram program(optimize(parse(in)));
+            for (int t = 0; t < 64 * kBlockSize; t += kBlockSize)
+            {
+                program.eval_block(t, kBlockSize, out, nullptr);
+            }
+            return out[0];
+        };
+
+        ProgramCache cache;
+        cache.parse(in)->wait();
+        BENCHMARK("parse crowd to 64 blocks (cache)")
+        {
+            auto program = cache.parse(in);
+            for (int t = 0; t < 64 * kBlockSize; t += kBlockSize)
+            {
+                program->eval_block(t, kBlockSize, out, nullptr);
+            }
+            return out[0];
+        };
+    }
+}
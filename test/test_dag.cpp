@@ -0,0 +1,172 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "dag.hpp"
+#include "parse.hpp"
+#include "vm.hpp"
+
+using namespace std;
+using namespace bb;
+
+void require_same_dag(const string &in, int t0, int n)
+{
+    auto ast = parse(in);
+    Dag dag(*ast);
+
+    vector<int> t(n);
+    vector<int> out(n);
+    vector<int> out_t(n);
+    bool defined[1000];
+    bool defined_t[1000];
+    for (int i = 0; i < n; ++i)
+    {
+        t[i] = t0 + i;
+    }
+    dag.eval_block(t0, n, out.data(), defined);
+    dag.eval_block(t.data(), n, out_t.data(), defined_t);
+
+    for (int i = 0; i < n; ++i)
+    {
+        Value expected = ast->eval(t0 + i);
+        Value actual = dag.eval(t0 + i);
+        REQUIRE(actual.is_int() == expected.is_int());
+        REQUIRE(actual.is_str() == expected.is_str());
+        REQUIRE(defined[i] == expected.is_int());
+        REQUIRE(defined_t[i] == expected.is_int());
+        if (expected.is_int())
+        {
+            REQUIRE(actual.to_int() == expected.to_int());
+            REQUIRE(out[i] == expected.to_int());
+            REQUIRE(out_t[i] == expected.to_int());
+        }
+    }
+}
+
+TEST_CASE("dag", "[dag]")
+{
+    string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+
+    SECTION("merges repeated subtrees")
+    {
+        Dag dag(*parse(in));
+        // Seven t leaves, two copies each of t<<1 and t>>7, and three each
+        // of the constants 1 and 7
+        REQUIRE(dag.get_tree_size() == 31);
+        REQUIRE(dag.get_merged() == 12);
+        REQUIRE(dag.get_nodes().size() == 19);
+    }
+
+    SECTION("commutative operands")
+    {
+        Dag dag(*parse("(t+1)*(1+t)"));
+        REQUIRE(dag.get_nodes().size() == 4);
+
+        Dag ordered(*parse("(t-1)*(1-t)"));
+        REQUIRE(ordered.get_nodes().size() == 5);
+    }
+
+    SECTION("matches tree")
+    {
+        vector<string> in = {
+            "t",
+            "42",
+            "-t",
+            "~t",
+            "!t",
+            "t/(t-5)",
+            "t%(t-5)",
+            "t/-1",
+            "t<<t",
+            "t>>(t&7)",
+            "t*t+t*t",
+            "t%2==0?(t*10):(t*100)+1",
+            "t > 10 ? t > 20 ? 1 : 0 : -1",
+            "\"foo\"[t]",
+            "(t==1?\"foo\":\"bar\")[t%3]",
+            "t%(1+(t>>12&3))",
+            "(t>>1)/(-2+(t&1))",
+            "\"abcdefgh\"[t>>9&7]",
+            "(t&1?\"ab\":\"cde\")[t>>4&1]",
+            "(t?\"foo\":\"foo\")[t%4]",
+            "t ? 1 : 1/0",
+            "t ? 1/t : 1/t",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7",
+        };
+        for (auto &s : in)
+        {
+            require_same_dag(s, -100, 200);
+            require_same_dag(s, 123456, 300);
+        }
+    }
+
+    SECTION("hoisting")
+    {
+        Dag dag(*parse(in));
+        // t>>7, t>>12, the three operators on t>>19 and the shift count
+        REQUIRE(dag.get_operator_count() == 13);
+        REQUIRE(dag.get_hoisted_count() == 6);
+        REQUIRE(dag.get_lowest_t_bit(dag.get_nodes().size() - 1) == 0);
+
+        Dag melody(*parse("t*(\"3345\"[t>>13&3]-48)>>(t>>16&1)&t>>9&255"));
+        // The note lookup, the shift count and t>>9
+        REQUIRE(melody.get_hoisted_count() == 7);
+
+        // Hoisted nodes keep their lanes across the blocks of one call
+        require_same_dag("t*(\"3345\"[t>>13&3]-48)>>(t>>16&1)&t>>9", 65000,
+                         1000);
+        require_same_dag("(t>>7)/(t>>10&3)|t>>6", 0, 1000);
+        require_same_dag("t>>5?t>>12:\"ab\"[t>>6&3]", -500, 1000);
+    }
+
+    SECTION("undefined subscript lanes")
+    {
+        // Lanes after one whose base or index is undefined are still
+        // evaluated
+        require_same_dag("\"abcdefghijklmn\"[\"abcdefghij\"[t]]", -5, 20);
+        require_same_dag("(t?\"ab\":\"xyz\")[t]", -3, 10);
+        require_same_dag("\"abc\"[t%5?t&3:1/0]", 0, 70);
+    }
+
+    SECTION("large dag")
+    {
+        string in = "t";
+        for (int i = 0; i < 100; ++i)
+        {
+            in = "(" + in + "+" + to_string(i) + ")";
+        }
+        require_same_dag(in, 0, 100);
+    }
+
+    SECTION("benchmarks")
+    {
+        auto crowd = parse(in);
+        BENCHMARK("dag crowd") { return Dag(*crowd).get_merged(); };
+
+        Dag dag(*crowd);
+        int t = 0;
+
+        BENCHMARK("eval crowd (dag)") { return dag.eval(t++); };
+
+        int out[kBlockSize];
+        bool defined[kBlockSize];
+        t = 0;
+
+        BENCHMARK("eval crowd (dag block of 64)")
+        {
+            dag.eval_block(t, kBlockSize, out, defined);
+            t += kBlockSize;
+            return out[0];
+        };
+
+        int long_out[64 * kBlockSize];
+        bool long_defined[64 * kBlockSize];
+        t = 0;
+
+        BENCHMARK("eval crowd (dag block of 4096)")
+        {
+            dag.eval_block(t, 64 * kBlockSize, long_out, long_defined);
+            t += 64 * kBlockSize;
+            return long_out[0];
+        };
+    }
+}
@@ -0,0 +1,191 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "flat.hpp"
+#include "parse.hpp"
+
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+using namespace bb;
+
+void require_same_flat(const string &in)
+{
+    auto ast = parse(in);
+    FlatAst flat = parse_flat(in);
+    REQUIRE(string(flat) == string(*ast));
+    REQUIRE(string(*flat.get_ast()) == string(*ast));
+    for (int t : {-1000, -1, 0, 1, 255, 4096, 123456, 2147483647})
+    {
+        Value expected = ast->eval(t);
+        Value actual = flat.eval(t);
+        REQUIRE(actual.is_int() == expected.is_int());
+        REQUIRE(actual.is_str() == expected.is_str());
+        if (expected.is_int())
+        {
+            REQUIRE(actual.to_int() == expected.to_int());
+        }
+
+        bool defined = true;
+        int value = flat.eval_int(t, defined);
+        REQUIRE(defined == expected.is_int());
+        if (defined)
+        {
+            REQUIRE(value == expected.to_int());
+        }
+    }
+}
+
+TEST_CASE("flat", "[flat]")
+{
+    string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+
+    SECTION("evaluation order")
+    {
+        FlatAst flat = parse_flat("t*2+(t>>3)");
+        auto &nodes = flat.get_nodes();
+        REQUIRE(flat.size() == 7);
+        REQUIRE(nodes.back().type == AstType::Add);
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            bool binary = nodes[i].type == AstType::Add ||
+                          nodes[i].type == AstType::Multiply ||
+                          nodes[i].type == AstType::BitwiseShiftRight;
+            for (int j = 0; j < (binary ? 2 : 0); ++j)
+            {
+                REQUIRE(nodes[i].operands[j] < i);
+            }
+        }
+    }
+
+    SECTION("matches tree")
+    {
+        vector<string> in_list = {
+            "t",
+            "42",
+            "-t",
+            "~t",
+            "!t",
+            "t+1",
+            "t+2*t",
+            "(t+1)*t",
+            "t/(t&3)",
+            "t%(t>>4)",
+            "t<3",
+            "t>=t>>1",
+            "t==0",
+            "t!=1",
+            "t?1:2",
+            "t%5?\"foo\"[t%4]:1/0",
+            "\"abc\"[t%3]",
+            "(t>>10?\"ab\":\"cd\")[t&1]",
+            in,
+        };
+        for (auto &s : in_list)
+        {
+            require_same_flat(s);
+        }
+        REQUIRE(string(FlatAst()) == "UNDEFINED");
+        REQUIRE(FlatAst().eval(0).is_undefined());
+    }
+
+    SECTION("deep trees")
+    {
+        // Deeper than kMaxRecursionDepth, so evaluated without recursion
+        string chain = "t";
+        for (int i = 0; i < 100000; ++i)
+        {
+            chain += i % 2 ? "%1000003" : "*3";
+        }
+        FlatAst flat = parse_flat(chain);
+        REQUIRE(flat.get_depth() > kMaxRecursionDepth);
+        REQUIRE(string(*flat.get_ast()) == string(flat));
+
+        // A shallow tree built from the same steps gives the reference
+        auto step = parse("t*3%1000003");
+        int out[100];
+        bool defined[100];
+        flat.eval_block(-50, 100, out, defined);
+        for (int i = 0; i < 100; ++i)
+        {
+            int expected = i - 50;
+            for (int j = 0; j < 50000; ++j)
+            {
+                expected = step->eval_int(expected, defined[i]);
+            }
+            REQUIRE(defined[i]);
+            REQUIRE(out[i] == expected);
+            REQUIRE(flat.eval(i - 50).to_int() == expected);
+        }
+
+        // An undefined arm only matters when it is taken
+        string ternary = "t&1?1/0:" + chain + "+(\"ab\"[t&3])";
+        FlatAst guarded = parse_flat(ternary);
+        REQUIRE(guarded.eval(1).is_undefined());
+        REQUIRE(guarded.eval(2).is_undefined());
+        REQUIRE(guarded.eval(0).to_int() == out[50] + 'a');
+        REQUIRE(guarded.eval(4).to_int() == out[54] + 'a');
+    }
+
+    SECTION("errors")
+    {
+        for (string s : {"", "(t+1", "t+", "t+1)))", "t&&1", "\"abc\"",
+                         "\"abc\"+1", "t[1]", "t?\"a\":1", "-\"a\""})
+        {
+            REQUIRE_THROWS_AS(parse_flat(s), invalid_argument);
+            REQUIRE_THROWS_AS(parse(s), invalid_argument);
+        }
+
+        try
+        {
+            parse_flat("\"abc\"+1");
+        }
+        catch (invalid_argument &ex)
+        {
+            REQUIRE(string(ex.what()) ==
+                    "Type error: expected an integer but found \"abc\"");
+        }
+    }
+
+    SECTION("benchmarks")
+    {
+        BENCHMARK("parse crowd (tree)") { return parse(in); };
+        BENCHMARK("parse crowd (flat)") { return parse_flat(in); };
+
+        auto crowd = parse(in);
+        FlatAst flat = parse_flat(in);
+        int t = 0;
+        bool defined = true;
+
+        BENCHMARK("eval crowd (tree)")
+        {
+            return crowd->eval_int(t++, defined);
+        };
+
+        BENCHMARK("eval crowd (flat)")
+        {
+            return flat.eval_int(t++, defined);
+        };
+
+        // Many copies of the expression spread the tree's nodes across the
+        // heap, where the flat tree keeps them in one array
+        string large = in;
+        for (int i = 0; i < 63; ++i)
+        {
+            large += "^" + in;
+        }
+        auto large_tree = parse(large);
+        FlatAst large_flat = parse_flat(large);
+
+        BENCHMARK("eval 64 x crowd (tree)")
+        {
+            return large_tree->eval_int(t++, defined);
+        };
+
+        BENCHMARK("eval 64 x crowd (flat)")
+        {
+            return large_flat.eval_int(t++, defined);
+        };
+    }
+}
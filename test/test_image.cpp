@@ -0,0 +1,228 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "image.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "tier.hpp"
+#include "vm.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace bb;
+
+void require_same_image(const string &in)
+{
+    auto ast = optimize(parse(in));
+    vector<uint8_t> image = write_image(*ast);
+    REQUIRE(image.size() % 8 == 0);
+
+    ProgramImage loaded(image.data(), image.size());
+    REQUIRE(loaded.get_period() == 0);
+    AstPtr copy = loaded.get_ast();
+    REQUIRE(string(*copy) == string(*ast));
+
+    for (int t : {-1000, -1, 0, 1, 255, 4096, 123456, 2147483647})
+    {
+        Value expected = ast->eval(t);
+        Value actual = copy->eval(t);
+        REQUIRE(actual.is_int() == expected.is_int());
+        if (expected.is_int())
+        {
+            REQUIRE(actual.to_int() == expected.to_int());
+        }
+    }
+}
+
+void require_invalid_image(const vector<uint8_t> &image)
+{
+    REQUIRE_THROWS_AS(ProgramImage(image.data(), image.size()),
+                      invalid_argument);
+}
+
+TEST_CASE("image", "[image]")
+{
+    string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+
+    SECTION("round trip")
+    {
+        vector<string> in_list = {
+            "t",
+            "-42",
+            "t+1",
+            "t>>4|t*3",
+            "t/(t&3)",
+            "t%(1+(t>>12&3))",
+            "-t^~t",
+            "!t",
+            "t<3?t*2:t*3",
+            "t%5?\"foo\"[t%4]:1/0",
+            "(t>>10?\"ab\":\"cd\")[t&1]",
+            "\"ab\"[t&1]+\"ab\"[t>>1&1]+\"\"[0]",
+            in,
+        };
+        for (auto &s : in_list)
+        {
+            require_same_image(s);
+        }
+    }
+
+    SECTION("strings")
+    {
+        // Repeated strings are stored once
+        auto same = parse("\"abcdefgh\"[t&7]+\"abcdefgh\"[t>>3&7]");
+        auto different = parse("\"abcdefgh\"[t&7]+\"hgfedcba\"[t>>3&7]");
+        REQUIRE(write_image(*different).size() - write_image(*same).size() ==
+                kImageStringBytes + 8);
+        require_same_image("\"abcdefgh\"[t&7]+\"hgfedcba\"[t>>3&7]");
+    }
+
+    SECTION("period")
+    {
+        string bend = "t*t>>4";
+        auto ast = parse(bend);
+        vector<uint8_t> image = write_image(*optimize(parse(bend)), 1 << 16);
+        ProgramImage loaded(image.data(), image.size());
+        REQUIRE(loaded.get_period() > 0);
+
+        // Plays back the period from the first block, without a thread
+        unique_ptr<TieredProgram> program = loaded.load();
+        REQUIRE(program->get_tier() == Tier::Period);
+        int out[kBlockSize];
+        program->eval_block(-1000, kBlockSize, out, nullptr);
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            uint8_t expected = ast->eval(-1000 + i).to_int();
+            REQUIRE(static_cast<uint8_t>(out[i]) == expected);
+        }
+
+        // An expression without a period within the bound stores none
+        vector<uint8_t> crowd = write_image(*optimize(parse(in)), 1 << 10);
+        REQUIRE(ProgramImage(crowd.data(), crowd.size()).get_period() == 0);
+    }
+
+    SECTION("load without a period")
+    {
+        auto ast = parse(in);
+        vector<uint8_t> image = write_image(*optimize(parse(in)));
+        unique_ptr<TieredProgram> program =
+            ProgramImage(image.data(), image.size()).load();
+        program->wait();
+        REQUIRE(program->get_tier() != Tier::Tree);
+
+        int out[kBlockSize];
+        program->eval_block(123456, kBlockSize, out, nullptr);
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            REQUIRE(out[i] == ast->eval(123456 + i).to_int());
+        }
+    }
+
+    SECTION("invalid images")
+    {
+        auto ast = optimize(parse("t%5?\"ab\"[t&1]:t"));
+        vector<uint8_t> image = write_image(*ast);
+
+        // Every truncation is caught by the size fields
+        for (size_t size = 0; size < image.size(); ++size)
+        {
+            require_invalid_image(
+                vector<uint8_t>(image.begin(), image.begin() + size));
+        }
+
+        vector<uint8_t> corrupt = image;
+        corrupt[0] = 'b';
+        require_invalid_image(corrupt);
+
+        corrupt = image;
+        corrupt[8] = kImageVersion + 1;
+        require_invalid_image(corrupt);
+
+        // A node count that does not match the size
+        corrupt = image;
+        corrupt[12] += 1;
+        require_invalid_image(corrupt);
+
+        // An unknown node type
+        corrupt = image;
+        corrupt[kImageHeaderBytes] = 200;
+        require_invalid_image(corrupt);
+
+        // The last node, the ternary, without enough operands
+        corrupt = image;
+        size_t nodes = corrupt[12];
+        corrupt[kImageHeaderBytes + (nodes - 1) * kImageNodeBytes] =
+            static_cast<uint8_t>(AstType::Identifier);
+        require_invalid_image(corrupt);
+
+        // A tree too deep for the passes over it
+        string deep = "t";
+        for (uint32_t i = 0; i < kMaxRecursionDepth; ++i)
+        {
+            deep += "+t";
+        }
+        vector<uint8_t> deep_image = write_image(*parse(deep));
+        ProgramImage deep_loaded(deep_image.data(), deep_image.size());
+        REQUIRE_THROWS_AS(deep_loaded.get_ast(), invalid_argument);
+        deep_image = write_image(*parse(deep.substr(2)));
+        REQUIRE(ProgramImage(deep_image.data(), deep_image.size()).get_ast());
+
+        // Every single byte change is either rejected or still loads
+        for (size_t i = 0; i < image.size(); ++i)
+        {
+            corrupt = image;
+            corrupt[i] ^= 0x5a;
+            try
+            {
+                ProgramImage loaded(corrupt.data(), corrupt.size());
+                loaded.get_ast();
+            }
+            catch (invalid_argument &)
+            {
+            }
+        }
+    }
+
+    SECTION("benchmarks")
+    {
+        vector<uint8_t> image = write_image(*optimize(parse(in)));
+        int out[kBlockSize];
+
+        BENCHMARK("parse to first block crowd (tiered)")
+        {
+            TieredProgram program(optimize(parse(in)));
+            program.eval_block(0, kBlockSize, out, nullptr);
+            return out[0];
+        };
+
+        BENCHMARK("load to first block crowd (tiered)")
+        {
+            auto program = ProgramImage(image.data(), image.size()).load();
+            program->eval_block(0, kBlockSize, out, nullptr);
+            return out[0];
+        };
+
+        string bend = "t*t>>4";
+        vector<uint8_t> periodic =
+            write_image(*optimize(parse(bend)), 1 << 16);
+
+        BENCHMARK("parse to period t*t>>4")
+        {
+            TieredProgram program(optimize(parse(bend)), 1 << 16);
+            program.wait();
+            program.eval_block(0, kBlockSize, out, nullptr);
+            return out[0];
+        };
+
+        BENCHMARK("load to period t*t>>4")
+        {
+            auto program =
+                ProgramImage(periodic.data(), periodic.size()).load();
+            program->eval_block(0, kBlockSize, out, nullptr);
+            return out[0];
+        };
+    }
+}
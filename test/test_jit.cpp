@@ -0,0 +1,149 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "jit.hpp"
+#include "parse.hpp"
+
+using namespace std;
+using namespace bb;
+
+void require_same_jit(const string &in, int t0, int n)
+{
+    auto ast = parse(in);
+    JitProgram program(*ast);
+
+    vector<int> t(n);
+    vector<int> out(n);
+    vector<int> out_t(n);
+    bool defined[1000];
+    bool defined_t[1000];
+    for (int i = 0; i < n; ++i)
+    {
+        t[i] = t0 + i;
+    }
+    program.eval_block(t0, n, out.data(), defined);
+    program.eval_block(t.data(), n, out_t.data(), defined_t);
+
+    for (int i = 0; i < n; ++i)
+    {
+        Value expected = ast->eval(t0 + i);
+        Value actual = program.eval(t0 + i);
+        REQUIRE(actual.is_int() == expected.is_int());
+        REQUIRE(defined[i] == expected.is_int());
+        REQUIRE(defined_t[i] == expected.is_int());
+        if (expected.is_int())
+        {
+            REQUIRE(actual.to_int() == expected.to_int());
+            REQUIRE(out[i] == expected.to_int());
+            REQUIRE(out_t[i] == expected.to_int());
+        }
+    }
+}
+
+TEST_CASE("jit", "[jit]")
+{
+    SECTION("native on x86-64")
+    {
+        auto ast = parse("t");
+        JitProgram program(*ast);
+        REQUIRE(program.is_native() == JitProgram::is_supported());
+    }
+
+    SECTION("matches tree")
+    {
+        vector<string> in = {
+            "t",
+            "42",
+            "t+1",
+            "t-3*t",
+            "-t",
+            "~t",
+            "!t",
+            "t/3",
+            "t%7",
+            "t/-1",
+            "t%-1",
+            "t/(t-5)",
+            "t%(t-5)",
+            "t&t>>8",
+            "t|t<<2",
+            "t^t>>3",
+            "t<<t",
+            "t>>(t&7)",
+            "t<10",
+            "t<=10",
+            "t>10",
+            "t>=10",
+            "t==10",
+            "t!=10",
+            "t<t*2",
+            "t<=t*2",
+            "t>t*2",
+            "t>=t*2",
+            "t==t*2",
+            "t!=t*2",
+            "t%2==0?(t*10):(t*100)+1",
+            "t > 10 ? t > 20 ? 1 : 0 : -1",
+            "\"foo\"[t%3]",
+            "\"foo\"[t]",
+            "\"\"[t]",
+            "(t==1?\"foo\":\"bar\")[t%3]",
+            "t%(1+(t>>12&3))",
+            "(t>>1)/(-2+(t&1))",
+            "\"abcdefgh\"[t>>9&7]",
+            "(t&1?\"ab\":\"cde\")[t>>4&1]",
+            "t ? 1 : 1/0",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7",
+        };
+        for (auto &s : in)
+        {
+            require_same_jit(s, -100, 200);
+            require_same_jit(s, 123456, 300);
+        }
+    }
+
+    SECTION("block without defined")
+    {
+        auto ast = parse("t*2");
+        JitProgram program(*ast);
+        int out[100];
+        program.eval_block(5, 100, out, nullptr);
+        REQUIRE(out[99] == 208);
+
+        int t[2] = {3, 4};
+        program.eval_block(t, 2, out, nullptr);
+        REQUIRE(out[1] == 8);
+    }
+
+    SECTION("divide minimum integer by minus one")
+    {
+        auto ast = parse("(0-2147483647-1)/(t-1)");
+        JitProgram program(*ast);
+        REQUIRE(program.eval(0).to_int() == -2147483647 - 1);
+        REQUIRE(program.eval(1).is_undefined());
+    }
+
+    SECTION("benchmarks")
+    {
+        string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+
+        auto crowd = parse(in);
+        BENCHMARK("jit compile crowd") { return JitProgram(*crowd).is_native(); };
+
+        JitProgram program(*crowd);
+        int t = 0;
+
+        BENCHMARK("eval crowd (jit)") { return program.eval(t++); };
+
+        int out[kBlockSize];
+        bool defined[kBlockSize];
+        t = 0;
+
+        BENCHMARK("eval crowd (jit block of 64)")
+        {
+            program.eval_block(t, kBlockSize, out, defined);
+            t += kBlockSize;
+            return out[0];
+        };
+    }
+}
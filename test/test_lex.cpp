@@ -3,6 +3,9 @@
 
 #include "lex.hpp"
 
+#include <stdexcept>
+#include <utility>
+
 using namespace std;
 using namespace bb;
 
@@ -73,6 +76,32 @@ TEST_CASE("lex", "[lex]")
         REQUIRE_THROWS(lex(in));
     }
 
+    SECTION("integer values")
+    {
+        string in = "1234 0xfff 0XA 010 08 0";
+        vector<int> out = {1234, 0xfff, 0xa, 010, 0, 0};
+        auto tokens = lex(in);
+        REQUIRE(tokens.size() == out.size());
+        for (size_t i = 0; i < out.size(); ++i)
+        {
+            REQUIRE(tokens[i].integer == out[i]);
+        }
+
+        REQUIRE(lex("2147483647")[0].integer == 2147483647);
+        REQUIRE(lex("0x7fffffff")[0].integer == 0x7fffffff);
+        REQUIRE_THROWS_AS(lex("2147483648"), out_of_range);
+        REQUIRE_THROWS_AS(lex("0xffffffff"), out_of_range);
+    }
+
+    SECTION("tokens refer to the input")
+    {
+        string in = "t>>\"abc\"[1]";
+        auto tokens = lex(in);
+        REQUIRE(tokens[1].value.data == in.data() + 1);
+        REQUIRE(tokens[2].value.data == in.data() + 4);
+        REQUIRE(tokens[2].value.str() == "abc");
+    }
+
     SECTION("left arrow tokens")
     {
         string in = "< << <= <";
@@ -164,6 +193,58 @@ TEST_CASE("lex", "[lex]")
         REQUIRE_THROWS(lex(in));
     }
 
+    SECTION("relex")
+    {
+        vector<pair<string, string>> edits = {
+            {"t*(42&t>>10)", "t*(42&t>>11)"},
+            {"t*(42&t>>10)", "t*(42&t>>10)"},
+            {"t*(42&t>>10)", "t * (42 & t>>10)"},
+            {"t*(42&t>>10)", "t*(42&t>>10)|t>>7"},
+            {"t<1", "t<<1"},
+            {"t<<1", "t<1"},
+            {"t&1", "t&&1"},
+            {"t*12", "t*123"},
+            {"t*12", "t*1"},
+            {"12+t", "0x12+t"},
+            {"\"ab\"[t&1]", "\"a b\"[t&1]"},
+            {"\"ab\"[t&1]", "\"ab\"+\"[t&1]\""},
+            {"", "t"},
+            {"t", ""},
+        };
+        for (auto &edit : edits)
+        {
+            const string &before = edit.first;
+            const string &after = edit.second;
+            auto tokens = lex(before);
+            TokenEdit token_edit;
+            auto out = relex(before.data(), before.length(), tokens,
+                             after.data(), after.length(), token_edit);
+            REQUIRE(out == lex(after));
+            for (auto &token : out)
+            {
+                REQUIRE(token.value.data >= after.data());
+                REQUIRE(token.value.data < after.data() + after.length());
+            }
+        }
+
+        // Only the edited integer is lexed again
+        string before = "t*(42&t>>10)";
+        string after = "t*(42&t>>11)";
+        auto tokens = lex(before);
+        TokenEdit edit;
+        auto out = relex(before.data(), before.length(), tokens, after.data(),
+                         after.length(), edit);
+        REQUIRE(edit.prefix == 7);
+        REQUIRE(edit.old_suffix == 8);
+        REQUIRE(edit.new_suffix == 8);
+        REQUIRE(out[7].integer == 11);
+
+        after = "t*(42&t>>11)=";
+        REQUIRE_THROWS_AS(relex(before.data(), before.length(), tokens,
+                                after.data(), after.length(), edit),
+                          invalid_argument);
+    }
+
     SECTION("crowd")
     {
         string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
@@ -219,5 +300,23 @@ TEST_CASE("lex", "[lex]")
         REQUIRE(lex(in) == out);
 
         BENCHMARK("lex crowd") { return lex(in); };
+
+        string large = in;
+        for (int i = 0; i < 1023; ++i)
+        {
+            large += "^" + in;
+        }
+        BENCHMARK("lex 1024 x crowd") { return lex(large); };
+
+        auto large_tokens = lex(large);
+        string edited = large;
+        size_t digit = edited.find('7', edited.length() / 2);
+        edited[digit] = '6';
+        TokenEdit edit;
+        BENCHMARK("relex 1024 x crowd after editing a digit")
+        {
+            return relex(large.data(), large.length(), large_tokens,
+                         edited.data(), edited.length(), edit);
+        };
     }
 }
@@ -0,0 +1,119 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "lookup.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "vm.hpp"
+
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+using namespace bb;
+
+void require_same_lookup(const string &in, int t0, int n, uint32_t demanded)
+{
+    auto ast = optimize(parse(in));
+    REQUIRE(is_lookup_sized(*ast, demanded));
+    LookupProgram program(*ast, demanded);
+
+    vector<int> t(n);
+    vector<int> out(n);
+    vector<int> out_t(n);
+    bool defined[1000];
+    bool defined_t[1000];
+    for (int i = 0; i < n; ++i)
+    {
+        t[i] = static_cast<int>(static_cast<unsigned>(t0) + i);
+    }
+    program.eval_block(t0, n, out.data(), defined);
+    program.eval_block(t.data(), n, out_t.data(), defined_t);
+
+    for (int i = 0; i < n; ++i)
+    {
+        Value expected = ast->eval(t[i]);
+        uint32_t value = expected.is_int() ? expected.to_int() : 0;
+        REQUIRE(defined[i] == expected.is_int());
+        REQUIRE(defined_t[i] == expected.is_int());
+        REQUIRE((out[i] & demanded) == (value & demanded));
+        REQUIRE((out_t[i] & demanded) == (value & demanded));
+    }
+}
+
+TEST_CASE("lookup", "[lookup]")
+{
+    SECTION("table bits")
+    {
+        REQUIRE(get_lookup_bits(*parse("42")) == 0);
+        REQUIRE(get_lookup_bits(*parse("t")) == 8);
+        REQUIRE(get_lookup_bits(*parse("t"), kAllBits) == 32);
+        REQUIRE(get_lookup_bits(*parse("\"abcd\"[t>>8&3]")) == 2);
+        REQUIRE(get_lookup_bits(*parse("t>>8&15|t<<4")) == 12);
+        REQUIRE(get_lookup_bits(*parse("t*(t>>10&42)")) == 16);
+        REQUIRE(!is_lookup_sized(*parse("t*(t>>10)")));
+        REQUIRE(is_lookup_sized(*parse("t&0x3FF"), kAllBits));
+        REQUIRE_THROWS_AS(LookupProgram(*parse("t/(t>>10)")),
+                          invalid_argument);
+
+        LookupProgram program(*parse("(t>>12&7)*(t>>12&7)"));
+        REQUIRE(program.get_table_bits() == 3);
+        REQUIRE(program.get_table_shift() == 12);
+    }
+
+    SECTION("matches tree")
+    {
+        vector<string> in = {
+            "42",
+            "t",
+            "t&0x3FF",
+            "(t&0x3FF)*(t&0x3FF)>>3^t&255",
+            "\"0123456789\"[t>>8&7]",
+            "t*(t>>10&42)",
+            "t>>8&15|t<<4",
+            "(t>>12&7)%(t>>9&3)",
+            "t>>28",
+            "(t&15)>7?t&7:\"ab\"[t>>4&3]",
+        };
+        for (auto &s : in)
+        {
+            for (uint32_t demanded : {0xFFu, 0x30u})
+            {
+                require_same_lookup(s, -100, 200, demanded);
+                require_same_lookup(s, 123457, 1000, demanded);
+                require_same_lookup(s, 2147483647 - 199, 200, demanded);
+            }
+        }
+        require_same_lookup("(t&0x3FF)*3+(t&0x3FF)>>2", 5000, 1000, kAllBits);
+        require_same_lookup("t>>28", -500, 1000, kAllBits);
+    }
+
+    SECTION("benchmarks")
+    {
+        auto ast = optimize(parse("(t&0x3FF)*(t&0x3FF)>>3^t*(t>>10&42)"));
+        LookupProgram table(*ast);
+        Program program = compile(*ast);
+        int out[kBlockSize];
+        bool defined[kBlockSize];
+        int t = 0;
+
+        BENCHMARK("build table")
+        {
+            return LookupProgram(*ast).get_table_bits();
+        };
+
+        BENCHMARK("eval (lookup block of 64)")
+        {
+            table.eval_block(t, kBlockSize, out, defined);
+            t += kBlockSize;
+            return out[0];
+        };
+
+        BENCHMARK("eval (vm block of 64)")
+        {
+            program.eval_block(t, kBlockSize, out, defined);
+            t += kBlockSize;
+            return out[0];
+        };
+    }
+}
@@ -0,0 +1,135 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "narrow.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "vm.hpp"
+
+using namespace std;
+using namespace bb;
+
+void require_same_narrow(const string &in, int t0, int n, uint32_t demanded)
+{
+    auto ast = optimize(parse(in));
+    NarrowProgram program(*ast, demanded);
+
+    vector<int> t(n);
+    vector<int> out(n);
+    vector<int> out_t(n);
+    bool defined[1000];
+    bool defined_t[1000];
+    for (int i = 0; i < n; ++i)
+    {
+        t[i] = t0 + i;
+    }
+    program.eval_block(t0, n, out.data(), defined);
+    program.eval_block(t.data(), n, out_t.data(), defined_t);
+
+    for (int i = 0; i < n; ++i)
+    {
+        Value expected = ast->eval(t0 + i);
+        REQUIRE(defined[i] == expected.is_int());
+        REQUIRE(defined_t[i] == expected.is_int());
+        if (expected.is_int())
+        {
+            uint32_t value = expected.to_int();
+            REQUIRE((out[i] & demanded) == (value & demanded));
+            REQUIRE((out_t[i] & demanded) == (value & demanded));
+        }
+    }
+}
+
+TEST_CASE("narrow", "[narrow]")
+{
+    string crowd = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+
+    SECTION("lane widths")
+    {
+        NarrowProgram program(*optimize(parse("t*(42&t>>10)")));
+        REQUIRE(program.get_node_count(32) == 0);
+        REQUIRE(program.get_node_count(16) == 2);
+        REQUIRE(program.get_node_count(8) == 3);
+    }
+
+    SECTION("matches tree")
+    {
+        vector<string> in = {
+            "t",
+            "42",
+            "-t",
+            "~t",
+            "!t",
+            "t*(t>>1)",
+            "t*(42&t>>10)",
+            "t*(t>>10)",
+            "t/(t-5)",
+            "t%(t-5)",
+            "t/-1",
+            "t<<t",
+            "t>>(t&7)",
+            "t>>28",
+            "(t|0x0F)*3",
+            "t%2==0?(t*10):(t*100)+1",
+            "t > 10 ? t > 20 ? 1 : 0 : -1",
+            "\"foo\"[t%3]",
+            "(t==1?\"foo\":\"bar\")[t%3]",
+            "\"abcdefgh\"[t>>9&7]*t",
+            "t*(\"36364689\"[t>>13&7]&15)/(1+(t>>10&7))",
+            "(t*(t>>5|t>>8))>>(t>>16)",
+            crowd,
+        };
+        for (auto &s : in)
+        {
+            for (uint32_t demanded : {0xFFu, 0xFFFFu, 0xFFFFFFFFu, 0x30u})
+            {
+                require_same_narrow(s, -100, 200, demanded);
+                require_same_narrow(s, 123456, 300, demanded);
+                require_same_narrow(s, 2147483647 - 199, 200, demanded);
+            }
+        }
+    }
+
+    SECTION("undefined lanes")
+    {
+        require_same_narrow("(t/(t%3))&256", -10, 100, 0xFF);
+        require_same_narrow("t%5 ? t : 1/0", -10, 100, 0xFF);
+    }
+
+    SECTION("large program")
+    {
+        string in = "t";
+        for (int i = 0; i < 100; ++i)
+        {
+            in = "(" + in + "+t*" + to_string(i) + ")";
+        }
+        require_same_narrow(in, 0, 100, 0xFF);
+    }
+
+    SECTION("benchmarks")
+    {
+        for (const string &in : {string("t*(42&t>>10)"), crowd})
+        {
+            auto ast = optimize(parse(in));
+            NarrowProgram narrow(*ast);
+            Program program = compile(*ast);
+            int out[kBlockSize];
+            bool defined[kBlockSize];
+            int t = 0;
+
+            BENCHMARK("eval " + in + " (narrow block of 64)")
+            {
+                narrow.eval_block(t, kBlockSize, out, defined);
+                t += kBlockSize;
+                return out[0];
+            };
+
+            BENCHMARK("eval " + in + " (vm block of 64)")
+            {
+                program.eval_block(t, kBlockSize, out, defined);
+                t += kBlockSize;
+                return out[0];
+            };
+        }
+    }
+}
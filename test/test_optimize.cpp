@@ -0,0 +1,135 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "optimize.hpp"
+#include "parse.hpp"
+
+using namespace std;
+using namespace bb;
+
+string optimized(const string &in) { return *optimize(parse(in)); }
+
+void require_same_optimized(const string &in)
+{
+    auto ast = parse(in);
+    auto opt = optimize(parse(in));
+    for (int t = -300; t < 300; ++t)
+    {
+        Value expected = ast->eval(t);
+        Value actual = opt->eval(t);
+        REQUIRE(actual.is_int() == expected.is_int());
+        REQUIRE(actual.is_str() == expected.is_str());
+        if (expected.is_int())
+        {
+            REQUIRE(actual.to_int() == expected.to_int());
+        }
+    }
+}
+
+TEST_CASE("optimize", "[optimize]")
+{
+    SECTION("constant folding")
+    {
+        REQUIRE(optimized("1+2*3") == "7");
+        REQUIRE(optimized("t>>(4-(1^7&3))") == "(t>>2)");
+        REQUIRE(optimized("\"foo\"[1]") == "111");
+        REQUIRE(optimized("1/0") == "UNDEFINED");
+        REQUIRE(optimized("(0-2147483647-1)/-1") == "-2147483648");
+        REQUIRE(optimized("(0-2147483647-1)%-1") == "0");
+
+        AstPtr mismatch = make_binary<AddOp>(AstPtr(new String("foo")),
+                                             AstPtr(new Identifier()));
+        REQUIRE((string)*optimize(move(mismatch)) == "UNDEFINED");
+    }
+
+    SECTION("identities")
+    {
+        REQUIRE(optimized("t|0") == "t");
+        REQUIRE(optimized("0^t") == "t");
+        REQUIRE(optimized("t<<0") == "t");
+        REQUIRE(optimized("t*1") == "t");
+        REQUIRE(optimized("t&-1") == "t");
+        REQUIRE(optimized("-(-t)") == "t");
+        REQUIRE(optimized("t*0") == "0");
+        REQUIRE(optimized("(t/(t-1))*0") == "((t/(t+-1))*0)");
+
+        // Only reachable in trees that were not type checked
+        AstPtr mixed = AstPtr(new TernaryIf(AstPtr(new Identifier()),
+                                            AstPtr(new String("foo")),
+                                            AstPtr(new Integer(1))));
+        AstPtr ast = make_binary<BitwiseOrOp>(move(mixed),
+                                              AstPtr(new Integer(0)));
+        REQUIRE((string)*optimize(move(ast)) == "((t?\"foo\":1)|0)");
+    }
+
+    SECTION("reassociation")
+    {
+        REQUIRE(optimized("t+1+2") == "(t+3)");
+        REQUIRE(optimized("t-1+1") == "t");
+        REQUIRE(optimized("(t&255)&15") == "(t&15)");
+        REQUIRE(optimized("t>>3>>4") == "(t>>7)");
+        REQUIRE(optimized("3*t") == "(t*3)");
+        REQUIRE(optimized("10<t") == "(t>10)");
+    }
+
+    SECTION("strength reduction")
+    {
+        REQUIRE(optimized("t*8") == "(t<<3)");
+        REQUIRE(optimized("t/8") == "(t/8)");
+        REQUIRE(optimized("t%256") == "(t%256)");
+        REQUIRE(optimized("(t>>4&255)/8") == "(((t>>4)&255)>>3)");
+        REQUIRE(optimized("(t&1023)%256") == "((t&1023)&255)");
+    }
+
+    SECTION("dead ternary arms")
+    {
+        REQUIRE(optimized("1?t:t/0") == "t");
+        REQUIRE(optimized("(2>3)?t:t*2") == "(t<<1)");
+        REQUIRE(optimized("(0?\"foo\":\"bar\")[t]") == "(\"bar\"[t])");
+    }
+
+    SECTION("matches tree")
+    {
+        vector<string> in = {
+            "t*8",
+            "t*(0-2147483647-1)",
+            "(t&1023)%256",
+            "(t&1023)/256",
+            "(t>>2)%8",
+            "(t|1)%8",
+            "t%(0-2147483647-1)",
+            "(t<<31)/-1",
+            "t%(-(t<=t))",
+            "t-(0-2147483647-1)",
+            "t<<40",
+            "t>>3>>30",
+            "t+2147483647+1",
+            "(t/(t-1))*0",
+            "(t/(t-1))%1",
+            "\"foo\"[t]|0",
+            "\"\\xff\"[0]*0",
+            "!!t",
+            "~~t",
+            "t > 10 ? t > 20 ? 1 : 0 : -1",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7",
+        };
+        for (auto &s : in)
+        {
+            require_same_optimized(s);
+        }
+    }
+
+    SECTION("benchmarks")
+    {
+        string in = "(t*(((t>>11)&(1*(16/4)))+0)|t>>(2*2+0))%256";
+
+        auto ast = parse(in);
+        BENCHMARK("optimize") { return optimize(parse(in)); };
+
+        auto opt = optimize(parse(in));
+        int t = 0;
+
+        BENCHMARK("eval (unoptimized)") { return ast->eval(t++); };
+        BENCHMARK("eval (optimized)") { return opt->eval(t++); };
+    }
+}
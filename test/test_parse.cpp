@@ -2,11 +2,61 @@
 #include <catch2/catch_test_macros.hpp>
 
 #include "lex.hpp"
+#include "optimize.hpp"
 #include "parse.hpp"
 
+#include <cctype>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
 using namespace std;
 using namespace bb;
 
+/** Expressions from the wild, for parsing benchmarks */
+const vector<string> kCorpus = {
+    "t*(42&t>>10)",
+    "t*(t>>5|t>>8)>>(t>>16)",
+    "t*((t>>12|t>>8)&63&t>>4)",
+    "(t*(t>>5|t>>8))>>(t>>16)",
+    "t*(((t>>12)|(t>>8))&(63&(t>>4)))",
+    "(t*5&t>>7)|(t*3&t>>10)",
+    "(t>>6|t|t>>(t>>16))*10+((t>>11)&7)",
+    "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7",
+    "(t*(t>>8|t>>9)&46&t>>8)^(t&t>>13|t>>6)",
+    "t*(0xCA98>>(t>>9&14)&15)|t>>8",
+    "t*(\"36364689\"[t>>13&7]&15)/12&128",
+    "(t>>7|t|t>>6)*10+4*(t&t>>13|t>>6)",
+    "(~t>>2)*((127&t*(7&t>>10))<(245&t*(2+(5&t>>14))))",
+    "t%2==0?(t*10):(t*100)+1",
+    "t>>4|t&((t>>5)/(t>>7-(t>>15)&-t>>7-(t>>15)))",
+    "(t&t>>12)*(t>>4|t>>8)^t>>6",
+};
+
+/**
+ * Each corpus expression with one digit changed, followed by the original,
+ * as when tweaking constants while live coding
+ */
+vector<string> get_corpus_edits()
+{
+    vector<string> edits;
+    for (auto &s : kCorpus)
+    {
+        for (size_t i = 0; i < s.length(); ++i)
+        {
+            if (!isdigit(s[i]) || i + 1 < s.length() && s[i + 1] == 'x')
+            {
+                continue;
+            }
+            string edited = s;
+            edited[i] = s[i] == '9' ? '1' : s[i] + 1;
+            edits.push_back(edited);
+            edits.push_back(s);
+        }
+    }
+    return edits;
+}
+
 TEST_CASE("parse", "[parse]")
 {
     SECTION("simple expression")
@@ -81,6 +131,37 @@ TEST_CASE("parse", "[parse]")
         REQUIRE(ast->eval(1).to_int() == 5);
     }
 
+    SECTION("operator precedence")
+    {
+        // From lowest to highest binding, as in C
+        vector<vector<string>> levels = {
+            {"|"},
+            {"^"},
+            {"&"},
+            {"==", "!="},
+            {"<", ">", "<=", ">="},
+            {"<<", ">>"},
+            {"+", "-"},
+            {"*", "/", "%"},
+        };
+        for (size_t i = 0; i < levels.size(); ++i)
+        {
+            for (size_t j = 0; j < levels.size(); ++j)
+            {
+                for (auto &a : levels[i])
+                {
+                    for (auto &b : levels[j])
+                    {
+                        string left = "((t" + a + "1)" + b + "2)";
+                        string right = "(t" + a + "(1" + b + "2))";
+                        REQUIRE((string)*parse("t" + a + "1" + b + "2") ==
+                                (i >= j ? left : right));
+                    }
+                }
+            }
+        }
+    }
+
     SECTION("deep nesting")
     {
         string in = "(((t*t)))";
@@ -89,6 +170,54 @@ TEST_CASE("parse", "[parse]")
         REQUIRE(ast->eval(2).to_int() == 4);
     }
 
+    SECTION("very deep nesting")
+    {
+        // Parsing, type checking, printing and destroying these would each
+        // overflow the stack if they recursed once per level
+        const int depth = 200000;
+        string parens = string(depth, '(') + "t" + string(depth, ')');
+        REQUIRE((string)*parse(parens) == "t");
+
+        string right;
+        for (int i = 0; i < depth; ++i)
+        {
+            right += "t+(";
+        }
+        right += "t" + string(depth, ')');
+        string printed = *parse(right);
+        REQUIRE(printed.length() == 4 * depth + 1);
+        REQUIRE(printed.substr(0, 6) == "(t+(t+");
+
+        string unary = string(depth, '~') + "t";
+        REQUIRE(string(*parse(unary)).length() == 3 * depth + 1);
+
+        string ternary;
+        for (int i = 0; i < depth; ++i)
+        {
+            ternary += "t?" + to_string(i) + ":";
+        }
+        ternary += "t";
+        REQUIRE(parse(ternary) != nullptr);
+
+        REQUIRE_THROWS_AS(parse(string(depth, '(') + "\"a\"+t" +
+                                string(depth, ')')),
+                          invalid_argument);
+        REQUIRE_THROWS_AS(parse(string(depth, '(') + "t"), invalid_argument);
+    }
+
+    SECTION("long expressions")
+    {
+        // A left associative chain is as deep as it is long
+        string in = "t";
+        for (int i = 0; i < 1000000; ++i)
+        {
+            in += "+1";
+        }
+        auto ast = parse(in);
+        REQUIRE(string(*ast).length() == in.length() + 2 * 1000000);
+        REQUIRE(parse_flat(in).get_depth() == 1000001);
+    }
+
     SECTION("unary")
     {
         string in = "1+-t";
@@ -134,15 +263,134 @@ TEST_CASE("parse", "[parse]")
         REQUIRE((char)ast->eval(2).to_int() == 'r');
     }
 
+    SECTION("type errors")
+    {
+        REQUIRE_THROWS_AS(parse("\"foo\"+1"), invalid_argument);
+        REQUIRE_THROWS_AS(parse("-\"foo\""), invalid_argument);
+        REQUIRE_THROWS_AS(parse("t[0]"), invalid_argument);
+        REQUIRE_THROWS_AS(parse("\"foo\"[\"bar\"]"), invalid_argument);
+        REQUIRE_THROWS_AS(parse("\"foo\""), invalid_argument);
+        REQUIRE_THROWS_AS(parse("t?\"foo\":1"), invalid_argument);
+        REQUIRE_THROWS_AS(parse("(t?\"foo\":1)[0]"), invalid_argument);
+        REQUIRE_THROWS_AS(parse("\"foo\"?1:2"), invalid_argument);
+        REQUIRE_NOTHROW(parse("(t?\"foo\":\"bar\")[t]"));
+    }
+
+    SECTION("reparse")
+    {
+        Reparser reparser;
+        auto require_reparse = [&](const string &in) {
+            auto ast = reparser.parse(in);
+            auto expected = optimize(parse(in));
+            REQUIRE(string(*ast) == string(*expected));
+            for (int t : {0, 1, 1000, 65535, -7})
+            {
+                bool defined = true;
+                bool expected_defined = true;
+                REQUIRE(ast->eval_int(t, defined) ==
+                        expected->eval_int(t, expected_defined));
+                REQUIRE(defined == expected_defined);
+            }
+        };
+
+        require_reparse("(t>>4)*(t&7)");
+        REQUIRE(reparser.get_lexed_tokens() == 11);
+        REQUIRE(reparser.get_reused_groups() == 0);
+        REQUIRE_FALSE(reparser.is_unchanged());
+
+        // Only the edited digit is lexed, and the group before it is copied
+        require_reparse("(t>>4)*(t&6)");
+        REQUIRE(reparser.get_lexed_tokens() == 1);
+        REQUIRE(reparser.get_reused_groups() == 1);
+        REQUIRE_FALSE(reparser.is_unchanged());
+
+        require_reparse("(t>>4) * (t&6)");
+        REQUIRE(reparser.get_reused_groups() == 2);
+        REQUIRE(reparser.is_unchanged());
+
+        // An edit that does not parse leaves the last one as the base
+        REQUIRE_THROWS_AS(reparser.parse("(t>>4) * (t&"), invalid_argument);
+        try
+        {
+            reparser.parse("(t>>4) * \"a\"");
+            FAIL("Expected a type error");
+        }
+        catch (invalid_argument &ex)
+        {
+            REQUIRE(string(ex.what()) ==
+                    "Type error: expected an integer but found \"a\"");
+        }
+        require_reparse("(t>>4) * (t&5)");
+        REQUIRE(reparser.get_reused_groups() == 1);
+
+        // The passes over the tree recurse, so a deeper one is rejected
+        string deep = "(t>>4) * (t&5";
+        for (uint32_t i = 0; i < kMaxRecursionDepth; ++i)
+        {
+            deep += "+t";
+        }
+        REQUIRE_THROWS_AS(reparser.parse(deep + ")"), invalid_argument);
+        require_reparse("(t>>4) * (t&5)");
+        REQUIRE(reparser.is_unchanged());
+
+        for (auto &in : get_corpus_edits())
+        {
+            require_reparse(in);
+        }
+        for (auto &in : kCorpus)
+        {
+            require_reparse(in);
+        }
+    }
+
     SECTION("benchmarks")
     {
         string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
 
         BENCHMARK("parse crowd") { return parse(in); };
 
+        BENCHMARK("parse corpus")
+        {
+            size_t size = 0;
+            for (auto &s : kCorpus)
+            {
+                size += parse(s) != nullptr;
+            }
+            return size;
+        };
+
+        auto edits = get_corpus_edits();
+
+        BENCHMARK("parse corpus edits (parse and optimize)")
+        {
+            size_t size = 0;
+            for (auto &s : edits)
+            {
+                size += optimize(parse(s)) != nullptr;
+            }
+            return size;
+        };
+
+        Reparser reparser;
+
+        BENCHMARK("parse corpus edits (reparse)")
+        {
+            size_t size = 0;
+            for (auto &s : edits)
+            {
+                size += reparser.parse(s) != nullptr;
+            }
+            return size;
+        };
+
         auto crowd = parse(in);
         int t = 0;
 
         BENCHMARK("eval crowd") { return crowd->eval(t++); };
+
+        bool defined = true;
+        t = 0;
+
+        BENCHMARK("eval crowd (int)") { return crowd->eval_int(t++, defined); };
     }
 }
@@ -0,0 +1,125 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "period.hpp"
+
+#include <string>
+
+using namespace std;
+using namespace bb;
+
+void require_same_period(const PeriodicProgram &program, const Ast &ast,
+                         int t0, int n)
+{
+    vector<int> t(n);
+    vector<int> out(n);
+    vector<int> out_t(n);
+    bool defined[1000];
+    bool defined_t[1000];
+    for (int i = 0; i < n; ++i)
+    {
+        t[i] = static_cast<int>(static_cast<unsigned>(t0) + i);
+    }
+    program.eval_block(t0, n, out.data(), defined);
+    program.eval_block(t.data(), n, out_t.data(), defined_t);
+
+    for (int i = 0; i < n; ++i)
+    {
+        Value expected = ast.eval(t[i]);
+        uint8_t value = expected.is_int() ? expected.to_int() : 0;
+        REQUIRE(defined[i] == expected.is_int());
+        REQUIRE(defined_t[i] == expected.is_int());
+        REQUIRE(static_cast<uint8_t>(out[i]) == value);
+        REQUIRE(static_cast<uint8_t>(out_t[i]) == value);
+    }
+}
+
+TEST_CASE("period", "[period]")
+{
+    SECTION("detects periods")
+    {
+        REQUIRE(PeriodicProgram(*parse("42")).get_period() == 1);
+        REQUIRE(PeriodicProgram(*parse("t")).get_period() == 256);
+        // Bits 4 to 11 of t*t only depend on t%4096, and (t+2048)^2 differs
+        // from t^2 by a multiple of 4096
+        REQUIRE(PeriodicProgram(*parse("t*t>>4")).get_period() == 2048);
+        REQUIRE(PeriodicProgram(*parse("(t%256+256)%256")).get_period() ==
+                256);
+        REQUIRE(PeriodicProgram(*parse("t>>12&255")).get_period() ==
+                1 << 20);
+
+        // Division rounds towards zero, so t/256 repeats for positive t but
+        // not across negative values
+        REQUIRE(!PeriodicProgram(*parse("t/256&255")).is_periodic());
+        REQUIRE(PeriodicProgram(*parse("t*(t>>10)")).get_period() == 1 << 18);
+        REQUIRE(!PeriodicProgram(*parse("t*(t>>20)")).is_periodic());
+    }
+
+    SECTION("bounded cache")
+    {
+        PeriodicProgram program(*parse("t>>12&255"), 1 << 16);
+        REQUIRE(!program.is_periodic());
+        REQUIRE(program.get_cache_bytes() == 0);
+        REQUIRE(!PeriodicProgram(*parse("t"), 0).is_periodic());
+
+        // A byte per sample and a bit for whether it is defined
+        PeriodicProgram undefined(*parse("t&256?1/0:t"), 1 << 12);
+        REQUIRE(undefined.get_period() == 512);
+        REQUIRE(undefined.get_cache_bytes() == 512 + 512 / 8);
+        REQUIRE(PeriodicProgram(*parse("t*t>>4")).get_cache_bytes() == 2048);
+    }
+
+    SECTION("matches tree")
+    {
+        vector<string> in = {
+            "42",
+            "t",
+            "t*t>>4",
+            "(t%256+256)%256",
+            "t&256?1/0:t",
+            "\"0123456789\"[t>>10&7]*(t&0x3FF)>>4",
+            "t/256&255",
+            "t*(t>>20)",
+        };
+        for (auto &s : in)
+        {
+            auto ast = optimize(parse(s));
+            PeriodicProgram program(*ast, 1 << 16);
+            require_same_period(program, *ast, 0, 1000);
+            require_same_period(program, *ast, 123456, 1000);
+            require_same_period(program, *ast, -500, 1000);
+        }
+    }
+
+    SECTION("benchmarks")
+    {
+        string in = "t*t>>4^t>>3";
+        auto ast = optimize(parse(in));
+        PeriodicProgram program(*ast);
+        Program live = compile(*ast);
+        int out[kBlockSize];
+        bool defined[kBlockSize];
+        int t = 0;
+
+        BENCHMARK("find period " + in)
+        {
+            return PeriodicProgram(*ast).get_period();
+        };
+
+        BENCHMARK("eval " + in + " (period block of 64)")
+        {
+            program.eval_block(t, kBlockSize, out, defined);
+            t += kBlockSize;
+            return out[0];
+        };
+
+        BENCHMARK("eval " + in + " (vm block of 64)")
+        {
+            live.eval_block(t, kBlockSize, out, defined);
+            t += kBlockSize;
+            return out[0];
+        };
+    }
+}
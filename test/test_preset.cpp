@@ -0,0 +1,170 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "jit.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "preset.hpp"
+#include "vm.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace bb;
+
+struct PrecedenceSource
+{
+    static constexpr const char *text =
+        "t+1*2-t/3%5<<2>>1<t==t>2&t^t|t>>4 != -~!t";
+};
+
+struct TernarySource
+{
+    static constexpr const char *text = "t&1?t>>2?t:t*3:(t>>4)%7";
+};
+
+struct StringSource
+{
+    static constexpr const char *text =
+        "t%5 ? (t>>10?\"ab\":\"cde\")[t%4] : 1/0";
+};
+
+struct IntegerSource
+{
+    static constexpr const char *text = " 0x1F + 017 * 09 - 2147483647 ";
+};
+
+struct DivideSource
+{
+    static constexpr const char *text = "t/(t&3)+t%(t>>8&7)";
+};
+
+// Presets are parsed and type checked at compile time
+static_assert(parse_preset("t*(42&t>>10)").size == 7,
+              "t, 42, t, 10, >>, & and *");
+static_assert(Preset<StringSource>::tree.nodes[6].type == AstType::String,
+              "\"cde\" is the seventh node");
+
+template <typename Source> void require_same_preset()
+{
+    auto ast = parse(Source::text);
+    for (int t0 : {-1000, 0, 4096, 123456, 2147483647 - 64})
+    {
+        int out[kBlockSize];
+        bool defined[kBlockSize];
+        Preset<Source>::eval_block(t0, kBlockSize, out, defined);
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            Value expected = ast->eval(t0 + i);
+            REQUIRE(defined[i] == expected.is_int());
+            REQUIRE(out[i] == (expected.is_int() ? expected.to_int() : 0));
+        }
+    }
+}
+
+TEST_CASE("preset", "[preset]")
+{
+    string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+
+    SECTION("matches runtime parse")
+    {
+        require_same_preset<PrecedenceSource>();
+        require_same_preset<TernarySource>();
+        require_same_preset<StringSource>();
+        require_same_preset<IntegerSource>();
+        require_same_preset<DivideSource>();
+    }
+
+    SECTION("built-in presets")
+    {
+        for (const BuiltinPreset &preset : get_builtin_presets())
+        {
+            auto ast = parse(preset.text);
+            int out[kBlockSize];
+            bool defined[kBlockSize];
+            preset.eval_block(123456, kBlockSize, out, defined);
+            for (int i = 0; i < kBlockSize; ++i)
+            {
+                REQUIRE(defined[i]);
+                REQUIRE(out[i] == ast->eval(123456 + i).to_int());
+            }
+            REQUIRE(find_builtin_preset(*optimize(parse(preset.text))) ==
+                    &preset);
+        }
+
+        // Found however the expression is written
+        const BuiltinPreset *found =
+            find_builtin_preset(*optimize(parse("((t>>10)&42) * t")));
+        REQUIRE(found);
+        REQUIRE(string(found->name) == "forty-two");
+        REQUIRE(!find_builtin_preset(*optimize(parse("t*(42&t>>11)"))));
+    }
+
+    SECTION("errors")
+    {
+        // The same inputs fail to parse at runtime as they would with parse
+        vector<string> in_list = {
+            "",      "t*(",   "(t",     "t)",    "t[1]",   "\"ab\"",
+            "t&&t",  "t||t",  "t?t",    "t=t",   "0x",     "\"ab",
+            "t$",    "-\"a\"", "\"a\"+1", "t?\"a\":1",
+        };
+        for (auto &s : in_list)
+        {
+            REQUIRE_THROWS_AS(parse(s), invalid_argument);
+            REQUIRE_THROWS_AS(parse_preset(s.c_str()), invalid_argument);
+        }
+        REQUIRE_THROWS_AS(parse_preset("2147483648"), out_of_range);
+
+        string deep(kMaxPresetNodes, '~');
+        REQUIRE_THROWS_AS(parse_preset((deep + "t").c_str()),
+                          invalid_argument);
+    }
+
+    SECTION("benchmarks")
+    {
+        int out[kBlockSize];
+
+        // The same expressions compiled at compile time and parsed at runtime
+        for (const BuiltinPreset &preset : get_builtin_presets())
+        {
+            string name = preset.name;
+            auto ast = optimize(parse(preset.text));
+            Program program = compile(*ast);
+            JitProgram jit(*ast);
+
+            BENCHMARK("eval 64 blocks " + name + " (vm)")
+            {
+                for (int t = 0; t < 64 * kBlockSize; t += kBlockSize)
+                {
+                    program.eval_block(t, kBlockSize, out, nullptr);
+                }
+                return out[0];
+            };
+
+            BENCHMARK("eval 64 blocks " + name + " (jit)")
+            {
+                for (int t = 0; t < 64 * kBlockSize; t += kBlockSize)
+                {
+                    jit.eval_block(t, kBlockSize, out, nullptr);
+                }
+                return out[0];
+            };
+
+            BENCHMARK("eval 64 blocks " + name + " (preset)")
+            {
+                for (int t = 0; t < 64 * kBlockSize; t += kBlockSize)
+                {
+                    preset.eval_block(t, kBlockSize, out, nullptr);
+                }
+                return out[0];
+            };
+        }
+
+        BENCHMARK("parse and compile crowd (jit)")
+        {
+            return JitProgram(*optimize(parse(in))).is_native();
+        };
+    }
+}
@@ -0,0 +1,196 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <climits>
+
+#include "parse.hpp"
+#include "range.hpp"
+#include "vm.hpp"
+
+using namespace std;
+using namespace bb;
+
+Range range_of(const string &in) { return get_range(*parse(in)); }
+
+bool guarded(const string &in) { return needs_guard(*parse(in)); }
+
+/**
+ * Check that every node of a tree evaluates to a value within its range,
+ * and that nodes without a guard are defined whenever their operands are.
+ */
+void require_in_range(const Ast &ast, int t)
+{
+    Value value = ast.eval(t);
+    if (value.is_int())
+    {
+        Range range = get_range(ast);
+        REQUIRE(range.contains(value.to_int()));
+    }
+
+    AstType type = ast.type();
+    if (type == AstType::TernaryIf)
+    {
+        auto &ternary = static_cast<const TernaryIf &>(ast);
+        require_in_range(ternary.get_pred(), t);
+        require_in_range(ternary.get_pass(), t);
+        require_in_range(ternary.get_fail(), t);
+    }
+    else if (type == AstType::Negate || type == AstType::BitwiseComplement ||
+             type == AstType::Not)
+    {
+        require_in_range(static_cast<const UnaryOperator &>(ast).get_inner(),
+                         t);
+    }
+    else if (auto binary = dynamic_cast<const BinaryOperator *>(&ast))
+    {
+        require_in_range(binary->get_left(), t);
+        require_in_range(binary->get_right(), t);
+        if (!needs_guard(ast) && !binary->get_left().eval(t).is_undefined() &&
+            !binary->get_right().eval(t).is_undefined())
+        {
+            REQUIRE(!value.is_undefined());
+        }
+    }
+}
+
+TEST_CASE("range", "[range]")
+{
+    SECTION("leaves")
+    {
+        REQUIRE(range_of("42").min == 42);
+        REQUIRE(range_of("42").max == 42);
+        REQUIRE(range_of("t").min == INT_MIN);
+        REQUIRE(range_of("t").max == INT_MAX);
+        REQUIRE(range_of("t<5").min == 0);
+        REQUIRE(range_of("t<5").max == 1);
+    }
+
+    SECTION("masks and shifts")
+    {
+        REQUIRE(range_of("t>>12&3").min == 0);
+        REQUIRE(range_of("t>>12&3").max == 3);
+        REQUIRE(range_of("1+(t>>12&3)").min == 1);
+        REQUIRE(range_of("1+(t>>12&3)").max == 4);
+        REQUIRE(range_of("t>>24").min == -128);
+        REQUIRE(range_of("t>>24").max == 127);
+        REQUIRE(range_of("(t&5)|2").max == 7);
+        REQUIRE(range_of("(t&3)<<4").max == 48);
+        REQUIRE(range_of("t%10").min == -9);
+        REQUIRE(range_of("t%10").max == 9);
+        REQUIRE(range_of("(t&255)/(1+(t&3))").max == 255);
+        REQUIRE(range_of("\"09\"[t&1]").min == '0');
+        REQUIRE(range_of("\"09\"[t&1]").max == '9');
+    }
+
+    SECTION("wrapping gives the full range")
+    {
+        REQUIRE(range_of("t+1").min == INT_MIN);
+        REQUIRE(range_of("t*2").max == INT_MAX);
+        REQUIRE(range_of("-t").min == INT_MIN);
+        REQUIRE(range_of("(t&255)<<t").max == INT_MAX);
+    }
+
+    SECTION("possibly undefined nodes contain zero")
+    {
+        REQUIRE(range_of("5/(t&1)").min == 0);
+        REQUIRE(range_of("\"ab\"[t&3]").min == 0);
+        REQUIRE(range_of("1+\"ab\"[t&3]").min == 1);
+    }
+
+    SECTION("guards")
+    {
+        REQUIRE(!guarded("t%(1+(t>>12&3))"));
+        REQUIRE(!guarded("t/(9+(t>>28))"));
+        REQUIRE(!guarded("\"abcdefgh\"[t>>9&7]"));
+        REQUIRE(!guarded("(t&1?\"ab\":\"cde\")[t>>4&1]"));
+        REQUIRE(!guarded("(t>>1)/(-2+(t&1))"));
+
+        REQUIRE(guarded("t/(t&3)"));
+        REQUIRE(guarded("t/(-2+(t&1))"));
+        REQUIRE(guarded("\"abc\"[t&3]"));
+        REQUIRE(guarded("\"\"[0]"));
+        REQUIRE(guarded("(t&1?\"ab\":\"\")[0]"));
+        REQUIRE(!guarded("t+1"));
+    }
+
+    SECTION("ranges hold")
+    {
+        vector<string> in = {
+            "t%(1+(t>>12&3))",
+            "(t>>1)/(-2+(t&1))",
+            "t/(9+(t>>28))",
+            "\"abcdefgh\"[t>>9&7]",
+            "(t&1?\"ab\":\"cde\")[t>>4&1]",
+            "t*(\"36364689\"[t>>13&7]&15)/(1+(t>>10&7))",
+            "(t>>5)%(t>>12&7)+((t&255)<<(t>>20))",
+            "~(t>>3)^-(t&127)|(t>>2&t>>5)",
+            "(t&7?t>>4:-(t>>8))/(t&3?3:-3)",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7",
+        };
+        vector<int> t;
+        for (int i = -300; i < 300; ++i)
+        {
+            t.push_back(i);
+            t.push_back(INT_MIN + 300 + i);
+            t.push_back(INT_MAX - 300 + i);
+            t.push_back(i * 7919 * 101);
+        }
+        for (auto &s : in)
+        {
+            auto ast = parse(s);
+            for (int value : t)
+            {
+                require_in_range(*ast, value);
+            }
+        }
+    }
+
+    SECTION("stored with each node")
+    {
+        auto ast = parse("t*(\"36364689\"[t>>13&7]&15)/(1+(t>>10&7))");
+        AstPtr copy = ast->clone();
+        REQUIRE(get_range(*copy).min == get_range(*ast).min);
+        REQUIRE(get_range(*copy).max == get_range(*ast).max);
+
+        // Each division finds its operands' ranges without walking them
+        string chain = "t&1023";
+        for (int i = 0; i < 4000; ++i)
+        {
+            chain += "/(1+(t&1))";
+        }
+        auto deep = parse(chain);
+        REQUIRE(get_range(*deep).min == 0);
+        REQUIRE(get_range(*deep).max == 1023);
+        REQUIRE(!needs_guard(*deep));
+    }
+
+    SECTION("benchmarks")
+    {
+        string in = "t*(\"36364689\"[t>>13&7]&15)/(1+(t>>10&7))";
+        auto ast = parse(in);
+        BENCHMARK("range of lookup") { return get_range(*ast); };
+
+        string chain = "t";
+        for (int i = 0; i < 4000; ++i)
+        {
+            chain += "/(t|1)";
+        }
+        auto deep = parse(chain);
+        BENCHMARK("compile division chain (vm)")
+        {
+            return compile(*deep).get_code().size();
+        };
+
+        Program program = compile(*ast);
+        int out[kBlockSize];
+        bool defined[kBlockSize];
+        int t = 0;
+
+        BENCHMARK("eval lookup (vm block of 64)")
+        {
+            program.eval_block(t, kBlockSize, out, defined);
+            t += kBlockSize;
+            return out[0];
+        };
+    }
+}
@@ -0,0 +1,246 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "jit.hpp"
+#include "optimize.hpp"
+#include "parse.hpp"
+#include "period.hpp"
+#include "tier.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace bb;
+
+void require_same_tiered(TieredProgram &program, const Ast &ast, int t0)
+{
+    int out[kBlockSize];
+    bool defined[kBlockSize];
+    program.eval_block(t0, kBlockSize, out, defined);
+    for (int i = 0; i < kBlockSize; ++i)
+    {
+        Value expected = ast.eval(t0 + i);
+        REQUIRE(defined[i] == expected.is_int());
+        REQUIRE(out[i] == (expected.is_int() ? expected.to_int() : 0));
+    }
+}
+
+TEST_CASE("tier", "[tier]")
+{
+    string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+
+    SECTION("matches tree on every tier")
+    {
+        auto ast = parse(in);
+        TieredProgram program(parse(in));
+
+        // Whichever tier is ready, the output must not change
+        for (int t = 0; t < 100 * kBlockSize; t += kBlockSize)
+        {
+            require_same_tiered(program, *ast, t);
+        }
+
+        program.wait();
+        Tier final_tier =
+            JitProgram::is_supported() ? Tier::Native : Tier::Bytecode;
+        REQUIRE(program.get_tier() == final_tier);
+        require_same_tiered(program, *ast, 123456);
+        require_same_tiered(program, *ast, -1000);
+    }
+
+    SECTION("undefined lanes")
+    {
+        auto ast = parse("t%5 ? \"foo\"[t%4] : 1/0");
+        TieredProgram program(parse("t%5 ? \"foo\"[t%4] : 1/0"));
+        require_same_tiered(program, *ast, -32);
+        program.wait();
+        require_same_tiered(program, *ast, -32);
+
+        int t[3] = {5, 6, 7};
+        int out[3];
+        bool defined[3];
+        program.eval_block(t, 3, out, defined);
+        REQUIRE(!defined[0]);
+        REQUIRE(out[1] == 'o');
+        REQUIRE(!defined[2]);
+    }
+
+    SECTION("table")
+    {
+        string melody = "\"0123456789\"[t>>10&7]*(t&0x3FF)>>4";
+        auto ast = parse(melody);
+        TieredProgram program(parse(melody));
+        program.wait();
+        REQUIRE(program.get_tier() == Tier::Table);
+        require_same_tiered(program, *ast, 0);
+        require_same_tiered(program, *ast, 123456);
+        require_same_tiered(program, *ast, -1000);
+        REQUIRE(string(get_tier_name(Tier::Table)) == "table");
+    }
+
+    SECTION("period")
+    {
+        string bend = "t*t>>4";
+        auto ast = parse(bend);
+        TieredProgram program(parse(bend), 1 << 16);
+        program.wait();
+        REQUIRE(program.get_tier() == Tier::Period);
+
+        int out[kBlockSize];
+        program.eval_block(-1000, kBlockSize, out, nullptr);
+        for (int i = 0; i < kBlockSize; ++i)
+        {
+            uint8_t expected = ast->eval(-1000 + i).to_int();
+            REQUIRE(static_cast<uint8_t>(out[i]) == expected);
+        }
+
+        TieredProgram live(parse(bend));
+        live.wait();
+        REQUIRE(live.get_tier() != Tier::Period);
+    }
+
+    SECTION("stats")
+    {
+        TieredProgram program(parse(in));
+        int out[kBlockSize];
+        program.eval_block(0, kBlockSize, out, nullptr);
+        program.wait();
+        program.eval_block(kBlockSize, kBlockSize, out, nullptr);
+
+        REQUIRE(program.get_stats(Tier::Tree).ready_ns == 0);
+
+        TierStats last = program.get_stats(program.get_tier());
+        REQUIRE(last.ready_ns >= 0);
+        REQUIRE(last.samples >= kBlockSize);
+        REQUIRE(last.first_block_ns >= last.ready_ns);
+
+        int64_t samples = 0;
+        for (int i = 0; i < kTierCount; ++i)
+        {
+            samples += program.get_stats(static_cast<Tier>(i)).samples;
+        }
+        REQUIRE(samples == 2 * kBlockSize);
+
+        // Tiers that were skipped were never ready
+        string bend = "t*t>>4";
+        auto ast = parse(bend);
+        unique_ptr<PeriodicProgram> periodic(
+            new PeriodicProgram(*ast, 1 << 16));
+        TieredProgram loaded(move(ast), move(periodic));
+        REQUIRE(loaded.get_tier() == Tier::Period);
+        REQUIRE(loaded.get_stats(Tier::Tree).ready_ns == 0);
+        REQUIRE(loaded.get_stats(Tier::Bytecode).ready_ns == -1);
+        REQUIRE(loaded.get_stats(Tier::Native).ready_ns == -1);
+        REQUIRE(loaded.get_stats(Tier::Period).ready_ns >= 0);
+    }
+
+    SECTION("shared tiers")
+    {
+        auto ast = parse(in);
+        unique_ptr<TieredProgram> shared;
+        {
+            TieredProgram program(parse(in));
+            program.wait();
+            shared = program.share();
+            REQUIRE(shared->get_tier() == program.get_tier());
+        }
+
+        // The tiers outlive the program they were compiled for, and were
+        // ready as soon as they were shared
+        Tier tier = shared->get_tier();
+        REQUIRE(tier != Tier::Tree);
+        require_same_tiered(*shared, *ast, 0);
+        require_same_tiered(*shared, *ast, -1000);
+        REQUIRE(shared->get_stats(tier).ready_ns == 0);
+        REQUIRE(shared->get_stats(tier).samples == 2 * kBlockSize);
+
+        // Sharing while compiling still finishes every tier
+        TieredProgram compiling(parse(in));
+        unique_ptr<TieredProgram> early = compiling.share();
+        early->wait();
+        REQUIRE(early->get_tier() == tier);
+    }
+
+    SECTION("destroy while compiling")
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            TieredProgram program(parse(in));
+        }
+        for (int i = 0; i < 100; ++i)
+        {
+            TieredProgram program(parse(in));
+            program.share();
+        }
+    }
+
+    SECTION("benchmarks")
+    {
+        int out[kBlockSize];
+
+        BENCHMARK("parse to first block crowd (vm)")
+        {
+            Program program = compile(*parse(in));
+            program.eval_block(0, kBlockSize, out, nullptr);
+            return out[0];
+        };
+
+        BENCHMARK("parse to first block crowd (jit)")
+        {
+            JitProgram program(*parse(in));
+            program.eval_block(0, kBlockSize, out, nullptr);
+            return out[0];
+        };
+
+        BENCHMARK("parse to first block crowd (tiered)")
+        {
+            TieredProgram program(parse(in));
+            program.eval_block(0, kBlockSize, out, nullptr);
+            return out[0];
+        };
+
+        // Edits as they are sent while live coding the crowd expression,
+        // including sending one again and changing only its spacing
+        vector<string> trace = {
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>6",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>5",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>5|t>>9",
+            "((t<<1)^((t<<1)+(t>>7)&t>>11))|t>>(4-(1^7&(t>>19)))|t>>5|t>>9",
+            "((t<<1)^((t<<1)+(t>>7)&t>>11))|t>>(4-(1^7&(t>>18)))|t>>5|t>>9",
+            "((t<<1)^((t<<1)+(t>>7)&t>>11))|t>>(4-(1^7&(t>>18)))|t>>5|t>>9",
+            "((t<<1)^((t<<1)+(t>>7)&t>>11))|t>>(4-(1^7&(t>>18)))|t>>5",
+            "((t<<1)^((t<<1)+(t>>7)&t>>11)) | t>>(4-(1^7&(t>>18))) | t>>5",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12)) | t>>(4-(1^7&(t>>19))) | t>>7",
+        };
+
+        BENCHMARK("edit trace to first block (parse)")
+        {
+            for (auto &s : trace)
+            {
+                TieredProgram program(optimize(parse(s)));
+                program.eval_block(0, kBlockSize, out, nullptr);
+            }
+            return out[0];
+        };
+
+        Reparser reparser;
+        unique_ptr<TieredProgram> program;
+
+        BENCHMARK("edit trace to first block (reparse)")
+        {
+            for (auto &s : trace)
+            {
+                AstPtr ast = reparser.parse(s);
+                if (!program || !reparser.is_unchanged())
+                {
+                    program.reset(new TieredProgram(move(ast)));
+                }
+                program->eval_block(0, kBlockSize, out, nullptr);
+            }
+            return out[0];
+        };
+    }
+}
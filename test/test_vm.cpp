@@ -0,0 +1,224 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+
+#include "parse.hpp"
+#include "vm.hpp"
+
+using namespace std;
+using namespace bb;
+
+void require_same_block(const string &in, int t0, int n)
+{
+    auto ast = parse(in);
+    Program program = compile(*ast);
+
+    vector<int> t(n);
+    vector<int> out(n);
+    vector<int> out_t(n);
+    bool defined[1000];
+    bool defined_t[1000];
+    for (int i = 0; i < n; ++i)
+    {
+        t[i] = t0 + i;
+    }
+    program.eval_block(t0, n, out.data(), defined);
+    program.eval_block(t.data(), n, out_t.data(), defined_t);
+
+    for (int i = 0; i < n; ++i)
+    {
+        Value expected = ast->eval(t0 + i);
+        REQUIRE(defined[i] == expected.is_int());
+        REQUIRE(defined_t[i] == expected.is_int());
+        if (expected.is_int())
+        {
+            REQUIRE(out[i] == expected.to_int());
+            REQUIRE(out_t[i] == expected.to_int());
+        }
+    }
+}
+
+void require_same(const string &in, int t)
+{
+    auto ast = parse(in);
+    Program program = compile(*ast);
+    Value expected = ast->eval(t);
+    Value actual = program.eval(t);
+    REQUIRE(actual.is_int() == expected.is_int());
+    if (expected.is_int())
+    {
+        REQUIRE(actual.to_int() == expected.to_int());
+    }
+}
+
+TEST_CASE("vm", "[vm]")
+{
+    SECTION("matches tree")
+    {
+        vector<string> in = {
+            "t",
+            "42",
+            "t+1",
+            "t-3*t",
+            "-t",
+            "~t",
+            "!t",
+            "t/3",
+            "t%7",
+            "t&t>>8",
+            "t|t<<2",
+            "t^t>>3",
+            "t<10",
+            "t<=10",
+            "t>10",
+            "t>=10",
+            "t==10",
+            "t!=10",
+            "t%2==0?(t*10):(t*100)+1",
+            "t > 10 ? t > 20 ? 1 : 0 : -1",
+            "\"foo\"[t%3]",
+            "(t==1?\"foo\":\"bar\")[t%3]",
+            "t%(1+(t>>12&3))",
+            "(t>>1)/(-2+(t&1))",
+            "\"abcdefgh\"[t>>9&7]",
+            "(t&1?\"ab\":\"cde\")[t>>4&1]",
+            "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7",
+        };
+        for (auto &s : in)
+        {
+            for (int t = -20; t < 20; ++t)
+            {
+                require_same(s, t);
+            }
+            require_same(s, 123456);
+            require_same_block(s, -100, 200);
+            require_same_block(s, 123456, 1000);
+        }
+    }
+
+    SECTION("divide by zero")
+    {
+        auto ast = parse("t/(t-1)");
+        Program program = compile(*ast);
+        REQUIRE(program.eval(1).is_undefined());
+        REQUIRE(program.eval(2).to_int() == 2);
+    }
+
+    SECTION("divide by constant zero")
+    {
+        auto ast = parse("t%0");
+        Program program = compile(*ast);
+        REQUIRE(program.eval(1).is_undefined());
+    }
+
+    SECTION("subscript out of range")
+    {
+        auto ast = parse("\"foo\"[t]");
+        Program program = compile(*ast);
+        REQUIRE(program.eval(-1).is_undefined());
+        REQUIRE(program.eval(2).to_int() == 'o');
+        REQUIRE(program.eval(3).is_undefined());
+    }
+
+    SECTION("type mismatch")
+    {
+        // parse() rejects these, so build the trees by hand
+        Add add(AstPtr(new String("foo")), AstPtr(new Integer(1)));
+        REQUIRE(compile(add).eval(0).is_undefined());
+
+        Subscript subscript(AstPtr(new Identifier()), AstPtr(new Integer(0)));
+        REQUIRE(compile(subscript).eval(0).is_undefined());
+
+        REQUIRE(compile(String("foo")).eval(0).is_undefined());
+    }
+
+    SECTION("untaken branch")
+    {
+        auto ast = parse("t ? 1 : 1/0");
+        Program program = compile(*ast);
+        REQUIRE(program.eval(1).to_int() == 1);
+        REQUIRE(program.eval(0).is_undefined());
+    }
+
+    SECTION("default program")
+    {
+        Program program;
+        REQUIRE(program.eval(0).is_undefined());
+
+        int out[3];
+        bool defined[3];
+        program.eval_block(0, 3, out, defined);
+        REQUIRE(!defined[0]);
+        REQUIRE(out[0] == 0);
+    }
+
+    SECTION("block undefined lanes")
+    {
+        require_same_block("t/(t%3)", -10, 100);
+        require_same_block("\"foo\"[t]", -10, 100);
+        require_same_block("t%5 ? t : 1/0", -10, 100);
+        require_same_block("t<1000 ? 0 : (0-2147483647-1)/(t-t-1)", -10, 100);
+    }
+
+    SECTION("block without defined")
+    {
+        auto ast = parse("t*2");
+        Program program = compile(*ast);
+        int out[10];
+        program.eval_block(5, 10, out, nullptr);
+        REQUIRE(out[9] == 28);
+    }
+
+    SECTION("constant operands")
+    {
+        auto ast = parse("t>>7&3");
+        Program program = compile(*ast);
+        REQUIRE(program.get_code().size() == 4);
+        REQUIRE(program.get_max_depth() == 1);
+    }
+
+    SECTION("unchecked operations")
+    {
+        Program program = compile(*parse("t%(1+(t>>12&3))+\"ab\"[t&1]"));
+        auto &code = program.get_block_code();
+        auto has = [&](OpCode op) {
+            return find_if(code.begin(), code.end(),
+                           [op](const Instruction &ins) {
+                               return ins.op == op;
+                           }) != code.end();
+        };
+        REQUIRE(has(OpCode::ModuloUnchecked));
+        REQUIRE(has(OpCode::SubscriptUnchecked));
+        REQUIRE(!has(OpCode::Modulo));
+        REQUIRE(!has(OpCode::Subscript));
+
+        program = compile(*parse("t%(t>>12&3)+\"ab\"[t&3]"));
+        REQUIRE(has(OpCode::Modulo));
+        REQUIRE(has(OpCode::Subscript));
+    }
+
+    SECTION("benchmarks")
+    {
+        string in = "((t<<1)^((t<<1)+(t>>7)&t>>12))|t>>(4-(1^7&(t>>19)))|t>>7";
+
+        auto crowd = parse(in);
+        BENCHMARK("compile crowd") { return compile(*crowd); };
+
+        Program program = compile(*crowd);
+        int t = 0;
+
+        BENCHMARK("eval crowd (vm)") { return program.eval(t++); };
+
+        int out[kBlockSize];
+        bool defined[kBlockSize];
+        t = 0;
+
+        BENCHMARK("eval crowd (vm block of 64)")
+        {
+            program.eval_block(t, kBlockSize, out, defined);
+            t += kBlockSize;
+            return out[0];
+        };
+    }
+}